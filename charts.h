@@ -15,7 +15,9 @@ typedef enum {
     CHART_LINE,
     CHART_BAR,
     CHART_PIE,
-    CHART_SCATTER
+    CHART_SCATTER,
+    CHART_HISTOGRAM,    // NEW: Counts of one column's values in equal-width bins
+    CHART_DENSITY       // NEW: Counts of X/Y pairs on a grid of bins
 } ChartType;
 
 // Chart configuration
@@ -30,17 +32,15 @@ typedef struct {
     int show_legend;
 } ChartConfig;
 
-// Chart data point
+// Chart data series, stored column-wise. Labels point at the sheet's own
+// strings, so a chart must be rebuilt (or refreshed, for a live chart) before
+// drawing once the cells it came from have changed.
 typedef struct {
-    double x;
-    double y;
-    char label[64];
-} ChartPoint;
-
-// Chart data series
-typedef struct {
-    ChartPoint* points;
+    double* xs;             // NULL while every X equals its point's index
+    double* ys;
+    const char** labels;    // Only allocated once some point has a label
     int count;
+    int capacity;
     char name[64];
     char symbol;  // Symbol to use for this series
 } ChartSeries;
@@ -52,19 +52,112 @@ typedef struct {
     int series_count;
     double x_min, x_max;
     double y_min, y_max;
-    char** canvas;  // ASCII canvas for drawing
+    char** canvas;  // ASCII canvas for drawing: row pointers into canvas_data
     int canvas_width;
     int canvas_height;
+    char* canvas_data;      // One block of canvas_height rows of canvas_width + 1 chars
+    size_t canvas_capacity; // Bytes allocated for canvas_data
+    int canvas_row_capacity;
+    
+    // NEW: Histogram and density charts: counts per bin, bins_y rows of
+    // bins_x (bins_y is 1 for a histogram)
+    double* bins;
+    int bins_x, bins_y;
+    double bin_max;         // Largest count
+    double bin_total;       // Values counted
+    
+    int owns_labels;        // NEW: Labels are private copies (see chart_own_labels)
 } Chart;
 
+// NEW: Live chart bound to a sheet range. The data rows are cut into buckets
+// and each bucket keeps a few representative points per series (the lowest
+// and highest Y for line charts, the X and Y extremes for scatter plots, the
+// row itself for bar and pie charts) along with its data bounds. Edits inside
+// the range only mark their buckets dirty; a refresh rescans just those rows
+// and redraws from the bucket summaries, whose size depends on the chart
+// width rather than the number of rows.
+#define LIVE_CHART_MAX_SLOTS 4
+
+typedef struct {
+    Chart* chart;
+    Sheet* sheet;
+    int start_row, start_col;
+    int end_row, end_col;
+    int has_headers;
+    int data_start;             // First data row (below the header row, if any)
+    int data_rows;
+    int bucket_count;
+    int slots;                  // Points kept per bucket and series
+    double* kept_x;             // [series][bucket][slot]
+    double* kept_y;
+    const char** kept_labels;
+    unsigned char* kept_count;  // [series][bucket]
+    double* bounds;             // [series][bucket]: x min, x max, y min, y max
+    unsigned char* dirty;       // [bucket]
+    int* dirty_list;            // Buckets being rescanned by a refresh
+    int dirty_count;
+    int header_dirty;           // Top row changed: recheck headers and series names
+    int watcher;                // Sheet watcher id (-1 if none)
+    int width, height;          // Plot size asked for (before clamping)
+} LiveChart;
+
+// NEW: Chart export running as a background task of the thread pool. The
+// job owns its chart, which no longer refers to the sheet, so the sheet can
+// change meanwhile.
+typedef struct {
+    Chart* chart;
+    char filename[256];
+    ParallelGroup group;
+    int ok;
+} ChartExport;
+
+#define CHART_SVG_WIDTH 800
+#define CHART_SVG_HEIGHT 500
+
 // Function prototypes
 Chart* chart_create(ChartType type, const char* x_label, const char* y_label);
 Chart* chart_create_sized(ChartType type, const char* x_label, const char* y_label, int width, int height);
 void chart_free(Chart* chart);
 int chart_add_data_from_range(Chart* chart, Sheet* sheet, RangeSelection* range);
+int chart_bin_range(Chart* chart, Sheet* sheet, RangeSelection* range, int bins_x, int bins_y);
+int chart_read_point(Sheet* sheet, int row, int x_col, int y_col, int index, double* x, double* y, const char** label);
+int chart_slice_point(Sheet* sheet, const ColumnSlice* xs, const ColumnSlice* ys, int i, int index,
+                      double* x, double* y, const char** label);
+void chart_name_series(Chart* chart, int index, Sheet* sheet, int header_row, int col);
+int chart_resize(Chart* chart, int width, int height);
+int chart_series_reserve(ChartSeries* series, int capacity);
+void chart_series_append(ChartSeries* series, double x, double y, const char* label);
+const char* chart_series_label(const ChartSeries* series, int index);
+double chart_series_x(const ChartSeries* series, int index);
+void chart_pad_bounds(Chart* chart);
 void chart_render(Chart* chart);
+void chart_clear_canvas(Chart* chart);
 void chart_display(Chart* chart, Console* console, int x, int y);
 char** chart_get_output(Chart* chart, int* line_count);
+void chart_blit(Console* console, Chart* chart, int left, int top, int width, int height);
+WORD chart_char_color(char c);
+void chart_draw_frame(Console* console, int left, int top, int width, int height, const char* title);
+
+// NEW: Live charts
+LiveChart* live_chart_new(Sheet* sheet, RangeSelection* range, ChartType type,
+                          const char* x_label, const char* y_label, int width, int height);
+int live_chart_refresh(LiveChart* live);
+int live_chart_resize(LiveChart* live, int width, int height);
+void live_chart_free(LiveChart* live);
+
+// NEW: Export to text or SVG files
+int chart_type_from_name(const char* name, ChartType* type);
+const char* chart_type_name(ChartType type);
+int chart_own_labels(Chart* chart);
+int chart_export_text(Chart* chart, FILE* file);
+int chart_export_svg(Chart* chart, FILE* file);
+int chart_export_file(Chart* chart, const char* filename);
+ChartExport* chart_export_start(Chart* chart, const char* filename);
+int chart_export_done(ChartExport* job);
+void chart_svg_text(FILE* file, const char* text);
+Chart* chart_from_range(Sheet* sheet, RangeSelection* range, ChartType type, const char* x_label,
+                        const char* y_label, int width, int height);
+int chart_export_finish(ChartExport* job);
 
 // Helper functions
 void chart_draw_line(Chart* chart, int x1, int y1, int x2, int y2, char symbol);
@@ -73,9 +166,14 @@ void chart_plot_line_chart(Chart* chart);
 void chart_plot_bar_chart(Chart* chart);
 void chart_plot_pie_chart(Chart* chart);
 void chart_plot_scatter_chart(Chart* chart);
+void chart_plot_histogram(Chart* chart);
+void chart_plot_density(Chart* chart);
+int chart_density_level(double count, double scale, int levels);
+void chart_write_text(Chart* chart, int x, int y, const char* text);
 void chart_set_pixel(Chart* chart, int x, int y, char c);
 int chart_scale_x(Chart* chart, double value);
 int chart_scale_y(Chart* chart, double value);
+double chart_pseudo_angle(double dx, double dy);
 
 // Implementation
 
@@ -92,14 +190,6 @@ Chart* chart_create_sized(ChartType type, const char* x_label, const char* y_lab
     strncpy_s(chart->config.x_label, sizeof(chart->config.x_label), x_label ? x_label : "X", _TRUNCATE);
     strncpy_s(chart->config.y_label, sizeof(chart->config.y_label), y_label ? y_label : "Y", _TRUNCATE);
     
-    // Use provided sizes with more generous bounds checking for full-screen charts
-    chart->config.width = width;
-    chart->config.height = height;
-    if (chart->config.width < 40) chart->config.width = 40;
-    if (chart->config.width > 300) chart->config.width = 300;  // Increased from 200
-    if (chart->config.height < 15) chart->config.height = 15;
-    if (chart->config.height > 100) chart->config.height = 100; // Increased from 50
-    
     chart->config.show_grid = 1;
     chart->config.show_legend = 1;
     
@@ -107,39 +197,82 @@ Chart* chart_create_sized(ChartType type, const char* x_label, const char* y_lab
     chart->x_min = DBL_MAX;
     chart->x_max = -DBL_MAX;
     chart->y_min = DBL_MAX;
-    chart->y_max = -DBL_MAX;      // Allocate canvas with appropriate margins for labels, axes, and legend
-    // Ensure canvas width doesn't exceed what can be displayed
-    int legend_space = chart->config.show_legend ? 25 : 5;  // Space for legend or minimal margin
-    chart->canvas_width = chart->config.width + legend_space;
-    chart->canvas_height = chart->config.height + 12; // Space for X-axis labels and potential legend below
-    chart->canvas = (char**)calloc(chart->canvas_height, sizeof(char*));
+    chart->y_max = -DBL_MAX;
     
-    for (int i = 0; i < chart->canvas_height; i++) {
-        chart->canvas[i] = (char*)calloc(chart->canvas_width + 1, sizeof(char));
-        memset(chart->canvas[i], ' ', chart->canvas_width);
-        chart->canvas[i][chart->canvas_width] = '\0';
+    if (!chart_resize(chart, width, height)) {
+        chart_free(chart);
+        return NULL;
     }
-    
     return chart;
 }
 
+// NEW: Set the plot size and lay out the canvas for it. The canvas is one
+// block reused across resizes; it is only reallocated when it has to grow.
+// Returns 0 if memory ran out (the chart keeps its previous size).
+int chart_resize(Chart* chart, int width, int height) {
+    // Use provided sizes with more generous bounds checking for full-screen charts
+    if (width < 40) width = 40;
+    if (width > 300) width = 300;  // Increased from 200
+    if (height < 15) height = 15;
+    if (height > 100) height = 100; // Increased from 50
+    
+    // Allocate canvas with appropriate margins for labels, axes, and legend
+    int legend_space = chart->config.show_legend ? 25 : 5;  // Space for legend or minimal margin
+    int canvas_width = width + legend_space;
+    int canvas_height = height + 12; // Space for X-axis labels and potential legend below
+    
+    size_t bytes = (size_t)canvas_height * (canvas_width + 1);
+    if (bytes > chart->canvas_capacity) {
+        char* data = (char*)realloc(chart->canvas_data, bytes);
+        if (!data) return 0;
+        chart->canvas_data = data;
+        chart->canvas_capacity = bytes;
+    }
+    if (canvas_height > chart->canvas_row_capacity) {
+        char** rows = (char**)realloc(chart->canvas, canvas_height * sizeof(char*));
+        if (!rows) return 0;
+        chart->canvas = rows;
+        chart->canvas_row_capacity = canvas_height;
+    }
+    
+    chart->config.width = width;
+    chart->config.height = height;
+    chart->canvas_width = canvas_width;
+    chart->canvas_height = canvas_height;
+    for (int i = 0; i < canvas_height; i++) {
+        chart->canvas[i] = chart->canvas_data + (size_t)i * (canvas_width + 1);
+    }
+    chart_clear_canvas(chart);
+    return 1;
+}
+
+// Fill the canvas with blanks, each row NUL-terminated
+void chart_clear_canvas(Chart* chart) {
+    memset(chart->canvas_data, ' ', (size_t)chart->canvas_height * (chart->canvas_width + 1));
+    for (int y = 0; y < chart->canvas_height; y++) {
+        chart->canvas[y][chart->canvas_width] = '\0';
+    }
+}
+
 void chart_free(Chart* chart) {
     if (!chart) return;
     
     // Free canvas
-    if (chart->canvas) {
-        for (int i = 0; i < chart->canvas_height; i++) {
-            free(chart->canvas[i]);
-        }
-        free(chart->canvas);
-    }
+    free(chart->canvas);
+    free(chart->canvas_data);
+    free(chart->bins);
     
     // Free series data
     if (chart->series) {
         for (int i = 0; i < chart->series_count; i++) {
-            if (chart->series[i].points) {
-                free(chart->series[i].points);
+            free(chart->series[i].xs);
+            free(chart->series[i].ys);
+            if (chart->owns_labels && chart->series[i].labels) {
+                for (int j = 0; j < chart->series[i].count; j++) {
+                    free((void*)chart->series[i].labels[j]);
+                }
             }
+            free(chart->series[i].labels);
         }
         free(chart->series);
     }
@@ -147,6 +280,232 @@ void chart_free(Chart* chart) {
     free(chart);
 }
 
+// NEW: Read one data point of a series. X comes from the first column (its
+// position in the series when that cell is not a number); returns 0 if the
+// Y cell has no number.
+int chart_read_point(Sheet* sheet, int row, int x_col, int y_col, int index, double* x, double* y, const char** label) {
+    Cell* y_cell = sheet_get_cell(sheet, row, y_col);
+    if (!y_cell || !(y_cell->type == CELL_NUMBER ||
+                     (y_cell->type == CELL_FORMULA && y_cell->data.formula.error == ERROR_NONE))) {
+        return 0;
+    }
+    *y = y_cell->type == CELL_NUMBER ? y_cell->data.number : y_cell->data.formula.cached_value;
+    
+    Cell* x_cell = sheet_get_cell(sheet, row, x_col);
+    *x = index;
+    *label = NULL;
+    if (x_cell) {
+        switch (x_cell->type) {
+            case CELL_NUMBER:
+                *x = x_cell->data.number;
+                break;
+            case CELL_FORMULA:
+                if (x_cell->data.formula.error == ERROR_NONE) {
+                    *x = x_cell->data.formula.cached_value;
+                }
+                break;
+            case CELL_STRING:
+                *label = x_cell->data.string;
+                break;
+            default:
+                break;
+        }
+    }
+    return 1;
+}
+
+// NEW: The same, for row i of column slices read with sheet_read_slices.
+// Only text X cells are looked up in the sheet, for their label.
+int chart_slice_point(Sheet* sheet, const ColumnSlice* xs, const ColumnSlice* ys, int i, int index,
+                      double* x, double* y, const char** label) {
+    if (!ys->valid[i]) return 0;
+    *y = ys->values[i];
+    *label = NULL;
+    if (xs->valid[i]) {
+        *x = xs->values[i];
+        return 1;
+    }
+    
+    *x = index;
+    Cell* x_cell = sheet->cells[xs->start_row + i][xs->col];
+    if (x_cell && x_cell->type == CELL_STRING) *label = x_cell->data.string;
+    return 1;
+}
+
+// Give a series its plot symbol and a name: the header cell above its
+// column when header_row is not -1, else "Series n"
+void chart_name_series(Chart* chart, int index, Sheet* sheet, int header_row, int col) {
+    // Symbols for different series
+    const char symbols[] = "*+ox#@$%&";
+    ChartSeries* series = &chart->series[index];
+    series->symbol = symbols[index % strlen(symbols)];
+    
+    Cell* header_cell = header_row >= 0 ? sheet_get_cell(sheet, header_row, col) : NULL;
+    if (header_cell && header_cell->type == CELL_STRING) {
+        strncpy_s(series->name, sizeof(series->name), header_cell->data.string, _TRUNCATE);
+    } else {
+        sprintf_s(series->name, sizeof(series->name), "Series %d", index + 1);
+    }
+}
+
+// Make room for 'capacity' points. Returns 0 if memory ran out.
+int chart_series_reserve(ChartSeries* series, int capacity) {
+    if (capacity <= series->capacity) return 1;
+    if (capacity < 1) capacity = 1;
+    
+    if (series->xs) {
+        double* xs = (double*)realloc(series->xs, capacity * sizeof(double));
+        if (!xs) return 0;
+        series->xs = xs;
+    }
+    double* ys = (double*)realloc(series->ys, capacity * sizeof(double));
+    if (!ys) return 0;
+    series->ys = ys;
+    if (series->labels) {
+        const char** labels = (const char**)realloc((void*)series->labels, capacity * sizeof(const char*));
+        if (!labels) return 0;
+        memset((void*)(labels + series->capacity), 0, (capacity - series->capacity) * sizeof(const char*));
+        series->labels = labels;
+    }
+    series->capacity = capacity;
+    return 1;
+}
+
+// Add a point (capacity must already be reserved). Label may be NULL.
+void chart_series_append(ChartSeries* series, double x, double y, const char* label) {
+    if (series->count >= series->capacity) return;
+    if (label && !series->labels) {
+        series->labels = (const char**)calloc(series->capacity, sizeof(const char*));
+    }
+    if (!series->xs && x != series->count) {
+        // First X that isn't just the index: store them all from here on
+        series->xs = (double*)malloc(series->capacity * sizeof(double));
+        if (series->xs) {
+            for (int i = 0; i < series->count; i++) series->xs[i] = i;
+        }
+    }
+    if (series->xs) series->xs[series->count] = x;
+    series->ys[series->count] = y;
+    if (series->labels) series->labels[series->count] = label;
+    series->count++;
+}
+
+double chart_series_x(const ChartSeries* series, int index) {
+    return series->xs ? series->xs[index] : index;
+}
+
+// Label of point 'index', or "" if it has none
+const char* chart_series_label(const ChartSeries* series, int index) {
+    if (!series->labels || !series->labels[index]) return "";
+    return series->labels[index];
+}
+
+// Line charts: keep the lowest and highest point of each of 'buckets' equal
+// runs of the series (in their original order), so peaks survive while the
+// stored series never exceeds two points per canvas column
+void chart_downsample_line(ChartSeries* series, Sheet* sheet, const ColumnSlice* xs,
+                           const ColumnSlice* ys, int total, int buckets) {
+    int bucket = -1;
+    double min_x = 0, min_y = 0, max_x = 0, max_y = 0;
+    const char* min_label = NULL;
+    const char* max_label = NULL;
+    int min_index = 0, max_index = 0;
+    int index = 0;
+    
+    for (int i = 0; i <= ys->count; i++) {
+        double x, y;
+        const char* label;
+        int valid = i < ys->count && chart_slice_point(sheet, xs, ys, i, index, &x, &y, &label);
+        int next_bucket = valid ? (int)((long long)index * buckets / total) : -1;
+        
+        // Flush the finished bucket (and the last one after the final row).
+        // Rows without a point don't end a bucket.
+        if (bucket >= 0 && (i == ys->count || (valid && next_bucket != bucket))) {
+            if (min_index <= max_index) {
+                chart_series_append(series, min_x, min_y, min_label);
+                if (max_index != min_index) chart_series_append(series, max_x, max_y, max_label);
+            } else {
+                chart_series_append(series, max_x, max_y, max_label);
+                chart_series_append(series, min_x, min_y, min_label);
+            }
+            bucket = -1;
+        }
+        if (!valid) continue;
+        
+        if (bucket < 0) {
+            bucket = next_bucket;
+            min_x = max_x = x;
+            min_y = max_y = y;
+            min_label = max_label = label;
+            min_index = max_index = index;
+        } else if (y < min_y) {
+            min_x = x;
+            min_y = y;
+            min_label = label;
+            min_index = index;
+        } else if (y > max_y) {
+            max_x = x;
+            max_y = y;
+            max_label = label;
+            max_index = index;
+        }
+        index++;
+    }
+}
+
+// Scatter charts: keep the first point that lands on each plot cell
+void chart_downsample_scatter(Chart* chart, ChartSeries* series, Sheet* sheet, const ColumnSlice* xs,
+                              const ColumnSlice* ys, int capacity) {
+    int width = chart->config.width;
+    int height = chart->config.height;
+    unsigned char* occupied = (unsigned char*)calloc((size_t)width * height, 1);
+    if (!occupied) return;
+    
+    int index = 0;
+    for (int i = 0; i < ys->count && series->count < capacity; i++) {
+        double x, y;
+        const char* label;
+        if (!chart_slice_point(sheet, xs, ys, i, index, &x, &y, &label)) continue;
+        index++;
+        
+        int px = chart_scale_x(chart, x) - 10;
+        int py = chart_scale_y(chart, y);
+        if (px < 0 || px >= width || py < 0 || py >= height) continue;
+        if (occupied[py * width + px]) continue;
+        occupied[py * width + px] = 1;
+        chart_series_append(series, x, y, label);
+    }
+    free(occupied);
+}
+
+// Widen the data bounds by 10% so points don't sit on the chart frame
+void chart_pad_bounds(Chart* chart) {
+    double x_range = chart->x_max - chart->x_min;
+    double y_range = chart->y_max - chart->y_min;
+    
+    if (x_range < 0.0001) {
+        chart->x_min -= 1.0;
+        chart->x_max += 1.0;
+    } else {
+        chart->x_min -= x_range * 0.1;
+        chart->x_max += x_range * 0.1;
+    }
+    
+    if (y_range < 0.0001) {
+        chart->y_min -= 1.0;
+        chart->y_max += 1.0;
+    } else {
+        chart->y_min -= y_range * 0.1;
+        chart->y_max += y_range * 0.1;
+    }
+    
+    // Ensure Y axis includes zero for bar charts
+    if (chart->config.type == CHART_BAR) {
+        if (chart->y_min > 0) chart->y_min = 0;
+        if (chart->y_max < 0) chart->y_max = 0;
+    }
+}
+
 int chart_add_data_from_range(Chart* chart, Sheet* sheet, RangeSelection* range) {
     if (!chart || !sheet || !range || !range->is_active) return 0;
     
@@ -156,7 +515,6 @@ int chart_add_data_from_range(Chart* chart, Sheet* sheet, RangeSelection* range)
     int min_col = range->start_col < range->end_col ? range->start_col : range->end_col;
     int max_col = range->start_col > range->end_col ? range->start_col : range->end_col;
     
-    int rows = max_row - min_row + 1;
     int cols = max_col - min_col + 1;
     
     // For now, assume first column is X values (or labels), rest are Y series
@@ -166,9 +524,11 @@ int chart_add_data_from_range(Chart* chart, Sheet* sheet, RangeSelection* range)
     int num_series = cols - 1;
     chart->series = (ChartSeries*)calloc(num_series, sizeof(ChartSeries));
     chart->series_count = num_series;
-    
-    // Symbols for different series
-    const char symbols[] = "*+ox#@$%&";
+    int* totals = (int*)calloc(num_series, sizeof(int));
+    if (!chart->series || !totals) {
+        free(totals);
+        return 0;
+    }
     
     // Check if first row contains headers
     int has_headers = 0;
@@ -176,126 +536,343 @@ int chart_add_data_from_range(Chart* chart, Sheet* sheet, RangeSelection* range)
     if (first_cell && first_cell->type == CELL_STRING) {
         has_headers = 1;
     }
+    int data_start = has_headers ? min_row + 1 : min_row;
+    
+    // Read every column of the range in one pass over its rows
+    ColumnSlice* slices = (ColumnSlice*)calloc(cols, sizeof(ColumnSlice));
+    if (!slices || !sheet_read_slices(sheet, min_col, cols, data_start, max_row - data_start + 1, slices)) {
+        free(slices);
+        free(totals);
+        return 0;
+    }
     
-    // Process each Y series
+    // Name each series, count its points and find the bounds. Nothing is
+    // stored yet, so the bounds are known before downsampling.
+    for (int series_idx = 0; series_idx < num_series; series_idx++) {
+        chart_name_series(chart, series_idx, sheet, has_headers ? min_row : -1, min_col + series_idx + 1);
+        
+        const ColumnSlice* ys = &slices[series_idx + 1];
+        int index = 0;
+        for (int i = 0; i < ys->count; i++) {
+            double x, y;
+            const char* label;
+            if (!chart_slice_point(sheet, &slices[0], ys, i, index, &x, &y, &label)) continue;
+            index++;
+            
+            // Update bounds
+            if (x < chart->x_min) chart->x_min = x;
+            if (x > chart->x_max) chart->x_max = x;
+            if (y < chart->y_min) chart->y_min = y;
+            if (y > chart->y_max) chart->y_max = y;
+        }
+        totals[series_idx] = index;
+    }
+    
+    chart_pad_bounds(chart);
+    
+    // Then store the points. Line and scatter charts never keep more
+    // points than the canvas can show; bar and pie charts keep every point.
+    int buckets = chart->config.width;
+    int plot_cells = chart->config.width * chart->config.height;
     for (int series_idx = 0; series_idx < num_series; series_idx++) {
         ChartSeries* series = &chart->series[series_idx];
-        series->symbol = symbols[series_idx % strlen(symbols)];
+        int total = totals[series_idx];
+        const ColumnSlice* ys = &slices[series_idx + 1];
+        if (total == 0) continue;
         
-        // Get series name from header if available
-        if (has_headers) {
-            Cell* header_cell = sheet_get_cell(sheet, min_row, min_col + series_idx + 1);
-            if (header_cell && header_cell->type == CELL_STRING) {
-                strncpy_s(series->name, sizeof(series->name), header_cell->data.string, _TRUNCATE);
-            } else {
-                sprintf_s(series->name, sizeof(series->name), "Series %d", series_idx + 1);
-            }
-        } else {
-            sprintf_s(series->name, sizeof(series->name), "Series %d", series_idx + 1);
+        int downsample = 0;
+        int capacity = total;
+        if (chart->config.type == CHART_LINE && total > 2 * buckets) {
+            downsample = 1;
+            capacity = 2 * buckets;
+        } else if (chart->config.type == CHART_SCATTER && total > buckets) {
+            downsample = 1;
+            if (capacity > plot_cells) capacity = plot_cells;
         }
         
-        // Count valid data points
-        int data_start = has_headers ? min_row + 1 : min_row;
-        int point_count = 0;
+        if (!chart_series_reserve(series, capacity)) continue;
         
-        for (int row = data_start; row <= max_row; row++) {
-            Cell* x_cell = sheet_get_cell(sheet, row, min_col);
-            Cell* y_cell = sheet_get_cell(sheet, row, min_col + series_idx + 1);
-            
-            if (y_cell && (y_cell->type == CELL_NUMBER || 
-                         (y_cell->type == CELL_FORMULA && y_cell->data.formula.error == ERROR_NONE))) {
-                point_count++;
+        if (downsample && chart->config.type == CHART_LINE) {
+            chart_downsample_line(series, sheet, &slices[0], ys, total, buckets);
+        } else if (downsample) {
+            chart_downsample_scatter(chart, series, sheet, &slices[0], ys, capacity);
+        } else {
+            int index = 0;
+            for (int i = 0; i < ys->count; i++) {
+                double x, y;
+                const char* label;
+                if (!chart_slice_point(sheet, &slices[0], ys, i, index, &x, &y, &label)) continue;
+                index++;
+                chart_series_append(series, x, y, label);
             }
         }
+    }
+    
+    for (int c = 0; c < cols; c++) column_slice_free(&slices[c]);
+    free(slices);
+    free(totals);
+    return 1;
+}
+
+// NEW: Binned charts
+//
+// Histogram and density charts never hold the values themselves. The range
+// is streamed twice: once for the bounds and once to count every value into
+// its bin. Each pass splits the rows into one block per thread, every block
+// keeping its own bounds and bin array, and the blocks are summed at the end.
+
+typedef struct {
+    Sheet* sheet;
+    int x_col, y_col;           // y_col is -1 for a histogram
+    int start_row, row_count;
+    int block_rows;
+    int counting;               // 0: bounds pass, 1: counting pass
+    double x_lo, x_hi, y_lo, y_hi;
+    int bins_x, bins_y;
+    double* block_bounds;       // [block]: x min, x max, y min, y max
+    double* block_bins;         // [block][bins_y][bins_x]
+} ChartBinning;
+
+void chart_bin_block(void* context, int index) {
+    ChartBinning* binning = (ChartBinning*)context;
+    Cell*** cells = binning->sheet->cells;
+    int first = binning->start_row + index * binning->block_rows;
+    int end = binning->start_row + binning->row_count;
+    if (first + binning->block_rows < end) end = first + binning->block_rows;
+    
+    double* bounds = &binning->block_bounds[index * 4];
+    double* bins = binning->block_bins + (size_t)index * binning->bins_x * binning->bins_y;
+    double x_scale = binning->bins_x / (binning->x_hi - binning->x_lo);
+    double y_scale = binning->bins_y / (binning->y_hi - binning->y_lo);
+    
+    if (!binning->counting) {
+        bounds[0] = DBL_MAX;
+        bounds[1] = -DBL_MAX;
+        bounds[2] = DBL_MAX;
+        bounds[3] = -DBL_MAX;
+    }
+    
+    for (int row = first; row < end; row++) {
+        double x, y = 0.0;
+        if (!cell_get_number(cells[row][binning->x_col], &x)) continue;
+        if (binning->y_col >= 0 && !cell_get_number(cells[row][binning->y_col], &y)) continue;
         
-        if (point_count == 0) continue;
-        
-        // Allocate points
-        series->points = (ChartPoint*)calloc(point_count, sizeof(ChartPoint));
-        series->count = point_count;
-        
-        // Fill in data points
-        int point_idx = 0;
-        for (int row = data_start; row <= max_row; row++) {
-            Cell* x_cell = sheet_get_cell(sheet, row, min_col);
-            Cell* y_cell = sheet_get_cell(sheet, row, min_col + series_idx + 1);
-            
-            if (y_cell && (y_cell->type == CELL_NUMBER || 
-                         (y_cell->type == CELL_FORMULA && y_cell->data.formula.error == ERROR_NONE))) {
-                
-                ChartPoint* point = &series->points[point_idx];
-                
-                // Get X value
-                if (x_cell) {
-                    switch (x_cell->type) {
-                        case CELL_NUMBER:
-                            point->x = x_cell->data.number;
-                            break;
-                        case CELL_FORMULA:
-                            if (x_cell->data.formula.error == ERROR_NONE) {
-                                point->x = x_cell->data.formula.cached_value;
-                            } else {
-                                point->x = point_idx;  // Use index as X
-                            }
-                            break;
-                        case CELL_STRING:
-                            // For string labels, use index as X value
-                            point->x = point_idx;
-                            strncpy_s(point->label, sizeof(point->label), x_cell->data.string, _TRUNCATE);
-                            break;
-                        default:
-                            point->x = point_idx;
-                            break;
-                    }
-                } else {
-                    point->x = point_idx;
-                }
-                
-                // Get Y value
-                if (y_cell->type == CELL_NUMBER) {
-                    point->y = y_cell->data.number;
-                } else if (y_cell->type == CELL_FORMULA) {
-                    point->y = y_cell->data.formula.cached_value;
-                }
-                
-                // Update bounds
-                if (point->x < chart->x_min) chart->x_min = point->x;
-                if (point->x > chart->x_max) chart->x_max = point->x;
-                if (point->y < chart->y_min) chart->y_min = point->y;
-                if (point->y > chart->y_max) chart->y_max = point->y;
-                
-                point_idx++;
-            }
+        if (!binning->counting) {
+            if (x < bounds[0]) bounds[0] = x;
+            if (x > bounds[1]) bounds[1] = x;
+            if (y < bounds[2]) bounds[2] = y;
+            if (y > bounds[3]) bounds[3] = y;
+            continue;
         }
+        
+        // The maximum lands on the upper edge: count it in the last bin
+        int bx = (int)((x - binning->x_lo) * x_scale);
+        int by = (int)((y - binning->y_lo) * y_scale);
+        if (bx >= binning->bins_x) bx = binning->bins_x - 1;
+        if (by >= binning->bins_y) by = binning->bins_y - 1;
+        if (bx < 0 || by < 0) continue;
+        bins[by * binning->bins_x + bx] += 1.0;
     }
+}
+
+// Count the numbers in the range's first column (histogram) or the number
+// pairs in its first two columns (density) into bins_x by bins_y bins. A
+// text cell at the top of a column names its axis. Returns 0 if the range
+// holds no numbers or memory ran out.
+int chart_bin_range(Chart* chart, Sheet* sheet, RangeSelection* range, int bins_x, int bins_y) {
+    if (!chart || !sheet || !range || !range->is_active) return 0;
     
-    // Add some padding to bounds
-    double x_range = chart->x_max - chart->x_min;
-    double y_range = chart->y_max - chart->y_min;
+    int min_row = range->start_row < range->end_row ? range->start_row : range->end_row;
+    int max_row = range->start_row > range->end_row ? range->start_row : range->end_row;
+    int min_col = range->start_col < range->end_col ? range->start_col : range->end_col;
+    int max_col = range->start_col > range->end_col ? range->start_col : range->end_col;
+    int density = chart->config.type == CHART_DENSITY;
+    if (density && max_col == min_col) return 0;  // Need an X and a Y column
+    
+    ChartBinning binning;
+    memset(&binning, 0, sizeof(binning));
+    binning.sheet = sheet;
+    binning.x_col = min_col;
+    binning.y_col = density ? min_col + 1 : -1;
+    binning.start_row = min_row;
+    binning.row_count = max_row - min_row + 1;
+    binning.bins_x = bins_x < 1 ? 1 : bins_x > chart->config.width ? chart->config.width : bins_x;
+    binning.bins_y = !density || bins_y < 1 ? 1 : bins_y > chart->config.height ? chart->config.height : bins_y;
+    binning.x_lo = binning.y_lo = 0.0;
+    binning.x_hi = binning.y_hi = 1.0;
+    
+    int blocks = parallel_thread_count();
+    binning.block_rows = (binning.row_count + blocks - 1) / blocks;
+    blocks = (binning.row_count + binning.block_rows - 1) / binning.block_rows;
+    
+    // Pass 1: bounds
+    binning.block_bounds = (double*)malloc(blocks * 4 * sizeof(double));
+    if (!binning.block_bounds) return 0;
+    parallel_run(chart_bin_block, &binning, blocks);
+    
+    double bounds[4] = {DBL_MAX, -DBL_MAX, DBL_MAX, -DBL_MAX};
+    for (int b = 0; b < blocks; b++) {
+        const double* block = &binning.block_bounds[b * 4];
+        if (block[0] < bounds[0]) bounds[0] = block[0];
+        if (block[1] > bounds[1]) bounds[1] = block[1];
+        if (block[2] < bounds[2]) bounds[2] = block[2];
+        if (block[3] > bounds[3]) bounds[3] = block[3];
+    }
+    if (bounds[0] > bounds[1]) {
+        free(binning.block_bounds);
+        return 0;
+    }
     
-    if (x_range < 0.0001) {
-        chart->x_min -= 1.0;
-        chart->x_max += 1.0;
+    // A single distinct value still gets a bin of width 1
+    binning.x_lo = bounds[0];
+    binning.x_hi = bounds[1] > bounds[0] ? bounds[1] : bounds[0] + 1.0;
+    binning.y_lo = bounds[2];
+    binning.y_hi = bounds[3] > bounds[2] ? bounds[3] : bounds[2] + 1.0;
+    
+    // Pass 2: counts, one bin array per block
+    size_t bin_count = (size_t)binning.bins_x * binning.bins_y;
+    binning.block_bins = (double*)calloc(blocks * bin_count, sizeof(double));
+    double* bins = (double*)calloc(bin_count, sizeof(double));
+    if (!binning.block_bins || !bins) {
+        free(binning.block_bounds);
+        free(binning.block_bins);
+        free(bins);
+        return 0;
+    }
+    binning.counting = 1;
+    parallel_run(chart_bin_block, &binning, blocks);
+    
+    chart->bin_max = 0;
+    chart->bin_total = 0;
+    for (int b = 0; b < blocks; b++) {
+        const double* block = binning.block_bins + b * bin_count;
+        for (size_t i = 0; i < bin_count; i++) {
+            bins[i] += block[i];
+        }
+    }
+    for (size_t i = 0; i < bin_count; i++) {
+        chart->bin_total += bins[i];
+        if (bins[i] > chart->bin_max) chart->bin_max = bins[i];
+    }
+    free(binning.block_bounds);
+    free(binning.block_bins);
+    
+    free(chart->bins);
+    chart->bins = bins;
+    chart->bins_x = binning.bins_x;
+    chart->bins_y = binning.bins_y;
+    
+    // Bins fill the plot exactly, so the bounds are the bin edges
+    chart->x_min = binning.x_lo;
+    chart->x_max = binning.x_hi;
+    if (density) {
+        chart->y_min = binning.y_lo;
+        chart->y_max = binning.y_hi;
     } else {
-        chart->x_min -= x_range * 0.1;
-        chart->x_max += x_range * 0.1;
+        chart->y_min = 0;
+        chart->y_max = chart->bin_max * 1.1 > 1.0 ? chart->bin_max * 1.1 : 1.0;
     }
     
-    if (y_range < 0.0001) {
-        chart->y_min -= 1.0;
-        chart->y_max += 1.0;
-    } else {
-        chart->y_min -= y_range * 0.1;
-        chart->y_max += y_range * 0.1;
+    Cell* x_header = sheet_get_cell(sheet, min_row, binning.x_col);
+    if (x_header && x_header->type == CELL_STRING) {
+        strncpy_s(chart->config.x_label, sizeof(chart->config.x_label), x_header->data.string, _TRUNCATE);
+    }
+    Cell* y_header = density ? sheet_get_cell(sheet, min_row, binning.y_col) : NULL;
+    if (y_header && y_header->type == CELL_STRING) {
+        strncpy_s(chart->config.y_label, sizeof(chart->config.y_label), y_header->data.string, _TRUNCATE);
     }
+    return 1;
+}
+
+// Write text onto the canvas (clipped at its edges)
+void chart_write_text(Chart* chart, int x, int y, const char* text) {
+    for (int i = 0; text[i] && x + i < chart->canvas_width; i++) {
+        chart_set_pixel(chart, x + i, y, text[i]);
+    }
+}
+
+void chart_plot_histogram(Chart* chart) {
+    if (!chart->bins) return;
+    chart_draw_axes(chart);
     
-    // Ensure Y axis includes zero for bar charts
-    if (chart->config.type == CHART_BAR) {
-        if (chart->y_min > 0) chart->y_min = 0;
-        if (chart->y_max < 0) chart->y_max = 0;
+    int width = chart->config.width;
+    int base = chart_scale_y(chart, 0);
+    int gaps = width / chart->bins_x >= 3;   // Bars are wide enough to keep apart
+    for (int px = 0; px < width; px++) {
+        int bin = px * chart->bins_x / width;
+        if (gaps && (px + 1) * chart->bins_x / width != bin) continue;  // Last column of a bar
+        if (chart->bins[bin] <= 0) continue;
+        
+        int top = chart_scale_y(chart, chart->bins[bin]);
+        if (top >= base) top = base - 1;    // Every non-empty bin shows
+        for (int y = top; y < base; y++) {
+            chart_set_pixel(chart, 10 + px, y, '#');
+        }
     }
     
-    return 1;
+    char text[64];
+    int legend_x = 10 + width + 2;
+    sprintf_s(text, sizeof(text), "N: %.0f", chart->bin_total);
+    chart_write_text(chart, legend_x, 1, text);
+    sprintf_s(text, sizeof(text), "Bins: %d", chart->bins_x);
+    chart_write_text(chart, legend_x, 2, text);
+    sprintf_s(text, sizeof(text), "Width: %.3g", (chart->x_max - chart->x_min) / chart->bins_x);
+    chart_write_text(chart, legend_x, 3, text);
+    sprintf_s(text, sizeof(text), "Max: %.0f", chart->bin_max);
+    chart_write_text(chart, legend_x, 4, text);
+}
+
+void chart_plot_density(Chart* chart) {
+    if (!chart->bins) return;
+    chart_draw_axes(chart);
+    
+    // Shades from sparse to dense; counts map on a log scale so sparse
+    // regions stay visible next to dense ones
+    const char ramp[] = ".:-=+*#%@";
+    int levels = (int)strlen(ramp);
+    double scale = log(1.0 + chart->bin_max);
+    int width = chart->config.width;
+    int height = chart->config.height;
+    
+    for (int py = 0; py < height; py++) {
+        int by = (height - 1 - py) * chart->bins_y / height;
+        const double* row = chart->bins + (size_t)by * chart->bins_x;
+        for (int px = 0; px < width; px++) {
+            double count = row[px * chart->bins_x / width];
+            if (count <= 0) continue;
+            
+            chart_set_pixel(chart, 10 + px, py, ramp[chart_density_level(count, scale, levels)]);
+        }
+    }
+    
+    char text[64];
+    int legend_x = 10 + width + 2;
+    sprintf_s(text, sizeof(text), "N: %.0f", chart->bin_total);
+    chart_write_text(chart, legend_x, 1, text);
+    sprintf_s(text, sizeof(text), "Bins: %dx%d", chart->bins_x, chart->bins_y);
+    chart_write_text(chart, legend_x, 2, text);
+    chart_write_text(chart, legend_x, 4, "Per bin:");
+    int line = 5;
+    for (int i = 0; i < levels; i++) {
+        // Smallest count drawn with this shade or a denser one. The estimate
+        // is settled with the plot's own mapping, so rounding can't put a
+        // shade in the legend that the plot draws differently.
+        double from = i == 0 ? 1.0 : ceil(exp((i - 0.5) / (levels - 1) * scale) - 1.0);
+        if (from < 1.0) from = 1.0;
+        while (from > 1.0 && chart_density_level(from - 1.0, scale, levels) >= i) from -= 1.0;
+        while (from <= chart->bin_max && chart_density_level(from, scale, levels) < i) from += 1.0;
+        if (from > chart->bin_max) break;
+        if (chart_density_level(from, scale, levels) != i) continue;   // No count is drawn with this shade
+        sprintf_s(text, sizeof(text), "%c >= %.0f", ramp[i], from);
+        chart_write_text(chart, legend_x, line++, text);
+    }
+}
+
+// The shade (index into a ramp of 'levels' characters) a bin count is drawn
+// with; 'scale' is log(1 + the largest bin count)
+int chart_density_level(double count, double scale, int levels) {
+    int level = (int)(log(1.0 + count) / scale * (levels - 1) + 0.5);
+    return level >= levels ? levels - 1 : level;
 }
 
 void chart_set_pixel(Chart* chart, int x, int y, char c) {
@@ -390,7 +967,7 @@ void chart_draw_axes(Chart* chart) {
     int has_string_labels = 0;
     if (chart->series_count > 0 && chart->series[0].count > 0) {
         for (int i = 0; i < chart->series[0].count; i++) {
-            if (strlen(chart->series[0].points[i].label) > 0) {
+            if (chart_series_label(&chart->series[0], i)[0]) {
                 has_string_labels = 1;
                 break;
             }
@@ -405,8 +982,8 @@ void chart_draw_axes(Chart* chart) {
         if (step < 1) step = 1;
         
         for (int i = 0; i < series->count; i += step) {
-            int x = chart_scale_x(chart, series->points[i].x);
-            const char* label = series->points[i].label;
+            int x = chart_scale_x(chart, chart_series_x(series, i));
+            const char* label = chart_series_label(series, i);
             
             if (strlen(label) > 0) {
                 int label_y = chart->config.height + 1;
@@ -511,8 +1088,8 @@ void chart_plot_line_chart(Chart* chart) {
         
         // Plot points and connect with lines
         for (int i = 0; i < series->count; i++) {
-            int x = chart_scale_x(chart, series->points[i].x);
-            int y = chart_scale_y(chart, series->points[i].y);
+            int x = chart_scale_x(chart, chart_series_x(series, i));
+            int y = chart_scale_y(chart, series->ys[i]);
             
             // Draw the point with a larger marker
             if (x >= 0 && x < chart->canvas_width && y >= 0 && y < chart->canvas_height) {
@@ -524,8 +1101,8 @@ void chart_plot_line_chart(Chart* chart) {
             
             // Connect to previous point with better line drawing
             if (i > 0) {
-                int prev_x = chart_scale_x(chart, series->points[i-1].x);
-                int prev_y = chart_scale_y(chart, series->points[i-1].y);
+                int prev_x = chart_scale_x(chart, chart_series_x(series, i-1));
+                int prev_y = chart_scale_y(chart, series->ys[i-1]);
                 
                 // Use different line styles for different series
                 char line_char = (s == 0) ? '*' : (s == 1) ? '+' : (s == 2) ? 'x' : '.';
@@ -609,7 +1186,7 @@ void chart_plot_bar_chart(Chart* chart) {
     // Draw bars
     for (int i = 0; i < series->count; i++) {
         int bar_x = 12 + i * (bar_width + spacing);
-        int bar_top = chart_scale_y(chart, series->points[i].y);
+        int bar_top = chart_scale_y(chart, series->ys[i]);
         int bar_bottom = chart_scale_y(chart, 0);
         
         if (bar_top > bar_bottom) {
@@ -640,10 +1217,10 @@ void chart_plot_bar_chart(Chart* chart) {
         
         // Draw value on top of bar with better formatting
         char value_str[32];
-        if (fabs(series->points[i].y) >= 1000) {
-            sprintf_s(value_str, sizeof(value_str), "%.0f", series->points[i].y);
+        if (fabs(series->ys[i]) >= 1000) {
+            sprintf_s(value_str, sizeof(value_str), "%.0f", series->ys[i]);
         } else {
-            sprintf_s(value_str, sizeof(value_str), "%.1f", series->points[i].y);
+            sprintf_s(value_str, sizeof(value_str), "%.1f", series->ys[i]);
         }
         
         int value_x = bar_x + (bar_width - (int)strlen(value_str)) / 2;
@@ -658,11 +1235,11 @@ void chart_plot_bar_chart(Chart* chart) {
         }
           // Draw label below bar with better handling for string labels
         const char* label_text = "";
-        if (strlen(series->points[i].label) > 0) {
-            label_text = series->points[i].label;
+        char index_label[16];
+        if (chart_series_label(series, i)[0]) {
+            label_text = chart_series_label(series, i);
         } else {
             // Use index-based label if no string label available
-            static char index_label[16];
             sprintf_s(index_label, sizeof(index_label), "Item %d", i + 1);
             label_text = index_label;
         }
@@ -705,6 +1282,15 @@ void chart_plot_bar_chart(Chart* chart) {
     }
 }
 
+// NEW: Monotonic stand-in for atan2(dy, dx) mapped to [0, 4): it orders
+// directions the same way as the true angle but needs only a division
+double chart_pseudo_angle(double dx, double dy) {
+    double sum = fabs(dx) + fabs(dy);
+    if (sum == 0) return 0;
+    double p = dx / sum;    // 1 at 0 degrees, -1 at 180 degrees
+    return dy >= 0 ? 1.0 - p : 3.0 + p;
+}
+
 void chart_plot_pie_chart(Chart* chart) {
     if (chart->series_count == 0 || chart->series[0].count == 0) return;
     
@@ -714,8 +1300,8 @@ void chart_plot_pie_chart(Chart* chart) {
     // Calculate total
     double total = 0;
     for (int i = 0; i < series->count; i++) {
-        if (series->points[i].y > 0) {
-            total += series->points[i].y;
+        if (series->ys[i] > 0) {
+            total += series->ys[i];
         }
     }
     
@@ -731,44 +1317,56 @@ void chart_plot_pie_chart(Chart* chart) {
     const char* slice_chars = "@#$%&*+=~-:.|ox+";
     int num_chars = (int)strlen(slice_chars);
     
-    // Draw the pie with better resolution
+    // Where each slice starts, as a pseudo-angle (see chart_pseudo_angle),
+    // so pixels can be placed with a binary search instead of atan2 and a
+    // scan over every slice
+    double* starts = (double*)malloc(series->count * sizeof(double));
+    int* slices = (int*)malloc(series->count * sizeof(int));
+    if (!starts || !slices) {
+        free(starts);
+        free(slices);
+        return;
+    }
+    int slice_count = 0;
+    double cumulative = 0;
+    for (int i = 0; i < series->count; i++) {
+        if (series->ys[i] <= 0) continue;
+        double angle = cumulative / total * 2 * 3.14159265359;
+        starts[slice_count] = slice_count == 0 ? 0.0 : chart_pseudo_angle(cos(angle), sin(angle));
+        slices[slice_count++] = i;
+        cumulative += series->ys[i];
+    }
+    
+    // Draw the pie with better resolution, one row span at a time
+    double radius_sq = (double)radius * radius;
+    double border_sq = (double)(radius - 1) * (radius - 1);
     for (int y = -radius; y <= radius; y++) {
-        for (int x = -radius * 2; x <= radius * 2; x++) {
+        double dy = y;
+        int half_width = (int)(2.0 * sqrt(radius_sq - dy * dy));  // Columns are half as wide as rows are tall
+        for (int x = -half_width; x <= half_width; x++) {
             double dx = x / 2.0;  // Correct for aspect ratio
-            double dy = y;
-            double dist = sqrt(dx * dx + dy * dy);
+            double dist_sq = dx * dx + dy * dy;
+            if (dist_sq > radius_sq) continue;
             
-            if (dist <= radius) {
-                // Calculate angle
-                double angle = atan2(dy, dx);
-                if (angle < 0) angle += 2 * 3.14159265359;
-                
-                // Find which slice this belongs to
-                double cumulative = 0;
-                int slice_idx = -1;
-                
-                for (int i = 0; i < series->count; i++) {
-                    if (series->points[i].y <= 0) continue;
-                    
-                    double slice_angle = (series->points[i].y / total) * 2 * 3.14159265359;
-                    if (angle >= cumulative && angle < cumulative + slice_angle) {
-                        slice_idx = i;
-                        break;
-                    }
-                    cumulative += slice_angle;
-                }
-                
-                if (slice_idx >= 0) {
-                    char c = slice_chars[slice_idx % num_chars];
-                    // Add border effect
-                    if (dist > radius - 1) {
-                        c = '*';
-                    }
-                    chart_set_pixel(chart, center_x + x, center_y + y, c);
-                }
+            // Last slice starting at or before this pixel's angle
+            double pseudo = chart_pseudo_angle(dx, dy);
+            int lo = 0, hi = slice_count - 1;
+            while (lo < hi) {
+                int mid = (lo + hi + 1) / 2;
+                if (starts[mid] <= pseudo) lo = mid;
+                else hi = mid - 1;
             }
+            
+            char c = slice_chars[slices[lo] % num_chars];
+            // Add border effect
+            if (dist_sq > border_sq) {
+                c = '*';
+            }
+            chart_set_pixel(chart, center_x + x, center_y + y, c);
         }
     }
+    free(starts);
+    free(slices);
     
     // Draw legend with better formatting
     int legend_x = 5;
@@ -781,9 +1379,9 @@ void chart_plot_pie_chart(Chart* chart) {
     }
     
     for (int i = 0; i < series->count && legend_y + i + 1 < chart->config.height; i++) {
-        if (series->points[i].y <= 0) continue;
+        if (series->ys[i] <= 0) continue;
         
-        double percentage = (series->points[i].y / total) * 100;
+        double percentage = (series->ys[i] / total) * 100;
         
         // Draw slice character with padding
         chart_set_pixel(chart, legend_x, legend_y + i + 1, slice_chars[i % num_chars]);
@@ -794,12 +1392,12 @@ void chart_plot_pie_chart(Chart* chart) {
         
         // Draw label and percentage with better formatting
         char legend_text[80];
-        if (strlen(series->points[i].label) > 0) {
-            sprintf_s(legend_text, sizeof(legend_text), "%-15s: %8.1f (%5.1f%%)", 
-                     series->points[i].label, series->points[i].y, percentage);
+        if (chart_series_label(series, i)[0]) {
+            sprintf_s(legend_text, sizeof(legend_text), "%-15.15s: %8.1f (%5.1f%%)", 
+                     chart_series_label(series, i), series->ys[i], percentage);
         } else {
             sprintf_s(legend_text, sizeof(legend_text), "Item %-10d: %8.1f (%5.1f%%)", 
-                     i + 1, series->points[i].y, percentage);
+                     i + 1, series->ys[i], percentage);
         }
         
         for (int j = 0; j < (int)strlen(legend_text) && legend_x + 5 + j < chart->canvas_width; j++) {
@@ -821,11 +1419,7 @@ void chart_plot_pie_chart(Chart* chart) {
 void chart_render(Chart* chart) {
     if (!chart) return;
     
-    // Clear canvas
-    for (int y = 0; y < chart->canvas_height; y++) {
-        memset(chart->canvas[y], ' ', chart->canvas_width);
-        chart->canvas[y][chart->canvas_width] = '\0';
-    }
+    chart_clear_canvas(chart);
     
     // Render based on chart type
     switch (chart->config.type) {
@@ -841,6 +1435,12 @@ void chart_render(Chart* chart) {
         case CHART_SCATTER:
             chart_plot_line_chart(chart);  // Use line chart without lines for now
             break;
+        case CHART_HISTOGRAM:
+            chart_plot_histogram(chart);
+            break;
+        case CHART_DENSITY:
+            chart_plot_density(chart);
+            break;
     }
 }
 
@@ -930,94 +1530,389 @@ int parse_chart_command_with_size(const char* command, ChartType* type, char* x_
     return 1;
 }
 
-// Function to display chart in a popup-style window
-void display_chart_popup(Console* console, Chart* chart, const char* title) {
-    if (!console || !chart) return;
+// NEW: Live charts
+
+// Bucket holding data row 'row' (buckets split data_rows as evenly as possible)
+int live_chart_bucket_of(const LiveChart* live, int row) {
+    long long offset = row - live->data_start;
+    return (int)(((offset + 1) * live->bucket_count - 1) / live->data_rows);
+}
+
+int live_chart_bucket_start(const LiveChart* live, int bucket) {
+    return live->data_start + (int)((long long)bucket * live->data_rows / live->bucket_count);
+}
+
+// Work out the header row and bucket layout and (re)allocate the bucket
+// arrays; every bucket starts dirty. Returns 0 if memory ran out.
+int live_chart_layout(LiveChart* live) {
+    Chart* chart = live->chart;
+    Cell* first_cell = sheet_get_cell(live->sheet, live->start_row, live->start_col);
+    live->has_headers = first_cell && first_cell->type == CELL_STRING;
+    live->data_start = live->has_headers ? live->start_row + 1 : live->start_row;
+    live->data_rows = live->end_row - live->data_start + 1;
+    if (live->data_rows < 0) live->data_rows = 0;
+    
+    int budget;
+    switch (chart->config.type) {
+        case CHART_LINE:
+            live->slots = 2;
+            budget = 2 * chart->config.width;
+            break;
+        case CHART_SCATTER:
+            live->slots = 4;
+            budget = 4 * chart->config.width;
+            break;
+        default:
+            live->slots = 1;
+            budget = live->data_rows;
+            break;
+    }
+    live->bucket_count = live->data_rows <= budget ? live->data_rows : budget / live->slots;
+    
+    free(live->kept_x);
+    free(live->kept_y);
+    free((void*)live->kept_labels);
+    free(live->kept_count);
+    free(live->bounds);
+    free(live->dirty);
+    free(live->dirty_list);
+    
+    size_t buckets = (size_t)chart->series_count * live->bucket_count;
+    live->kept_x = (double*)malloc((buckets * live->slots + 1) * sizeof(double));
+    live->kept_y = (double*)malloc((buckets * live->slots + 1) * sizeof(double));
+    live->kept_labels = (const char**)malloc((buckets * live->slots + 1) * sizeof(const char*));
+    live->kept_count = (unsigned char*)calloc(buckets + 1, 1);
+    live->bounds = (double*)calloc(buckets * 4 + 1, sizeof(double));
+    live->dirty = (unsigned char*)malloc(live->bucket_count + 1);
+    live->dirty_list = (int*)malloc((live->bucket_count + 1) * sizeof(int));
+    if (!live->kept_x || !live->kept_y || !live->kept_labels || !live->kept_count || !live->bounds || !live->dirty || !live->dirty_list) return 0;
+    
+    for (int i = 0; i < chart->series_count; i++) {
+        ChartSeries* series = &chart->series[i];
+        series->count = 0;
+        if (!chart_series_reserve(series, live->bucket_count * live->slots)) return 0;
+        chart_name_series(chart, i, live->sheet, live->has_headers ? live->start_row : -1, live->start_col + i + 1);
+    }
     
-    // Save current screen (simplified - in practice you'd save the buffer)
-    console_clear(console);
+    memset(live->dirty, 1, live->bucket_count);
+    live->dirty_count = live->bucket_count;
+    live->header_dirty = 0;
+    return 1;
+}
+
+// Sheet watcher callback: mark the buckets covering the changed rows
+void live_chart_on_change(void* context, int start_row, int start_col, int end_row, int end_col) {
+    LiveChart* live = (LiveChart*)context;
+    (void)start_col;
+    (void)end_col;
+    
+    if (start_row <= live->start_row) live->header_dirty = 1;
+    
+    int first = start_row > live->data_start ? start_row : live->data_start;
+    if (first > end_row || live->bucket_count == 0) return;
+    
+    int last_bucket = live_chart_bucket_of(live, end_row);
+    for (int bucket = live_chart_bucket_of(live, first); bucket <= last_bucket; bucket++) {
+        if (!live->dirty[bucket]) {
+            live->dirty[bucket] = 1;
+            live->dirty_count++;
+        }
+    }
+}
+
+// Rescan one dirty bucket (parallel_run task; buckets are independent)
+void live_chart_scan_bucket(void* context, int index) {
+    LiveChart* live = (LiveChart*)context;
+    Chart* chart = live->chart;
+    int bucket = live->dirty_list[index];
+    int first = live_chart_bucket_start(live, bucket);
+    int last = live_chart_bucket_start(live, bucket + 1) - 1;
+    
+    for (int s = 0; s < chart->series_count; s++) {
+        int y_col = live->start_col + s + 1;
+        size_t slot = (size_t)s * live->bucket_count + bucket;
+        double* bounds = &live->bounds[slot * 4];
+        int extreme_rows[4] = {-1, -1, -1, -1};    // Rows of x min, x max, y min, y max
+        
+        bounds[0] = DBL_MAX;
+        bounds[1] = -DBL_MAX;
+        bounds[2] = DBL_MAX;
+        bounds[3] = -DBL_MAX;
+        for (int row = first; row <= last; row++) {
+            double x, y;
+            const char* label;
+            if (!chart_read_point(live->sheet, row, live->start_col, y_col, row - live->data_start, &x, &y, &label)) continue;
+            
+            if (x < bounds[0]) { bounds[0] = x; extreme_rows[0] = row; }
+            if (x > bounds[1]) { bounds[1] = x; extreme_rows[1] = row; }
+            if (y < bounds[2]) { bounds[2] = y; extreme_rows[2] = row; }
+            if (y > bounds[3]) { bounds[3] = y; extreme_rows[3] = row; }
+        }
+        
+        // Rows to keep, in row order and without repeats: line charts keep
+        // the Y extremes, scatter plots the X and Y extremes (bar and pie
+        // buckets are a single row, so every extreme is the same row)
+        int rows[LIVE_CHART_MAX_SLOTS];
+        int count = 0;
+        for (int k = chart->config.type == CHART_SCATTER ? 0 : 2; k < 4; k++) {
+            int row = extreme_rows[k];
+            if (row < 0) continue;
+            
+            int pos = count;
+            while (pos > 0 && rows[pos - 1] > row) pos--;
+            if (pos > 0 && rows[pos - 1] == row) continue;
+            memmove(&rows[pos + 1], &rows[pos], (count - pos) * sizeof(int));
+            rows[pos] = row;
+            count++;
+        }
+        
+        size_t kept = slot * live->slots;
+        for (int k = 0; k < count; k++) {
+            chart_read_point(live->sheet, rows[k], live->start_col, y_col, rows[k] - live->data_start,
+                             &live->kept_x[kept + k], &live->kept_y[kept + k], &live->kept_labels[kept + k]);
+        }
+        live->kept_count[slot] = (unsigned char)count;
+    }
+}
+
+// Rebuild the chart's series and bounds from the bucket summaries and redraw
+void live_chart_publish(LiveChart* live) {
+    Chart* chart = live->chart;
+    chart->x_min = DBL_MAX;
+    chart->x_max = -DBL_MAX;
+    chart->y_min = DBL_MAX;
+    chart->y_max = -DBL_MAX;
     
-    // Use almost the full screen space with minimal borders
-    int border_width = console->width - 2;
-    int border_height = console->height - 2;
+    for (int s = 0; s < chart->series_count; s++) {
+        ChartSeries* series = &chart->series[s];
+        series->count = 0;
+        for (int bucket = 0; bucket < live->bucket_count; bucket++) {
+            size_t slot = (size_t)s * live->bucket_count + bucket;
+            int count = live->kept_count[slot];
+            if (count == 0) continue;
+            
+            size_t kept = slot * live->slots;
+            for (int k = 0; k < count; k++) {
+                chart_series_append(series, live->kept_x[kept + k], live->kept_y[kept + k], live->kept_labels[kept + k]);
+            }
+            
+            const double* bounds = &live->bounds[slot * 4];
+            if (bounds[0] < chart->x_min) chart->x_min = bounds[0];
+            if (bounds[1] > chart->x_max) chart->x_max = bounds[1];
+            if (bounds[2] < chart->y_min) chart->y_min = bounds[2];
+            if (bounds[3] > chart->y_max) chart->y_max = bounds[3];
+        }
+    }
     
-    // Center the chart on screen
-    int border_x = 1;
-    int border_y = 1;
+    chart_pad_bounds(chart);
+    chart_render(chart);
+}
+
+// Bind a chart to a range (first column X, the rest Y series, optional header
+// row) and draw it. Returns NULL for ranges under 2 columns or out of memory.
+LiveChart* live_chart_new(Sheet* sheet, RangeSelection* range, ChartType type,
+                          const char* x_label, const char* y_label, int width, int height) {
+    if (!sheet || !range || !range->is_active) return NULL;
+    
+    LiveChart* live = (LiveChart*)calloc(1, sizeof(LiveChart));
+    if (!live) return NULL;
+    live->sheet = sheet;
+    live->watcher = -1;
+    live->start_row = range->start_row < range->end_row ? range->start_row : range->end_row;
+    live->end_row = range->start_row > range->end_row ? range->start_row : range->end_row;
+    live->start_col = range->start_col < range->end_col ? range->start_col : range->end_col;
+    live->end_col = range->start_col > range->end_col ? range->start_col : range->end_col;
+    if (live->end_col - live->start_col < 1) {
+        free(live);
+        return NULL;
+    }
     
-    // Draw simple border for full-screen experience
-    for (int x = 0; x < console->width; x++) {
-        console_write_char(console, x, 0, '=', MAKE_COLOR(COLOR_WHITE | COLOR_BRIGHT, COLOR_BLACK));
-        console_write_char(console, x, console->height - 1, '=', MAKE_COLOR(COLOR_WHITE | COLOR_BRIGHT, COLOR_BLACK));
+    live->width = width;
+    live->height = height;
+    live->chart = chart_create_sized(type, x_label, y_label, width, height);
+    if (!live->chart) {
+        live_chart_free(live);
+        return NULL;
     }
-    for (int y = 0; y < console->height; y++) {
-        console_write_char(console, 0, y, '|', MAKE_COLOR(COLOR_WHITE | COLOR_BRIGHT, COLOR_BLACK));
-        console_write_char(console, console->width - 1, y, '|', MAKE_COLOR(COLOR_WHITE | COLOR_BRIGHT, COLOR_BLACK));
+    live->chart->series_count = live->end_col - live->start_col;
+    live->chart->series = (ChartSeries*)calloc(live->chart->series_count, sizeof(ChartSeries));
+    if (!live->chart->series || !live_chart_layout(live)) {
+        live_chart_free(live);
+        return NULL;
     }
     
-    // Draw corners
-    console_write_char(console, 0, 0, '#', MAKE_COLOR(COLOR_WHITE | COLOR_BRIGHT, COLOR_BLACK));
-    console_write_char(console, console->width - 1, 0, '#', MAKE_COLOR(COLOR_WHITE | COLOR_BRIGHT, COLOR_BLACK));
-    console_write_char(console, 0, console->height - 1, '#', MAKE_COLOR(COLOR_WHITE | COLOR_BRIGHT, COLOR_BLACK));
-    console_write_char(console, console->width - 1, console->height - 1, '#', MAKE_COLOR(COLOR_WHITE | COLOR_BRIGHT, COLOR_BLACK));
+    live->watcher = sheet_watch_range(sheet, live->start_row, live->start_col, live->end_row, live->end_col,
+                                      live_chart_on_change, live);
+    if (live->watcher < 0) {
+        live_chart_free(live);
+        return NULL;
+    }
     
-    // Draw title with better formatting
-    if (title && strlen(title) > 0) {
-        int title_x = (console->width - (int)strlen(title)) / 2;
-        console_write_string(console, title_x - 1, 0, "[", MAKE_COLOR(COLOR_YELLOW | COLOR_BRIGHT, COLOR_BLACK));
-        console_write_string(console, title_x, 0, title, MAKE_COLOR(COLOR_YELLOW | COLOR_BRIGHT, COLOR_BLACK));
-        console_write_string(console, title_x + (int)strlen(title), 0, "]", MAKE_COLOR(COLOR_YELLOW | COLOR_BRIGHT, COLOR_BLACK));
-    }      // Display chart using the full available space (minus borders)
-    int display_start_x = border_x;
-    int display_start_y = border_y;
-    int display_width = border_width;
-    int display_height = border_height;
-    
-    // Fill the entire available area with the chart
-    int chart_rows = chart->canvas_height;
-    int chart_cols = chart->canvas_width;
-    
-    for (int y = 0; y < chart_rows && y < display_height; y++) {
-        for (int x = 0; x < chart_cols && x < display_width; x++) {
-            if (display_start_x + x < console->width && display_start_y + y < console->height) {
-                // Enhanced color coding for much better visibility
-                WORD color = MAKE_COLOR(COLOR_WHITE, COLOR_BLACK);
-                char c = chart->canvas[y][x];
-                
-                // Color coding based on character type for better visibility
-                if (c == '|' || c == '-' || c == '=' || c == '#') {
-                    // Axes and grid
-                    color = MAKE_COLOR(COLOR_CYAN | COLOR_BRIGHT, COLOR_BLACK);
-                } else if (c == 'O' || c == '*') {
-                    // First series - bright yellow
-                    color = MAKE_COLOR(COLOR_YELLOW | COLOR_BRIGHT, COLOR_BLACK);
-                } else if (c == '+' || c == 'X') {
-                    // Second series - bright green
-                    color = MAKE_COLOR(COLOR_GREEN | COLOR_BRIGHT, COLOR_BLACK);
-                } else if (c == 'x' || c == '@') {
-                    // Third series - bright magenta
-                    color = MAKE_COLOR(COLOR_MAGENTA | COLOR_BRIGHT, COLOR_BLACK);
-                } else if (c == '$' || c == '%') {
-                    // Fourth series - bright red
-                    color = MAKE_COLOR(COLOR_RED | COLOR_BRIGHT, COLOR_BLACK);
-                } else if (c == '[' || c == ']') {
-                    // Bar chart borders
-                    color = MAKE_COLOR(COLOR_BLUE | COLOR_BRIGHT, COLOR_BLACK);
-                } else if (c == '#' && y > 0 && chart->canvas[y-1][x] == '#') {
-                    // Bar chart fill
-                    color = MAKE_COLOR(COLOR_BLUE | COLOR_BRIGHT, COLOR_BLACK);
-                } else if (isdigit(c) || c == '.') {
-                    // Numbers and decimal points
-                    color = MAKE_COLOR(COLOR_WHITE | COLOR_BRIGHT, COLOR_BLACK);
-                } else if (isalpha(c)) {
-                    // Letters (labels, legend text)
-                    color = MAKE_COLOR(COLOR_WHITE, COLOR_BLACK);
-                }
-                
-                console_write_char(console, display_start_x + x, display_start_y + y, c, color);
+    live_chart_refresh(live);
+    return live;
+}
+
+// Bring the chart up to date with the sheet. Returns 1 if it was redrawn.
+int live_chart_refresh(LiveChart* live) {
+    if (!live || (live->dirty_count == 0 && !live->header_dirty)) return 0;
+    
+    if (live->header_dirty) {
+        live->header_dirty = 0;
+        Cell* first_cell = sheet_get_cell(live->sheet, live->start_row, live->start_col);
+        int has_headers = first_cell && first_cell->type == CELL_STRING;
+        if (has_headers != live->has_headers) {
+            // The first row switched between header and data
+            if (!live_chart_layout(live)) return 0;
+        } else if (has_headers) {
+            for (int i = 0; i < live->chart->series_count; i++) {
+                chart_name_series(live->chart, i, live->sheet, live->start_row, live->start_col + i + 1);
             }
         }
-    }    
+    }
+    
+    int count = 0;
+    for (int bucket = 0; bucket < live->bucket_count && count < live->dirty_count; bucket++) {
+        if (live->dirty[bucket]) {
+            live->dirty[bucket] = 0;
+            live->dirty_list[count++] = bucket;
+        }
+    }
+    live->dirty_count = 0;
+    
+    parallel_run(live_chart_scan_bucket, live, count);
+    live_chart_publish(live);
+    return 1;
+}
+
+// Give the chart a new plot size; the buckets follow the new width, so the
+// whole range is rescanned on the next refresh
+int live_chart_resize(LiveChart* live, int width, int height) {
+    if (!chart_resize(live->chart, width, height)) return 0;
+    live->width = width;
+    live->height = height;
+    return live_chart_layout(live);
+}
+
+void live_chart_free(LiveChart* live) {
+    if (!live) return;
+    if (live->watcher >= 0) sheet_unwatch(live->sheet, live->watcher);
+    chart_free(live->chart);
+    free(live->kept_x);
+    free(live->kept_y);
+    free((void*)live->kept_labels);
+    free(live->kept_count);
+    free(live->bounds);
+    free(live->dirty);
+    free(live->dirty_list);
+    free(live);
+}
+
+// NEW: Console colour for a canvas character
+WORD chart_char_color(char c) {
+    // Enhanced color coding for much better visibility
+    WORD color = MAKE_COLOR(COLOR_WHITE, COLOR_BLACK);
+    
+    // Color coding based on character type for better visibility
+    if (c == '|' || c == '-' || c == '=' || c == '#') {
+        // Axes and grid
+        color = MAKE_COLOR(COLOR_CYAN | COLOR_BRIGHT, COLOR_BLACK);
+    } else if (c == 'O' || c == '*') {
+        // First series - bright yellow
+        color = MAKE_COLOR(COLOR_YELLOW | COLOR_BRIGHT, COLOR_BLACK);
+    } else if (c == '+' || c == 'X') {
+        // Second series - bright green
+        color = MAKE_COLOR(COLOR_GREEN | COLOR_BRIGHT, COLOR_BLACK);
+    } else if (c == 'x' || c == '@') {
+        // Third series - bright magenta
+        color = MAKE_COLOR(COLOR_MAGENTA | COLOR_BRIGHT, COLOR_BLACK);
+    } else if (c == '$' || c == '%') {
+        // Fourth series - bright red
+        color = MAKE_COLOR(COLOR_RED | COLOR_BRIGHT, COLOR_BLACK);
+    } else if (c == '[' || c == ']') {
+        // Bar chart borders
+        color = MAKE_COLOR(COLOR_BLUE | COLOR_BRIGHT, COLOR_BLACK);
+    } else if (isdigit((unsigned char)c) || c == '.') {
+        // Numbers and decimal points
+        color = MAKE_COLOR(COLOR_WHITE | COLOR_BRIGHT, COLOR_BLACK);
+    } else if (isalpha((unsigned char)c)) {
+        // Letters (labels, legend text)
+        color = MAKE_COLOR(COLOR_WHITE, COLOR_BLACK);
+    }
+    return color;
+}
+
+// NEW: Copy the chart canvas onto the console at (left, top), clipped to
+// width x height. Rows are written straight into the back buffer, with
+// colours looked up per character.
+void chart_blit(Console* console, Chart* chart, int left, int top, int width, int height) {
+    static WORD colors[256];
+    static int colors_ready = 0;
+    if (!colors_ready) {
+        for (int c = 0; c < 256; c++) {
+            colors[c] = chart_char_color((char)c);
+        }
+        colors_ready = 1;
+    }
+    
+    if (left < 0 || top < 0) return;
+    int cols = chart->canvas_width;
+    if (cols > width) cols = width;
+    if (cols > console->width - left) cols = console->width - left;
+    int rows = chart->canvas_height;
+    if (rows > height) rows = height;
+    if (rows > console->height - top) rows = console->height - top;
+    
+    for (int y = 0; y < rows; y++) {
+        const unsigned char* row = (const unsigned char*)chart->canvas[y];
+        CHAR_INFO* out = console->backBuffer + (size_t)(top + y) * console->width + left;
+        for (int x = 0; x < cols; x++) {
+            out[x].Char.AsciiChar = (char)row[x];
+            out[x].Attributes = colors[row[x]];
+        }
+    }
+}
+
+// NEW: Border with a centred [title] for a chart window
+void chart_draw_frame(Console* console, int left, int top, int width, int height, const char* title) {
+    WORD frame_color = MAKE_COLOR(COLOR_WHITE | COLOR_BRIGHT, COLOR_BLACK);
+    int right = left + width - 1;
+    int bottom = top + height - 1;
+    
+    for (int x = left; x <= right; x++) {
+        console_write_char(console, x, top, '=', frame_color);
+        console_write_char(console, x, bottom, '=', frame_color);
+    }
+    for (int y = top; y <= bottom; y++) {
+        console_write_char(console, left, y, '|', frame_color);
+        console_write_char(console, right, y, '|', frame_color);
+    }
+    
+    // Draw corners
+    console_write_char(console, left, top, '#', frame_color);
+    console_write_char(console, right, top, '#', frame_color);
+    console_write_char(console, left, bottom, '#', frame_color);
+    console_write_char(console, right, bottom, '#', frame_color);
+    
+    if (title && strlen(title) > 0) {
+        WORD title_color = MAKE_COLOR(COLOR_YELLOW | COLOR_BRIGHT, COLOR_BLACK);
+        int title_x = left + (width - (int)strlen(title)) / 2;
+        console_write_string(console, title_x - 1, top, "[", title_color);
+        console_write_string(console, title_x, top, title, title_color);
+        console_write_string(console, title_x + (int)strlen(title), top, "]", title_color);
+    }
+}
+
+// Function to display chart in a popup-style window
+void display_chart_popup(Console* console, Chart* chart, const char* title) {
+    if (!console || !chart) return;
+    
+    // Save current screen (simplified - in practice you'd save the buffer)
+    console_clear(console);
+    
+    // Use the full screen with a one-character border
+    chart_draw_frame(console, 0, 0, console->width, console->height, title);
+    chart_blit(console, chart, 1, 1, console->width - 2, console->height - 2);
+    
     // Draw instructions with better visibility at the bottom
     const char* instructions = "[ Press any key to close ]";
     int inst_x = (console->width - (int)strlen(instructions)) / 2;
@@ -1027,4 +1922,334 @@ void display_chart_popup(Console* console, Chart* chart, const char* title) {
     console_flip(console);
 }
 
+// NEW: Chart export
+//
+// A chart can be written as the same ASCII canvas shown on screen (.txt and
+// any other extension) or as an SVG drawing of its data (.svg). Writing needs
+// no console, so it also works headless, and chart_export_start runs it on a
+// worker thread so large charts don't hold up the UI.
+
+// Chart type for a command word ("line", "bar", ...). Returns 0 if unknown.
+int chart_type_from_name(const char* name, ChartType* type) {
+    static const char* names[] = {"line", "bar", "pie", "scatter", "histogram", "density"};
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if (_stricmp(name, names[i]) == 0) {
+            *type = (ChartType)i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const char* chart_type_name(ChartType type) {
+    switch (type) {
+        case CHART_LINE: return "Line Chart";
+        case CHART_BAR: return "Bar Chart";
+        case CHART_PIE: return "Pie Chart";
+        case CHART_SCATTER: return "Scatter Plot";
+        case CHART_HISTOGRAM: return "Histogram";
+        case CHART_DENSITY: return "Density Plot";
+        default: return "Chart";
+    }
+}
+
+// Chart of any type for a range, with the default bins for histogram (20)
+// and density charts (one per plot cell). Returns NULL if it has no data.
+Chart* chart_from_range(Sheet* sheet, RangeSelection* range, ChartType type, const char* x_label,
+                        const char* y_label, int width, int height) {
+    Chart* chart = chart_create_sized(type, x_label, y_label, width, height);
+    if (!chart) return NULL;
+    
+    int ok;
+    if (type == CHART_HISTOGRAM || type == CHART_DENSITY) {
+        ok = chart_bin_range(chart, sheet, range, type == CHART_DENSITY ? chart->config.width : 20,
+                             chart->config.height);
+    } else {
+        ok = chart_add_data_from_range(chart, sheet, range);
+    }
+    if (!ok) {
+        chart_free(chart);
+        return NULL;
+    }
+    return chart;
+}
+
+// Replace the labels pointing into the sheet with private copies, so the
+// chart stays valid after the cells change. Returns 0 if memory ran out
+// (labels not copied yet are dropped).
+int chart_own_labels(Chart* chart) {
+    if (chart->owns_labels) return 1;
+    chart->owns_labels = 1;
+    
+    int ok = 1;
+    for (int s = 0; s < chart->series_count; s++) {
+        ChartSeries* series = &chart->series[s];
+        if (!series->labels) continue;
+        for (int i = 0; i < series->count; i++) {
+            if (!series->labels[i]) continue;
+            series->labels[i] = ok ? _strdup(series->labels[i]) : NULL;
+            if (!series->labels[i]) ok = 0;
+        }
+    }
+    return ok;
+}
+
+// Canvas rows without trailing blanks, and without the blank rows at the end
+int chart_export_text(Chart* chart, FILE* file) {
+    chart_render(chart);
+    
+    int rows = chart->canvas_height;
+    while (rows > 0) {
+        const char* row = chart->canvas[rows - 1];
+        int blank = 1;
+        for (int x = 0; x < chart->canvas_width && blank; x++) {
+            if (row[x] != ' ') blank = 0;
+        }
+        if (!blank) break;
+        rows--;
+    }
+    
+    for (int y = 0; y < rows; y++) {
+        int len = chart->canvas_width;
+        while (len > 0 && chart->canvas[y][len - 1] == ' ') len--;
+        fprintf(file, "%.*s\n", len, chart->canvas[y]);
+    }
+    return !ferror(file);
+}
+
+// Write text with the XML special characters escaped
+void chart_svg_text(FILE* file, const char* text) {
+    for (; *text; text++) {
+        switch (*text) {
+            case '&': fputs("&amp;", file); break;
+            case '<': fputs("&lt;", file); break;
+            case '>': fputs("&gt;", file); break;
+            case '"': fputs("&quot;", file); break;
+            default: fputc(*text, file); break;
+        }
+    }
+}
+
+int chart_export_svg(Chart* chart, FILE* file) {
+    // Series colours, reused in turn
+    static const char* colors[] = {"#1f77b4", "#ff7f0e", "#2ca02c", "#d62728",
+                                   "#9467bd", "#8c564b", "#e377c2", "#17becf"};
+    const int color_count = (int)(sizeof(colors) / sizeof(colors[0]));
+    
+    // Plot area, leaving room for the title, axis labels and the legend
+    const double left = 70, top = 40;
+    const double width = CHART_SVG_WIDTH - left - 170;
+    const double height = CHART_SVG_HEIGHT - top - 60;
+    ChartType type = chart->config.type;
+    double x_range = chart->x_max > chart->x_min ? chart->x_max - chart->x_min : 1.0;
+    double y_range = chart->y_max > chart->y_min ? chart->y_max - chart->y_min : 1.0;
+    
+    fprintf(file, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" "
+                  "font-family=\"sans-serif\" font-size=\"12\">\n", CHART_SVG_WIDTH, CHART_SVG_HEIGHT);
+    fprintf(file, "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n");
+    fprintf(file, "<text x=\"%d\" y=\"24\" text-anchor=\"middle\" font-size=\"16\">", CHART_SVG_WIDTH / 2);
+    chart_svg_text(file, chart->config.title[0] ? chart->config.title : chart_type_name(type));
+    fprintf(file, "</text>\n");
+    
+    if (type == CHART_PIE) {
+        ChartSeries* series = chart->series_count > 0 ? &chart->series[0] : NULL;
+        double total = 0;
+        for (int i = 0; series && i < series->count; i++) {
+            if (series->ys[i] > 0) total += series->ys[i];
+        }
+        
+        double radius = height / 2;
+        double cx = left + width / 2, cy = top + height / 2;
+        double angle = 0;
+        int shown = 0;
+        for (int i = 0; total > 0 && i < series->count; i++) {
+            double value = series->ys[i];
+            if (value <= 0) continue;
+            double sweep = value / total * 2 * 3.14159265359;
+            const char* color = colors[shown % color_count];
+            
+            if (value >= total) {
+                fprintf(file, "<circle cx=\"%.2f\" cy=\"%.2f\" r=\"%.2f\" fill=\"%s\"/>\n", cx, cy, radius, color);
+            } else {
+                fprintf(file, "<path d=\"M%.2f,%.2f L%.2f,%.2f A%.2f,%.2f 0 %d 1 %.2f,%.2f Z\" fill=\"%s\" stroke=\"white\"/>\n",
+                        cx, cy, cx + radius * sin(angle), cy - radius * cos(angle), radius, radius,
+                        sweep > 3.14159265359 ? 1 : 0,
+                        cx + radius * sin(angle + sweep), cy - radius * cos(angle + sweep), color);
+            }
+            angle += sweep;
+            
+            // Legend: the first 25 slices
+            if (shown < 25) {
+                double ly = top + shown * 16;
+                fprintf(file, "<rect x=\"%.0f\" y=\"%.0f\" width=\"10\" height=\"10\" fill=\"%s\"/>\n",
+                        left + width + 20, ly, color);
+                fprintf(file, "<text x=\"%.0f\" y=\"%.0f\">", left + width + 36, ly + 10);
+                const char* label = chart_series_label(series, i);
+                if (label[0]) {
+                    chart_svg_text(file, label);
+                } else {
+                    fprintf(file, "Item %d", i + 1);
+                }
+                fprintf(file, " (%.1f%%)</text>\n", value / total * 100);
+            }
+            shown++;
+        }
+        fprintf(file, "</svg>\n");
+        return !ferror(file);
+    }
+    
+    // Axes with five labelled ticks each
+    fprintf(file, "<g stroke=\"black\">\n");
+    fprintf(file, "<line x1=\"%.0f\" y1=\"%.0f\" x2=\"%.0f\" y2=\"%.0f\"/>\n", left, top, left, top + height);
+    fprintf(file, "<line x1=\"%.0f\" y1=\"%.0f\" x2=\"%.0f\" y2=\"%.0f\"/>\n", left, top + height, left + width, top + height);
+    fprintf(file, "</g>\n");
+    for (int t = 0; t <= 4; t++) {
+        double ty = top + height - t * height / 4;
+        fprintf(file, "<line x1=\"%.0f\" y1=\"%.1f\" x2=\"%.0f\" y2=\"%.1f\" stroke=\"#ddd\"/>\n",
+                left + 1, ty, left + width, ty);
+        fprintf(file, "<text x=\"%.0f\" y=\"%.1f\" text-anchor=\"end\">%.4g</text>\n",
+                left - 6, ty + 4, chart->y_min + t * y_range / 4);
+        if (type != CHART_BAR) {
+            fprintf(file, "<text x=\"%.1f\" y=\"%.0f\" text-anchor=\"middle\">%.4g</text>\n",
+                    left + t * width / 4, top + height + 16, chart->x_min + t * x_range / 4);
+        }
+    }
+    fprintf(file, "<text x=\"%.0f\" y=\"%.0f\" text-anchor=\"middle\">", left + width / 2, top + height + 40);
+    chart_svg_text(file, chart->config.x_label);
+    fprintf(file, "</text>\n<text transform=\"translate(16,%.0f) rotate(-90)\" text-anchor=\"middle\">", top + height / 2);
+    chart_svg_text(file, chart->config.y_label);
+    fprintf(file, "</text>\n");
+    
+#define SVG_X(v) (left + ((v) - chart->x_min) / x_range * width)
+#define SVG_Y(v) (top + height - ((v) - chart->y_min) / y_range * height)
+    
+    if (type == CHART_HISTOGRAM || type == CHART_DENSITY) {
+        double bin_w = width / chart->bins_x;
+        double bin_h = height / chart->bins_y;
+        double scale = log(1.0 + chart->bin_max);
+        for (int by = 0; chart->bins && by < chart->bins_y; by++) {
+            for (int bx = 0; bx < chart->bins_x; bx++) {
+                double count = chart->bins[(size_t)by * chart->bins_x + bx];
+                if (count <= 0) continue;
+                if (type == CHART_HISTOGRAM) {
+                    double y = SVG_Y(count);
+                    fprintf(file, "<rect x=\"%.2f\" y=\"%.2f\" width=\"%.2f\" height=\"%.2f\" fill=\"%s\" stroke=\"white\"/>\n",
+                            left + bx * bin_w, y, bin_w, top + height - y, colors[0]);
+                } else {
+                    fprintf(file, "<rect x=\"%.2f\" y=\"%.2f\" width=\"%.2f\" height=\"%.2f\" fill=\"%s\" fill-opacity=\"%.3f\"/>\n",
+                            left + bx * bin_w, top + height - (by + 1) * bin_h, bin_w, bin_h, colors[0],
+                            0.1 + 0.9 * log(1.0 + count) / scale);
+                }
+            }
+        }
+        fprintf(file, "<text x=\"%.0f\" y=\"%.0f\">N: %.0f</text>\n", left + width + 20, top + 10, chart->bin_total);
+    } else if (type == CHART_BAR) {
+        // First series only, one bar per point from the zero line, as on screen
+        ChartSeries* series = chart->series_count > 0 ? &chart->series[0] : NULL;
+        int count = series ? series->count : 0;
+        double slot = count > 0 ? width / count : width;
+        double base = SVG_Y(0.0);
+        for (int i = 0; i < count; i++) {
+            double y = SVG_Y(series->ys[i]);
+            fprintf(file, "<rect x=\"%.2f\" y=\"%.2f\" width=\"%.2f\" height=\"%.2f\" fill=\"%s\"/>\n",
+                    left + i * slot + slot * 0.1, y < base ? y : base, slot * 0.8, fabs(base - y), colors[0]);
+            if (count <= 40) {
+                fprintf(file, "<text x=\"%.1f\" y=\"%.0f\" text-anchor=\"middle\">", left + (i + 0.5) * slot, top + height + 16);
+                const char* label = chart_series_label(series, i);
+                if (label[0]) {
+                    chart_svg_text(file, label);
+                } else {
+                    fprintf(file, "Item %d", i + 1);
+                }
+                fprintf(file, "</text>\n");
+            }
+        }
+    } else {
+        for (int s = 0; s < chart->series_count; s++) {
+            ChartSeries* series = &chart->series[s];
+            const char* color = colors[s % color_count];
+            if (type == CHART_LINE) {
+                fprintf(file, "<polyline fill=\"none\" stroke=\"%s\" stroke-width=\"1.5\" points=\"", color);
+                for (int i = 0; i < series->count; i++) {
+                    fprintf(file, "%.2f,%.2f ", SVG_X(chart_series_x(series, i)), SVG_Y(series->ys[i]));
+                }
+                fprintf(file, "\"/>\n");
+            } else {
+                fprintf(file, "<g fill=\"%s\">\n", color);
+                for (int i = 0; i < series->count; i++) {
+                    fprintf(file, "<circle cx=\"%.2f\" cy=\"%.2f\" r=\"2.5\"/>\n",
+                            SVG_X(chart_series_x(series, i)), SVG_Y(series->ys[i]));
+                }
+                fprintf(file, "</g>\n");
+            }
+            
+            double ly = top + s * 16;
+            fprintf(file, "<rect x=\"%.0f\" y=\"%.0f\" width=\"10\" height=\"10\" fill=\"%s\"/>\n",
+                    left + width + 20, ly, color);
+            fprintf(file, "<text x=\"%.0f\" y=\"%.0f\">", left + width + 36, ly + 10);
+            chart_svg_text(file, series->name);
+            fprintf(file, "</text>\n");
+        }
+    }
+#undef SVG_X
+#undef SVG_Y
+    
+    fprintf(file, "</svg>\n");
+    return !ferror(file);
+}
+
+// Write the chart to a file: SVG for a .svg name, the text canvas otherwise
+int chart_export_file(Chart* chart, const char* filename) {
+    FILE* file;
+    if (fopen_s(&file, filename, "w") != 0) return 0;
+    
+    const char* ext = strrchr(filename, '.');
+    int ok = ext && _stricmp(ext, ".svg") == 0 ? chart_export_svg(chart, file)
+                                                : chart_export_text(chart, file);
+    if (fclose(file) != 0) ok = 0;
+    return ok;
+}
+
+void chart_export_task(void* context, int index) {
+    ChartExport* job = (ChartExport*)context;
+    (void)index;
+    job->ok = chart_export_file(job->chart, job->filename);
+}
+
+// Write the chart to a file in the background. The job takes the chart over
+// (copying its labels out of the sheet); poll chart_export_done and collect
+// the result with chart_export_finish. Returns NULL if the pool has no
+// worker to run it, in which case the caller still owns the chart.
+ChartExport* chart_export_start(Chart* chart, const char* filename) {
+    ChartExport* job = (ChartExport*)calloc(1, sizeof(ChartExport));
+    if (!job) return NULL;
+    if (!chart_own_labels(chart)) {
+        free(job);
+        return NULL;
+    }
+    job->chart = chart;
+    strncpy_s(job->filename, sizeof(job->filename), filename, _TRUNCATE);
+    
+    parallel_group_init(&job->group);
+    if (!parallel_submit_background(&job->group, chart_export_task, job)) {
+        free(job);
+        return NULL;
+    }
+    return job;
+}
+
+int chart_export_done(ChartExport* job) {
+    return parallel_done(&job->group);
+}
+
+// Wait for the export, free the job and its chart; returns 1 if the file was written
+int chart_export_finish(ChartExport* job) {
+    if (!job) return 0;
+    parallel_wait(&job->group);
+    int ok = job->ok;
+    chart_free(job->chart);
+    free(job);
+    return ok;
+}
+
 #endif // CHARTS_H
\ No newline at end of file
@@ -0,0 +1,125 @@
+// clipboard.h - Text clipboard access for WinSpread
+#ifndef CLIPBOARD_H
+#define CLIPBOARD_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Text exchange with other programs goes through a provider so the copy and
+// paste logic does not depend on where the text actually lives. The system
+// provider talks to the Windows clipboard; the memory provider keeps the text
+// in-process (used where there is no system clipboard, e.g. test builds).
+typedef struct ClipboardProvider {
+    const char* name;
+    int (*set_text)(struct ClipboardProvider* provider, const char* text);
+    char* (*get_text)(struct ClipboardProvider* provider);  // Caller frees; NULL on failure
+    void* context;
+} ClipboardProvider;
+
+// Function prototypes
+ClipboardProvider* clipboard_system_provider(void);
+ClipboardProvider* clipboard_memory_provider(void);
+int clipboard_set_text(ClipboardProvider* provider, const char* text);
+char* clipboard_get_text(ClipboardProvider* provider);
+
+// Implementation
+
+int clipboard_set_text(ClipboardProvider* provider, const char* text) {
+    if (!provider || !text) return 0;
+    return provider->set_text(provider, text);
+}
+
+char* clipboard_get_text(ClipboardProvider* provider) {
+    if (!provider) return NULL;
+    return provider->get_text(provider);
+}
+
+// In-memory provider: context holds a heap copy of the last text set
+int memory_clipboard_set_text(ClipboardProvider* provider, const char* text) {
+    char* copy = _strdup(text);
+    if (!copy) return 0;
+    free(provider->context);
+    provider->context = copy;
+    return 1;
+}
+
+char* memory_clipboard_get_text(ClipboardProvider* provider) {
+    return provider->context ? _strdup((const char*)provider->context) : NULL;
+}
+
+ClipboardProvider* clipboard_memory_provider(void) {
+    static ClipboardProvider provider = {
+        "memory", memory_clipboard_set_text, memory_clipboard_get_text, NULL
+    };
+    return &provider;
+}
+
+#ifdef _WIN32
+int system_clipboard_set_text(ClipboardProvider* provider, const char* text) {
+    (void)provider;
+    if (!OpenClipboard(NULL)) return 0;
+
+    EmptyClipboard();
+
+    size_t len = strlen(text) + 1;
+    HGLOBAL hMem = GlobalAlloc(GMEM_MOVEABLE, len);
+    if (!hMem) {
+        CloseClipboard();
+        return 0;
+    }
+
+    char* pMem = (char*)GlobalLock(hMem);
+    if (pMem) {
+        memcpy(pMem, text, len);
+        GlobalUnlock(hMem);
+        SetClipboardData(CF_TEXT, hMem);
+    }
+
+    CloseClipboard();
+    return 1;
+}
+
+char* system_clipboard_get_text(ClipboardProvider* provider) {
+    (void)provider;
+    if (!OpenClipboard(NULL)) return NULL;
+
+    HANDLE hData = GetClipboardData(CF_TEXT);
+    if (!hData) {
+        CloseClipboard();
+        return NULL;
+    }
+
+    char* pData = (char*)GlobalLock(hData);
+    if (!pData) {
+        CloseClipboard();
+        return NULL;
+    }
+
+    size_t len = strlen(pData) + 1;
+    char* result = (char*)malloc(len);
+    if (result) {
+        memcpy(result, pData, len);
+    }
+
+    GlobalUnlock(hData);
+    CloseClipboard();
+    return result;
+}
+
+ClipboardProvider* clipboard_system_provider(void) {
+    static ClipboardProvider provider = {
+        "system", system_clipboard_set_text, system_clipboard_get_text, NULL
+    };
+    return &provider;
+}
+#else
+ClipboardProvider* clipboard_system_provider(void) {
+    return clipboard_memory_provider();
+}
+#endif
+
+#endif // CLIPBOARD_H
@@ -0,0 +1,1299 @@
+// formula.h - Formula token streams for reference-aware copy/paste
+#ifndef FORMULA_H
+#define FORMULA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+// A formula is compiled into a flat stream of tokens: runs of plain text that
+// are copied through unchanged, and cell references that have already been
+// parsed into row/column numbers. Moving a formula to another cell then only
+// needs integer arithmetic on the reference tokens, not a re-parse.
+typedef enum {
+    FTOK_TEXT,      // Literal span of the source text
+    FTOK_REF        // Cell reference such as A1, $A1, A$1 or $A$1
+} FormulaTokenType;
+
+typedef struct {
+    FormulaTokenType type;
+    int start;          // FTOK_TEXT: offset into the source text
+    int length;         // FTOK_TEXT: number of characters
+    int row, col;       // FTOK_REF: 0-based position
+    int row_abs;        // FTOK_REF: row is fixed with '$'
+    int col_abs;        // FTOK_REF: column is fixed with '$'
+    int invalid;        // FTOK_REF: the referenced cell was deleted (#REF!)
+} FormulaToken;
+
+typedef struct {
+    char* source;           // Copy of the original expression
+    FormulaToken* tokens;
+    int count;
+    int capacity;
+    int ref_count;          // Number of FTOK_REF tokens
+} CompiledFormula;
+
+// NEW: Expression trees
+// For evaluation a formula is parsed once into a tree of nodes. The nodes sit
+// in one flat array and each node's arguments are a run of node indexes in
+// 'args', so a tree is three allocations however large the formula is. Once
+// optimized, repeated subexpressions are one node with several parents.
+typedef enum {
+    FNODE_NUMBER,       // Numeric literal (TRUE and FALSE parse to 1 and 0)
+    FNODE_STRING,       // "text" literal
+    FNODE_REF,          // Single cell
+    FNODE_RANGE,        // Rectangle of cells, corners in order
+    FNODE_REF_ERROR,    // #REF! left behind by a deleted reference
+    FNODE_NEGATE,
+    FNODE_ADD, FNODE_SUB, FNODE_MUL, FNODE_DIV,
+    FNODE_EQ, FNODE_NE, FNODE_LT, FNODE_LE, FNODE_GT, FNODE_GE,
+    FNODE_CALL          // Function call: 'func' says which
+} FormulaNodeType;
+
+typedef enum {
+    FFUNC_SUM, FFUNC_AVG, FFUNC_MAX, FFUNC_MIN, FFUNC_MEDIAN, FFUNC_MODE,
+    FFUNC_POWER, FFUNC_VLOOKUP,
+    FFUNC_SUMIF, FFUNC_COUNTIF, FFUNC_AVERAGEIF,
+    FFUNC_SUMIFS, FFUNC_COUNTIFS, FFUNC_AVERAGEIFS,
+    // Lazy: only the arguments the result depends on are evaluated
+    FFUNC_IF, FFUNC_IFS, FFUNC_AND, FFUNC_OR, FFUNC_IFERROR, FFUNC_CHOOSE
+} FormulaFunction;
+
+typedef struct {
+    const char* name;
+    FormulaFunction func;
+    int min_args;
+    int max_args;
+    int lazy;           // Arguments after the first may go unevaluated
+} FormulaFunctionInfo;
+
+typedef struct {
+    FormulaNodeType type;
+    FormulaFunction func;   // FNODE_CALL
+    int first_arg;          // Children: args[first_arg .. first_arg + arg_count)
+    int arg_count;
+    double number;          // FNODE_NUMBER
+    int row, col;           // FNODE_REF, and the top-left of FNODE_RANGE
+    int end_row, end_col;   // FNODE_RANGE: the bottom-right
+    int row_abs, col_abs;           // FNODE_REF and FNODE_RANGE: top-left fixed with '$'
+    int end_row_abs, end_col_abs;   // FNODE_RANGE: bottom-right fixed with '$'
+    char* text;             // FNODE_STRING
+    int shared;             // Slot of a node used more than once, else -1 (see formula_tree_optimize)
+} FormulaNode;
+
+typedef struct {
+    FormulaNode* nodes;
+    int count;
+    int capacity;
+    int* args;
+    int arg_count;
+    int arg_capacity;
+    int root;               // -1 when the expression did not parse
+    unsigned int id;        // Unique per parse, so callers can tell trees apart
+    int parsed_count;       // Nodes as parsed, before optimizing
+    int shared_count;       // Nodes whose value is computed once and reused
+    void* memo;             // Evaluator's cache for the shared nodes (freed with the tree)
+    unsigned int memo_generation;
+    void* program;          // Threaded form compiled by the evaluator (one block, freed with the tree)
+    unsigned int eval_count;    // Evaluations before the program was compiled
+} FormulaTree;
+
+// Called for each reference in a tree. 'conditional' is set when the
+// reference sits in a lazy argument, so it is not read on every evaluation.
+typedef void (*FormulaRefVisitor)(void* context, int row, int col, int end_row, int end_col, int conditional);
+
+// Function prototypes
+CompiledFormula* formula_compile(const char* expression);
+void formula_free(CompiledFormula* formula);
+char* formula_render(const CompiledFormula* formula, int row_delta, int col_delta);
+int formula_shift_references(CompiledFormula* formula, int on_rows, int at, int count, int deleting);
+int formula_write_reference(char* out, int row, int col, int row_abs, int col_abs);
+
+// NEW: Expression tree prototypes
+FormulaTree* formula_parse(const char* expression);
+void formula_tree_free(FormulaTree* tree);
+const FormulaFunctionInfo* formula_function_info(FormulaFunction func);
+void formula_tree_references(const FormulaTree* tree, FormulaRefVisitor visit, void* context);
+int formula_tree_optimize(FormulaTree* tree);
+int formula_tree_render(const FormulaTree* tree, char* out, int size);
+FormulaTree* formula_tree_shifted(const FormulaTree* tree, int row_delta, int col_delta);
+
+// Implementation
+
+int formula_add_token(CompiledFormula* formula, FormulaToken token) {
+    if (formula->count == formula->capacity) {
+        int new_capacity = formula->capacity ? formula->capacity * 2 : 8;
+        FormulaToken* tokens = (FormulaToken*)realloc(formula->tokens, new_capacity * sizeof(FormulaToken));
+        if (!tokens) return 0;
+        formula->tokens = tokens;
+        formula->capacity = new_capacity;
+    }
+    formula->tokens[formula->count++] = token;
+    return 1;
+}
+
+// Append plain text, merging with the previous text token when adjacent
+int formula_add_text(CompiledFormula* formula, int start, int length) {
+    if (length <= 0) return 1;
+
+    if (formula->count > 0) {
+        FormulaToken* last = &formula->tokens[formula->count - 1];
+        if (last->type == FTOK_TEXT && last->start + last->length == start) {
+            last->length += length;
+            return 1;
+        }
+    }
+
+    FormulaToken token = {0};
+    token.type = FTOK_TEXT;
+    token.start = start;
+    token.length = length;
+    return formula_add_token(formula, token);
+}
+
+// Try to read a cell reference at p. Returns the number of characters used,
+// or 0 if p does not start a reference (function names, numbers, etc.).
+int formula_scan_reference(const char* p, FormulaToken* token) {
+    const char* q = p;
+    int col_abs = 0, row_abs = 0;
+    int col = 0, row = 0;
+    int letters = 0, digits = 0;
+
+    if (*q == '$') {
+        col_abs = 1;
+        q++;
+    }
+    while (isalpha((unsigned char)*q) && letters < 3) {
+        col = col * 26 + (toupper((unsigned char)*q) - 'A' + 1);
+        q++;
+        letters++;
+    }
+    if (letters == 0 || isalpha((unsigned char)*q)) return 0;
+
+    if (*q == '$') {
+        row_abs = 1;
+        q++;
+    }
+    while (isdigit((unsigned char)*q) && digits < 7) {
+        row = row * 10 + (*q - '0');
+        q++;
+        digits++;
+    }
+    if (digits == 0 || row == 0) return 0;
+
+    // A reference can't run straight into more name characters or a call
+    if (isalnum((unsigned char)*q) || *q == '_' || *q == '(' || *q == '.') return 0;
+
+    token->type = FTOK_REF;
+    token->row = row - 1;
+    token->col = col - 1;
+    token->row_abs = row_abs;
+    token->col_abs = col_abs;
+    return (int)(q - p);
+}
+
+CompiledFormula* formula_compile(const char* expression) {
+    if (!expression) return NULL;
+
+    CompiledFormula* formula = (CompiledFormula*)calloc(1, sizeof(CompiledFormula));
+    if (!formula) return NULL;
+    formula->source = _strdup(expression);
+    if (!formula->source) {
+        free(formula);
+        return NULL;
+    }
+
+    const char* src = formula->source;
+    int i = 0;
+    while (src[i]) {
+        char c = src[i];
+
+        // String literals are copied through untouched
+        if (c == '"') {
+            int start = i++;
+            while (src[i] && src[i] != '"') i++;
+            if (src[i] == '"') i++;
+            formula_add_text(formula, start, i - start);
+            continue;
+        }
+
+        // References only start at a word boundary
+        int boundary = (i == 0) || !(isalnum((unsigned char)src[i - 1]) || src[i - 1] == '_' || src[i - 1] == '.' || src[i - 1] == '$');
+        if (boundary && (isalpha((unsigned char)c) || c == '$')) {
+            FormulaToken token = {0};
+            int used = formula_scan_reference(src + i, &token);
+            if (used > 0) {
+                formula_add_token(formula, token);
+                formula->ref_count++;
+                i += used;
+                continue;
+            }
+
+            // Not a reference: copy the whole word so its tail isn't misread
+            int start = i++;
+            while (isalnum((unsigned char)src[i]) || src[i] == '_' || src[i] == '.') i++;
+            formula_add_text(formula, start, i - start);
+            continue;
+        }
+
+        formula_add_text(formula, i, 1);
+        i++;
+    }
+
+    return formula;
+}
+
+void formula_free(CompiledFormula* formula) {
+    if (!formula) return;
+    free(formula->source);
+    free(formula->tokens);
+    free(formula);
+}
+
+// Write a reference such as $B$12 into out (at least 16 bytes); returns its length
+int formula_write_reference(char* out, int row, int col, int row_abs, int col_abs) {
+    char letters[8];
+    int n = 0;
+    int c = col + 1;
+    while (c > 0 && n < (int)sizeof(letters)) {
+        c--;
+        letters[n++] = (char)('A' + c % 26);
+        c /= 26;
+    }
+
+    int len = 0;
+    if (col_abs) out[len++] = '$';
+    while (n > 0) out[len++] = letters[--n];
+    if (row_abs) out[len++] = '$';
+    len += sprintf_s(out + len, 16 - len, "%d", row + 1);
+    return len;
+}
+
+// True if token i is the first cell of a range written as REF:REF
+int formula_is_range_start(const CompiledFormula* formula, int i) {
+    if (i + 2 >= formula->count) return 0;
+    const FormulaToken* sep = &formula->tokens[i + 1];
+    return formula->tokens[i].type == FTOK_REF &&
+           sep->type == FTOK_TEXT && sep->length == 1 && formula->source[sep->start] == ':' &&
+           formula->tokens[i + 2].type == FTOK_REF;
+}
+
+// Move one coordinate for an insert or delete of 'count' lines at 'at'.
+// For deletes, a coordinate inside the deleted block becomes 'fallback'
+// (or -1 when fallback is -1, meaning the reference is lost).
+int formula_shift_coordinate(int value, int at, int count, int deleting, int fallback) {
+    if (!deleting) {
+        return value >= at ? value + count : value;
+    }
+    if (value >= at + count) return value - count;
+    if (value >= at) return fallback;
+    return value;
+}
+
+// Rewrite references for rows (on_rows) or columns inserted or deleted at
+// 'at'. Absolute references move too, as the cells they name have moved.
+// Ranges that lose part of their extent shrink; references whose cells were
+// deleted become #REF!. Returns the number of references changed.
+int formula_shift_references(CompiledFormula* formula, int on_rows, int at, int count, int deleting) {
+    int changed = 0;
+    
+    for (int i = 0; i < formula->count; i++) {
+        FormulaToken* token = &formula->tokens[i];
+        if (token->type != FTOK_REF || token->invalid) continue;
+        
+        if (formula_is_range_start(formula, i) && !formula->tokens[i + 2].invalid) {
+            FormulaToken* last = &formula->tokens[i + 2];
+            int* first_value = on_rows ? &token->row : &token->col;
+            int* last_value = on_rows ? &last->row : &last->col;
+            int ordered = *first_value <= *last_value;
+            int lo = ordered ? *first_value : *last_value;
+            int hi = ordered ? *last_value : *first_value;
+            
+            int new_lo = formula_shift_coordinate(lo, at, count, deleting, at);
+            int new_hi = formula_shift_coordinate(hi, at, count, deleting, at - 1);
+            if (deleting && lo >= at && hi < at + count) {
+                token->invalid = 1;
+                last->invalid = 1;
+                changed++;
+            } else if (new_lo != lo || new_hi != hi) {
+                *first_value = ordered ? new_lo : new_hi;
+                *last_value = ordered ? new_hi : new_lo;
+                changed++;
+            }
+            i += 2;
+            continue;
+        }
+        
+        int* value = on_rows ? &token->row : &token->col;
+        int shifted = formula_shift_coordinate(*value, at, count, deleting, -1);
+        if (shifted < 0) {
+            token->invalid = 1;
+            changed++;
+        } else if (shifted != *value) {
+            *value = shifted;
+            changed++;
+        }
+    }
+    
+    return changed;
+}
+
+// Produce the expression text with relative references shifted by the given
+// offsets. References that would move off the sheet become #REF!.
+// Returns a newly allocated string.
+char* formula_render(const CompiledFormula* formula, int row_delta, int col_delta) {
+    if (!formula) return NULL;
+
+    size_t size = strlen(formula->source) + (size_t)formula->ref_count * 16 + 1;
+    char* out = (char*)malloc(size);
+    if (!out) return NULL;
+
+    size_t len = 0;
+    for (int i = 0; i < formula->count; i++) {
+        const FormulaToken* token = &formula->tokens[i];
+        if (token->type == FTOK_TEXT) {
+            memcpy(out + len, formula->source + token->start, token->length);
+            len += token->length;
+        } else if (token->invalid) {
+            memcpy(out + len, "#REF!", 5);
+            len += 5;
+            // A range that lost both ends collapses to a single #REF!
+            if (formula_is_range_start(formula, i) && formula->tokens[i + 2].invalid) {
+                i += 2;
+            }
+        } else {
+            int row = token->row_abs ? token->row : token->row + row_delta;
+            int col = token->col_abs ? token->col : token->col + col_delta;
+            if (row < 0 || col < 0) {
+                memcpy(out + len, "#REF!", 5);
+                len += 5;
+            } else {
+                len += formula_write_reference(out + len, row, col, token->row_abs, token->col_abs);
+            }
+        }
+    }
+    out[len] = '\0';
+    return out;
+}
+
+// NEW: Expression trees
+
+#define FORMULA_MAX_DEPTH 200      // Nesting limit, so a hostile formula can't exhaust the stack
+
+const FormulaFunctionInfo formula_functions[] = {
+    {"SUM",        FFUNC_SUM,        1, 255, 0},
+    {"AVG",        FFUNC_AVG,        1, 255, 0},
+    {"AVERAGE",    FFUNC_AVG,        1, 255, 0},
+    {"MAX",        FFUNC_MAX,        1, 255, 0},
+    {"MIN",        FFUNC_MIN,        1, 255, 0},
+    {"MEDIAN",     FFUNC_MEDIAN,     1, 255, 0},
+    {"MODE",       FFUNC_MODE,       1, 255, 0},
+    {"POWER",      FFUNC_POWER,      2, 2,   0},
+    {"VLOOKUP",    FFUNC_VLOOKUP,    3, 4,   0},
+    {"SUMIF",      FFUNC_SUMIF,      2, 3,   0},
+    {"COUNTIF",    FFUNC_COUNTIF,    2, 2,   0},
+    {"AVERAGEIF",  FFUNC_AVERAGEIF,  2, 3,   0},
+    {"SUMIFS",     FFUNC_SUMIFS,     3, 33,  0},
+    {"COUNTIFS",   FFUNC_COUNTIFS,   2, 32,  0},
+    {"AVERAGEIFS", FFUNC_AVERAGEIFS, 3, 33,  0},
+    {"IF",         FFUNC_IF,         2, 3,   1},
+    {"IFS",        FFUNC_IFS,        2, 254, 1},
+    {"AND",        FFUNC_AND,        1, 255, 1},
+    {"OR",         FFUNC_OR,         1, 255, 1},
+    {"IFERROR",    FFUNC_IFERROR,    2, 2,   1},
+    {"CHOOSE",     FFUNC_CHOOSE,     2, 255, 1}
+};
+
+unsigned int formula_tree_next_id = 0;
+
+const FormulaFunctionInfo* formula_function_info(FormulaFunction func) {
+    for (int i = 0; i < (int)(sizeof(formula_functions) / sizeof(formula_functions[0])); i++) {
+        if (formula_functions[i].func == func) return &formula_functions[i];
+    }
+    return NULL;
+}
+
+typedef struct {
+    FormulaTree* tree;
+    const char* p;
+    int depth;
+    int failed;
+    int* stack;             // Argument lists being collected, innermost last
+    int stack_count;
+    int stack_capacity;
+} FormulaParser;
+
+int formula_tree_add(FormulaParser* parser, FormulaNode node) {
+    FormulaTree* tree = parser->tree;
+    if (tree->count == tree->capacity) {
+        int new_capacity = tree->capacity ? tree->capacity * 2 : 16;
+        FormulaNode* nodes = (FormulaNode*)realloc(tree->nodes, new_capacity * sizeof(FormulaNode));
+        if (!nodes) {
+            free(node.text);
+            parser->failed = 1;
+            return -1;
+        }
+        tree->nodes = nodes;
+        tree->capacity = new_capacity;
+    }
+    tree->nodes[tree->count] = node;
+    return tree->count++;
+}
+
+int formula_parser_push(FormulaParser* parser, int index) {
+    if (parser->stack_count == parser->stack_capacity) {
+        int new_capacity = parser->stack_capacity ? parser->stack_capacity * 2 : 16;
+        int* stack = (int*)realloc(parser->stack, new_capacity * sizeof(int));
+        if (!stack) {
+            parser->failed = 1;
+            return 0;
+        }
+        parser->stack = stack;
+        parser->stack_capacity = new_capacity;
+    }
+    parser->stack[parser->stack_count++] = index;
+    return 1;
+}
+
+// Add a node whose children are the indexes pushed since 'base'
+int formula_tree_add_parent(FormulaParser* parser, FormulaNode node, int base) {
+    FormulaTree* tree = parser->tree;
+    int count = parser->stack_count - base;
+    if (tree->arg_count + count > tree->arg_capacity) {
+        int new_capacity = tree->arg_capacity ? tree->arg_capacity * 2 : 16;
+        while (new_capacity < tree->arg_count + count) new_capacity *= 2;
+        int* args = (int*)realloc(tree->args, new_capacity * sizeof(int));
+        if (!args) {
+            parser->failed = 1;
+            return -1;
+        }
+        tree->args = args;
+        tree->arg_capacity = new_capacity;
+    }
+    memcpy(tree->args + tree->arg_count, parser->stack + base, count * sizeof(int));
+    node.first_arg = tree->arg_count;
+    node.arg_count = count;
+    tree->arg_count += count;
+    parser->stack_count = base;
+    return formula_tree_add(parser, node);
+}
+
+int formula_tree_add_binary(FormulaParser* parser, FormulaNodeType type, int left, int right) {
+    if (left < 0 || right < 0) return -1;
+    int base = parser->stack_count;
+    if (!formula_parser_push(parser, left) || !formula_parser_push(parser, right)) return -1;
+    FormulaNode node = {0};
+    node.type = type;
+    return formula_tree_add_parent(parser, node, base);
+}
+
+void formula_parser_skip(FormulaParser* parser) {
+    while (*parser->p && isspace((unsigned char)*parser->p)) parser->p++;
+}
+
+int formula_parse_comparison(FormulaParser* parser);
+
+int formula_parse_primary(FormulaParser* parser) {
+    formula_parser_skip(parser);
+    const char* p = parser->p;
+    FormulaNode node = {0};
+
+    if (*p == '(') {
+        parser->p++;
+        int inner = formula_parse_comparison(parser);
+        formula_parser_skip(parser);
+        if (inner < 0 || *parser->p != ')') {
+            parser->failed = 1;
+            return -1;
+        }
+        parser->p++;
+        return inner;
+    }
+
+    if (*p == '"') {
+        // "" inside a literal stands for one quote
+        size_t length = 0;
+        const char* q = p + 1;
+        while (*q && !(*q == '"' && q[1] != '"')) {
+            q += (*q == '"') ? 2 : 1;
+            length++;
+        }
+        if (*q != '"') {
+            parser->failed = 1;
+            return -1;
+        }
+        node.type = FNODE_STRING;
+        node.text = (char*)malloc(length + 1);
+        if (!node.text) {
+            parser->failed = 1;
+            return -1;
+        }
+        length = 0;
+        for (q = p + 1; !(*q == '"' && q[1] != '"'); q++) {
+            node.text[length++] = *q;
+            if (*q == '"') q++;
+        }
+        node.text[length] = '\0';
+        parser->p = q + 1;
+        return formula_tree_add(parser, node);
+    }
+
+    if (isdigit((unsigned char)*p) || (*p == '.' && isdigit((unsigned char)p[1]))) {
+        char* end;
+        node.type = FNODE_NUMBER;
+        node.number = strtod(p, &end);
+        parser->p = end;
+        return formula_tree_add(parser, node);
+    }
+
+    if (strncmp(p, "#REF!", 5) == 0) {
+        node.type = FNODE_REF_ERROR;
+        parser->p += 5;
+        // A range that lost only one end still reads as #REF!
+        if (*parser->p == ':') {
+            FormulaToken other = {0};
+            int used = formula_scan_reference(parser->p + 1, &other);
+            if (used > 0) parser->p += 1 + used;
+            else if (strncmp(parser->p + 1, "#REF!", 5) == 0) parser->p += 6;
+        }
+        return formula_tree_add(parser, node);
+    }
+
+    if (isalpha((unsigned char)*p) || *p == '$') {
+        FormulaToken token = {0};
+        int used = formula_scan_reference(p, &token);
+        if (used > 0) {
+            parser->p += used;
+            node.type = FNODE_REF;
+            node.row = token.row;
+            node.col = token.col;
+            node.row_abs = token.row_abs;
+            node.col_abs = token.col_abs;
+            if (*parser->p == ':') {
+                FormulaToken last = {0};
+                int more = formula_scan_reference(parser->p + 1, &last);
+                if (more > 0) {
+                    parser->p += 1 + more;
+                    // On a tie the fixed end goes first, as formula_tree_shifted does
+                    int row_first = token.row < last.row || (token.row == last.row && token.row_abs >= last.row_abs);
+                    int col_first = token.col < last.col || (token.col == last.col && token.col_abs >= last.col_abs);
+                    node.type = FNODE_RANGE;
+                    node.row = row_first ? token.row : last.row;
+                    node.col = col_first ? token.col : last.col;
+                    node.end_row = row_first ? last.row : token.row;
+                    node.end_col = col_first ? last.col : token.col;
+                    node.row_abs = row_first ? token.row_abs : last.row_abs;
+                    node.col_abs = col_first ? token.col_abs : last.col_abs;
+                    node.end_row_abs = row_first ? last.row_abs : token.row_abs;
+                    node.end_col_abs = col_first ? last.col_abs : token.col_abs;
+                } else if (strncmp(parser->p + 1, "#REF!", 5) == 0) {
+                    parser->p += 6;
+                    node.type = FNODE_REF_ERROR;
+                }
+            }
+            return formula_tree_add(parser, node);
+        }
+
+        // A function name, or TRUE/FALSE
+        const char* name = p;
+        while (isalnum((unsigned char)*p) || *p == '_' || *p == '.') p++;
+        int name_length = (int)(p - name);
+        parser->p = p;
+        formula_parser_skip(parser);
+
+        if (*parser->p != '(') {
+            if (name_length == 4 && _strnicmp(name, "TRUE", 4) == 0) {
+                node.type = FNODE_NUMBER;
+                node.number = 1.0;
+                return formula_tree_add(parser, node);
+            }
+            if (name_length == 5 && _strnicmp(name, "FALSE", 5) == 0) {
+                node.type = FNODE_NUMBER;
+                return formula_tree_add(parser, node);
+            }
+            parser->failed = 1;
+            return -1;
+        }
+
+        const FormulaFunctionInfo* info = NULL;
+        for (int i = 0; i < (int)(sizeof(formula_functions) / sizeof(formula_functions[0])); i++) {
+            if ((int)strlen(formula_functions[i].name) == name_length &&
+                _strnicmp(formula_functions[i].name, name, name_length) == 0) {
+                info = &formula_functions[i];
+                break;
+            }
+        }
+        if (!info) {
+            parser->failed = 1;
+            return -1;
+        }
+
+        parser->p++;
+        int base = parser->stack_count;
+        formula_parser_skip(parser);
+        if (*parser->p != ')') {
+            while (1) {
+                int arg = formula_parse_comparison(parser);
+                if (arg < 0 || !formula_parser_push(parser, arg)) return -1;
+                formula_parser_skip(parser);
+                if (*parser->p == ',') {
+                    parser->p++;
+                } else if (*parser->p == ')') {
+                    break;
+                } else {
+                    parser->failed = 1;
+                    return -1;
+                }
+            }
+        }
+        parser->p++;
+
+        int count = parser->stack_count - base;
+        if (count < info->min_args || count > info->max_args) {
+            parser->failed = 1;
+            return -1;
+        }
+        node.type = FNODE_CALL;
+        node.func = info->func;
+        return formula_tree_add_parent(parser, node, base);
+    }
+
+    parser->failed = 1;
+    return -1;
+}
+
+int formula_parse_unary(FormulaParser* parser) {
+    formula_parser_skip(parser);
+    if (*parser->p == '-' || *parser->p == '+') {
+        int negate = *parser->p == '-';
+        parser->p++;
+        if (++parser->depth > FORMULA_MAX_DEPTH) {
+            parser->failed = 1;
+            return -1;
+        }
+        int operand = formula_parse_unary(parser);
+        parser->depth--;
+        if (operand < 0 || !negate) return operand;
+
+        // Fold a negative literal straight away
+        FormulaNode* inner = &parser->tree->nodes[operand];
+        if (inner->type == FNODE_NUMBER) {
+            inner->number = -inner->number;
+            return operand;
+        }
+        int base = parser->stack_count;
+        if (!formula_parser_push(parser, operand)) return -1;
+        FormulaNode node = {0};
+        node.type = FNODE_NEGATE;
+        return formula_tree_add_parent(parser, node, base);
+    }
+    return formula_parse_primary(parser);
+}
+
+int formula_parse_term(FormulaParser* parser) {
+    int left = formula_parse_unary(parser);
+    while (left >= 0) {
+        formula_parser_skip(parser);
+        char op = *parser->p;
+        if (op != '*' && op != '/') break;
+        parser->p++;
+        int right = formula_parse_unary(parser);
+        left = formula_tree_add_binary(parser, op == '*' ? FNODE_MUL : FNODE_DIV, left, right);
+    }
+    return left;
+}
+
+int formula_parse_additive(FormulaParser* parser) {
+    int left = formula_parse_term(parser);
+    while (left >= 0) {
+        formula_parser_skip(parser);
+        char op = *parser->p;
+        if (op != '+' && op != '-') break;
+        parser->p++;
+        int right = formula_parse_term(parser);
+        left = formula_tree_add_binary(parser, op == '+' ? FNODE_ADD : FNODE_SUB, left, right);
+    }
+    return left;
+}
+
+int formula_parse_comparison(FormulaParser* parser) {
+    if (++parser->depth > FORMULA_MAX_DEPTH) {
+        parser->failed = 1;
+        return -1;
+    }
+    int left = formula_parse_additive(parser);
+    while (left >= 0) {
+        formula_parser_skip(parser);
+        const char* p = parser->p;
+        FormulaNodeType type;
+        int length = 1;
+        if (p[0] == '<' && p[1] == '>') { type = FNODE_NE; length = 2; }
+        else if (p[0] == '<' && p[1] == '=') { type = FNODE_LE; length = 2; }
+        else if (p[0] == '>' && p[1] == '=') { type = FNODE_GE; length = 2; }
+        else if (p[0] == '<') type = FNODE_LT;
+        else if (p[0] == '>') type = FNODE_GT;
+        else if (p[0] == '=') type = FNODE_EQ;
+        else break;
+        parser->p += length;
+        int right = formula_parse_additive(parser);
+        left = formula_tree_add_binary(parser, type, left, right);
+    }
+    parser->depth--;
+    return left;
+}
+
+// Parse an expression (with or without its leading '='). Returns NULL only
+// when out of memory; text that does not parse gives a tree with root -1.
+FormulaTree* formula_parse(const char* expression) {
+    FormulaTree* tree = (FormulaTree*)calloc(1, sizeof(FormulaTree));
+    if (!tree) return NULL;
+    tree->id = ++formula_tree_next_id;
+
+    FormulaParser parser = {0};
+    parser.tree = tree;
+    parser.p = expression ? expression : "";
+    if (*parser.p == '=') parser.p++;
+
+    int root = formula_parse_comparison(&parser);
+    formula_parser_skip(&parser);
+    free(parser.stack);
+
+    tree->root = (parser.failed || *parser.p || root < 0) ? -1 : root;
+    tree->parsed_count = tree->count;
+    formula_tree_optimize(tree);
+    return tree;
+}
+
+void formula_tree_free(FormulaTree* tree) {
+    if (!tree) return;
+    for (int i = 0; i < tree->count; i++) {
+        free(tree->nodes[i].text);
+    }
+    free(tree->nodes);
+    free(tree->args);
+    free(tree->memo);
+    free(tree->program);
+    free(tree);
+}
+
+void formula_tree_visit(const FormulaTree* tree, int index, int conditional, FormulaRefVisitor visit, void* context) {
+    const FormulaNode* node = &tree->nodes[index];
+    if (node->type == FNODE_REF) {
+        visit(context, node->row, node->col, node->row, node->col, conditional);
+        return;
+    }
+    if (node->type == FNODE_RANGE) {
+        visit(context, node->row, node->col, node->end_row, node->end_col, conditional);
+        return;
+    }
+
+    // Everything after the first argument of a lazy function may be skipped
+    int lazy = node->type == FNODE_CALL && formula_function_info(node->func)->lazy;
+    for (int i = 0; i < node->arg_count; i++) {
+        formula_tree_visit(tree, tree->args[node->first_arg + i], conditional || (lazy && i > 0), visit, context);
+    }
+}
+
+// Report every reference in the tree, with whether it is conditional
+void formula_tree_references(const FormulaTree* tree, FormulaRefVisitor visit, void* context) {
+    if (!tree || tree->root < 0) return;
+    formula_tree_visit(tree, tree->root, 0, visit, context);
+}
+
+// Move one corner of a reference the way formula_render moves it in the
+// text. Returns 0 when it falls off the sheet.
+int formula_shift_corner(int* row, int* col, int row_abs, int col_abs, int row_delta, int col_delta) {
+    if (!row_abs) *row += row_delta;
+    if (!col_abs) *col += col_delta;
+    return *row >= 0 && *col >= 0;
+}
+
+// Copy a tree with its relative references moved by the given offsets, so a
+// copied formula can be installed next to its rebased text without being
+// parsed again. The copy matches what formula_parse gives for the text
+// formula_render writes: references that move off the sheet become #REF!.
+// Returns NULL only when out of memory.
+FormulaTree* formula_tree_shifted(const FormulaTree* tree, int row_delta, int col_delta) {
+    FormulaTree* copy = (FormulaTree*)calloc(1, sizeof(FormulaTree));
+    if (!copy) return NULL;
+    copy->id = ++formula_tree_next_id;
+    copy->root = tree->root;
+    copy->parsed_count = tree->parsed_count;
+    copy->shared_count = tree->shared_count;
+
+    copy->nodes = (FormulaNode*)malloc((tree->count ? tree->count : 1) * sizeof(FormulaNode));
+    copy->args = (int*)malloc((tree->arg_count ? tree->arg_count : 1) * sizeof(int));
+    if (!copy->nodes || !copy->args) {
+        formula_tree_free(copy);
+        return NULL;
+    }
+    memcpy(copy->args, tree->args, tree->arg_count * sizeof(int));
+    copy->arg_count = tree->arg_count;
+    copy->arg_capacity = tree->arg_count ? tree->arg_count : 1;
+    copy->capacity = tree->count ? tree->count : 1;
+
+    for (int i = 0; i < tree->count; i++) {
+        FormulaNode node = tree->nodes[i];
+        if (node.text) {
+            node.text = _strdup(node.text);
+            if (!node.text) {
+                formula_tree_free(copy);
+                return NULL;
+            }
+        }
+        if (node.type == FNODE_REF) {
+            if (!formula_shift_corner(&node.row, &node.col, node.row_abs, node.col_abs, row_delta, col_delta)) {
+                node.type = FNODE_REF_ERROR;
+            }
+        } else if (node.type == FNODE_RANGE) {
+            int inside = formula_shift_corner(&node.row, &node.col, node.row_abs, node.col_abs, row_delta, col_delta);
+            inside &= formula_shift_corner(&node.end_row, &node.end_col, node.end_row_abs, node.end_col_abs, row_delta, col_delta);
+            if (!inside) {
+                node.type = FNODE_REF_ERROR;
+            } else {
+                // A fixed corner and a moving one can pass or meet each other
+                if (node.row > node.end_row || (node.row == node.end_row && node.row_abs < node.end_row_abs)) {
+                    int row = node.row, row_abs = node.row_abs;
+                    node.row = node.end_row;
+                    node.row_abs = node.end_row_abs;
+                    node.end_row = row;
+                    node.end_row_abs = row_abs;
+                }
+                if (node.col > node.end_col || (node.col == node.end_col && node.col_abs < node.end_col_abs)) {
+                    int col = node.col, col_abs = node.col_abs;
+                    node.col = node.end_col;
+                    node.col_abs = node.end_col_abs;
+                    node.end_col = col;
+                    node.end_col_abs = col_abs;
+                }
+            }
+        }
+        copy->nodes[i] = node;
+        copy->count = i + 1;
+    }
+    return copy;
+}
+
+// NEW: Expression tree optimizer
+//
+// One pass over the nodes in parse order (children always come before their
+// parents) folds constant subexpressions into literals and merges nodes that
+// are identical to an earlier one, so a repeated subexpression becomes a
+// single node with several parents. Every function here is pure, which makes
+// any two identical subexpressions safe to merge. Nodes that end up with
+// more than one parent get a 'shared' slot: the evaluator computes them once
+// per evaluation and reuses the value.
+
+int formula_node_is_literal(const FormulaNode* node) {
+    return node->type == FNODE_NUMBER || node->type == FNODE_STRING;
+}
+
+// Compare two literals the way the evaluator does; numbers sort before text
+int formula_literal_compare(FormulaNodeType op, const FormulaNode* a, const FormulaNode* b, double* result) {
+    int cmp;
+    if (a->type == FNODE_NUMBER && b->type == FNODE_NUMBER) {
+        if (op == FNODE_EQ) {
+            *result = fabs(a->number - b->number) < 1e-10 ? 1.0 : 0.0;
+            return 1;
+        }
+        if (op == FNODE_NE) {
+            *result = a->number != b->number ? 1.0 : 0.0;
+            return 1;
+        }
+        cmp = a->number < b->number ? -1 : (a->number > b->number ? 1 : 0);
+    } else if (a->type == FNODE_NUMBER) {
+        cmp = -1;
+    } else if (b->type == FNODE_NUMBER) {
+        cmp = 1;
+    } else {
+        cmp = strcmp(a->text, b->text);
+    }
+
+    switch (op) {
+        case FNODE_EQ: *result = cmp == 0; break;
+        case FNODE_NE: *result = cmp != 0; break;
+        case FNODE_LT: *result = cmp < 0; break;
+        case FNODE_LE: *result = cmp <= 0; break;
+        case FNODE_GT: *result = cmp > 0; break;
+        default: *result = cmp >= 0; break;
+    }
+    return 1;
+}
+
+// Try to fold node i, whose arguments are already final. Returns the index
+// of the node that replaces it (i itself when it became a literal or could
+// not be folded).
+int formula_node_fold(FormulaTree* tree, int i) {
+    FormulaNode* node = &tree->nodes[i];
+    const int* args = tree->args + node->first_arg;
+    const FormulaNode* a = node->arg_count > 0 ? &tree->nodes[args[0]] : NULL;
+    const FormulaNode* b = node->arg_count > 1 ? &tree->nodes[args[1]] : NULL;
+    double value;
+
+    switch (node->type) {
+        case FNODE_NEGATE:
+            if (a->type != FNODE_NUMBER) return i;
+            value = -a->number;
+            break;
+
+        case FNODE_ADD:
+        case FNODE_SUB:
+        case FNODE_MUL:
+        case FNODE_DIV:
+            if (a->type != FNODE_NUMBER || b->type != FNODE_NUMBER) return i;
+            if (node->type == FNODE_ADD) value = a->number + b->number;
+            else if (node->type == FNODE_SUB) value = a->number - b->number;
+            else if (node->type == FNODE_MUL) value = a->number * b->number;
+            else if (b->number == 0.0) return i;    // Left for the evaluator to report #DIV/0!
+            else value = a->number / b->number;
+            break;
+
+        case FNODE_EQ:
+        case FNODE_NE:
+        case FNODE_LT:
+        case FNODE_LE:
+        case FNODE_GT:
+        case FNODE_GE:
+            if (!formula_node_is_literal(a) || !formula_node_is_literal(b)) return i;
+            formula_literal_compare(node->type, a, b, &value);
+            break;
+
+        case FNODE_CALL:
+            switch (node->func) {
+                case FFUNC_POWER:
+                    if (a->type != FNODE_NUMBER || b->type != FNODE_NUMBER) return i;
+                    value = pow(a->number, b->number);
+                    break;
+
+                case FFUNC_IF:
+                    if (a->type != FNODE_NUMBER) return i;
+                    if (a->number != 0.0) return args[1];
+                    if (node->arg_count > 2) return args[2];
+                    value = 0.0;
+                    break;
+
+                case FFUNC_IFS:
+                    // Constant conditions up front: skip the false ones, stop at a true one
+                    for (int k = 0; k + 1 < node->arg_count; k += 2) {
+                        const FormulaNode* condition = &tree->nodes[args[k]];
+                        if (condition->type != FNODE_NUMBER) return i;
+                        if (condition->number != 0.0) return k == 0 ? args[k + 1] : i;
+                    }
+                    return i;
+
+                case FFUNC_AND:
+                case FFUNC_OR: {
+                    // Constant arguments up to the one that decides the result
+                    int stop_on = node->func == FFUNC_OR;
+                    int decided = 0;
+                    for (int k = 0; k < node->arg_count && !decided; k++) {
+                        const FormulaNode* arg = &tree->nodes[args[k]];
+                        if (arg->type != FNODE_NUMBER) return i;
+                        decided = (arg->number != 0.0) == stop_on;
+                    }
+                    value = (decided ? stop_on : !stop_on) ? 1.0 : 0.0;
+                    break;
+                }
+
+                case FFUNC_IFERROR:
+                    return formula_node_is_literal(a) ? args[0] : i;
+
+                case FFUNC_CHOOSE:
+                    if (a->type != FNODE_NUMBER || a->number < 1.0 || a->number >= (double)node->arg_count) return i;
+                    return args[(int)a->number];
+
+                default:
+                    return i;
+            }
+            break;
+
+        default:
+            return i;
+    }
+
+    node->type = FNODE_NUMBER;
+    node->func = (FormulaFunction)0;
+    node->number = value;
+    node->arg_count = 0;
+    return i;
+}
+
+unsigned long long formula_node_hash(const FormulaTree* tree, const FormulaNode* node) {
+    unsigned long long hash = 1469598103934665603ULL;
+    unsigned long long parts[6];
+    memcpy(&parts[0], &node->number, sizeof(double));
+    parts[1] = ((unsigned long long)node->type << 32) | (unsigned int)node->func;
+    parts[2] = ((unsigned long long)(unsigned int)node->row << 32) | (unsigned int)node->col;
+    parts[3] = ((unsigned long long)(unsigned int)node->end_row << 32) | (unsigned int)node->end_col;
+    parts[4] = ((unsigned long long)(node->row_abs | node->col_abs << 1 | node->end_row_abs << 2 | node->end_col_abs << 3) << 32) |
+               (unsigned int)node->arg_count;
+    parts[5] = 0;
+    if (node->text) {
+        for (const char* p = node->text; *p; p++) parts[5] = parts[5] * 31 + (unsigned char)*p;
+    }
+    for (int k = 0; k < 6; k++) hash = (hash ^ parts[k]) * 1099511628211ULL;
+    for (int k = 0; k < node->arg_count; k++) {
+        hash = (hash ^ (unsigned long long)tree->args[node->first_arg + k]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+int formula_node_equal(const FormulaTree* tree, const FormulaNode* a, const FormulaNode* b) {
+    if (a->type != b->type || a->func != b->func || a->arg_count != b->arg_count) return 0;
+    if (memcmp(&a->number, &b->number, sizeof(double)) != 0) return 0;
+    if (a->row != b->row || a->col != b->col || a->end_row != b->end_row || a->end_col != b->end_col) return 0;
+    // A$1 and A1 name the same cell here but not once the formula is copied
+    if (a->row_abs != b->row_abs || a->col_abs != b->col_abs ||
+        a->end_row_abs != b->end_row_abs || a->end_col_abs != b->end_col_abs) return 0;
+    if ((a->text || b->text) && (!a->text || !b->text || strcmp(a->text, b->text) != 0)) return 0;
+    return memcmp(tree->args + a->first_arg, tree->args + b->first_arg, a->arg_count * sizeof(int)) == 0;
+}
+
+void formula_tree_mark(const FormulaTree* tree, int index, int* uses) {
+    if (uses[index]++ > 0) return;      // Its arguments are already counted
+    const FormulaNode* node = &tree->nodes[index];
+    for (int k = 0; k < node->arg_count; k++) {
+        formula_tree_mark(tree, tree->args[node->first_arg + k], uses);
+    }
+}
+
+// Fold constants and merge identical subexpressions. Returns the number of
+// nodes removed, or -1 if out of memory (the tree is then left as it was).
+int formula_tree_optimize(FormulaTree* tree) {
+    for (int i = 0; i < tree->count; i++) tree->nodes[i].shared = -1;
+    tree->shared_count = 0;
+    if (tree->root < 0) return 0;
+
+    int n = tree->count;
+    int table_size = 16;
+    while (table_size < n * 2) table_size *= 2;
+    int* canonical = (int*)malloc(n * sizeof(int));
+    int* table = (int*)malloc(table_size * sizeof(int));
+    int* uses = (int*)calloc(n, sizeof(int));
+    int* remap = (int*)malloc(n * sizeof(int));
+    if (!canonical || !table || !uses || !remap) {
+        free(canonical);
+        free(table);
+        free(uses);
+        free(remap);
+        return -1;
+    }
+    for (int k = 0; k < table_size; k++) table[k] = -1;
+
+    for (int i = 0; i < n; i++) {
+        FormulaNode* node = &tree->nodes[i];
+        for (int k = 0; k < node->arg_count; k++) {
+            tree->args[node->first_arg + k] = canonical[tree->args[node->first_arg + k]];
+        }
+
+        int replacement = formula_node_fold(tree, i);
+        if (replacement != i) {
+            canonical[i] = replacement;
+            continue;
+        }
+
+        // Reuse an identical earlier node
+        unsigned long long hash = formula_node_hash(tree, node);
+        int slot = (int)(hash & (table_size - 1));
+        canonical[i] = i;
+        while (table[slot] >= 0) {
+            if (formula_node_equal(tree, &tree->nodes[table[slot]], node)) {
+                canonical[i] = table[slot];
+                break;
+            }
+            slot = (slot + 1) & (table_size - 1);
+        }
+        if (canonical[i] == i) table[slot] = i;
+    }
+
+    // Keep the nodes still reachable, in order, and count their parents
+    int root = canonical[tree->root];
+    formula_tree_mark(tree, root, uses);
+    int kept = 0;
+    int arg_total = 0;
+    for (int i = 0; i < n; i++) {
+        if (uses[i] > 0) {
+            remap[i] = kept++;
+            arg_total += tree->nodes[i].arg_count;
+        } else {
+            free(tree->nodes[i].text);
+            tree->nodes[i].text = NULL;
+        }
+    }
+
+    int* args = (int*)malloc((arg_total ? arg_total : 1) * sizeof(int));
+    if (!args) {
+        // Everything needed is still in place; only the compaction is skipped
+        free(canonical);
+        free(table);
+        free(uses);
+        free(remap);
+        tree->root = root;
+        return 0;
+    }
+
+    int arg_count = 0;
+    for (int i = 0; i < n; i++) {
+        if (uses[i] == 0) continue;
+        FormulaNode node = tree->nodes[i];
+        for (int k = 0; k < node.arg_count; k++) {
+            args[arg_count + k] = remap[tree->args[node.first_arg + k]];
+        }
+        node.first_arg = arg_count;
+        arg_count += node.arg_count;
+
+        // Only worth caching when the node does real work
+        int leaf = node.type == FNODE_NUMBER || node.type == FNODE_STRING ||
+                   node.type == FNODE_REF || node.type == FNODE_REF_ERROR;
+        if (uses[i] > 1 && !leaf) node.shared = tree->shared_count++;
+        tree->nodes[remap[i]] = node;
+    }
+
+    free(tree->args);
+    tree->args = args;
+    tree->arg_count = arg_count;
+    tree->arg_capacity = arg_total ? arg_total : 1;
+    tree->count = kept;
+    tree->root = remap[root];
+
+    free(canonical);
+    free(table);
+    free(uses);
+    free(remap);
+    return n - kept;
+}
+
+// Text output that stops quietly at the end of the buffer
+typedef struct {
+    char* out;
+    int size;
+    int length;
+} FormulaWriter;
+
+void formula_write(FormulaWriter* writer, const char* text, int length) {
+    if (length < 0) length = (int)strlen(text);
+    int room = writer->size - 1 - writer->length;
+    if (length > room) length = room > 0 ? room : 0;
+    memcpy(writer->out + writer->length, text, length);
+    writer->length += length;
+    writer->out[writer->length] = '\0';
+}
+
+int formula_node_precedence(const FormulaNode* node) {
+    switch (node->type) {
+        case FNODE_EQ: case FNODE_NE: case FNODE_LT: case FNODE_LE: case FNODE_GT: case FNODE_GE:
+            return 1;
+        case FNODE_ADD: case FNODE_SUB:
+            return 2;
+        case FNODE_MUL: case FNODE_DIV:
+            return 3;
+        case FNODE_NEGATE:
+            return 4;
+        default:
+            return 5;
+    }
+}
+
+void formula_render_node(const FormulaTree* tree, int index, int top, FormulaWriter* writer);
+
+void formula_render_operand(const FormulaTree* tree, int index, int min_precedence, FormulaWriter* writer) {
+    const FormulaNode* node = &tree->nodes[index];
+    int precedence = node->shared >= 0 ? 5 : formula_node_precedence(node);
+    if (node->type == FNODE_NUMBER && node->number < 0) precedence = 4;
+    if (precedence < min_precedence) {
+        formula_write(writer, "(", 1);
+        formula_render_node(tree, index, 0, writer);
+        formula_write(writer, ")", 1);
+    } else {
+        formula_render_node(tree, index, 0, writer);
+    }
+}
+
+// Write a node; shared nodes below the top are written as #slot
+void formula_render_node(const FormulaTree* tree, int index, int top, FormulaWriter* writer) {
+    const FormulaNode* node = &tree->nodes[index];
+    const int* args = tree->args + node->first_arg;
+    char buffer[64];
+    static const char* operators[] = {"+", "-", "*", "/", "=", "<>", "<", "<=", ">", ">="};
+
+    if (node->shared >= 0 && !top) {
+        sprintf_s(buffer, sizeof(buffer), "#%d", node->shared + 1);
+        formula_write(writer, buffer, -1);
+        return;
+    }
+
+    switch (node->type) {
+        case FNODE_NUMBER:
+            // Folded constants get as many digits as it takes to read back exactly
+            sprintf_s(buffer, sizeof(buffer), "%.15g", node->number);
+            if (strtod(buffer, NULL) != node->number) sprintf_s(buffer, sizeof(buffer), "%.17g", node->number);
+            formula_write(writer, buffer, -1);
+            break;
+        case FNODE_STRING:
+            formula_write(writer, "\"", 1);
+            for (const char* p = node->text; *p; p++) {
+                formula_write(writer, p, 1);
+                if (*p == '"') formula_write(writer, "\"", 1);
+            }
+            formula_write(writer, "\"", 1);
+            break;
+        case FNODE_REF:
+        case FNODE_RANGE:
+            formula_write(writer, buffer, formula_write_reference(buffer, node->row, node->col, node->row_abs, node->col_abs));
+            if (node->type == FNODE_RANGE) {
+                formula_write(writer, ":", 1);
+                formula_write(writer, buffer, formula_write_reference(buffer, node->end_row, node->end_col, node->end_row_abs, node->end_col_abs));
+            }
+            break;
+        case FNODE_REF_ERROR:
+            formula_write(writer, "#REF!", 5);
+            break;
+        case FNODE_NEGATE:
+            formula_write(writer, "-", 1);
+            formula_render_operand(tree, args[0], 4, writer);
+            break;
+        case FNODE_CALL:
+            formula_write(writer, formula_function_info(node->func)->name, -1);
+            formula_write(writer, "(", 1);
+            for (int k = 0; k < node->arg_count; k++) {
+                if (k > 0) formula_write(writer, ", ", 2);
+                formula_render_node(tree, args[k], 0, writer);
+            }
+            formula_write(writer, ")", 1);
+            break;
+        default: {
+            // Binary operators: the right operand needs brackets at equal precedence
+            int precedence = formula_node_precedence(node);
+            formula_render_operand(tree, args[0], precedence, writer);
+            formula_write(writer, operators[node->type - FNODE_ADD], -1);
+            formula_render_operand(tree, args[1], precedence + 1, writer);
+            break;
+        }
+    }
+}
+
+// Write the optimized expression, followed by the shared subexpressions it
+// refers to as #1, #2, ... Returns the length written.
+int formula_tree_render(const FormulaTree* tree, char* out, int size) {
+    FormulaWriter writer = {out, size, 0};
+    if (size <= 0) return 0;
+    out[0] = '\0';
+    if (!tree || tree->root < 0) {
+        formula_write(&writer, "#PARSE!", -1);
+        return writer.length;
+    }
+
+    formula_render_node(tree, tree->root, 1, &writer);
+    for (int i = 0; i < tree->count; i++) {
+        if (tree->nodes[i].shared < 0 || i == tree->root) continue;
+        char label[32];
+        sprintf_s(label, sizeof(label), "%s#%d = ", tree->nodes[i].shared == 0 ? " where " : ", ", tree->nodes[i].shared + 1);
+        formula_write(&writer, label, -1);
+        formula_render_node(tree, i, 1, &writer);
+    }
+    return writer.length;
+}
+
+#endif // FORMULA_H
@@ -9,6 +9,7 @@
 #include "sheet.h"
 #include "debug.h"
 #include "charts.h"
+#include "clipboard.h"
 
 // Application state
 typedef enum {
@@ -27,77 +28,49 @@ typedef enum {
     UNDO_CLEAR_CELL,
     UNDO_FORMAT_CHANGE,
     UNDO_RESIZE_COLUMN,
-    UNDO_RESIZE_ROW
+    UNDO_RESIZE_ROW,
+    UNDO_STRUCTURE,     // Row/column insert or delete
+    UNDO_SORT           // Rows reordered by a sort
 } UndoType;
 
-typedef struct {
-    int row, col;
-    CellType old_type;
-    CellType new_type;
-    union {
-        double number;
-        char* string;
-        struct {
-            char* expression;
-            double cached_value;
-            char* cached_string;
-            int is_string_result;
-            ErrorType error;
-        } formula;
-    } old_data;
-    union {
-        double number;
-        char* string;
-        struct {
-            char* expression;
-            double cached_value;
-            char* cached_string;
-            int is_string_result;
-            ErrorType error;
-        } formula;
-    } new_data;
-    // Formatting data
-    DataFormat old_format;
-    FormatStyle old_format_style;
-    DataFormat new_format;
-    FormatStyle new_format_style;
-    int old_text_color;
-    int old_background_color;
-    int new_text_color;
-    int new_background_color;
-} CellUndoData;
-
-typedef struct {
-    int start_row, start_col;
-    int end_row, end_col;
-    CellUndoData* cell_data;
-    int cell_count;
-} RangeUndoData;
-
-typedef struct {
-    int index;  // Column or row index
-    int old_size;
-    int new_size;
-} ResizeUndoData;
-
-typedef struct UndoAction {
+// Undo history is an append-only log of variable-sized delta records. Each
+// record's payload holds the packed state of the cells (or column/row size)
+// that is NOT currently on the sheet: undoing or redoing a record swaps its
+// payload with the sheet's current state. Records are linked oldest -> newest
+// and the log is bounded by a byte budget rather than an entry count. Large
+// range edits store a RangeSnapshot instead of a packed payload.
+typedef struct UndoRecord {
+    struct UndoRecord* prev;
+    struct UndoRecord* next;
     UndoType type;
-    union {
-        CellUndoData cell;
-        RangeUndoData range;
-        ResizeUndoData resize;
-    } data;
-    char description[128];
-} UndoAction;
+    unsigned char* payload;  // Packed delta (see undo_encode_cell)
+    RangeSnapshot* snapshot; // Set instead of payload for snapshot records
+    StructuralChange* structure; // Set instead of payload for UNDO_STRUCTURE
+    RowPermutation* permutation; // Set instead of payload for UNDO_SORT
+    size_t payload_size;     // Bytes held by payload or snapshot
+    char description[64];
+} UndoRecord;
 
-#define MAX_UNDO_ACTIONS 100
+#define UNDO_DEFAULT_BUDGET (8 * 1024 * 1024)  // Bytes of history kept by default
+#define UNDO_CELL_ABSENT 0xFF                   // Payload tag for "no cell at this position"
 
 typedef struct {
-    UndoAction actions[MAX_UNDO_ACTIONS];
-    int current_index;  // Points to the next action to be added
-    int count;          // Number of actions in the buffer
+    UndoRecord* oldest;
+    UndoRecord* newest;
+    UndoRecord* cursor;   // Most recent record that can be undone (NULL = nothing to undo)
+    size_t bytes_used;    // Records plus payloads currently held
+    size_t byte_budget;   // Oldest records are evicted once bytes_used exceeds this
+    int count;            // Number of records in the log
 } UndoBuffer;
 
+// Growable byte buffer used to build undo payloads
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+    int failed;         // A write did not fit, so the payload is incomplete
+} UndoWriter;
+
 typedef struct {
     Sheet* sheet;
     Console* console;
@@ -123,6 +96,15 @@ typedef struct {
     
     // NEW: Undo/Redo system
     UndoBuffer undo_buffer;
+    
+    // NEW: Text clipboard used for exchange with other programs
+    ClipboardProvider* clipboard;
+    
+    // NEW: Chart panel bound to a range (NULL when closed)
+    LiveChart* live_chart;
+    
+    // NEW: Chart being written to a file in the background (NULL when idle)
+    ChartExport* chart_export;
 } AppState;
 
 // Function prototypes
@@ -136,12 +118,20 @@ void app_finish_input(AppState* state);
 void app_cancel_input(AppState* state);
 void app_update_cursor_blink(AppState* state);
 void app_show_chart(AppState* state, ChartType type, const char* x_label, const char* y_label);
+void app_live_chart(AppState* state, const char* args);
+void app_show_binned_chart(AppState* state, ChartType type, const char* args);
+void app_present_chart(AppState* state, Chart* chart);
+void app_live_chart_panel(AppState* state, int* left, int* top, int* width, int* height, int* plot_width, int* plot_height);
+void app_export_chart(AppState* state, const char* args);
+void app_poll_chart_export(AppState* state);
+int app_export_chart_headless(int argc, char* argv[]);
 
 // NEW: Range selection functions
 void app_start_range_selection(AppState* state);
 void app_extend_range_selection(AppState* state, int row, int col);
 void app_finish_range_selection(AppState* state);
 void app_cancel_range_selection(AppState* state);
+int app_get_selection_bounds(AppState* state, int* min_row, int* min_col, int* max_row, int* max_col);
 
 // Copy/paste operations
 void app_copy_cell(AppState* state);
@@ -166,16 +156,24 @@ void undo_buffer_init(UndoBuffer* buffer);
 void undo_buffer_cleanup(UndoBuffer* buffer);
 void undo_save_cell_state(AppState* state, int row, int col, const char* description);
 void undo_save_range_state(AppState* state, int start_row, int start_col, int end_row, int end_col, const char* description);
-void undo_save_resize_state(AppState* state, int index, int old_size, int new_size, UndoType type, const char* description);
+int undo_save_resize_state(AppState* state, int index, int old_size, int new_size, UndoType type, const char* description);
+void undo_snapshot_range(AppState* state, SnapshotKind kind, int start_row, int start_col, int end_row, int end_col, const char* description);
+int app_commit_batch(AppState* state, const char* description);
+void app_structural_edit(AppState* state, int on_rows, int deleting, int count);
+void app_sort(AppState* state, const char* args);
+void app_filter(AppState* state, const char* args);
+int app_parse_columns(Sheet* sheet, const char* text, int* cols, int max_cols);
+void app_pivot(AppState* state, const char* args);
+void app_explain(AppState* state);
+double app_bench_tier(Sheet* sheet, FormulaTier tier, int runs);
+void app_bench(AppState* state, const char* args);
+int app_step_row(AppState* state, int delta);
 void undo_perform(AppState* state);
 void redo_perform(AppState* state);
-void undo_copy_cell_data(Cell* src, CellUndoData* dest);
-void undo_restore_cell_data(AppState* state, CellUndoData* src, int row, int col);
-void undo_free_cell_data(CellUndoData* data);
-
-// System clipboard functions
-BOOL set_system_clipboard_text(const char* text);
-char* get_system_clipboard_text(void);
+void undo_set_budget(UndoBuffer* buffer, size_t byte_budget);
+void undo_encode_cell(UndoWriter* writer, Cell* cell);
+const unsigned char* undo_restore_cell(AppState* state, const unsigned char* p, int row, int col);
+void undo_swap_record(AppState* state, UndoRecord* record);
 
 // Initialize application
 void app_init(AppState* state) {
@@ -215,6 +213,10 @@ void app_init(AppState* state) {
     // NEW: Initialize undo buffer
     undo_buffer_init(&state->undo_buffer);
     
+    state->clipboard = clipboard_system_provider();
+    state->live_chart = NULL;
+    state->chart_export = NULL;
+    
     state->cursor_blink_time = GetTickCount();
     state->cursor_visible = TRUE;
     state->cursor_blink_rate = 500;
@@ -326,6 +328,17 @@ void app_cleanup(AppState* state) {
     // NEW: Cleanup undo buffer
     undo_buffer_cleanup(&state->undo_buffer);
     
+    // NEW: Let a running chart export finish writing its file
+    if (state->chart_export) {
+        chart_export_finish(state->chart_export);
+        state->chart_export = NULL;
+    }
+    parallel_shutdown();
+    
+    // NEW: Close the live chart before the sheet it watches
+    live_chart_free(state->live_chart);
+    state->live_chart = NULL;
+    
     if (state->sheet) {
         sheet_free(state->sheet);
         state->sheet = NULL;
@@ -378,6 +391,18 @@ void app_cancel_range_selection(AppState* state) {
     strcpy_s(state->status_message, sizeof(state->status_message), "Range selection cancelled");
 }
 
+// NEW: Normalized bounds of the active selection; returns 0 if there is none
+int app_get_selection_bounds(AppState* state, int* min_row, int* min_col, int* max_row, int* max_col) {
+    RangeSelection* sel = &state->sheet->selection;
+    if (!sel->is_active) return 0;
+    
+    *min_row = min(sel->start_row, sel->end_row);
+    *max_row = max(sel->start_row, sel->end_row);
+    *min_col = min(sel->start_col, sel->end_col);
+    *max_col = max(sel->start_col, sel->end_col);
+    return 1;
+}
+
 // Render the spreadsheet
 void app_render(AppState* state) {
     Console* con = state->console;
@@ -439,8 +464,12 @@ void app_render(AppState* state) {
         current_x += col_width;
     }
       // Draw row headers (accounting for variable row heights)
+    // NEW: Rows are walked through the view, which skips rows hidden by a filter
+    int view_count = sheet_view_count(state->sheet);
+    int top_index = sheet_view_index(state->sheet, state->view_top);
     int visual_row = 0;
-    for (int sheet_row = state->view_top; sheet_row < state->sheet->rows && visual_row < visible_rows; sheet_row++) {
+    for (int index = top_index; index < view_count && visual_row < visible_rows; index++) {
+        int sheet_row = sheet_view_row(state->sheet, index);
         int row_height = sheet_get_row_height(state->sheet, sheet_row);
         
         // Draw row number only on the first line of each row
@@ -454,8 +483,9 @@ void app_render(AppState* state) {
     
     // Draw grid and cell contents (with dynamic sizes)
     current_x = col_header_width;
-    for (int row = 0; row < visible_rows && state->view_top + row < state->sheet->rows; row++) {
-        int sheet_row = state->view_top + row;
+    int view_index = top_index;
+    for (int row = 0; row < visible_rows && view_index < view_count; row++, view_index++) {
+        int sheet_row = sheet_view_row(state->sheet, view_index);
         int row_height = sheet_get_row_height(state->sheet, sheet_row);
         
         // Draw multiple lines for tall rows
@@ -597,6 +627,23 @@ void app_render(AppState* state) {
     }
     console_write_string(con, 0, status_y + 1, status, headerColor);
     
+    // NEW: Live chart panel, brought up to date with any edits first
+    if (state->live_chart) {
+        int left, top, width, height, plot_width, plot_height;
+        app_live_chart_panel(state, &left, &top, &width, &height, &plot_width, &plot_height);
+        if (plot_width != state->live_chart->width || plot_height != state->live_chart->height) {
+            live_chart_resize(state->live_chart, plot_width, plot_height);
+        }
+        live_chart_refresh(state->live_chart);
+        for (int y = top; y < top + height; y++) {
+            for (int x = left; x < left + width; x++) {
+                console_write_char(con, x, y, ' ', cellColor);
+            }
+        }
+        chart_draw_frame(con, left, top, width, height, " Live Chart ");
+        chart_blit(con, state->live_chart->chart, left + 1, top + 1, width - 2, height - 2);
+    }
+    
     console_flip(con);
 }
 
@@ -920,10 +967,13 @@ void app_execute_command(AppState* state, const char* command) {
         int preserve = ask_preserve_formulas(state, "Load CSV");
         if (preserve == -1) return;
         
+        sheet_begin_batch(state->sheet);
         if (sheet_load_csv(state->sheet, filename, preserve)) {
+            if (!app_commit_batch(state, "Load CSV")) return;
             sprintf_s(state->status_message, sizeof(state->status_message), 
                      "Loaded from %s (%s)", filename, preserve ? "formulas preserved" : "values only");
         } else {
+            sheet_rollback_batch(state->sheet);
             sprintf_s(state->status_message, sizeof(state->status_message), 
                      "Failed to load %s", filename);
         }
@@ -985,6 +1035,7 @@ void app_execute_command(AppState* state, const char* command) {
         int max_col = state->sheet->selection.start_col > state->sheet->selection.end_col ? 
                       state->sheet->selection.start_col : state->sheet->selection.end_col;
         
+        undo_snapshot_range(state, SNAPSHOT_FORMAT, min_row, min_col, max_row, max_col, "Range format");
         for (int row = min_row; row <= max_row; row++) {
             for (int col = min_col; col <= max_col; col++) {
                 Cell* cell = sheet_get_or_create_cell(state->sheet, row, col);
@@ -1012,6 +1063,7 @@ void app_execute_command(AppState* state, const char* command) {
                 int max_col = state->sheet->selection.start_col > state->sheet->selection.end_col ? 
                               state->sheet->selection.start_col : state->sheet->selection.end_col;
                 
+                undo_snapshot_range(state, SNAPSHOT_FORMAT, min_row, min_col, max_row, max_col, "Range text color");
                 for (int row = min_row; row <= max_row; row++) {
                     for (int col = min_col; col <= max_col; col++) {
                         Cell* cell = sheet_get_or_create_cell(state->sheet, row, col);
@@ -1024,6 +1076,7 @@ void app_execute_command(AppState* state, const char* command) {
                          "Range text color set to %s", color_str);
             } else {
                 // Apply to current cell
+                undo_save_cell_state(state, state->cursor_row, state->cursor_col, "Cell text color");
                 Cell* cell = sheet_get_or_create_cell(state->sheet, state->cursor_row, state->cursor_col);
                 if (cell) {
                     cell_set_text_color(cell, color);
@@ -1086,9 +1139,23 @@ void app_execute_command(AppState* state, const char* command) {
         
         app_show_chart(state, CHART_SCATTER, x_label, y_label);
     }
+    else if (strncmp(command, "livechart", 9) == 0 && (command[9] == '\0' || command[9] == ' ')) {
+        const char* args = command + 9;
+        while (*args == ' ') args++;
+        app_live_chart(state, args);
+    }
+    else if (strncmp(command, "histogram", 9) == 0 && (command[9] == '\0' || command[9] == ' ')) {
+        app_show_binned_chart(state, CHART_HISTOGRAM, command + 9);
+    }
+    else if (strncmp(command, "density", 7) == 0 && (command[7] == '\0' || command[7] == ' ')) {
+        app_show_binned_chart(state, CHART_DENSITY, command + 7);
+    }
+    else if (strncmp(command, "chart export", 12) == 0 && (command[12] == '\0' || command[12] == ' ')) {
+        app_export_chart(state, command + 12);
+    }
     else if (strcmp(command, "chart help") == 0 || strcmp(command, "help chart") == 0) {
         strcpy_s(state->status_message, sizeof(state->status_message), 
-                "Charts: Select range with Shift+arrows, then :line/:bar/:pie/:scatter [x_label] [y_label]");
+                "Charts: Select range with Shift+arrows, then :line/:bar/:pie/:scatter [x_label] [y_label], :histogram [bins], :density [xb] [yb], :chart export <file>");
     }
     else if (strncmp(command, "clrbg ", 6) == 0) {
         const char* color_str = command + 6;
@@ -1105,6 +1172,7 @@ void app_execute_command(AppState* state, const char* command) {
                 int max_col = state->sheet->selection.start_col > state->sheet->selection.end_col ? 
                               state->sheet->selection.start_col : state->sheet->selection.end_col;
                 
+                undo_snapshot_range(state, SNAPSHOT_FORMAT, min_row, min_col, max_row, max_col, "Range background color");
                 for (int row = min_row; row <= max_row; row++) {
                     for (int col = min_col; col <= max_col; col++) {
                         Cell* cell = sheet_get_or_create_cell(state->sheet, row, col);
@@ -1117,6 +1185,7 @@ void app_execute_command(AppState* state, const char* command) {
                          "Range background color set to %s", color_str);
             } else {
                 // Apply to current cell
+                undo_save_cell_state(state, state->cursor_row, state->cursor_col, "Cell background color");
                 Cell* cell = sheet_get_or_create_cell(state->sheet, state->cursor_row, state->cursor_col);
                 if (cell) {
                     cell_set_background_color(cell, color);
@@ -1128,6 +1197,176 @@ void app_execute_command(AppState* state, const char* command) {
             sprintf_s(state->status_message, sizeof(state->status_message), 
                      "Invalid color: %s", color_str);
         }
+    }
+    // NEW: Undo history budget
+    else if (strcmp(command, "undobudget") == 0 || strncmp(command, "undobudget ", 11) == 0) {
+        UndoBuffer* buffer = &state->undo_buffer;
+        const char* args = command + 10;
+        while (*args == ' ') args++;
+
+        if (*args) {
+            int kb = atoi(args);
+            if (kb <= 0) {
+                strcpy_s(state->status_message, sizeof(state->status_message), "Usage: undobudget [KB]");
+                return;
+            }
+            undo_set_budget(buffer, (size_t)kb * 1024);
+        }
+        sprintf_s(state->status_message, sizeof(state->status_message),
+                 "Undo history: %d steps, %zu KB used of %zu KB",
+                 buffer->count, (buffer->bytes_used + 1023) / 1024, buffer->byte_budget / 1024);
+    }
+    // NEW: Thread pool size and statistics
+    else if (strcmp(command, "threads") == 0 || strncmp(command, "threads ", 8) == 0) {
+        const char* args = command + 7;
+        while (*args == ' ') args++;
+
+        if (*args) {
+            int threads = _stricmp(args, "auto") == 0 ? 0 : atoi(args);
+            if (threads <= 0 && _stricmp(args, "auto") != 0) {
+                strcpy_s(state->status_message, sizeof(state->status_message), "Usage: threads [count|auto]");
+                return;
+            }
+            parallel_set_thread_count(threads);
+        }
+        ParallelStats stats;
+        parallel_get_stats(&stats);
+        sprintf_s(state->status_message, sizeof(state->status_message),
+                 "Threads: %d | %ld tasks run (%ld stolen), %.1f ms busy | last job: %d tasks in %.2f ms, %.2f ms busy, longest %.2f ms",
+                 stats.threads, stats.tasks_run, stats.steals, stats.busy_ms,
+                 stats.last_tasks, stats.last_wall_ms, stats.last_busy_ms, stats.last_longest_ms);
+    }
+    // NEW: Fill commands
+    else if (strcmp(command, "filldown") == 0 || strcmp(command, "fillright") == 0) {
+        int min_row, min_col, max_row, max_col;
+        if (!app_get_selection_bounds(state, &min_row, &min_col, &max_row, &max_col)) {
+            strcpy_s(state->status_message, sizeof(state->status_message), "No range selected");
+            return;
+        }
+        
+        int down = strcmp(command, "filldown") == 0;
+        if (down ? max_row == min_row : max_col == min_col) {
+            sprintf_s(state->status_message, sizeof(state->status_message),
+                     "Select more than one %s to fill", down ? "row" : "column");
+            return;
+        }
+        
+        // Every target cell is overwritten, so snapshot them by reference
+        if (down) {
+            undo_snapshot_range(state, SNAPSHOT_CELLS, min_row + 1, min_col, max_row, max_col, "Fill down");
+        } else {
+            undo_snapshot_range(state, SNAPSHOT_CELLS, min_row, min_col + 1, max_row, max_col, "Fill right");
+        }
+        int written = down ? sheet_fill_down(state->sheet, min_row, min_col, max_row, max_col)
+                           : sheet_fill_right(state->sheet, min_row, min_col, max_row, max_col);
+        sprintf_s(state->status_message, sizeof(state->status_message), "Filled %d cells", written);
+    }
+    else if (strcmp(command, "series") == 0 || strncmp(command, "series ", 7) == 0) {
+        int min_row, min_col, max_row, max_col;
+        if (!app_get_selection_bounds(state, &min_row, &min_col, &max_row, &max_col)) {
+            strcpy_s(state->status_message, sizeof(state->status_message), "No range selected");
+            return;
+        }
+        
+        char kind[16] = "";
+        char step_str[32] = "";
+        char unit_str[16] = "";
+        sscanf_s(command + 6, "%15s %31s %15s", kind, (unsigned)sizeof(kind),
+                 step_str, (unsigned)sizeof(step_str), unit_str, (unsigned)sizeof(unit_str));
+        
+        SeriesType type;
+        if (strcmp(kind, "linear") == 0) {
+            type = SERIES_LINEAR;
+        } else if (strcmp(kind, "growth") == 0) {
+            type = SERIES_GROWTH;
+        } else if (strcmp(kind, "date") == 0) {
+            type = SERIES_DATE;
+        } else {
+            strcpy_s(state->status_message, sizeof(state->status_message),
+                    "Usage: series linear|growth|date [step] [day|week|month|year]");
+            return;
+        }
+        
+        // The date unit may come with or without a step
+        DateUnit unit = DATE_UNIT_DAY;
+        const char* unit_arg = unit_str[0] ? unit_str : step_str;
+        if (strcmp(unit_arg, "week") == 0) unit = DATE_UNIT_WEEK;
+        else if (strcmp(unit_arg, "month") == 0) unit = DATE_UNIT_MONTH;
+        else if (strcmp(unit_arg, "year") == 0) unit = DATE_UNIT_YEAR;
+        
+        char* endptr;
+        double step = strtod(step_str, &endptr);
+        int has_step = step_str[0] && *endptr == '\0';
+        
+        // A batch rather than a snapshot: the step may be read from the second cell
+        sheet_begin_batch(state->sheet);
+        int written = sheet_fill_series(state->sheet, min_row, min_col, max_row, max_col,
+                                        type, step, has_step, unit);
+        if (written < 0) {
+            sheet_rollback_batch(state->sheet);
+            strcpy_s(state->status_message, sizeof(state->status_message),
+                    "Series must start with a number");
+            return;
+        }
+        if (!app_commit_batch(state, "Fill series")) return;
+        sprintf_s(state->status_message, sizeof(state->status_message), "Filled %d cells with %s series", written, kind);
+    }
+    // NEW: Row/column insert and delete
+    else if (strncmp(command, "insrow", 6) == 0 || strncmp(command, "delrow", 6) == 0 ||
+             strncmp(command, "inscol", 6) == 0 || strncmp(command, "delcol", 6) == 0) {
+        const char* args = command + 6;
+        if (*args && *args != ' ') {
+            sprintf_s(state->status_message, sizeof(state->status_message), "Unknown command: %s", command);
+            return;
+        }
+        while (*args == ' ') args++;
+        int count = *args ? atoi(args) : 1;
+        if (count <= 0) {
+            sprintf_s(state->status_message, sizeof(state->status_message), "Usage: %.6s [count]", command);
+            return;
+        }
+        app_structural_edit(state, command[3] == 'r', command[0] == 'd', count);
+    }
+    // NEW: Sort
+    else if (strcmp(command, "sort") == 0 || strncmp(command, "sort ", 5) == 0) {
+        app_sort(state, command + 4);
+    }
+    // NEW: Filter
+    else if (strcmp(command, "filter") == 0 || strncmp(command, "filter ", 7) == 0) {
+        app_filter(state, command + 6);
+    }
+    // NEW: Pivot
+    else if (strncmp(command, "pivot ", 6) == 0) {
+        app_pivot(state, command + 6);
+    }
+    else if (strcmp(command, "pivot") == 0) {
+        strcpy_s(state->status_message, sizeof(state->status_message),
+                "Usage: pivot <key cols> <value cols> [sum,count,avg,min,max] [@cell] (e.g. pivot A C,D)");
+    }
+    // NEW: Show how the current formula is evaluated
+    else if (strcmp(command, "explain") == 0) {
+        app_explain(state);
+    }
+    // NEW: Formula execution tier
+    else if (strcmp(command, "tier") == 0 || strncmp(command, "tier ", 5) == 0) {
+        const char* args = command + 4;
+        while (*args == ' ') args++;
+
+        if (*args) {
+            if (_strnicmp(args, "interp", 6) == 0) {
+                formula_tier = FORMULA_TIER_INTERPRETER;
+            } else if (_stricmp(args, "threaded") == 0) {
+                formula_tier = FORMULA_TIER_THREADED;
+            } else {
+                strcpy_s(state->status_message, sizeof(state->status_message), "Usage: tier [interpreter|threaded]");
+                return;
+            }
+        }
+        sprintf_s(state->status_message, sizeof(state->status_message), "Formulas run %s",
+                 formula_tier == FORMULA_TIER_THREADED ? "threaded (compiled once evaluated twice)" : "in the interpreter");
+    }
+    else if (strcmp(command, "bench") == 0 || strncmp(command, "bench ", 6) == 0) {
+        app_bench(state, command + 5);
     }else {
         sprintf_s(state->status_message, sizeof(state->status_message), "Unknown command: %s", command);
     }
@@ -1144,9 +1383,10 @@ void app_copy_cell(AppState* state) {
 void app_paste_cell(AppState* state) {
     Cell* clipboard = sheet_get_clipboard_cell();
     if (clipboard) {
-        undo_save_cell_state(state, state->cursor_row, state->cursor_col, "Paste cell");
+        sheet_begin_batch(state->sheet);
         sheet_copy_cell(state->sheet, clipboard->row, clipboard->col, 
                        state->cursor_row, state->cursor_col);
+        if (!app_commit_batch(state, "Paste cell")) return;
         strcpy_s(state->status_message, sizeof(state->status_message), "Cell pasted");
     } else {
         strcpy_s(state->status_message, sizeof(state->status_message), "Nothing to paste");
@@ -1172,8 +1412,8 @@ void app_paste_range(AppState* state) {
         int end_row = state->cursor_row + paste_rows - 1;
         int end_col = state->cursor_col + paste_cols - 1;
         
-        // Save undo state for the affected range
-        undo_save_range_state(state, state->cursor_row, state->cursor_col, end_row, end_col, "Paste range");
+        // Snapshot the affected range; paste overwrites every value in it
+        undo_snapshot_range(state, SNAPSHOT_CELLS, state->cursor_row, state->cursor_col, end_row, end_col, "Paste range");
         
         sheet_paste_range(state->sheet, state->cursor_row, state->cursor_col);
         strcpy_s(state->status_message, sizeof(state->status_message), "Range pasted");
@@ -1182,103 +1422,63 @@ void app_paste_range(AppState* state) {
     }
 }
 
-// Copy current cell to system clipboard
+// Copy current cell, or the selected range as TSV, to the system clipboard
 void app_copy_to_system_clipboard(AppState* state) {
+    int min_row, min_col, max_row, max_col;
+    if (app_get_selection_bounds(state, &min_row, &min_col, &max_row, &max_col)) {
+        char* text = sheet_range_to_tsv(state->sheet, min_row, min_col, max_row, max_col);
+        if (text && clipboard_set_text(state->clipboard, text)) {
+            sprintf_s(state->status_message, sizeof(state->status_message),
+                     "Copied %dx%d range to system clipboard", max_row - min_row + 1, max_col - min_col + 1);
+        } else {
+            strcpy_s(state->status_message, sizeof(state->status_message), "Failed to copy range to system clipboard");
+        }
+        free(text);
+        return;
+    }
+    
     Cell* cell = sheet_get_cell(state->sheet, state->cursor_row, state->cursor_col);
     if (cell) {
         char* text = sheet_get_display_value(state->sheet, state->cursor_row, state->cursor_col);
         if (text) {
-            set_system_clipboard_text(text);
+            clipboard_set_text(state->clipboard, text);
             strcpy_s(state->status_message, sizeof(state->status_message), "Cell content copied to system clipboard");
         } else {
             strcpy_s(state->status_message, sizeof(state->status_message), "Failed to get cell content");
         }
     } else {
-        set_system_clipboard_text("");
+        clipboard_set_text(state->clipboard, "");
         strcpy_s(state->status_message, sizeof(state->status_message), "Empty cell copied to system clipboard");
     }
 }
 
-// Paste from system clipboard to current cell
+// Paste system clipboard text at the current cell. Tab-separated rows fill a
+// block of cells; the whole paste is a single undo step.
 void app_paste_from_system_clipboard(AppState* state) {
-    char* text = get_system_clipboard_text();
-    if (text) {
-        if (strlen(text) == 0) {
-            sheet_clear_cell(state->sheet, state->cursor_row, state->cursor_col);
-            strcpy_s(state->status_message, sizeof(state->status_message), "Cell cleared from system clipboard");
-        } else if (text[0] == '=') {
-            sheet_set_formula(state->sheet, state->cursor_row, state->cursor_col, text);
-            sheet_recalculate(state->sheet);
-            strcpy_s(state->status_message, sizeof(state->status_message), "Formula pasted from system clipboard");
-        } else {
-            char* endptr;
-            double num = strtod(text, &endptr);
-            if (*endptr == '\0' || (*endptr == '\n' && *(endptr+1) == '\0')) {
-                sheet_set_number(state->sheet, state->cursor_row, state->cursor_col, num);
-                strcpy_s(state->status_message, sizeof(state->status_message), "Number pasted from system clipboard");
-            } else {
-                size_t len = strlen(text);
-                if (len > 0 && text[len-1] == '\n') {
-                    text[len-1] = '\0';
-                }
-                sheet_set_string(state->sheet, state->cursor_row, state->cursor_col, text);
-                strcpy_s(state->status_message, sizeof(state->status_message), "Text pasted from system clipboard");
-            }
-        }
-        free(text);
-    } else {
+    char* text = clipboard_get_text(state->clipboard);
+    if (!text) {
         strcpy_s(state->status_message, sizeof(state->status_message), "Failed to get system clipboard content");
-    }
-}
-
-// System clipboard helper functions
-BOOL set_system_clipboard_text(const char* text) {
-    if (!OpenClipboard(NULL)) return FALSE;
-    
-    EmptyClipboard();
-    
-    size_t len = strlen(text) + 1;
-    HGLOBAL hMem = GlobalAlloc(GMEM_MOVEABLE, len);
-    if (!hMem) {
-        CloseClipboard();
-        return FALSE;
-    }
-    
-    char* pMem = (char*)GlobalLock(hMem);
-    if (pMem) {
-        strcpy_s(pMem, len, text);
-        GlobalUnlock(hMem);
-        SetClipboardData(CF_TEXT, hMem);
-    }
-    
-    CloseClipboard();
-    return TRUE;
-}
-
-char* get_system_clipboard_text(void) {
-    if (!OpenClipboard(NULL)) return NULL;
-    
-    HANDLE hData = GetClipboardData(CF_TEXT);
-    if (!hData) {
-        CloseClipboard();
-        return NULL;
+        return;
     }
     
-    char* pData = (char*)GlobalLock(hData);
-    if (!pData) {
-        CloseClipboard();
-        return NULL;
+    int rows = 0, cols = 0;
+    sheet_begin_batch(state->sheet);
+    if (text[0] == '\0') {
+        sheet_clear_cell(state->sheet, state->cursor_row, state->cursor_col);
+    } else {
+        sheet_paste_tsv(state->sheet, text, state->cursor_row, state->cursor_col, &rows, &cols);
     }
+    int recorded = app_commit_batch(state, "Paste from system clipboard");
+    free(text);
+    if (!recorded) return;
     
-    size_t len = strlen(pData) + 1;
-    char* result = (char*)malloc(len);
-    if (result) {
-        strcpy_s(result, len, pData);
+    if (rows <= 1 && cols <= 1) {
+        strcpy_s(state->status_message, sizeof(state->status_message),
+                rows ? "Cell pasted from system clipboard" : "Cell cleared from system clipboard");
+    } else {
+        sprintf_s(state->status_message, sizeof(state->status_message),
+                 "Pasted %dx%d range from system clipboard", rows, cols);
     }
-    
-    GlobalUnlock(hData);
-    CloseClipboard();
-    return result;
 }
 
 // Handle keyboard input
@@ -1323,7 +1523,7 @@ void app_handle_input(AppState* state, KeyEvent* key) {
                                 app_start_range_selection(state);
                             }
                         }
-                        state->cursor_row++;
+                        state->cursor_row = app_step_row(state, 1);
                         if (key->shift) {
                             app_extend_range_selection(state, state->cursor_row, state->cursor_col);
                         } else if (state->range_selection_active) {
@@ -1338,7 +1538,7 @@ void app_handle_input(AppState* state, KeyEvent* key) {
                                 app_start_range_selection(state);
                             }
                         }
-                        state->cursor_row--;
+                        state->cursor_row = app_step_row(state, -1);
                         if (key->shift) {
                             app_extend_range_selection(state, state->cursor_row, state->cursor_col);
                         } else if (state->range_selection_active) {
@@ -1500,7 +1700,7 @@ void app_handle_input(AppState* state, KeyEvent* key) {
                                 app_start_range_selection(state);
                             }
                         }
-                        state->cursor_row--;
+                        state->cursor_row = app_step_row(state, -1);
                         if (key->shift) {
                             app_extend_range_selection(state, state->cursor_row, state->cursor_col);
                         } else if (state->range_selection_active) {
@@ -1529,7 +1729,7 @@ void app_handle_input(AppState* state, KeyEvent* key) {
                                 app_start_range_selection(state);
                             }
                         }
-                        state->cursor_row++;
+                        state->cursor_row = app_step_row(state, 1);
                         if (key->shift) {
                             app_extend_range_selection(state, state->cursor_row, state->cursor_col);
                         } else if (state->range_selection_active) {
@@ -1538,13 +1738,13 @@ void app_handle_input(AppState* state, KeyEvent* key) {
                     }
                     break;
                 case KEY_PGUP:
-                    state->cursor_row = max(0, state->cursor_row - 10);
+                    state->cursor_row = app_step_row(state, -10);
                     if (state->range_selection_active) {
                         app_cancel_range_selection(state);
                     }
                     break;
                 case KEY_PGDN:
-                    state->cursor_row = min(state->sheet->rows - 1, state->cursor_row + 10);
+                    state->cursor_row = app_step_row(state, 10);
                     if (state->range_selection_active) {
                         app_cancel_range_selection(state);
                     }
@@ -1561,11 +1761,15 @@ void app_handle_input(AppState* state, KeyEvent* key) {
         int visible_rows = state->console->height - 3;
         int visible_cols = (state->console->width - 4) / 10;
         
-        if (state->cursor_row < state->view_top) {
-            state->view_top = state->cursor_row;
-        } else if (state->cursor_row >= state->view_top + visible_rows) {
-            state->view_top = state->cursor_row - visible_rows + 1;
+        // Compare positions in the view so rows hidden by a filter don't count
+        int cursor_index = sheet_view_index(state->sheet, state->cursor_row);
+        int top_index = sheet_view_index(state->sheet, state->view_top);
+        if (cursor_index < top_index) {
+            top_index = cursor_index;
+        } else if (cursor_index >= top_index + visible_rows) {
+            top_index = cursor_index - visible_rows + 1;
         }
+        state->view_top = sheet_view_row(state->sheet, top_index);
         
         if (state->cursor_col < state->view_left) {
             state->view_left = state->cursor_col;
@@ -1600,445 +1804,1029 @@ void app_handle_input(AppState* state, KeyEvent* key) {
 
 // NEW: Undo/Redo system implementation
 void undo_buffer_init(UndoBuffer* buffer) {
-    buffer->current_index = 0;
+    buffer->oldest = NULL;
+    buffer->newest = NULL;
+    buffer->cursor = NULL;
+    buffer->bytes_used = 0;
+    buffer->byte_budget = UNDO_DEFAULT_BUDGET;
     buffer->count = 0;
-    memset(buffer->actions, 0, sizeof(buffer->actions));
+}
+
+void undo_record_free(UndoBuffer* buffer, UndoRecord* record) {
+    buffer->bytes_used -= sizeof(UndoRecord) + record->payload_size;
+    buffer->count--;
+    free(record->payload);
+    sheet_snapshot_free(record->snapshot);
+    structural_change_free(record->structure);
+    row_permutation_free(record->permutation);
+    free(record);
 }
 
 void undo_buffer_cleanup(UndoBuffer* buffer) {
-    for (int i = 0; i < buffer->count; i++) {
-        if (buffer->actions[i].type == UNDO_CELL_CHANGE) {
-            undo_free_cell_data(&buffer->actions[i].data.cell);
-        } else if (buffer->actions[i].type == UNDO_RANGE_CHANGE) {
-            if (buffer->actions[i].data.range.cell_data) {
-                for (int j = 0; j < buffer->actions[i].data.range.cell_count; j++) {
-                    undo_free_cell_data(&buffer->actions[i].data.range.cell_data[j]);
-                }
-                free(buffer->actions[i].data.range.cell_data);
-            }
-        }
-    }
-    buffer->current_index = 0;
+    UndoRecord* record = buffer->oldest;
+    while (record) {
+        UndoRecord* next = record->next;
+        undo_record_free(buffer, record);
+        record = next;
+    }
+    buffer->oldest = NULL;
+    buffer->newest = NULL;
+    buffer->cursor = NULL;
+    buffer->bytes_used = 0;
     buffer->count = 0;
 }
 
-void undo_free_cell_data(CellUndoData* data) {
-    if (data->old_type == CELL_STRING && data->old_data.string) {
-        free(data->old_data.string);
-        data->old_data.string = NULL;
-    }
-    if (data->old_type == CELL_FORMULA) {
-        if (data->old_data.formula.expression) {
-            free(data->old_data.formula.expression);
-            data->old_data.formula.expression = NULL;
-        }
-        if (data->old_data.formula.cached_string) {
-            free(data->old_data.formula.cached_string);
-            data->old_data.formula.cached_string = NULL;
+// Drop oldest records until the log fits its budget. Only undoable records
+// (at or before the cursor) are evicted, and the newest record is always kept
+// so the last edit stays undoable even if it alone is over budget.
+void undo_evict(UndoBuffer* buffer) {
+    while (buffer->bytes_used > buffer->byte_budget && buffer->cursor && buffer->oldest != buffer->newest) {
+        UndoRecord* record = buffer->oldest;
+        buffer->oldest = record->next;
+        buffer->oldest->prev = NULL;
+        if (buffer->cursor == record) {
+            buffer->cursor = NULL;
         }
+        undo_record_free(buffer, record);
     }
-    if (data->new_type == CELL_STRING && data->new_data.string) {
-        free(data->new_data.string);
-        data->new_data.string = NULL;
+}
+
+void undo_set_budget(UndoBuffer* buffer, size_t byte_budget) {
+    buffer->byte_budget = byte_budget;
+    undo_evict(buffer);
+}
+
+// Grow the writer so that at least 'extra' more bytes fit
+int undo_writer_reserve(UndoWriter* writer, size_t extra) {
+    if (writer->size + extra <= writer->capacity) return 1;
+    
+    size_t new_capacity = writer->capacity ? writer->capacity * 2 : 64;
+    while (new_capacity < writer->size + extra) {
+        new_capacity *= 2;
+    }
+    unsigned char* data = (unsigned char*)realloc(writer->data, new_capacity);
+    if (!data) return 0;
+    writer->data = data;
+    writer->capacity = new_capacity;
+    return 1;
+}
+
+void undo_writer_put(UndoWriter* writer, const void* bytes, size_t count) {
+    if (writer->failed) return;
+    if (!undo_writer_reserve(writer, count)) {
+        writer->failed = 1;
+        return;
     }
-    if (data->new_type == CELL_FORMULA) {
-        if (data->new_data.formula.expression) {
-            free(data->new_data.formula.expression);
-            data->new_data.formula.expression = NULL;
-        }
-        if (data->new_data.formula.cached_string) {
-            free(data->new_data.formula.cached_string);
-            data->new_data.formula.cached_string = NULL;
-        }
+    memcpy(writer->data + writer->size, bytes, count);
+    writer->size += count;
+}
+
+void undo_writer_put_byte(UndoWriter* writer, unsigned char value) {
+    undo_writer_put(writer, &value, 1);
+}
+
+void undo_writer_put_string(UndoWriter* writer, const char* str) {
+    unsigned int len = str ? (unsigned int)strlen(str) : 0;
+    undo_writer_put(writer, &len, sizeof(len));
+    if (len) {
+        undo_writer_put(writer, str, len);
     }
 }
 
-void undo_copy_cell_data(Cell* src, CellUndoData* dest) {
-    if (!src) {
-        dest->old_type = CELL_EMPTY;
-        memset(&dest->old_data, 0, sizeof(dest->old_data));
-        dest->old_format = FORMAT_GENERAL;
-        dest->old_format_style = 0;
-        dest->old_text_color = -1;
-        dest->old_background_color = -1;
+// Pack one cell: a kind byte (UNDO_CELL_ABSENT or the CellType), then its
+// formatting bytes and value. Formula results are not stored; they are
+// recomputed after the restore.
+void undo_encode_cell(UndoWriter* writer, Cell* cell) {
+    if (!cell) {
+        undo_writer_put_byte(writer, UNDO_CELL_ABSENT);
         return;
     }
     
-    dest->old_type = src->type;
-    dest->old_format = src->format;
-    dest->old_format_style = src->format_style;
-    dest->old_text_color = src->text_color;
-    dest->old_background_color = src->background_color;
+    undo_writer_put_byte(writer, (unsigned char)cell->type);
+    undo_writer_put_byte(writer, (unsigned char)cell->format);
+    undo_writer_put_byte(writer, (unsigned char)cell->format_style);
+    undo_writer_put_byte(writer, (unsigned char)cell->align);
+    undo_writer_put_byte(writer, (unsigned char)(signed char)cell->text_color);
+    undo_writer_put_byte(writer, (unsigned char)(signed char)cell->background_color);
     
-    switch (src->type) {
-        case CELL_EMPTY:
-            memset(&dest->old_data, 0, sizeof(dest->old_data));
+    switch (cell->type) {
+        case CELL_NUMBER:
+            undo_writer_put(writer, &cell->data.number, sizeof(double));
+            break;
+        case CELL_STRING:
+            undo_writer_put_string(writer, cell->data.string);
             break;
+        case CELL_FORMULA:
+            undo_writer_put_string(writer, cell->data.formula.expression);
+            break;
+        default:
+            break;
+    }
+}
+
+// Unpack one cell written by undo_encode_cell into (row, col), replacing
+// whatever is there. Returns the position just past the packed cell.
+const unsigned char* undo_restore_cell(AppState* state, const unsigned char* p, int row, int col) {
+    unsigned char kind = *p++;
+    
+    sheet_touch_cell(state->sheet, row, col);    
+    if (kind == UNDO_CELL_ABSENT) {
+        Cell* existing = sheet_get_cell(state->sheet, row, col);
+        if (existing) {
+            cell_free(existing);
+            state->sheet->cells[row][col] = NULL;
+            state->sheet->needs_recalc = 1;
+        }
+        return p;
+    }
+    
+    Cell* cell = sheet_get_or_create_cell(state->sheet, row, col);
+    DataFormat format = (DataFormat)p[0];
+    FormatStyle style = (FormatStyle)p[1];
+    int align = p[2];
+    int text_color = (signed char)p[3];
+    int background_color = (signed char)p[4];
+    p += 5;
+    
+    double number = 0.0;
+    char* text = NULL;
+    unsigned int len = 0;
+    switch ((CellType)kind) {
         case CELL_NUMBER:
-            dest->old_data.number = src->data.number;
+            memcpy(&number, p, sizeof(double));
+            p += sizeof(double);
             break;
         case CELL_STRING:
-            if (src->data.string) {
-                dest->old_data.string = _strdup(src->data.string);
-            } else {
-                dest->old_data.string = NULL;
+        case CELL_FORMULA:
+            memcpy(&len, p, sizeof(len));
+            p += sizeof(len);
+            text = (char*)malloc(len + 1);
+            if (text) {
+                memcpy(text, p, len);
+                text[len] = '\0';
             }
+            p += len;
+            break;
+        default:
+            break;
+    }
+    
+    if (!cell) {
+        free(text);
+        return p;
+    }
+    
+    switch ((CellType)kind) {
+        case CELL_NUMBER:
+            cell_set_number(cell, number);
+            break;
+        case CELL_STRING:
+            cell_set_string(cell, text ? text : "");
             break;
         case CELL_FORMULA:
-            if (src->data.formula.expression) {
-                dest->old_data.formula.expression = _strdup(src->data.formula.expression);
-            } else {
-                dest->old_data.formula.expression = NULL;
-            }
-            dest->old_data.formula.cached_value = src->data.formula.cached_value;
-            if (src->data.formula.cached_string) {
-                dest->old_data.formula.cached_string = _strdup(src->data.formula.cached_string);
-            } else {
-                dest->old_data.formula.cached_string = NULL;
-            }
-            dest->old_data.formula.is_string_result = src->data.formula.is_string_result;
-            dest->old_data.formula.error = src->data.formula.error;
+            cell_set_formula(cell, text ? text : "");
             break;
         default:
-            memset(&dest->old_data, 0, sizeof(dest->old_data));
+            cell_clear(cell);
             break;
     }
+    free(text);
+    
+    // Restore formatting last so setters' defaults (e.g. string alignment) don't win
+    cell_set_format(cell, format, style);
+    cell->align = align;
+    cell_set_text_color(cell, text_color);
+    cell_set_background_color(cell, background_color);
+    state->sheet->needs_recalc = 1;
+    return p;
+}
+
+// Drop a payload that could not be written in full
+int undo_writer_finish(UndoWriter* writer) {
+    if (!writer->failed) return 1;
+    free(writer->data);
+    writer->data = NULL;
+    writer->size = 0;
+    writer->capacity = 0;
+    return 0;
+}
+
+// Pack the current contents of a rectangle. Header is the (clipped) rectangle
+// followed by one packed cell per position in row-major order. Returns 0,
+// with nothing left in the writer, if the payload did not fit in memory.
+int undo_encode_range(AppState* state, UndoWriter* writer, int start_row, int start_col, int end_row, int end_col) {
+    Sheet* sheet = state->sheet;
+    int rect[4];
+    rect[0] = max(0, min(start_row, end_row));
+    rect[1] = max(0, min(start_col, end_col));
+    rect[2] = min(sheet->rows - 1, max(start_row, end_row));
+    rect[3] = min(sheet->cols - 1, max(start_col, end_col));
+    if (rect[0] > rect[2] || rect[1] > rect[3]) return 0;
+    
+    undo_writer_put(writer, rect, sizeof(rect));
+    for (int row = rect[0]; row <= rect[2]; row++) {
+        for (int col = rect[1]; col <= rect[3]; col++) {
+            undo_encode_cell(writer, sheet->cells[row][col]);
+        }
+    }
+    return undo_writer_finish(writer);
+}
+
+// Link a record into the log as the newest entry. Any redo history beyond
+// the cursor is discarded first. Takes ownership of the record's payload.
+UndoRecord* undo_link(AppState* state, UndoType type, unsigned char* payload, RangeSnapshot* snapshot, size_t size, const char* description) {
+    UndoBuffer* buffer = &state->undo_buffer;
+    
+    UndoRecord* discard = buffer->cursor ? buffer->cursor->next : buffer->oldest;
+    while (discard) {
+        UndoRecord* next = discard->next;
+        undo_record_free(buffer, discard);
+        discard = next;
+    }
+    buffer->newest = buffer->cursor;
+    if (buffer->newest) {
+        buffer->newest->next = NULL;
+    } else {
+        buffer->oldest = NULL;
+    }
+    
+    UndoRecord* record = (UndoRecord*)calloc(1, sizeof(UndoRecord));
+    if (!record) {
+        free(payload);
+        sheet_snapshot_free(snapshot);
+        return NULL;
+    }
+    
+    record->type = type;
+    record->payload = payload;
+    record->snapshot = snapshot;
+    record->payload_size = size;
+    strncpy_s(record->description, sizeof(record->description), description, _TRUNCATE);
+    
+    record->prev = buffer->newest;
+    if (buffer->newest) {
+        buffer->newest->next = record;
+    } else {
+        buffer->oldest = record;
+    }
+    buffer->newest = record;
+    buffer->cursor = record;
+    buffer->bytes_used += sizeof(UndoRecord) + record->payload_size;
+    buffer->count++;
+    
+    undo_evict(buffer);
+    return record;
+}
+
+void undo_append(AppState* state, UndoType type, UndoWriter* writer, const char* description) {
+    undo_link(state, type, writer->data, NULL, writer->size, description);
 }
 
 void undo_save_cell_state(AppState* state, int row, int col, const char* description) {
+    UndoWriter writer = {0};
+    if (!undo_encode_range(state, &writer, row, col, row, col)) return;
+    undo_append(state, UNDO_CELL_CHANGE, &writer, description);
+}
+
+void undo_save_range_state(AppState* state, int start_row, int start_col, int end_row, int end_col, const char* description) {
+    UndoWriter writer = {0};
+    if (!undo_encode_range(state, &writer, start_row, start_col, end_row, end_col)) return;
+    undo_append(state, UNDO_RANGE_CHANGE, &writer, description);
+}
+
+// Returns 0 if the record could not be written
+int undo_save_resize_state(AppState* state, int index, int old_size, int new_size, UndoType type, const char* description) {
+    (void)new_size;  // The new size is read back from the sheet when undoing
+    int packed[2] = { index, old_size };
+    UndoWriter writer = {0};
+    undo_writer_put(&writer, packed, sizeof(packed));
+    if (!undo_writer_finish(&writer)) return 0;
+    undo_append(state, type, &writer, description);
+    return 1;
+}
+
+// Capture a range by snapshot before a bulk edit. SNAPSHOT_CELLS takes the
+// cells out of the grid by reference (see sheet_snapshot_range), so the
+// caller must be about to overwrite every value in the range.
+void undo_snapshot_range(AppState* state, SnapshotKind kind, int start_row, int start_col, int end_row, int end_col, const char* description) {
+    RangeSnapshot* snapshot = sheet_snapshot_range(state->sheet, kind, start_row, start_col, end_row, end_col);
+    if (!snapshot) return;
+    UndoType type = kind == SNAPSHOT_FORMAT ? UNDO_FORMAT_CHANGE : UNDO_RANGE_CHANGE;
+    undo_link(state, type, NULL, snapshot, sheet_snapshot_bytes(snapshot), description);
+}
+
+// Exchange a record's payload with the sheet's current state. The same
+// operation serves both undo and redo: afterwards the payload holds what was
+// just replaced.
+void undo_swap_record(AppState* state, UndoRecord* record) {
     UndoBuffer* buffer = &state->undo_buffer;
+    UndoWriter writer = {0};
     
-    // If we're not at the end of the buffer, we need to discard future actions
-    if (buffer->current_index < buffer->count) {
-        // Free memory for discarded actions
-        for (int i = buffer->current_index; i < buffer->count; i++) {
-            if (buffer->actions[i].type == UNDO_CELL_CHANGE) {
-                undo_free_cell_data(&buffer->actions[i].data.cell);
-            } else if (buffer->actions[i].type == UNDO_RANGE_CHANGE) {
-                if (buffer->actions[i].data.range.cell_data) {
-                    for (int j = 0; j < buffer->actions[i].data.range.cell_count; j++) {
-                        undo_free_cell_data(&buffer->actions[i].data.range.cell_data[j]);
-                    }
-                    free(buffer->actions[i].data.range.cell_data);
-                }
-            }
+    if (record->snapshot) {
+        sheet_snapshot_swap(state->sheet, record->snapshot);
+        size_t size = sheet_snapshot_bytes(record->snapshot);
+        buffer->bytes_used = buffer->bytes_used - record->payload_size + size;
+        record->payload_size = size;
+        return;
+    }
+    
+    if (record->structure) {
+        // Undo reverts the change; redo applies it again
+        StructuralChange* change = record->structure;
+        if (change->applied) {
+            sheet_revert_structural(state->sheet, change);
+        } else {
+            sheet_apply_structural(state->sheet, change);
         }
-        buffer->count = buffer->current_index;
+        size_t size = structural_change_bytes(change);
+        buffer->bytes_used = buffer->bytes_used - record->payload_size + size;
+        record->payload_size = size;
+        return;
     }
     
-    // Check if buffer is full
-    if (buffer->count >= MAX_UNDO_ACTIONS) {
-        // Free the oldest action
-        if (buffer->actions[0].type == UNDO_CELL_CHANGE) {
-            undo_free_cell_data(&buffer->actions[0].data.cell);
-        } else if (buffer->actions[0].type == UNDO_RANGE_CHANGE) {
-            if (buffer->actions[0].data.range.cell_data) {
-                for (int j = 0; j < buffer->actions[0].data.range.cell_count; j++) {
-                    undo_free_cell_data(&buffer->actions[0].data.range.cell_data[j]);
+    if (record->permutation) {
+        RowPermutation* permutation = record->permutation;
+        if (permutation->applied) {
+            sheet_revert_permutation(state->sheet, permutation);
+        } else {
+            sheet_apply_permutation(state->sheet, permutation);
+        }
+        size_t size = row_permutation_bytes(permutation);
+        buffer->bytes_used = buffer->bytes_used - record->payload_size + size;
+        record->payload_size = size;
+        return;
+    }
+    
+    switch (record->type) {
+        case UNDO_RESIZE_COLUMN:
+        case UNDO_RESIZE_ROW: {
+            int packed[2];
+            memcpy(packed, record->payload, sizeof(packed));
+            int current;
+            if (record->type == UNDO_RESIZE_COLUMN) {
+                current = sheet_get_column_width(state->sheet, packed[0]);
+                sheet_set_column_width(state->sheet, packed[0], packed[1]);
+            } else {
+                current = sheet_get_row_height(state->sheet, packed[0]);
+                sheet_set_row_height(state->sheet, packed[0], packed[1]);
+            }
+            packed[1] = current;
+            memcpy(record->payload, packed, sizeof(packed));
+            return;
+        }
+        default: {
+            int rect[4];
+            memcpy(rect, record->payload, sizeof(rect));
+            if (!undo_encode_range(state, &writer, rect[0], rect[1], rect[2], rect[3])) return;
+            
+            const unsigned char* p = record->payload + sizeof(rect);
+            for (int row = rect[0]; row <= rect[2]; row++) {
+                for (int col = rect[1]; col <= rect[3]; col++) {
+                    p = undo_restore_cell(state, p, row, col);
                 }
-                free(buffer->actions[0].data.range.cell_data);
             }
+            break;
         }
-        // Shift all actions down
-        memmove(&buffer->actions[0], &buffer->actions[1], 
-                sizeof(UndoAction) * (MAX_UNDO_ACTIONS - 1));
-        buffer->count--;
-        buffer->current_index--;
     }
     
-    // Create new undo action
-    UndoAction* action = &buffer->actions[buffer->count];
-    action->type = UNDO_CELL_CHANGE;
-    action->data.cell.row = row;
-    action->data.cell.col = col;
+    buffer->bytes_used = buffer->bytes_used - record->payload_size + writer.size;
+    free(record->payload);
+    record->payload = writer.data;
+    record->payload_size = writer.size;
+}
+
+// Commit the sheet's open batch and record everything it touched as one undo
+// step. Returns 0, with the status message set, if the batch ran out of memory
+// for its journal: the edit stands but cannot be undone.
+int app_commit_batch(AppState* state, const char* description) {
+    int failed = 0;
+    RangeSnapshot* journal = sheet_commit_batch(state->sheet, &failed);
+    if (failed) {
+        sprintf_s(state->status_message, sizeof(state->status_message),
+                 "%s done, but out of memory: it cannot be undone", description);
+        return 0;
+    }
+    if (journal) {
+        undo_link(state, UNDO_RANGE_CHANGE, NULL, journal, sheet_snapshot_bytes(journal), description);
+    }
+    return 1;
+}
+
+// Insert or delete rows/columns at the selection (or 'count' at the cursor)
+// and record the change as one undo step
+void app_structural_edit(AppState* state, int on_rows, int deleting, int count) {
+    int min_row, min_col, max_row, max_col;
+    int at;
+    if (app_get_selection_bounds(state, &min_row, &min_col, &max_row, &max_col)) {
+        at = on_rows ? min_row : min_col;
+        count = on_rows ? max_row - min_row + 1 : max_col - min_col + 1;
+    } else {
+        at = on_rows ? state->cursor_row : state->cursor_col;
+    }
+    
+    const char* what = on_rows ? (count == 1 ? "row" : "rows") : (count == 1 ? "column" : "columns");
+    int limit = on_rows ? state->sheet->rows : state->sheet->cols;
+    if (count <= 0 || at + count > limit) {
+        sprintf_s(state->status_message, sizeof(state->status_message),
+                 "Cannot %s %d %s here", deleting ? "delete" : "insert", count, what);
+        return;
+    }
     
-    // Save current cell state
-    Cell* cell = sheet_get_cell(state->sheet, row, col);
-    undo_copy_cell_data(cell, &action->data.cell);
+    StructuralChange* change = structural_change_new(on_rows, at, count, deleting);
+    if (!change) return;
+    if (!sheet_apply_structural(state->sheet, change)) {
+        structural_change_free(change);
+        sprintf_s(state->status_message, sizeof(state->status_message),
+                 deleting ? "Cannot delete %s" : "Cannot insert %s: data would be pushed off the sheet", what);
+        return;
+    }
     
-    // Copy description
-    strncpy_s(action->description, sizeof(action->description), description, _TRUNCATE);
-      buffer->count++;
-    buffer->current_index = buffer->count;
+    char description[64];
+    sprintf_s(description, sizeof(description), "%s %d %s", deleting ? "Delete" : "Insert", count, what);
+    UndoRecord* record = undo_link(state, UNDO_STRUCTURE, NULL, NULL, structural_change_bytes(change), description);
+    if (record) {
+        record->structure = change;
+    } else {
+        structural_change_free(change);
+    }
+    
+    app_cancel_range_selection(state);
+    sprintf_s(state->status_message, sizeof(state->status_message), "%sed %d %s",
+             deleting ? "Delet" : "Insert", count, what);
 }
 
-void undo_save_range_state(AppState* state, int start_row, int start_col, int end_row, int end_col, const char* description) {
-    UndoBuffer* buffer = &state->undo_buffer;
+// Sort the selection, or the used range when nothing is selected, by the
+// key columns in args ("B desc A" = column B descending, then A ascending)
+void app_sort(AppState* state, const char* args) {
+    Sheet* sheet = state->sheet;
+    SortKey keys[8];
+    int key_count = 0;
+    
+    char token[16];
+    int used = 0;
+    while (sscanf_s(args, "%15s%n", token, (unsigned)sizeof(token), &used) == 1) {
+        args += used;
+        if (_stricmp(token, "asc") == 0 || _stricmp(token, "desc") == 0) {
+            if (key_count == 0) break;
+            keys[key_count - 1].descending = _stricmp(token, "desc") == 0;
+            continue;
+        }
+        
+        int col = 0;
+        int letters = 0;
+        while (isalpha((unsigned char)token[letters])) {
+            col = col * 26 + (toupper((unsigned char)token[letters]) - 'A' + 1);
+            letters++;
+        }
+        if (letters == 0 || letters > 3 || token[letters] != '\0' || col > sheet->cols || key_count == 8) {
+            strcpy_s(state->status_message, sizeof(state->status_message),
+                    "Usage: sort [column [asc|desc]]... (e.g. sort B desc A)");
+            return;
+        }
+        keys[key_count].col = col - 1;
+        keys[key_count].descending = 0;
+        key_count++;
+    }
     
-    // Calculate the number of cells in the range
-    int cell_count = (end_row - start_row + 1) * (end_col - start_col + 1);
-    
-    // If we're not at the end of the buffer, discard future actions
-    if (buffer->current_index < buffer->count) {
-        for (int i = buffer->current_index; i < buffer->count; i++) {
-            if (buffer->actions[i].type == UNDO_CELL_CHANGE) {
-                undo_free_cell_data(&buffer->actions[i].data.cell);
-            } else if (buffer->actions[i].type == UNDO_RANGE_CHANGE) {
-                if (buffer->actions[i].data.range.cell_data) {
-                    for (int j = 0; j < buffer->actions[i].data.range.cell_count; j++) {
-                        undo_free_cell_data(&buffer->actions[i].data.range.cell_data[j]);
-                    }
-                    free(buffer->actions[i].data.range.cell_data);
-                }
-            }
+    int min_row, min_col, max_row, max_col;
+    int whole_rows = 0;
+    if (!app_get_selection_bounds(state, &min_row, &min_col, &max_row, &max_col)) {
+        // The used range spans every column with data, so whole rows can move
+        if (!sheet_used_range(sheet, &min_row, &min_col, &max_row, &max_col)) {
+            strcpy_s(state->status_message, sizeof(state->status_message), "Nothing to sort");
+            return;
         }
-        buffer->count = buffer->current_index;
+        whole_rows = 1;
     }
     
-    // Check if buffer is full
-    if (buffer->count >= MAX_UNDO_ACTIONS) {
-        if (buffer->actions[0].type == UNDO_CELL_CHANGE) {
-            undo_free_cell_data(&buffer->actions[0].data.cell);
-        } else if (buffer->actions[0].type == UNDO_RANGE_CHANGE) {
-            if (buffer->actions[0].data.range.cell_data) {
-                for (int j = 0; j < buffer->actions[0].data.range.cell_count; j++) {
-                    undo_free_cell_data(&buffer->actions[0].data.range.cell_data[j]);
-                }
-                free(buffer->actions[0].data.range.cell_data);
-            }
+    if (key_count == 0) {
+        keys[0].col = min_col;
+        keys[0].descending = 0;
+        key_count = 1;
+    }
+    for (int k = 0; k < key_count; k++) {
+        if (keys[k].col < min_col || keys[k].col > max_col) {
+            strcpy_s(state->status_message, sizeof(state->status_message), "Sort column is outside the range");
+            return;
         }
-        memmove(&buffer->actions[0], &buffer->actions[1], 
-                sizeof(UndoAction) * (MAX_UNDO_ACTIONS - 1));
-        buffer->count--;
-        buffer->current_index--;
-    }
-    
-    // Create new undo action
-    UndoAction* action = &buffer->actions[buffer->count];
-    action->type = UNDO_RANGE_CHANGE;
-    action->data.range.start_row = start_row;
-    action->data.range.start_col = start_col;
-    action->data.range.end_row = end_row;
-    action->data.range.end_col = end_col;
-    action->data.range.cell_count = cell_count;
-    
-    // Allocate memory for cell data
-    action->data.range.cell_data = (CellUndoData*)malloc(sizeof(CellUndoData) * cell_count);
-    if (!action->data.range.cell_data) {
-        return; // Failed to allocate memory
-    }
-    
-    // Save state for each cell in the range
-    int index = 0;
-    for (int row = start_row; row <= end_row; row++) {
-        for (int col = start_col; col <= end_col; col++) {
-            action->data.range.cell_data[index].row = row;
-            action->data.range.cell_data[index].col = col;
-            
-            Cell* cell = sheet_get_cell(state->sheet, row, col);
-            undo_copy_cell_data(cell, &action->data.range.cell_data[index]);
-            index++;
+    }
+    
+    // Without a selection, keep a header row in place: text over a number
+    if (whole_rows && max_row > min_row) {
+        Cell* top = sheet->cells[min_row][keys[0].col];
+        Cell* next = sheet->cells[min_row + 1][keys[0].col];
+        if (top && top->type == CELL_STRING && next &&
+            (next->type == CELL_NUMBER || (next->type == CELL_FORMULA && !next->data.formula.is_string_result))) {
+            min_row++;
         }
     }
     
-    // Copy description
-    strncpy_s(action->description, sizeof(action->description), description, _TRUNCATE);
+    RowPermutation* permutation = sheet_sort_range(sheet, min_row, min_col, max_row, max_col,
+                                                   whole_rows, keys, key_count);
+    if (!permutation) {
+        strcpy_s(state->status_message, sizeof(state->status_message), "Sort failed");
+        return;
+    }
+    
+    UndoRecord* record = undo_link(state, UNDO_SORT, NULL, NULL, row_permutation_bytes(permutation), "Sort");
+    if (record) {
+        record->permutation = permutation;
+    } else {
+        row_permutation_free(permutation);
+    }
     
-    buffer->count++;
-    buffer->current_index = buffer->count;
+    sprintf_s(state->status_message, sizeof(state->status_message), "Sorted %d rows by %d key%s",
+             max_row - min_row + 1, key_count, key_count == 1 ? "" : "s");
+}
+
+// Row 'delta' rows away from the cursor in the current view (rows hidden
+// by a filter are skipped), clamped to the first and last shown rows
+int app_step_row(AppState* state, int delta) {
+    int index = sheet_view_index(state->sheet, state->cursor_row) + delta;
+    int count = sheet_view_count(state->sheet);
+    if (index >= count) index = count - 1;
+    if (index < 0) index = 0;
+    return sheet_view_row(state->sheet, index);
 }
 
-void undo_restore_cell_data(AppState* state, CellUndoData* src, int row, int col) {
-    // Clear the current cell first
-    sheet_clear_cell(state->sheet, row, col);
+// Add a filter predicate ("B > 10", "A contains foo", "C between 1 5",
+// "B top 10") or remove the filter ("off")
+void app_filter(AppState* state, const char* args) {
+    Sheet* sheet = state->sheet;
+    while (*args == ' ') args++;
+    
+    if (*args == '\0') {
+        if (sheet->filter) {
+            sprintf_s(state->status_message, sizeof(state->status_message),
+                     "Filter: %d predicate%s, %d of %d rows match", sheet->filter->predicate_count,
+                     sheet->filter->predicate_count == 1 ? "" : "s", sheet->filter->matched,
+                     sheet->filter->end_row - sheet->filter->start_row + 1);
+        } else {
+            strcpy_s(state->status_message, sizeof(state->status_message),
+                    "Usage: filter <col> <op> <value> | filter off (ops: = != < <= > >= contains between top bottom)");
+        }
+        return;
+    }
+    if (_stricmp(args, "off") == 0) {
+        sheet_filter_clear(sheet);
+        strcpy_s(state->status_message, sizeof(state->status_message), "Filter removed");
+        return;
+    }
     
-    if (src->old_type == CELL_EMPTY) {
-        return;  // Cell should remain empty
+    char col_str[16] = "";
+    char op[16] = "";
+    int used = 0;
+    if (sscanf_s(args, "%15s %15s %n", col_str, (unsigned)sizeof(col_str), op, (unsigned)sizeof(op), &used) < 2 || used == 0) {
+        strcpy_s(state->status_message, sizeof(state->status_message), "Usage: filter <col> <op> <value>");
+        return;
     }
+    const char* value = args + used;
     
-    // Get or create cell
-    Cell* cell = sheet_get_or_create_cell(state->sheet, row, col);
-    if (!cell) return;
+    FilterPredicate predicate;
+    memset(&predicate, 0, sizeof(predicate));
+    int row, col;
+    char ref[24];
+    sprintf_s(ref, sizeof(ref), "%s1", col_str);
+    if (!parse_cell_reference(ref, &row, &col) || col >= sheet->cols) {
+        sprintf_s(state->status_message, sizeof(state->status_message), "Invalid column: %s", col_str);
+        return;
+    }
+    predicate.col = col;
+    
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) predicate.op = FILTER_EQ;
+    else if (strcmp(op, "!=") == 0 || strcmp(op, "<>") == 0) predicate.op = FILTER_NE;
+    else if (strcmp(op, "<") == 0) predicate.op = FILTER_LT;
+    else if (strcmp(op, "<=") == 0) predicate.op = FILTER_LE;
+    else if (strcmp(op, ">") == 0) predicate.op = FILTER_GT;
+    else if (strcmp(op, ">=") == 0) predicate.op = FILTER_GE;
+    else if (_stricmp(op, "contains") == 0) predicate.op = FILTER_CONTAINS;
+    else if (_stricmp(op, "between") == 0) predicate.op = FILTER_BETWEEN;
+    else if (_stricmp(op, "top") == 0) predicate.op = FILTER_TOP;
+    else if (_stricmp(op, "bottom") == 0) predicate.op = FILTER_BOTTOM;
+    else {
+        sprintf_s(state->status_message, sizeof(state->status_message), "Unknown filter operator: %s", op);
+        return;
+    }
     
-    // Restore cell data
-    switch (src->old_type) {
-        case CELL_NUMBER:
-            cell_set_number(cell, src->old_data.number);
-            break;
-        case CELL_STRING:
-            if (src->old_data.string) {
-                cell_set_string(cell, src->old_data.string);
-            }
-            break;
-        case CELL_FORMULA:
-            if (src->old_data.formula.expression) {
-                cell_set_formula(cell, src->old_data.formula.expression);
+    char* endptr;
+    predicate.low = strtod(value, &endptr);
+    int numeric = endptr != value;
+    while (*endptr == ' ') endptr++;
+    if (predicate.op == FILTER_BETWEEN) {
+        const char* second = endptr;
+        predicate.high = strtod(second, &endptr);
+        numeric = numeric && endptr != second;
+        if (predicate.low > predicate.high) {
+            double swap = predicate.low;
+            predicate.low = predicate.high;
+            predicate.high = swap;
+        }
+    } else if (*endptr != '\0') {
+        numeric = 0;
+    }
+    
+    if (predicate.op == FILTER_CONTAINS ||
+        (!numeric && (predicate.op == FILTER_EQ || predicate.op == FILTER_NE))) {
+        predicate.is_text = 1;
+        predicate.text = (char*)value;
+    } else if (!numeric) {
+        sprintf_s(state->status_message, sizeof(state->status_message), "Filter %s needs a number", op);
+        return;
+    }
+    
+    // The first predicate fixes the filtered range: the selection, or the
+    // used range below a header row of text
+    int start_row = 0, end_row = 0;
+    if (!sheet->filter) {
+        int min_row, min_col, max_row, max_col;
+        if (app_get_selection_bounds(state, &min_row, &min_col, &max_row, &max_col)) {
+            app_cancel_range_selection(state);
+        } else if (sheet_used_range(sheet, &min_row, &min_col, &max_row, &max_col)) {
+            int header = max_row > min_row;
+            for (int c = min_col; c <= max_col && header; c++) {
+                Cell* cell = sheet->cells[min_row][c];
+                if (cell && cell->type != CELL_STRING) header = 0;
             }
-            break;
-        default:
-            break;
+            if (header) min_row++;
+        } else {
+            strcpy_s(state->status_message, sizeof(state->status_message), "Nothing to filter");
+            return;
+        }
+        start_row = min_row;
+        end_row = max_row;
     }
     
-    // Restore formatting
-    cell_set_format(cell, src->old_format, src->old_format_style);
-    cell_set_text_color(cell, src->old_text_color);
-    cell_set_background_color(cell, src->old_background_color);
+    if (!sheet_filter_add(sheet, &predicate, start_row, end_row)) {
+        strcpy_s(state->status_message, sizeof(state->status_message), "Could not apply filter");
+        return;
+    }
+    
+    // Keep the cursor and the top of the screen on shown rows
+    state->cursor_row = sheet_view_row(sheet, sheet_view_index(sheet, state->cursor_row));
+    state->view_top = sheet_view_row(sheet, sheet_view_index(sheet, state->view_top));
+    
+    sprintf_s(state->status_message, sizeof(state->status_message), "Filter: %d of %d rows match",
+             sheet->filter->matched, sheet->filter->end_row - sheet->filter->start_row + 1);
 }
 
-void undo_perform(AppState* state) {
-    UndoBuffer* buffer = &state->undo_buffer;
+// Parse a comma-separated list of column letters ("A" or "A,C") into
+// cols[0..max_cols). Returns how many were read, or 0 if the list is invalid.
+int app_parse_columns(Sheet* sheet, const char* text, int* cols, int max_cols) {
+    int count = 0;
+    while (*text) {
+        int col = 0;
+        int letters = 0;
+        while (isalpha((unsigned char)text[letters])) {
+            col = col * 26 + (toupper((unsigned char)text[letters]) - 'A' + 1);
+            letters++;
+        }
+        if (letters == 0 || letters > 3 || col > sheet->cols || count == max_cols) return 0;
+        cols[count++] = col - 1;
+        text += letters;
+        if (*text == ',') {
+            text++;
+            if (*text == '\0') return 0;
+        } else if (*text != '\0') {
+            return 0;
+        }
+    }
+    return count;
+}
+
+// Group the selection (or the used range) by key columns and write the
+// SUM/COUNT/AVG/MIN/MAX of the value columns per group to a new area:
+// "pivot A C,D [sum,avg] [@H1]"
+void app_pivot(AppState* state, const char* args) {
+    static const struct { const char* name; PivotFunc func; const char* label; } funcs[] = {
+        { "sum", PIVOT_SUM, "Sum" },
+        { "count", PIVOT_COUNT, "Count" },
+        { "avg", PIVOT_AVG, "Average" },
+        { "min", PIVOT_MIN, "Min" },
+        { "max", PIVOT_MAX, "Max" }
+    };
+    const int func_total = (int)(sizeof(funcs) / sizeof(funcs[0]));
+    Sheet* sheet = state->sheet;
+    const char* usage = "Usage: pivot <key cols> <value cols> [sum,count,avg,min,max] [@cell] (e.g. pivot A C,D)";
+    
+    char key_str[64] = "";
+    char value_str[64] = "";
+    char token[64];
+    int used = 0;
+    if (sscanf_s(args, "%63s %63s%n", key_str, (unsigned)sizeof(key_str),
+                 value_str, (unsigned)sizeof(value_str), &used) < 2 || used == 0) {
+        strcpy_s(state->status_message, sizeof(state->status_message), usage);
+        return;
+    }
+    args += used;
     
-    if (buffer->current_index == 0) {
-        strcpy_s(state->status_message, sizeof(state->status_message), "Nothing to undo");
+    PivotTable pivot;
+    memset(&pivot, 0, sizeof(pivot));
+    pivot.key_count = app_parse_columns(sheet, key_str, pivot.key_cols, PIVOT_MAX_KEYS);
+    pivot.value_count = app_parse_columns(sheet, value_str, pivot.value_cols, PIVOT_MAX_VALUES);
+    if (pivot.key_count == 0 || pivot.value_count == 0) {
+        strcpy_s(state->status_message, sizeof(state->status_message), usage);
         return;
     }
     
-    buffer->current_index--;
-    UndoAction* action = &buffer->actions[buffer->current_index];
+    int func_mask = 0;
+    int dest_row = -1, dest_col = -1;
+    while (sscanf_s(args, "%63s%n", token, (unsigned)sizeof(token), &used) == 1) {
+        args += used;
+        if (token[0] == '@') {
+            if (!parse_cell_reference(token + 1, &dest_row, &dest_col) ||
+                dest_row >= sheet->rows || dest_col >= sheet->cols) {
+                sprintf_s(state->status_message, sizeof(state->status_message), "Invalid destination: %s", token + 1);
+                return;
+            }
+            continue;
+        }
+        char* context = NULL;
+        for (char* name = strtok_s(token, ",", &context); name; name = strtok_s(NULL, ",", &context)) {
+            int f = 0;
+            while (f < func_total && _stricmp(name, funcs[f].name) != 0) f++;
+            if (f == func_total) {
+                sprintf_s(state->status_message, sizeof(state->status_message), "Unknown pivot function: %s", name);
+                return;
+            }
+            func_mask |= funcs[f].func;
+        }
+    }
+    if (func_mask == 0) func_mask = PIVOT_SUM | PIVOT_COUNT | PIVOT_AVG | PIVOT_MIN | PIVOT_MAX;
     
-    switch (action->type) {
-        case UNDO_CELL_CHANGE:
-            // Save current state for redo before restoring old state
-            Cell* cell = sheet_get_cell(state->sheet, action->data.cell.row, action->data.cell.col);
-            
-            // Save current state as new state for potential redo
-            if (cell) {
-                action->data.cell.new_type = cell->type;
-                action->data.cell.new_format = cell->format;
-                action->data.cell.new_format_style = cell->format_style;
-                action->data.cell.new_text_color = cell->text_color;
-                action->data.cell.new_background_color = cell->background_color;
-                
-                switch (cell->type) {
-                    case CELL_NUMBER:
-                        action->data.cell.new_data.number = cell->data.number;
-                        break;
-                    case CELL_STRING:
-                        if (action->data.cell.new_data.string) {
-                            free(action->data.cell.new_data.string);
-                        }
-                        action->data.cell.new_data.string = cell->data.string ? _strdup(cell->data.string) : NULL;
-                        break;
-                    case CELL_FORMULA:
-                        if (action->data.cell.new_data.formula.expression) {
-                            free(action->data.cell.new_data.formula.expression);
-                        }
-                        if (action->data.cell.new_data.formula.cached_string) {
-                            free(action->data.cell.new_data.formula.cached_string);
-                        }
-                        action->data.cell.new_data.formula.expression = cell->data.formula.expression ? _strdup(cell->data.formula.expression) : NULL;
-                        action->data.cell.new_data.formula.cached_value = cell->data.formula.cached_value;
-                        action->data.cell.new_data.formula.cached_string = cell->data.formula.cached_string ? _strdup(cell->data.formula.cached_string) : NULL;
-                        action->data.cell.new_data.formula.is_string_result = cell->data.formula.is_string_result;
-                        action->data.cell.new_data.formula.error = cell->data.formula.error;
-                        break;
-                    default:
-                        memset(&action->data.cell.new_data, 0, sizeof(action->data.cell.new_data));
-                        break;
-                }
-            } else {
-                action->data.cell.new_type = CELL_EMPTY;
-                action->data.cell.new_format = FORMAT_GENERAL;
-                action->data.cell.new_format_style = 0;
-                action->data.cell.new_text_color = -1;
-                action->data.cell.new_background_color = -1;
-                memset(&action->data.cell.new_data, 0, sizeof(action->data.cell.new_data));
+    // Source: the selection, or the used range; a first row of text is the header
+    int min_row, min_col, max_row, max_col;
+    if (app_get_selection_bounds(state, &min_row, &min_col, &max_row, &max_col)) {
+        app_cancel_range_selection(state);
+    } else if (!sheet_used_range(sheet, &min_row, &min_col, &max_row, &max_col)) {
+        strcpy_s(state->status_message, sizeof(state->status_message), "Nothing to pivot");
+        return;
+    }
+    for (int k = 0; k < pivot.key_count + pivot.value_count; k++) {
+        int col = k < pivot.key_count ? pivot.key_cols[k] : pivot.value_cols[k - pivot.key_count];
+        if (col < min_col || col > max_col) {
+            strcpy_s(state->status_message, sizeof(state->status_message), "Pivot column is outside the range");
+            return;
+        }
+    }
+    int header = max_row > min_row;
+    for (int c = min_col; c <= max_col && header; c++) {
+        Cell* cell = sheet->cells[min_row][c];
+        if (cell && cell->type != CELL_STRING) header = 0;
+    }
+    pivot.start_row = header ? min_row + 1 : min_row;
+    pivot.end_row = max_row;
+    
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+    if (!sheet_pivot(sheet, &pivot)) {
+        strcpy_s(state->status_message, sizeof(state->status_message), "Pivot failed: out of memory");
+        return;
+    }
+    QueryPerformanceCounter(&end);
+    
+    // Output: a header row, then one row per group. By default it goes two
+    // columns right of everything in use, level with the top of the source.
+    int func_count = 0;
+    for (int f = 0; f < func_total; f++) {
+        if (func_mask & funcs[f].func) func_count++;
+    }
+    int width = pivot.key_count + pivot.value_count * func_count;
+    int height = pivot.group_count + 1;
+    if (dest_row < 0) {
+        int used_min_row, used_min_col, used_max_row, used_max_col;
+        sheet_used_range(sheet, &used_min_row, &used_min_col, &used_max_row, &used_max_col);
+        dest_row = min_row;
+        dest_col = used_max_col + 2;
+    }
+    if (dest_row + height > sheet->rows || dest_col + width > sheet->cols) {
+        sprintf_s(state->status_message, sizeof(state->status_message),
+                 "Pivot needs %d rows x %d columns at %s; not enough room", height, width,
+                 cell_reference_to_string(dest_row, dest_col));
+        pivot_free(&pivot);
+        return;
+    }
+    if (dest_row <= max_row && dest_row + height - 1 >= min_row &&
+        dest_col <= max_col && dest_col + width - 1 >= min_col) {
+        strcpy_s(state->status_message, sizeof(state->status_message), "Pivot output would overlap its source");
+        pivot_free(&pivot);
+        return;
+    }
+    
+    // One batch, so formulas reading the output recalculate once and the
+    // whole pivot is a single undo step
+    sheet_begin_batch(sheet);
+    
+    // Header row: the source headers, or the column letters
+    char label[256];
+    int col = dest_col;
+    for (int k = 0; k < pivot.key_count + pivot.value_count; k++) {
+        int source_col = k < pivot.key_count ? pivot.key_cols[k] : pivot.value_cols[k - pivot.key_count];
+        Cell* title = header ? sheet->cells[min_row][source_col] : NULL;
+        char name[128];
+        if (title && title->data.string) {
+            strncpy_s(name, sizeof(name), title->data.string, _TRUNCATE);
+        } else {
+            char* ref = cell_reference_to_string(0, source_col);
+            sprintf_s(name, sizeof(name), "Column %.*s", (int)strlen(ref) - 1, ref);
+        }
+        if (k < pivot.key_count) {
+            sheet_set_string(sheet, dest_row, col++, name);
+            continue;
+        }
+        for (int f = 0; f < func_total; f++) {
+            if (!(func_mask & funcs[f].func)) continue;
+            sprintf_s(label, sizeof(label), "%s of %s", funcs[f].label, name);
+            sheet_set_string(sheet, dest_row, col++, label);
+        }
+    }
+    
+    for (int g = 0; g < pivot.group_count; g++) {
+        int row = dest_row + 1 + g;
+        col = dest_col;
+        for (int k = 0; k < pivot.key_count; k++) {
+            Cell* key = sheet->cells[pivot.group_rows[g]][pivot.key_cols[k]];
+            double number;
+            const char* text;
+            switch (pivot_key_kind(key, &number, &text)) {
+                case 1: sheet_set_number(sheet, row, col, number); break;
+                case 2: sheet_set_string(sheet, row, col, text); break;
+                case 3: sheet_set_string(sheet, row, col, cell_get_display_value(key)); break;
+                default: sheet_set_string(sheet, row, col, "(blank)"); break;
             }
-            
-            // Restore the old state
-            undo_restore_cell_data(state, &action->data.cell, action->data.cell.row, action->data.cell.col);
-            break;
-            
-        case UNDO_RANGE_CHANGE:
-            // Similar logic for range changes - restore all cells in the range
-            for (int i = 0; i < action->data.range.cell_count; i++) {
-                CellUndoData* cell_data = &action->data.range.cell_data[i];
-                undo_restore_cell_data(state, cell_data, cell_data->row, cell_data->col);
+            col++;
+        }
+        const PivotAggregate* aggregates = &pivot.aggregates[(size_t)g * pivot.value_count];
+        for (int v = 0; v < pivot.value_count; v++) {
+            const PivotAggregate* aggregate = &aggregates[v];
+            for (int f = 0; f < func_total; f++) {
+                if (!(func_mask & funcs[f].func)) continue;
+                // Average, min and max of a group without numbers stay blank
+                if (funcs[f].func == PIVOT_SUM) sheet_set_number(sheet, row, col, aggregate->sum);
+                else if (funcs[f].func == PIVOT_COUNT) sheet_set_number(sheet, row, col, aggregate->count);
+                else if (aggregate->count == 0) sheet_clear_cell(sheet, row, col);
+                else if (funcs[f].func == PIVOT_AVG) sheet_set_number(sheet, row, col, aggregate->sum / aggregate->count);
+                else if (funcs[f].func == PIVOT_MIN) sheet_set_number(sheet, row, col, aggregate->min);
+                else sheet_set_number(sheet, row, col, aggregate->max);
+                col++;
             }
-            break;
-            
-        case UNDO_RESIZE_COLUMN:
-            sheet_set_column_width(state->sheet, action->data.resize.index, action->data.resize.old_size);
-            break;
-            
-        case UNDO_RESIZE_ROW:
-            sheet_set_row_height(state->sheet, action->data.resize.index, action->data.resize.old_size);
-            break;
-            
-        default:
-            break;
+        }
+    }
+    if (!app_commit_batch(state, "Pivot")) {
+        pivot_free(&pivot);
+        return;
+    }
+    
+    sprintf_s(state->status_message, sizeof(state->status_message),
+             "Pivot: %d group%s from %d rows in %.0f ms, at %s", pivot.group_count,
+             pivot.group_count == 1 ? "" : "s", pivot.end_row - pivot.start_row + 1,
+             parallel_ticks_to_ms(end.QuadPart - start.QuadPart), cell_reference_to_string(dest_row, dest_col));
+    pivot_free(&pivot);
+}
+
+// NEW: Show the current cell's formula as it is evaluated: constants folded,
+// repeated subexpressions computed once (#1, #2, ...). The status line
+// shows the start; the full text goes to the debug log.
+void app_explain(AppState* state) {
+    Cell* cell = sheet_get_cell(state->sheet, state->cursor_row, state->cursor_col);
+    char name[16];
+    strcpy_s(name, sizeof(name), cell_reference_to_string(state->cursor_row, state->cursor_col));
+    
+    if (!cell || cell->type != CELL_FORMULA) {
+        sprintf_s(state->status_message, sizeof(state->status_message), "%s does not hold a formula", name);
+        return;
+    }
+    FormulaTree* tree = cell_formula_tree(cell);
+    if (!tree || tree->root < 0) {
+        sprintf_s(state->status_message, sizeof(state->status_message), "%s: %.200s does not parse", name, cell->data.formula.expression);
+        return;
+    }
+    
+    char text[1024];
+    formula_tree_render(tree, text, sizeof(text));
+    debug_log("explain %s: %s -> %s (%d nodes, %d as written, %d shared)", name,
+              cell->data.formula.expression, text, tree->count, tree->parsed_count, tree->shared_count);
+    sprintf_s(state->status_message, sizeof(state->status_message), "%s: =%.*s | %d nodes (%d as written), %d shared",
+             name, 160, text, tree->count, tree->parsed_count, tree->shared_count);
+}
+
+// NEW: Best time of 'runs' full recalculations of 'sheet' in the given
+// tier, in milliseconds. The first runs only warm up (parse and compile).
+double app_bench_tier(Sheet* sheet, FormulaTier tier, int runs) {
+    FormulaTier saved = formula_tier;
+    formula_tier = tier;
+
+    double best = -1.0;
+    for (int i = 0; i < FORMULA_HOT_EVALUATIONS + runs; i++) {
+        LARGE_INTEGER start, end;
+        sheet->needs_recalc = 1;
+        QueryPerformanceCounter(&start);
+        sheet_recalculate(sheet);
+        QueryPerformanceCounter(&end);
+
+        double ms = parallel_ticks_to_ms(end.QuadPart - start.QuadPart);
+        if (i >= FORMULA_HOT_EVALUATIONS && (best < 0.0 || ms < best)) best = ms;
+    }
+
+    formula_tier = saved;
+    return best;
+}
+
+// NEW: Compare the interpreter with the threaded tier. With a row count the
+// sheet timed is a scratch one that many rows deep: arithmetic formulas and
+// a column of exact VLOOKUPs into a table of up to 2000 rows. Without, it is
+// the current sheet.
+void app_bench(AppState* state, const char* args) {
+    while (*args == ' ') args++;
+    int rows = *args ? atoi(args) : 0;
+    if (*args && rows <= 0) {
+        strcpy_s(state->status_message, sizeof(state->status_message), "Usage: bench [rows]");
+        return;
+    }
+
+    Sheet* sheet = state->sheet;
+    if (rows > 0) {
+        sheet = sheet_new(rows, 10);
+        if (!sheet) {
+            strcpy_s(state->status_message, sizeof(state->status_message), "Out of memory for the benchmark sheet");
+            return;
+        }
+        char formula[160];
+        int table = rows < 2000 ? rows : 2000;
+        for (int row = 0; row < rows; row++) {
+            int n = row + 1;
+            sheet_set_number(sheet, row, 0, n);
+            sheet_set_number(sheet, row, 1, row % 7 + 1);
+            sprintf_s(formula, sizeof(formula), "=A%d*B%d+A%d/B%d-1", n, n, n, n);
+            sheet_set_formula(sheet, row, 2, formula);
+            sprintf_s(formula, sizeof(formula), "=C%d*C%d-A%d*2+B%d*3", n, n, n, n);
+            sheet_set_formula(sheet, row, 3, formula);
+            sprintf_s(formula, sizeof(formula), "=IF(D%d>C%d,D%d-C%d,C%d-D%d)*0.5", n, n, n, n, n, n);
+            sheet_set_formula(sheet, row, 4, formula);
+            sprintf_s(formula, sizeof(formula), "=(C%d+D%d+E%d)/(B%d+1)-POWER(B%d,2)", n, n, n, n, n);
+            sheet_set_formula(sheet, row, 5, formula);
+            // Keys spread over the whole table, so a scan goes half way down it on average
+            sheet_set_number(sheet, row, 6, (long long)row * 7919 % table);
+            if (row < table) {
+                sheet_set_number(sheet, row, 7, row);
+                sheet_set_number(sheet, row, 8, row * 3);
+            }
+            sprintf_s(formula, sizeof(formula), "=VLOOKUP(G%d,H$1:I$%d,2,0)", n, table);
+            sheet_set_formula(sheet, row, 9, formula);
+        }
+    }
+
+    const int runs = 3;
+    double interpreted = app_bench_tier(sheet, FORMULA_TIER_INTERPRETER, runs);
+    double threaded = app_bench_tier(sheet, FORMULA_TIER_THREADED, runs);
+    int formulas = sheet->calc_count;
+    if (sheet != state->sheet) sheet_free(sheet);
+
+    if (formulas == 0) {
+        strcpy_s(state->status_message, sizeof(state->status_message),
+                "No formulas to time (bench <rows> times a generated sheet)");
+        return;
+    }
+    sprintf_s(state->status_message, sizeof(state->status_message),
+             "Recalc of %d formulas, best of %d: interpreter %.2f ms, threaded %.2f ms (%.1fx)",
+             formulas, runs, interpreted, threaded, threaded > 0.0 ? interpreted / threaded : 0.0);
+    debug_log("bench: %d formulas, interpreter %.3f ms, threaded %.3f ms", formulas, interpreted, threaded);
+}
+
+void undo_perform(AppState* state) {
+    UndoBuffer* buffer = &state->undo_buffer;
+    UndoRecord* record = buffer->cursor;
+    
+    if (!record) {
+        strcpy_s(state->status_message, sizeof(state->status_message), "Nothing to undo");
+        return;
     }
     
+    undo_swap_record(state, record);
+    buffer->cursor = record->prev;
     sheet_recalculate(state->sheet);
+    undo_evict(buffer);
     
     char msg[256];
-    snprintf(msg, sizeof(msg), "Undid: %s", action->description);
+    snprintf(msg, sizeof(msg), "Undid: %s", record->description);
     strcpy_s(state->status_message, sizeof(state->status_message), msg);
 }
 
 void redo_perform(AppState* state) {
     UndoBuffer* buffer = &state->undo_buffer;
+    UndoRecord* record = buffer->cursor ? buffer->cursor->next : buffer->oldest;
     
-    if (buffer->current_index >= buffer->count) {
+    if (!record) {
         strcpy_s(state->status_message, sizeof(state->status_message), "Nothing to redo");
         return;
     }
     
-    UndoAction* action = &buffer->actions[buffer->current_index];
-    
-    switch (action->type) {
-        case UNDO_CELL_CHANGE:
-            // Clear the cell first
-            sheet_clear_cell(state->sheet, action->data.cell.row, action->data.cell.col);
-            
-            if (action->data.cell.new_type != CELL_EMPTY) {
-                // Get or create cell for redo
-                Cell* cell = sheet_get_or_create_cell(state->sheet, action->data.cell.row, action->data.cell.col);
-                if (cell) {
-                    // Restore the "new" state that was undone
-                    switch (action->data.cell.new_type) {
-                        case CELL_NUMBER:
-                            cell_set_number(cell, action->data.cell.new_data.number);
-                            break;
-                        case CELL_STRING:
-                            if (action->data.cell.new_data.string) {
-                                cell_set_string(cell, action->data.cell.new_data.string);
-                            }
-                            break;
-                        case CELL_FORMULA:
-                            if (action->data.cell.new_data.formula.expression) {
-                                cell_set_formula(cell, action->data.cell.new_data.formula.expression);
-                            }
-                            break;
-                        default:
-                            break;
-                    }
-                    
-                    // Restore formatting
-                    cell_set_format(cell, action->data.cell.new_format, action->data.cell.new_format_style);
-                    cell_set_text_color(cell, action->data.cell.new_text_color);
-                    cell_set_background_color(cell, action->data.cell.new_background_color);
-                }
-            }
-            break;
-            
-        case UNDO_RANGE_CHANGE:
-            // Restore new state for all cells in range
-            for (int i = 0; i < action->data.range.cell_count; i++) {
-                CellUndoData* cell_data = &action->data.range.cell_data[i];
-                // This would need similar logic as above for each cell
-                // For now, keeping it simple
-                undo_restore_cell_data(state, cell_data, cell_data->row, cell_data->col);
-            }
-            break;
-            
-        case UNDO_RESIZE_COLUMN:
-            sheet_set_column_width(state->sheet, action->data.resize.index, action->data.resize.new_size);
-            break;
-            
-        case UNDO_RESIZE_ROW:
-            sheet_set_row_height(state->sheet, action->data.resize.index, action->data.resize.new_size);
-            break;
-            
-        default:
-            break;
-    }
-    
-    buffer->current_index++;
+    undo_swap_record(state, record);
+    buffer->cursor = record;
     sheet_recalculate(state->sheet);
+    undo_evict(buffer);
     
     char msg[256];
-    snprintf(msg, sizeof(msg), "Redid: %s", action->description);
+    snprintf(msg, sizeof(msg), "Redid: %s", record->description);
     strcpy_s(state->status_message, sizeof(state->status_message), msg);
 }
 
@@ -2068,19 +2856,50 @@ void app_show_chart(AppState* state, ChartType type, const char* x_label, const
         return;
     }
     
+    app_present_chart(state, chart);
+}
+
+// NEW: :histogram [bins] and :density [x_bins] [y_bins] on the selection
+void app_show_binned_chart(AppState* state, ChartType type, const char* args) {
+    if (!state->sheet->selection.is_active) {
+        strcpy_s(state->status_message, sizeof(state->status_message), 
+                "Please select a data range first (use Shift+arrows)");
+        return;
+    }
+    
+    int chart_width = state->console->width - 25;
+    int chart_height = state->console->height - 8;
+    Chart* chart = chart_create_sized(type, "Value", type == CHART_DENSITY ? "Y" : "Count", chart_width, chart_height);
+    if (!chart) {
+        strcpy_s(state->status_message, sizeof(state->status_message), 
+                "Failed to create chart");
+        return;
+    }
+    
+    // Histograms default to 20 bins; density plots to one bin per plot cell
+    int bins_x = type == CHART_DENSITY ? chart->config.width : 20;
+    int bins_y = chart->config.height;
+    sscanf_s(args, "%d %d", &bins_x, &bins_y);
+    
+    if (!chart_bin_range(chart, state->sheet, &state->sheet->selection, bins_x, bins_y)) {
+        chart_free(chart);
+        strcpy_s(state->status_message, sizeof(state->status_message), type == CHART_DENSITY
+                ? "No X/Y number pairs in the selection (need 2 columns)"
+                : "No numbers in the selection");
+        return;
+    }
+    
+    app_present_chart(state, chart);
+}
+
+// Render a chart in a full-screen popup until a key is pressed, then free it
+void app_present_chart(AppState* state, Chart* chart) {
     // Render the chart
     chart_render(chart);
     
     // Create title for the chart
     char title[128];
-    const char* type_name = "Chart";
-    switch (type) {
-        case CHART_LINE: type_name = "Line Chart"; break;
-        case CHART_BAR: type_name = "Bar Chart"; break;
-        case CHART_PIE: type_name = "Pie Chart"; break;
-        case CHART_SCATTER: type_name = "Scatter Plot"; break;
-    }
-    sprintf_s(title, sizeof(title), " %s ", type_name);
+    sprintf_s(title, sizeof(title), " %s ", chart_type_name(chart->config.type));
     
     // Display chart in popup
     display_chart_popup(state->console, chart, title);
@@ -2104,8 +2923,183 @@ void app_show_chart(AppState* state, ChartType type, const char* x_label, const
     // Update status    strcpy_s(state->status_message, sizeof(state->status_message), "Chart closed");
 }
 
+// NEW: The live chart panel covers the right half of the grid area. The plot
+// size leaves room for the frame and the chart's legend and axis margins.
+void app_live_chart_panel(AppState* state, int* left, int* top, int* width, int* height, int* plot_width, int* plot_height) {
+    Console* con = state->console;
+    *left = con->width / 2;
+    *top = 0;
+    *width = con->width - *left;
+    *height = con->height - 2;  // Keep the status lines visible
+    *plot_width = *width - 2 - 25;
+    *plot_height = *height - 2 - 12;
+}
+
+// NEW: :livechart <type> [x_label] [y_label] binds a chart panel to the
+// selection that redraws as the data changes; :livechart off closes it
+void app_live_chart(AppState* state, const char* args) {
+    if (*args == '\0' || _stricmp(args, "off") == 0) {
+        if (!state->live_chart) {
+            strcpy_s(state->status_message, sizeof(state->status_message), "No live chart is open");
+            return;
+        }
+        live_chart_free(state->live_chart);
+        state->live_chart = NULL;
+        strcpy_s(state->status_message, sizeof(state->status_message), "Live chart closed");
+        return;
+    }
+    
+    ChartType type;
+    char x_label[64] = "X";
+    char y_label[64] = "Y";
+    if (!parse_chart_command(args, &type, x_label, y_label)) {
+        strcpy_s(state->status_message, sizeof(state->status_message),
+                "Usage: :livechart line|bar|pie|scatter [x_label] [y_label], or :livechart off");
+        return;
+    }
+    if (!state->sheet->selection.is_active) {
+        strcpy_s(state->status_message, sizeof(state->status_message), 
+                "Please select a data range first (use Shift+arrows)");
+        return;
+    }
+    
+    int left, top, width, height, plot_width, plot_height;
+    app_live_chart_panel(state, &left, &top, &width, &height, &plot_width, &plot_height);
+    LiveChart* live = live_chart_new(state->sheet, &state->sheet->selection, type, x_label, y_label,
+                                     plot_width, plot_height);
+    if (!live) {
+        strcpy_s(state->status_message, sizeof(state->status_message), 
+                "Failed to create live chart (need at least 2 columns)");
+        return;
+    }
+    
+    live_chart_free(state->live_chart);
+    state->live_chart = live;
+    sprintf_s(state->status_message, sizeof(state->status_message),
+             "Live chart bound to %d rows; it updates as you edit (:livechart off to close)",
+             live->end_row - live->start_row + 1);
+}
+
+// NEW: :chart export <file> [type] [x_label] [y_label] writes a chart of the
+// selection to a .txt or .svg file. The chart data is read here, while the
+// sheet can't change; rendering and writing run on a worker thread, and
+// app_poll_chart_export reports the result in the status line.
+void app_export_chart(AppState* state, const char* args) {
+    char filename[256] = "";
+    char type_name[32] = "line";
+    char x_label[64] = "X";
+    char y_label[64] = "Y";
+    ChartType type;
+    
+    int n = sscanf_s(args, "%255s %31s %63s %63s", filename, (unsigned)sizeof(filename),
+                     type_name, (unsigned)sizeof(type_name), x_label, (unsigned)sizeof(x_label),
+                     y_label, (unsigned)sizeof(y_label));
+    if (n < 1 || !chart_type_from_name(type_name, &type)) {
+        strcpy_s(state->status_message, sizeof(state->status_message),
+                "Usage: :chart export <file.txt|file.svg> [line|bar|pie|scatter|histogram|density] [x_label] [y_label]");
+        return;
+    }
+    if (state->chart_export) {
+        strcpy_s(state->status_message, sizeof(state->status_message), "A chart export is still running");
+        return;
+    }
+    if (!state->sheet->selection.is_active) {
+        strcpy_s(state->status_message, sizeof(state->status_message), 
+                "Please select a data range first (use Shift+arrows)");
+        return;
+    }
+    
+    Chart* chart = chart_from_range(state->sheet, &state->sheet->selection, type, x_label, y_label, 120, 40);
+    if (!chart) {
+        strcpy_s(state->status_message, sizeof(state->status_message), "No chartable data in the selection");
+        return;
+    }
+    
+    state->chart_export = chart_export_start(chart, filename);
+    if (!state->chart_export) {
+        // No worker thread: write it here instead
+        int ok = chart_export_file(chart, filename);
+        chart_free(chart);
+        sprintf_s(state->status_message, sizeof(state->status_message),
+                 ok ? "Chart exported to %s" : "Failed to export chart to %s", filename);
+        return;
+    }
+    sprintf_s(state->status_message, sizeof(state->status_message), "Exporting chart to %s...", filename);
+}
+
+// NEW: Report a finished background chart export
+void app_poll_chart_export(AppState* state) {
+    if (!state->chart_export || !chart_export_done(state->chart_export)) return;
+    
+    char filename[256];
+    strcpy_s(filename, sizeof(filename), state->chart_export->filename);
+    int ok = chart_export_finish(state->chart_export);
+    state->chart_export = NULL;
+    sprintf_s(state->status_message, sizeof(state->status_message),
+             ok ? "Chart exported to %s" : "Failed to export chart to %s", filename);
+}
+
+// NEW: winspread --export-chart <data.csv> <range> <type> <output> [x_label] [y_label]
+// loads a CSV file, recalculates it and writes one chart without opening
+// the console, for scripts and scheduled jobs. Returns the exit code.
+int app_export_chart_headless(int argc, char* argv[]) {
+    if (argc < 6) {
+        printf("Usage: %s --export-chart <data.csv> <range> <type> <output.txt|output.svg> [x_label] [y_label]\n", argv[0]);
+        return 2;
+    }
+    
+    CellRange cells;
+    ChartType type;
+    if (!parse_range(argv[3], &cells)) {
+        printf("Invalid range: %s\n", argv[3]);
+        return 2;
+    }
+    if (!chart_type_from_name(argv[4], &type)) {
+        printf("Unknown chart type: %s\n", argv[4]);
+        return 2;
+    }
+    
+    // Big enough for the range even where it lies beyond the usual sheet size
+    int rows = cells.end_row >= 1000 ? cells.end_row + 1 : 1000;
+    int cols = cells.end_col >= 100 ? cells.end_col + 1 : 100;
+    Sheet* sheet = sheet_new(rows, cols);
+    if (!sheet || !sheet_load_csv(sheet, argv[2], 1)) {
+        printf("Failed to load %s\n", argv[2]);
+        if (sheet) sheet_free(sheet);
+        return 1;
+    }
+    sheet_recalculate(sheet);
+    
+    RangeSelection range;
+    range.start_row = cells.start_row;
+    range.start_col = cells.start_col;
+    range.end_row = cells.end_row;
+    range.end_col = cells.end_col;
+    range.is_active = 1;
+    
+    int result = 1;
+    Chart* chart = chart_from_range(sheet, &range, type, argc > 6 ? argv[6] : "X", argc > 7 ? argv[7] : "Y", 120, 40);
+    if (!chart) {
+        printf("No chartable data in %s\n", argv[3]);
+    } else if (!chart_export_file(chart, argv[5])) {
+        printf("Failed to write %s\n", argv[5]);
+    } else {
+        printf("Chart written to %s\n", argv[5]);
+        result = 0;
+    }
+    
+    chart_free(chart);
+    sheet_free(sheet);
+    return result;
+}
+
 // Main program
-int main() {
+int main(int argc, char* argv[]) {
+    // NEW: Headless chart export
+    if (argc > 1 && strcmp(argv[1], "--export-chart") == 0) {
+        return app_export_chart_headless(argc, argv);
+    }
+    
     debug_init();
     debug_log("=== Starting Enhanced WinSpread ===");
     
@@ -2121,6 +3115,7 @@ int main() {
     
     // Main loop
     while (state.running) {
+        app_poll_chart_export(&state);
         app_update_cursor_blink(&state);
         app_render(&state);
         
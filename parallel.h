@@ -0,0 +1,562 @@
+// parallel.h - Data-parallel helpers for WinSpread
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+// parallel_run calls task(context, i) for every i in [0, count), spreading the
+// calls over the worker pool plus the calling thread, and returns once all of
+// them have finished. Tasks must only write to data owned by their index.
+typedef void (*ParallelTask)(void* context, int index);
+
+// Comparison callback for parallel_sort_indices: <0, 0 or >0 like strcmp
+typedef int (*IndexCompare)(void* context, int a, int b);
+
+#define PARALLEL_MAX_THREADS 64
+#define PARALLEL_MIN_SORT 8192      // Below this many items a sort runs on one thread
+#define PARALLEL_INSERTION_RUN 32   // Run length sorted by insertion before merging
+#define PARALLEL_DEQUE_SIZE 256     // Initial items per work deque (grows as needed)
+
+// NEW: Task group: tasks submitted together that are waited on, timed and
+// cancelled together. Once a group is cancelled its tasks that have not
+// started yet are skipped; running tasks can poll parallel_cancelled.
+typedef struct {
+    volatile LONG pending;          // Tasks not yet run or skipped
+    volatile LONG cancelled;
+    volatile LONG background;       // Only pool workers run its tasks
+    volatile LONG tasks_run;
+    volatile LONG tasks_skipped;
+    volatile LONG64 busy_ticks;     // Time spent inside tasks (performance counter ticks)
+    volatile LONG64 longest_ticks;  // Longest single task
+} ParallelGroup;
+
+// Work item: tasks [first, last) of one group
+typedef struct {
+    ParallelTask task;
+    void* context;
+    int first, last;
+    ParallelGroup* group;
+} ParallelItem;
+
+// A thread's work items. The owner pushes and pops at the back; other
+// threads steal from the front, where the largest ranges are.
+typedef struct {
+    CRITICAL_SECTION lock;
+    ParallelItem* items;    // Ring buffer
+    int capacity;
+    int head;               // Index of the front item
+    volatile LONG count;
+} ParallelDeque;
+
+// Pool figures shown by :threads
+typedef struct {
+    int threads;
+    LONG tasks_run;         // Since the pool started
+    LONG steals;
+    double busy_ms;
+    int last_tasks;         // The last parallel_run made outside the pool
+    double last_wall_ms;
+    double last_busy_ms;
+    double last_longest_ms;
+} ParallelStats;
+
+// Function prototypes
+int parallel_thread_count(void);
+int parallel_set_thread_count(int threads);
+int parallel_worker_count(void);
+void parallel_shutdown(void);
+void parallel_group_init(ParallelGroup* group);
+void parallel_submit(ParallelGroup* group, ParallelTask task, void* context, int count);
+int parallel_submit_background(ParallelGroup* group, ParallelTask task, void* context);
+void parallel_wait(ParallelGroup* group);
+int parallel_done(ParallelGroup* group);
+void parallel_cancel(ParallelGroup* group);
+int parallel_cancelled(ParallelGroup* group);
+double parallel_ticks_to_ms(LONG64 ticks);
+void parallel_get_stats(ParallelStats* stats);
+void parallel_run(ParallelTask task, void* context, int count);
+int parallel_sort_indices(int* items, int count, IndexCompare compare, void* context);
+
+// Implementation
+
+// NEW: Shared work-stealing pool
+//
+// Every parallel operation (sorting, filtering, column reads, chart binning,
+// live chart refreshes, background chart export) runs on one pool of worker
+// threads, started on first use, so overlapping work never has more threads
+// than the pool size. A submitted range of tasks is one work item; whoever
+// runs an item first splits off its upper half as a new item, down to single
+// tasks, so idle workers can steal large pieces while each thread works
+// through neighbouring indices. A thread waiting on a group helps run that
+// group's items instead of blocking.
+
+typedef struct {
+    int threads;                // Threads a job may use: the workers plus the waiting thread
+    int worker_count;
+    int started;
+    HANDLE workers[PARALLEL_MAX_THREADS];
+    ParallelDeque deques[PARALLEL_MAX_THREADS + 1];  // One per worker; the last is for outside threads
+    CRITICAL_SECTION idle_lock;
+    CONDITION_VARIABLE idle;    // Workers sleep here while every deque is empty
+    volatile LONG sleeping;
+    volatile LONG queued;       // Items in all deques
+    volatile LONG stopping;
+    volatile LONG tasks_run;
+    volatile LONG steals;
+    volatile LONG64 busy_ticks;
+    ParallelStats last;
+} ParallelPool;
+
+ParallelPool parallel_pool;
+__declspec(thread) int parallel_self = -1;  // Worker index of this thread (-1 outside the pool)
+
+int parallel_thread_count(void) {
+    if (parallel_pool.threads == 0) {
+        // WINSPREAD_THREADS overrides the number of cores
+        int threads = 0;
+        char* env = NULL;
+        if (_dupenv_s(&env, NULL, "WINSPREAD_THREADS") == 0 && env) {
+            threads = atoi(env);
+            free(env);
+        }
+        if (threads <= 0) {
+            SYSTEM_INFO info;
+            GetSystemInfo(&info);
+            threads = (int)info.dwNumberOfProcessors;
+        }
+        if (threads < 1) threads = 1;
+        if (threads > PARALLEL_MAX_THREADS) threads = PARALLEL_MAX_THREADS;
+        parallel_pool.threads = threads;
+    }
+    return parallel_pool.threads;
+}
+
+// Resize the pool (0 = back to the default). Running workers finish the
+// queued work and exit; the new size takes effect with the next job.
+int parallel_set_thread_count(int threads) {
+    parallel_shutdown();
+    parallel_pool.threads = threads > PARALLEL_MAX_THREADS ? PARALLEL_MAX_THREADS : threads > 0 ? threads : 0;
+    return parallel_thread_count();
+}
+
+int parallel_deque_push(ParallelDeque* deque, const ParallelItem* item) {
+    EnterCriticalSection(&deque->lock);
+    if (deque->count == deque->capacity) {
+        int capacity = deque->capacity ? deque->capacity * 2 : PARALLEL_DEQUE_SIZE;
+        ParallelItem* items = (ParallelItem*)malloc(capacity * sizeof(ParallelItem));
+        if (!items) {
+            LeaveCriticalSection(&deque->lock);
+            return 0;
+        }
+        for (int i = 0; i < deque->count; i++) {
+            items[i] = deque->items[(deque->head + i) % deque->capacity];
+        }
+        free(deque->items);
+        deque->items = items;
+        deque->capacity = capacity;
+        deque->head = 0;
+    }
+    deque->items[(deque->head + deque->count) % deque->capacity] = *item;
+    deque->count++;
+    LeaveCriticalSection(&deque->lock);
+    return 1;
+}
+
+// Take the back (own deque) or front (stealing) item, if it belongs to
+// 'group' (or to any group when NULL)
+int parallel_deque_take(ParallelDeque* deque, ParallelItem* item, int from_back, ParallelGroup* group) {
+    if (deque->count == 0) return 0;    // Unlocked peek: an empty deque is common
+    
+    int taken = 0;
+    EnterCriticalSection(&deque->lock);
+    if (deque->count > 0) {
+        int slot = from_back ? (deque->head + deque->count - 1) % deque->capacity : deque->head;
+        if (!group || deque->items[slot].group == group) {
+            *item = deque->items[slot];
+            if (!from_back) deque->head = (deque->head + 1) % deque->capacity;
+            deque->count--;
+            taken = 1;
+        }
+    }
+    LeaveCriticalSection(&deque->lock);
+    return taken;
+}
+
+// Next item for this thread: its own newest, else the oldest of another deque
+int parallel_take(ParallelItem* item, ParallelGroup* group) {
+    int own = parallel_self >= 0 ? parallel_self : PARALLEL_MAX_THREADS;
+    if (parallel_deque_take(&parallel_pool.deques[own], item, 1, group)) {
+        InterlockedDecrement(&parallel_pool.queued);
+        return 1;
+    }
+    int workers = parallel_pool.worker_count;
+    for (int k = 0; k <= workers; k++) {
+        int victim = k < workers ? (own + 1 + k) % workers : PARALLEL_MAX_THREADS;
+        if (victim == own) continue;
+        if (parallel_deque_take(&parallel_pool.deques[victim], item, 0, group)) {
+            InterlockedDecrement(&parallel_pool.queued);
+            InterlockedIncrement(&parallel_pool.steals);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int parallel_push(const ParallelItem* item) {
+    int own = parallel_self >= 0 ? parallel_self : PARALLEL_MAX_THREADS;
+    if (!parallel_deque_push(&parallel_pool.deques[own], item)) return 0;
+    
+    // Both counters change with full barriers, so either this thread sees a
+    // sleeping worker or the worker sees the new item before it sleeps
+    InterlockedIncrement(&parallel_pool.queued);
+    if (InterlockedCompareExchange(&parallel_pool.sleeping, 0, 0) > 0) {
+        EnterCriticalSection(&parallel_pool.idle_lock);
+        WakeConditionVariable(&parallel_pool.idle);
+        LeaveCriticalSection(&parallel_pool.idle_lock);
+    }
+    return 1;
+}
+
+void parallel_record(ParallelGroup* group, LONG64 ticks) {
+    InterlockedIncrement(&group->tasks_run);
+    InterlockedExchangeAdd64(&group->busy_ticks, ticks);
+    LONG64 longest = group->longest_ticks;
+    while (ticks > longest) {
+        LONG64 seen = InterlockedCompareExchange64(&group->longest_ticks, ticks, longest);
+        if (seen == longest) break;
+        longest = seen;
+    }
+    InterlockedIncrement(&parallel_pool.tasks_run);
+    InterlockedExchangeAdd64(&parallel_pool.busy_ticks, ticks);
+}
+
+void parallel_execute(ParallelItem* item) {
+    ParallelGroup* group = item->group;
+    
+    // Leave the upper half for other threads, down to single tasks
+    while (item->last - item->first > 1) {
+        ParallelItem upper = *item;
+        upper.first = item->first + (item->last - item->first) / 2;
+        if (!parallel_push(&upper)) break;  // Out of memory: run the rest here
+        item->last = upper.first;
+    }
+    
+    for (int i = item->first; i < item->last; i++) {
+        if (group->cancelled) {
+            InterlockedIncrement(&group->tasks_skipped);
+        } else {
+            LARGE_INTEGER start, end;
+            QueryPerformanceCounter(&start);
+            item->task(item->context, i);
+            QueryPerformanceCounter(&end);
+            parallel_record(group, end.QuadPart - start.QuadPart);
+        }
+        InterlockedDecrement(&group->pending);  // The group may be gone after the last one
+    }
+}
+
+DWORD WINAPI parallel_worker(LPVOID param) {
+    parallel_self = (int)(INT_PTR)param;
+    for (;;) {
+        ParallelItem item;
+        if (parallel_take(&item, NULL)) {
+            parallel_execute(&item);
+            continue;
+        }
+        
+        EnterCriticalSection(&parallel_pool.idle_lock);
+        InterlockedIncrement(&parallel_pool.sleeping);
+        while (InterlockedCompareExchange(&parallel_pool.queued, 0, 0) == 0 && !parallel_pool.stopping) {
+            SleepConditionVariableCS(&parallel_pool.idle, &parallel_pool.idle_lock, INFINITE);
+        }
+        InterlockedDecrement(&parallel_pool.sleeping);
+        int stop = parallel_pool.stopping && parallel_pool.queued == 0;
+        LeaveCriticalSection(&parallel_pool.idle_lock);
+        if (stop) break;
+    }
+    return 0;
+}
+
+void parallel_start(void) {
+    static int initialized = 0;
+    if (parallel_pool.started) return;
+    if (!initialized) {
+        InitializeCriticalSection(&parallel_pool.idle_lock);
+        InitializeConditionVariable(&parallel_pool.idle);
+        for (int i = 0; i <= PARALLEL_MAX_THREADS; i++) {
+            InitializeCriticalSection(&parallel_pool.deques[i].lock);
+        }
+        initialized = 1;
+    }
+    
+    // At least one worker, so background jobs run even on a single core
+    int workers = parallel_thread_count() - 1;
+    if (workers < 1) workers = 1;
+    int started = 0;
+    for (int i = 0; i < workers; i++) {
+        HANDLE handle = CreateThread(NULL, 0, parallel_worker, (LPVOID)(INT_PTR)i, 0, NULL);
+        if (!handle) break;
+        parallel_pool.workers[started++] = handle;
+    }
+    parallel_pool.worker_count = started;   // Deques past it are empty, so a stale count is harmless
+    parallel_pool.started = 1;
+}
+
+// Stop the workers once the work already queued is done
+void parallel_shutdown(void) {
+    if (!parallel_pool.started) return;
+    
+    EnterCriticalSection(&parallel_pool.idle_lock);
+    parallel_pool.stopping = 1;
+    WakeAllConditionVariable(&parallel_pool.idle);
+    LeaveCriticalSection(&parallel_pool.idle_lock);
+    
+    if (parallel_pool.worker_count > 0) {
+        WaitForMultipleObjects((DWORD)parallel_pool.worker_count, parallel_pool.workers, TRUE, INFINITE);
+        for (int i = 0; i < parallel_pool.worker_count; i++) {
+            CloseHandle(parallel_pool.workers[i]);
+        }
+    }
+    parallel_pool.stopping = 0;
+    parallel_pool.started = 0;
+}
+
+int parallel_worker_count(void) {
+    parallel_start();
+    return parallel_pool.worker_count;
+}
+
+void parallel_group_init(ParallelGroup* group) {
+    memset((void*)group, 0, sizeof(ParallelGroup));
+}
+
+// Queue tasks 0..count-1 of a group; parallel_wait runs and waits for them
+void parallel_submit(ParallelGroup* group, ParallelTask task, void* context, int count) {
+    if (count <= 0) return;
+    parallel_start();
+    InterlockedExchangeAdd(&group->pending, count);
+    
+    ParallelItem item;
+    item.task = task;
+    item.context = context;
+    item.first = 0;
+    item.last = count;
+    item.group = group;
+    if (!parallel_push(&item)) parallel_execute(&item);
+}
+
+// Queue a single task that only pool workers run, for work that must not
+// hold up the submitting thread (poll parallel_done, then parallel_wait).
+// Returns 0 if the pool has no workers.
+int parallel_submit_background(ParallelGroup* group, ParallelTask task, void* context) {
+    if (parallel_worker_count() == 0) return 0;
+    group->background = 1;
+    parallel_submit(group, task, context, 1);
+    return 1;
+}
+
+// Help with the group's queued tasks until all of them have finished
+void parallel_wait(ParallelGroup* group) {
+    while (InterlockedCompareExchange(&group->pending, 0, 0) > 0) {
+        ParallelItem item;
+        if (group->background) {
+            Sleep(1);           // Left to the workers
+        } else if (parallel_take(&item, group)) {
+            parallel_execute(&item);
+        } else {
+            SwitchToThread();   // Its last tasks are running elsewhere
+        }
+    }
+}
+
+int parallel_done(ParallelGroup* group) {
+    return InterlockedCompareExchange(&group->pending, 0, 0) == 0;
+}
+
+void parallel_cancel(ParallelGroup* group) {
+    InterlockedExchange(&group->cancelled, 1);
+}
+
+int parallel_cancelled(ParallelGroup* group) {
+    return group->cancelled != 0;
+}
+
+double parallel_ticks_to_ms(LONG64 ticks) {
+    static double ms_per_tick = 0.0;
+    if (ms_per_tick == 0.0) {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        ms_per_tick = 1000.0 / (double)frequency.QuadPart;
+    }
+    return ticks * ms_per_tick;
+}
+
+void parallel_get_stats(ParallelStats* stats) {
+    *stats = parallel_pool.last;
+    stats->threads = parallel_thread_count();
+    stats->tasks_run = parallel_pool.tasks_run;
+    stats->steals = parallel_pool.steals;
+    stats->busy_ms = parallel_ticks_to_ms(parallel_pool.busy_ticks);
+}
+
+void parallel_run(ParallelTask task, void* context, int count) {
+    if (count <= 0) return;
+    
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+    ParallelGroup group;
+    parallel_group_init(&group);
+    
+    if (parallel_thread_count() == 1) {
+        // One thread: no pool, but the same timing
+        group.pending = count;
+        ParallelItem item;
+        item.task = task;
+        item.context = context;
+        item.first = 0;
+        item.last = 1;
+        item.group = &group;
+        for (int i = 0; i < count; i++) {
+            item.first = i;
+            item.last = i + 1;
+            parallel_execute(&item);
+        }
+    } else {
+        parallel_submit(&group, task, context, count);
+        parallel_wait(&group);
+    }
+    
+    QueryPerformanceCounter(&end);
+    if (parallel_self < 0) {
+        parallel_pool.last.last_tasks = group.tasks_run;
+        parallel_pool.last.last_wall_ms = parallel_ticks_to_ms(end.QuadPart - start.QuadPart);
+        parallel_pool.last.last_busy_ms = parallel_ticks_to_ms(group.busy_ticks);
+        parallel_pool.last.last_longest_ms = parallel_ticks_to_ms(group.longest_ticks);
+    }
+}
+
+// NEW: Stable parallel merge sort of an index array
+//
+// The array is cut into one chunk per thread; chunks are sorted in parallel
+// (insertion-sorted runs, then bottom-up merges), and sorted chunks are then
+// merged pairwise, each round's merges running in parallel. Equal items keep
+// their original order.
+
+typedef struct {
+    int* items;
+    int* scratch;
+    int count;
+    int width;              // Chunk size (phase 1) or run size being merged (phase 2)
+    int* source;            // Phase 2: runs are read from here...
+    int* dest;              // ...and merged into here
+    IndexCompare compare;
+    void* context;
+} ParallelSort;
+
+// Merge the sorted runs src[lo, mid) and src[mid, hi) into dst[lo, hi)
+void parallel_merge(ParallelSort* sort, const int* src, int* dst, int lo, int mid, int hi) {
+    int i = lo, j = mid, k = lo;
+
+    // Already in order: the runs just concatenate
+    if (mid > lo && mid < hi && sort->compare(sort->context, src[mid - 1], src[mid]) <= 0) {
+        memcpy(dst + lo, src + lo, (hi - lo) * sizeof(int));
+        return;
+    }
+
+    while (i < mid && j < hi) {
+        // Take from the right run only when strictly smaller (keeps the sort stable)
+        if (sort->compare(sort->context, src[j], src[i]) < 0) {
+            dst[k++] = src[j++];
+        } else {
+            dst[k++] = src[i++];
+        }
+    }
+    while (i < mid) dst[k++] = src[i++];
+    while (j < hi) dst[k++] = src[j++];
+}
+
+void parallel_sort_chunk(void* context, int index) {
+    ParallelSort* sort = (ParallelSort*)context;
+    int lo = index * sort->width;
+    int hi = lo + sort->width < sort->count ? lo + sort->width : sort->count;
+    int* a = sort->items;
+
+    for (int run = lo; run < hi; run += PARALLEL_INSERTION_RUN) {
+        int end = run + PARALLEL_INSERTION_RUN < hi ? run + PARALLEL_INSERTION_RUN : hi;
+        for (int i = run + 1; i < end; i++) {
+            int item = a[i];
+            int j = i - 1;
+            while (j >= run && sort->compare(sort->context, item, a[j]) < 0) {
+                a[j + 1] = a[j];
+                j--;
+            }
+            a[j + 1] = item;
+        }
+    }
+
+    int* src = sort->items;
+    int* dst = sort->scratch;
+    for (int width = PARALLEL_INSERTION_RUN; width < hi - lo; width *= 2) {
+        for (int left = lo; left < hi; left += 2 * width) {
+            int mid = left + width < hi ? left + width : hi;
+            int right = left + 2 * width < hi ? left + 2 * width : hi;
+            parallel_merge(sort, src, dst, left, mid, right);
+        }
+        int* swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    // Leave the sorted chunk in items
+    if (src != sort->items) {
+        memcpy(sort->items + lo, src + lo, (hi - lo) * sizeof(int));
+    }
+}
+
+void parallel_merge_pair(void* context, int index) {
+    ParallelSort* sort = (ParallelSort*)context;
+    int left = index * 2 * sort->width;
+    int mid = left + sort->width < sort->count ? left + sort->width : sort->count;
+    int right = left + 2 * sort->width < sort->count ? left + 2 * sort->width : sort->count;
+    parallel_merge(sort, sort->source, sort->dest, left, mid, right);
+}
+
+// Sort items in place with a stable merge sort. Returns 0 if scratch memory
+// could not be allocated (items are left unchanged).
+int parallel_sort_indices(int* items, int count, IndexCompare compare, void* context) {
+    if (count < 2) return 1;
+
+    ParallelSort sort;
+    sort.items = items;
+    sort.scratch = (int*)malloc(count * sizeof(int));
+    if (!sort.scratch) return 0;
+    sort.count = count;
+    sort.compare = compare;
+    sort.context = context;
+
+    int chunks = count < PARALLEL_MIN_SORT ? 1 : parallel_thread_count();
+    sort.width = (count + chunks - 1) / chunks;
+    chunks = (count + sort.width - 1) / sort.width;
+    parallel_run(parallel_sort_chunk, &sort, chunks);
+
+    sort.source = items;
+    sort.dest = sort.scratch;
+    while (sort.width < count) {
+        int pairs = (count + 2 * sort.width - 1) / (2 * sort.width);
+        parallel_run(parallel_merge_pair, &sort, pairs);
+        int* swap = sort.source;
+        sort.source = sort.dest;
+        sort.dest = swap;
+        sort.width *= 2;
+    }
+
+    if (sort.source != items) {
+        memcpy(items, sort.source, count * sizeof(int));
+    }
+    free(sort.scratch);
+    return 1;
+}
+
+#endif // PARALLEL_H
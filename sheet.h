@@ -9,6 +9,9 @@
 #include <ctype.h>
 #include <time.h>
 
+#include "formula.h"
+#include "parallel.h"
+
 // Cell types
 typedef enum {
     CELL_EMPTY,
@@ -68,6 +71,7 @@ typedef struct Cell {
             char* cached_string;    // For IF function string results
             int is_string_result;   // Flag indicating if result is a string
             ErrorType error;
+            FormulaTree* tree;      // NEW: Parsed expression, built on first recalc
         } formula;
     } data;
       // Display properties
@@ -104,12 +108,220 @@ typedef struct {
 } RangeSelection;
 
 // NEW: Range clipboard structure
+//
+// Copying a range only records where it is. The copied cells stay in the
+// sheet and are read from there at paste time. Before a copied cell is
+// changed, the write hook (sheet_touch_cell) preserves its original in
+// 'saved', so the clipboard keeps showing the contents at copy time.
+// Row blocks of 'saved' and 'compiled' are allocated only when first needed.
 typedef struct {
-    Cell*** cells;  // 2D array of copied cells
+    int src_row, src_col;   // Top-left of the copied region
     int rows, cols;
+    Cell*** saved;          // Per row: preserved originals (CLIPBOARD_EMPTY = was empty)
+    int saved_count;
+    CompiledFormula*** compiled;  // Per row: formulas compiled on first paste
     int is_active;
 } RangeClipboard;
 
+// NEW: Range snapshot structure (captured before bulk edits, used by undo)
+typedef enum {
+    SNAPSHOT_CELLS,     // Whole cells, held by reference
+    SNAPSHOT_FORMAT,    // Formatting fields only, stored column-wise
+    SNAPSHOT_SPARSE     // Whole cells at scattered positions (from a batch)
+} SnapshotKind;
+
+typedef struct {
+    SnapshotKind kind;
+    int start_row, start_col;
+    int end_row, end_col;
+    int count;                      // Number of positions, row-major
+    
+    // SNAPSHOT_CELLS / SNAPSHOT_SPARSE: cells detached from the grid (NULL = no cell)
+    Cell** cells;
+    int* rows;                      // SNAPSHOT_SPARSE: position of each entry
+    int* cols;
+    
+    // SNAPSHOT_FORMAT: one array per field, plus a bitmap of positions that had a cell
+    unsigned char* formats;
+    unsigned char* styles;
+    signed char* text_colors;
+    signed char* background_colors;
+    unsigned char* present;
+} RangeSnapshot;
+
+// NEW: Series fill types
+typedef enum {
+    SERIES_LINEAR,      // Add a fixed step
+    SERIES_GROWTH,      // Multiply by a fixed factor
+    SERIES_DATE         // Advance a date by a number of days, weeks, months or years
+} SeriesType;
+
+typedef enum {
+    DATE_UNIT_DAY,
+    DATE_UNIT_WEEK,
+    DATE_UNIT_MONTH,
+    DATE_UNIT_YEAR
+} DateUnit;
+
+// NEW: Batch edit state. While a batch is open, recalculation is deferred and
+// the first write to each cell moves the original into the journal.
+typedef struct {
+    int depth;                      // Nesting level of begin/commit pairs
+    unsigned char* touched;         // One bit per grid position
+    int* rows;                      // Journal: positions in first-touch order
+    int* cols;
+    Cell** originals;               // Journal: cells as they were before the batch
+    int count;
+    int capacity;
+    int failed;                     // A cell could not be journaled, so the batch can't be undone
+} SheetBatch;
+
+// NEW: Old text of formulas rewritten by a move, so the move can be undone
+typedef struct {
+    int* rows;              // Position of each formula after the move
+    int* cols;
+    char** texts;           // Text before the move (owned)
+    int count;
+    int capacity;
+} FormulaJournal;
+
+// NEW: A row/column insert or delete, kept so it can be reverted and redone
+typedef struct {
+    int on_rows;            // 1 = rows, 0 = columns
+    int at;                 // First row/column inserted or deleted
+    int count;
+    int deleting;
+    int applied;            // 1 while the change is on the sheet
+    int span;               // Length of each line (sheet width for rows, height for columns)
+    
+    // Lines taken out by a delete; owned by the change while it is applied
+    Cell*** removed_rows;   // Rows: the deleted row arrays
+    Cell** removed_cells;   // Columns: span x count cell pointers, row-major
+    int* removed_sizes;     // Heights/widths of the deleted lines
+    
+    FormulaJournal formulas;    // Formulas whose references were rewritten
+} StructuralChange;
+
+// NEW: Sort key: a sheet column and its direction
+typedef struct {
+    int col;
+    int descending;
+} SortKey;
+
+// NEW: A reordering of rows (from a sort), kept so it can be reverted and redone
+typedef struct {
+    int start_row, start_col;
+    int end_row, end_col;
+    int whole_rows;             // Move entire rows rather than just the column span
+    int* order;                 // Row start_row + i holds the row from start_row + order[i]
+    int applied;                // 1 while the sorted order is on the sheet
+    FormulaJournal formulas;    // Formulas rebased because their row moved
+} RowPermutation;
+
+// NEW: Filter predicates
+typedef enum {
+    FILTER_EQ,
+    FILTER_NE,
+    FILTER_LT,
+    FILTER_LE,
+    FILTER_GT,
+    FILTER_GE,
+    FILTER_CONTAINS,    // Text contains (case-insensitive)
+    FILTER_BETWEEN,     // low <= value <= high
+    FILTER_TOP,         // The 'low' largest values
+    FILTER_BOTTOM       // The 'low' smallest values
+} FilterOp;
+
+#define FILTER_MAX_PREDICATES 8
+
+typedef struct {
+    int col;
+    FilterOp op;
+    double low, high;   // Numeric operands (low only, except for FILTER_BETWEEN)
+    char* text;         // Text operand for FILTER_CONTAINS and text (in)equality
+    int is_text;
+} FilterPredicate;
+
+// NEW: Filtered view: the rows of start_row..end_row matching every
+// predicate, plus all rows outside that range
+typedef struct {
+    int start_row, end_row;
+    FilterPredicate predicates[FILTER_MAX_PREDICATES];
+    int predicate_count;
+    int* rows;          // Sheet rows shown, ascending
+    int count;
+    int matched;        // Rows of the range that matched
+} SheetFilter;
+
+// NEW: Range watchers. The sheet calls a watcher back with the part of its
+// range that was written, moved or recalculated to a different value; what
+// to do about it (e.g. refreshing a live chart) is up to the watcher.
+typedef void (*SheetWatchCallback)(void* context, int start_row, int start_col, int end_row, int end_col);
+
+typedef struct {
+    int start_row, start_col;
+    int end_row, end_col;
+    SheetWatchCallback callback;    // NULL marks a free slot
+    void* context;
+} SheetWatcher;
+
+// NEW: Column slice: the numbers of one column over a run of rows, read
+// into a flat array. valid[i] is 1 where the cell holds a number (or a
+// formula with a numeric result) and 0 elsewhere, where values[i] is 0.
+typedef struct {
+    int col;
+    int start_row;
+    int count;
+    double* values;
+    unsigned char* valid;
+} ColumnSlice;
+
+// NEW: Pivot (group-by) aggregation over a block of rows
+#define PIVOT_MAX_KEYS 4
+#define PIVOT_MAX_VALUES 8
+
+typedef enum {
+    PIVOT_SUM = 1,
+    PIVOT_COUNT = 2,
+    PIVOT_AVG = 4,
+    PIVOT_MIN = 8,
+    PIVOT_MAX = 16
+} PivotFunc;
+
+// Running aggregate of one value column within a group
+typedef struct {
+    double sum;
+    double min, max;
+    int count;                  // Numeric cells seen
+} PivotAggregate;
+
+typedef struct {
+    int start_row, end_row;     // Data rows (no header)
+    int key_cols[PIVOT_MAX_KEYS];
+    int key_count;
+    int value_cols[PIVOT_MAX_VALUES];
+    int value_count;
+    
+    // Result of sheet_pivot, one entry per group in key order
+    int group_count;
+    int* group_rows;            // First row of the group (holds its key cells)
+    int* group_sizes;           // Rows in the group
+    PivotAggregate* aggregates; // group_count x value_count, group-major
+} PivotTable;
+
+// NEW: Cached criteria index for the *IF functions (see sheet_criteria_index)
+typedef struct CriteriaIndex CriteriaIndex;
+#define CRITERIA_CACHE_SIZE 8
+
+// NEW: Formula cells found by a recalc scan, row-major (see sheet_recalculate)
+typedef struct {
+    Cell** cells;
+    int* positions;             // row * cols + col
+    unsigned int* tree_ids;     // Parsed tree of each cell when scanned
+    int count;
+    int capacity;
+} CalcScan;
+
 // Sheet structure
 typedef struct Sheet {
     Cell*** cells;      // 2D array of cell pointers
@@ -122,10 +334,32 @@ typedef struct Sheet {
     int needs_recalc;
     Cell** calc_order;  // Topological sort of cells for calculation
     int calc_count;
+    int* calc_index;            // NEW: Scan index of each cell of calc_order
+    int* calc_blocks;           // NEW: Per calc_order entry, the rows of the filled-down block it starts (else 0)
+    int calc_cycles;            // NEW: Cells left in cycles by the last sort
+    CalcScan calc_scan;         // NEW: The scan calc_order was built from
+    unsigned int structure_version;     // NEW: Bumped when row arrays move (threaded formulas rebind)
     
     // NEW: Range operations
     RangeSelection selection;
     RangeClipboard range_clipboard;
+    
+    // NEW: Open batch edit (NULL when not batching)
+    SheetBatch* batch;
+    
+    // NEW: Active filter (NULL when all rows are shown)
+    SheetFilter* filter;
+    
+    // NEW: Range watchers (slots are reused after sheet_unwatch)
+    SheetWatcher* watchers;
+    int watcher_count;
+    int watcher_capacity;
+    
+    // NEW: Change counter per column (bumped whenever a cell's value may
+    // have changed) and the criteria indexes built against those counters
+    unsigned int* col_versions;
+    CriteriaIndex* criteria_cache[CRITERIA_CACHE_SIZE];
+    unsigned int criteria_clock;
 } Sheet;
 
 // Function prototypes
@@ -149,33 +383,123 @@ void sheet_set_clipboard_cell(Cell* cell);
 int sheet_save_csv(Sheet* sheet, const char* filename, int preserve_formulas);
 int sheet_load_csv(Sheet* sheet, const char* filename, int preserve_formulas);
 
+// NEW: TSV (clipboard text) operations
+char* sheet_range_to_tsv(Sheet* sheet, int start_row, int start_col, int end_row, int end_col);
+int sheet_paste_tsv(Sheet* sheet, const char* text, int start_row, int start_col, int* out_rows, int* out_cols);
+int parse_number_fast(const char* str, size_t len, double* out);
+
 // Cell operations
 Cell* cell_new(int row, int col);
+Cell* cell_clone(const Cell* src);
 void cell_free(Cell* cell);
 void cell_set_number(Cell* cell, double value);
 void cell_set_string(Cell* cell, const char* str);
 void cell_set_formula(Cell* cell, const char* formula);
 void cell_clear(Cell* cell);
+void cell_take_formula(Cell* cell, char* expression);
+void cell_copy_format(Cell* dest, const Cell* src);
 char* cell_get_display_value(Cell* cell);
 
 // Formula evaluation
 double evaluate_formula(Sheet* sheet, const char* formula, ErrorType* error);
 double evaluate_expression(Sheet* sheet, const char* expr, ErrorType* error);
-double evaluate_comparison(Sheet* sheet, const char* expr, ErrorType* error);
 int parse_cell_reference(const char* ref, int* row, int* col);
 char* cell_reference_to_string(int row, int col);
 
-// Skip whitespace in expression
-void skip_whitespace(const char** expr);
-
 // NEW: Range copy/paste operations
 void sheet_start_range_selection(Sheet* sheet, int row, int col);
 void sheet_extend_range_selection(Sheet* sheet, int row, int col);
 void sheet_copy_range(Sheet* sheet);
 void sheet_paste_range(Sheet* sheet, int start_row, int start_col);
+void sheet_free_range_clipboard(Sheet* sheet);
+void sheet_clipboard_preserve(Sheet* sheet, int row, int col);
+void sheet_clipboard_preserve_range(Sheet* sheet, int start_row, int start_col, int end_row, int end_col);
+Cell* sheet_clipboard_cell_at(Sheet* sheet, int i, int j);
+
+// NEW: Fill operations
+int sheet_fill_line(Sheet* sheet, int src_row, int src_col, int row_step, int col_step, int count);
+int sheet_fill_down(Sheet* sheet, int start_row, int start_col, int end_row, int end_col);
+int sheet_fill_right(Sheet* sheet, int start_row, int start_col, int end_row, int end_col);
+int sheet_fill_series(Sheet* sheet, int start_row, int start_col, int end_row, int end_col,
+                      SeriesType type, double step, int has_step, DateUnit unit);
+double date_add_months(double serial, int months);
 void sheet_clear_range_selection(Sheet* sheet);
 int sheet_is_in_selection(Sheet* sheet, int row, int col);
 
+// NEW: Range snapshot functions
+RangeSnapshot* sheet_snapshot_range(Sheet* sheet, SnapshotKind kind, int start_row, int start_col, int end_row, int end_col);
+void sheet_snapshot_swap(Sheet* sheet, RangeSnapshot* snapshot);
+size_t sheet_snapshot_bytes(const RangeSnapshot* snapshot);
+void sheet_snapshot_free(RangeSnapshot* snapshot);
+
+// NEW: Batch edit functions
+void sheet_begin_batch(Sheet* sheet);
+RangeSnapshot* sheet_commit_batch(Sheet* sheet, int* failed);
+void sheet_rollback_batch(Sheet* sheet);
+void sheet_touch_cell(Sheet* sheet, int row, int col);
+void sheet_batch_free(SheetBatch* batch);
+
+// NEW: Row/column insert and delete
+StructuralChange* structural_change_new(int on_rows, int at, int count, int deleting);
+int sheet_apply_structural(Sheet* sheet, StructuralChange* change);
+void sheet_revert_structural(Sheet* sheet, StructuralChange* change);
+size_t structural_change_bytes(const StructuralChange* change);
+void structural_change_free(StructuralChange* change);
+int formula_journal_add(FormulaJournal* journal, int row, int col, char* old_text);
+void formula_journal_restore(Sheet* sheet, FormulaJournal* journal);
+size_t formula_journal_bytes(const FormulaJournal* journal);
+void formula_journal_free(FormulaJournal* journal);
+
+// NEW: Sorting
+RowPermutation* sheet_sort_range(Sheet* sheet, int start_row, int start_col, int end_row, int end_col,
+                                 int whole_rows, const SortKey* keys, int key_count);
+int sheet_apply_permutation(Sheet* sheet, RowPermutation* permutation);
+void sheet_revert_permutation(Sheet* sheet, RowPermutation* permutation);
+size_t row_permutation_bytes(const RowPermutation* permutation);
+void row_permutation_free(RowPermutation* permutation);
+int sheet_used_range(Sheet* sheet, int* start_row, int* start_col, int* end_row, int* end_col);
+
+// NEW: Filtering
+int sheet_filter_add(Sheet* sheet, const FilterPredicate* predicate, int start_row, int end_row);
+int sheet_filter_evaluate(Sheet* sheet);
+void sheet_filter_clear(Sheet* sheet);
+int cell_get_number(const Cell* cell, double* value);
+int sheet_view_count(Sheet* sheet);
+int sheet_view_row(Sheet* sheet, int index);
+int sheet_view_index(Sheet* sheet, int row);
+
+// NEW: Column slices
+int sheet_read_slice(Sheet* sheet, int col, int start_row, int count, ColumnSlice* slice);
+int sheet_read_slices(Sheet* sheet, int first_col, int col_count, int start_row, int count, ColumnSlice* slices);
+void column_slice_free(ColumnSlice* slice);
+
+// NEW: Pivot aggregation
+int pivot_key_kind(const Cell* cell, double* number, const char** text);
+unsigned long long pivot_key_hash(int kind, double number, const char* text);
+int pivot_key_compare(int kind_a, double number_a, const char* text_a, int kind_b, double number_b, const char* text_b);
+int sheet_pivot(Sheet* sheet, PivotTable* pivot);
+void pivot_free(PivotTable* pivot);
+
+// NEW: Criteria indexes (conditional aggregates)
+CriteriaIndex* sheet_criteria_index(Sheet* sheet, int col, int start_row, int end_row);
+void criteria_index_free(CriteriaIndex* index);
+void sheet_criteria_cache_clear(Sheet* sheet);
+
+// NEW: Dependency-ordered recalculation
+void calc_scan_free(CalcScan* scan);
+int sheet_build_calc_order(Sheet* sheet, const CalcScan* scan);
+void sheet_recalculate_cell(Sheet* sheet, Cell* cell, int row, int col);
+int sheet_recalculate_run(Sheet* sheet, int first);
+void sheet_find_calc_blocks(Sheet* sheet, const CalcScan* scan);
+int sheet_recalculate_block(Sheet* sheet, int first, int rows);
+
+// NEW: Range watchers
+int sheet_watch_range(Sheet* sheet, int start_row, int start_col, int end_row, int end_col,
+                      SheetWatchCallback callback, void* context);
+void sheet_unwatch(Sheet* sheet, int id);
+void sheet_notify_range(Sheet* sheet, int start_row, int start_col, int end_row, int end_col);
+void sheet_notify_all(Sheet* sheet);
+
 // NEW: Cell formatting functions
 void cell_set_format(Cell* cell, DataFormat format, FormatStyle style);
 char* format_cell_value(Cell* cell);
@@ -239,10 +563,12 @@ Sheet* sheet_new(int rows, int cols) {
         sheet->row_heights[i] = 1;  // Default height
     }
     
+    // NEW: Column change counters for cached criteria indexes
+    sheet->col_versions = (unsigned int*)calloc(cols, sizeof(unsigned int));
+    
     // NEW: Initialize range selection and clipboard
     sheet->selection.is_active = 0;
-    sheet->range_clipboard.is_active = 0;
-    sheet->range_clipboard.cells = NULL;
+    memset(&sheet->range_clipboard, 0, sizeof(sheet->range_clipboard));
     
     return sheet;
 }
@@ -250,6 +576,14 @@ Sheet* sheet_new(int rows, int cols) {
 void sheet_free(Sheet* sheet) {
     if (!sheet) return;
     
+    // NEW: Discard any batch still open
+    if (sheet->batch) {
+        for (int i = 0; i < sheet->batch->count; i++) {
+            cell_free(sheet->batch->originals[i]);
+        }
+        sheet_batch_free(sheet->batch);
+    }
+    
     // Free all cells
     for (int i = 0; i < sheet->rows; i++) {
         for (int j = 0; j < sheet->cols; j++) {
@@ -260,22 +594,19 @@ void sheet_free(Sheet* sheet) {
         free(sheet->cells[i]);    }
     free(sheet->cells);
     
-    // NEW: Free range clipboard
-    if (sheet->range_clipboard.cells) {
-        for (int i = 0; i < sheet->range_clipboard.rows; i++) {
-            for (int j = 0; j < sheet->range_clipboard.cols; j++) {
-                if (sheet->range_clipboard.cells[i][j]) {
-                    cell_free(sheet->range_clipboard.cells[i][j]);
-                }
-            }
-            free(sheet->range_clipboard.cells[i]);
-        }
-        free(sheet->range_clipboard.cells);
-    }
+    // NEW: Free range clipboard and filter
+    sheet_free_range_clipboard(sheet);
+    sheet_filter_clear(sheet);
+    free(sheet->watchers);
+    sheet_criteria_cache_clear(sheet);
+    free(sheet->col_versions);
       free(sheet->col_widths);
     free(sheet->row_heights);  // NEW: Free row heights
     free(sheet->name);
     free(sheet->calc_order);
+    free(sheet->calc_index);
+    free(sheet->calc_blocks);
+    calc_scan_free(&sheet->calc_scan);
     free(sheet);
 }
 
@@ -291,6 +622,7 @@ Cell* sheet_get_or_create_cell(Sheet* sheet, int row, int col) {
         return NULL;
     }
     
+    sheet_touch_cell(sheet, row, col);
     if (!sheet->cells[row][col]) {
         sheet->cells[row][col] = cell_new(row, col);
     }
@@ -319,6 +651,33 @@ Cell* cell_new(int row, int col) {
     return cell;
 }
 
+// Deep copy of a cell's value and display properties (dependencies are not copied)
+Cell* cell_clone(const Cell* src) {
+    if (!src) return NULL;
+    
+    Cell* cell = (Cell*)malloc(sizeof(Cell));
+    if (!cell) return NULL;
+    *cell = *src;
+    cell->depends_on = NULL;
+    cell->depends_count = 0;
+    cell->dependents = NULL;
+    cell->dependents_count = 0;
+    
+    if (src->type == CELL_STRING && src->data.string) {
+        cell->data.string = _strdup(src->data.string);
+    } else if (src->type == CELL_FORMULA) {
+        if (src->data.formula.expression) {
+            cell->data.formula.expression = _strdup(src->data.formula.expression);
+        }
+        if (src->data.formula.cached_string) {
+            cell->data.formula.cached_string = _strdup(src->data.formula.cached_string);
+        }
+        cell->data.formula.tree = NULL;
+    }
+    
+    return cell;
+}
+
 void cell_free(Cell* cell) {
     if (!cell) return;
       // Free string data
@@ -331,6 +690,7 @@ void cell_free(Cell* cell) {
         if (cell->data.formula.cached_string) {
             free(cell->data.formula.cached_string);
         }
+        formula_tree_free(cell->data.formula.tree);
     }
     
     // Free dependency arrays
@@ -354,7 +714,10 @@ void cell_clear(Cell* cell) {
         if (cell->data.formula.cached_string) {
             free(cell->data.formula.cached_string);
             cell->data.formula.cached_string = NULL;
-        }    }
+        }
+        formula_tree_free(cell->data.formula.tree);
+        cell->data.formula.tree = NULL;
+    }
     
     cell->type = CELL_EMPTY;
     // Keep formatting when clearing
@@ -386,6 +749,23 @@ void cell_set_formula(Cell* cell, const char* formula) {
     cell->data.formula.cached_string = NULL;
     cell->data.formula.is_string_result = 0;
     cell->data.formula.error = ERROR_NONE;
+    cell->data.formula.tree = NULL;
+}
+
+// Like cell_set_formula, but takes ownership of an already allocated expression
+void cell_take_formula(Cell* cell, char* expression) {
+    if (!cell) {
+        free(expression);
+        return;
+    }
+    cell_clear(cell);
+    cell->type = CELL_FORMULA;
+    cell->data.formula.expression = expression;
+    cell->data.formula.cached_value = 0.0;
+    cell->data.formula.cached_string = NULL;
+    cell->data.formula.is_string_result = 0;
+    cell->data.formula.error = ERROR_NONE;
+    cell->data.formula.tree = NULL;
 }
 
 void sheet_set_number(Sheet* sheet, int row, int col, double value) {
@@ -400,6 +780,7 @@ void sheet_set_string(Sheet* sheet, int row, int col, const char* str) {
     Cell* cell = sheet_get_or_create_cell(sheet, row, col);
     if (cell) {
         cell_set_string(cell, str);
+        sheet->needs_recalc = 1;    // Text can be a criterion (SUMIF etc.)
     }
 }
 
@@ -414,6 +795,8 @@ void sheet_set_formula(Sheet* sheet, int row, int col, const char* formula) {
 void sheet_clear_cell(Sheet* sheet, int row, int col) {
     Cell* cell = sheet_get_cell(sheet, row, col);
     if (cell) {
+        sheet_touch_cell(sheet, row, col);
+        cell = sheet->cells[row][col];
         cell_clear(cell);
         sheet->needs_recalc = 1;
     }
@@ -465,7 +848,8 @@ int parse_cell_reference(const char* ref, int* row, int* col) {
     // Skip whitespace
     while (*p && isspace(*p)) p++;
     
-    // Parse column letters
+    // Parse column letters (optionally marked absolute with '$')
+    if (*p == '$') p++;
     if (!isalpha(*p)) return 0;
     
     while (*p && isalpha(*p)) {
@@ -475,6 +859,7 @@ int parse_cell_reference(const char* ref, int* row, int* col) {
     (*col)--;  // Convert to 0-based
     
     // Parse row number
+    if (*p == '$') p++;
     if (!isdigit(*p)) return 0;
     
     *row = 0;
@@ -491,19 +876,6 @@ int parse_cell_reference(const char* ref, int* row, int* col) {
     return 1;
 }
 
-// Forward declarations for expression parsing
-double parse_arithmetic_expression(Sheet* sheet, const char** expr, ErrorType* error);
-double parse_arithmetic_expression_old(Sheet* sheet, const char* expr, ErrorType* error);
-double parse_term(Sheet* sheet, const char** expr, ErrorType* error);
-double parse_factor(Sheet* sheet, const char** expr, ErrorType* error);
-double parse_function(Sheet* sheet, const char** expr, ErrorType* error);
-void skip_whitespace(const char** expr);
-
-// Global variables for IF function string results
-extern char g_if_result_string[256];
-extern int g_if_result_is_string;
-extern Cell* g_current_evaluating_cell;
-
 // Range parsing structures
 typedef struct {
     int start_row, start_col;
@@ -511,7 +883,129 @@ typedef struct {
 } CellRange;
 
 int parse_range(const char* range_str, CellRange* range);
-int get_range_values(Sheet* sheet, const CellRange* range, double* values, int max_values);
+
+// NEW: Criteria for SUMIF/COUNTIF/AVERAGEIF and the *IFS functions
+typedef enum {
+    CRITERIA_EQ,
+    CRITERIA_NE,
+    CRITERIA_LT,
+    CRITERIA_LE,
+    CRITERIA_GT,
+    CRITERIA_GE
+} CriteriaOp;
+
+#define CRITERIA_MAX 16             // Criteria pairs in one *IFS call
+
+typedef struct {
+    CriteriaOp op;
+    int kind;           // Operand kind, as pivot_key_kind: 0 blank, 1 number, 2 text
+    double number;
+    char text[256];
+    int wildcard;       // Text operand with * or ? (equality tests only)
+} Criterion;
+
+void criteria_parse(const char* text, Criterion* criterion);
+int criteria_match_cell(const Criterion* criterion, const Cell* cell);
+int text_wildcard_match(const char* text, const char* pattern);
+double sheet_conditional_aggregate(Sheet* sheet, PivotFunc func, const CellRange* value_range,
+                                   const CellRange* criteria_ranges, const Criterion* criteria, int count, ErrorType* error);
+
+// NEW: Formula tree evaluation
+typedef enum {
+    FVALUE_NUMBER,
+    FVALUE_STRING,
+    FVALUE_BLANK,       // An empty cell: 0 in arithmetic, "" against text
+    FVALUE_ERROR
+} FormulaValueType;
+
+typedef struct {
+    FormulaValueType type;
+    double number;
+    const char* string;     // FVALUE_STRING: borrowed from the tree or a cell
+    ErrorType error;
+} FormulaValue;
+
+// A shared node's value, valid while 'generation' matches the tree's
+typedef struct {
+    unsigned int generation;
+    FormulaValue value;
+} FormulaMemo;
+
+// NEW: Threaded tier. A hot tree is compiled to one op per node; each op
+// holds the function that computes it and direct pointers to its operands.
+typedef enum {
+    FORMULA_TIER_INTERPRETER,
+    FORMULA_TIER_THREADED
+} FormulaTier;
+
+#define FORMULA_HOT_EVALUATIONS 2   // Evaluations of a tree before it is compiled
+#define FORMULA_BLOCK_MIN_ROWS 16   // Shortest filled-down block evaluated a column at a time
+#define FORMULA_BLOCK_CHUNK 256     // Rows of a block evaluated together
+
+// Whole-formula shapes common enough to get a kernel of their own
+typedef enum {
+    FORMULA_KERNEL_NONE,
+    FORMULA_KERNEL_SUM_RANGE,       // =SUM(range)
+    FORMULA_KERNEL_REF_OP_REF,      // =ref op ref, op one of + - * /
+    FORMULA_KERNEL_REF_OP_CONSTANT, // =ref op number or =number op ref
+    FORMULA_KERNEL_VLOOKUP_EXACT    // =VLOOKUP(ref, range, k, 0)
+} FormulaKernel;
+
+typedef struct FormulaOp FormulaOp;
+typedef FormulaValue (*FormulaOpFunction)(const FormulaOp* op, Sheet* sheet);
+
+struct FormulaOp {
+    FormulaOpFunction run;
+    FormulaOpFunction compute;  // What run computes (run remembers it for a shared node)
+    const FormulaOp* a;         // Operands, in argument order
+    const FormulaOp* b;
+    const FormulaOp* c;         // IF's else branch (NULL when left out)
+    Cell** slot;                // FNODE_REF: the grid slot it reads, else NULL
+    FormulaValue constant;      // FNODE_NUMBER and FNODE_STRING
+    FormulaNodeType type;       // Arithmetic and comparisons: which one
+    CellRange range;            // Kernels: the range read
+    int column;                 // VLOOKUP kernel: column of the range returned (from 1)
+    int index;                  // The node in the tree
+    const FormulaTree* tree;
+};
+
+typedef struct {
+    const Sheet* sheet;                 // Sheet the slots were bound in
+    unsigned int structure_version;     // ...and its structure_version then
+    int count;
+    FormulaKernel kernel;               // Shape of the whole formula, computed by the root op
+    FormulaOp* ops;                     // One per tree node, in the same block
+} FormulaProgram;
+
+FormulaTier formula_tier = FORMULA_TIER_THREADED;
+Cell* formula_no_cell = NULL;       // The slot of references off the grid (never written)
+
+FormulaValue formula_eval(Sheet* sheet, const FormulaTree* tree, int index);
+FormulaValue formula_eval_node(Sheet* sheet, const FormulaTree* tree, int index);
+FormulaValue formula_eval_tree(Sheet* sheet, FormulaTree* tree);
+FormulaValue formula_eval_program(Sheet* sheet, FormulaTree* tree, const FormulaProgram* program);
+FormulaValue formula_cell_value(const Cell* cell);
+FormulaValue formula_number_value(double number);
+FormulaValue formula_error_value(ErrorType error);
+FormulaValue formula_eval_conditional(Sheet* sheet, const FormulaTree* tree, const FormulaNode* node);
+int formula_node_range(const FormulaNode* node, CellRange* range, ErrorType* error);
+FormulaTree* cell_formula_tree(Cell* cell);
+int formula_op_number(const FormulaOp* op, Sheet* sheet, double* number, ErrorType* error);
+FormulaValue formula_op_constant(const FormulaOp* op, Sheet* sheet);
+FormulaValue formula_op_interpret(const FormulaOp* op, Sheet* sheet);
+FormulaValue formula_op_shared(const FormulaOp* op, Sheet* sheet);
+FormulaValue formula_arith(FormulaNodeType type, double a, double b);
+FormulaValue formula_op_arith(const FormulaOp* op, Sheet* sheet);
+int formula_slot_number(const Cell* cell, double* number);
+int sheet_lookup_exact(Sheet* sheet, const CellRange* range, FormulaValue lookup, int* row);
+FormulaKernel formula_program_kernel(FormulaProgram* program, const FormulaTree* tree);
+FormulaProgram* formula_compile_program(const FormulaTree* tree);
+void formula_program_bind(FormulaProgram* program, const FormulaTree* tree, Sheet* sheet);
+FormulaProgram* formula_tree_program(Sheet* sheet, FormulaTree* tree);
+int formula_tree_columnar(const FormulaTree* tree);
+int formula_tree_filled_down(const FormulaTree* first, const FormulaTree* second, const FormulaTree* tree, int offset);
+void sheet_store_formula_value(Sheet* sheet, Cell* cell, int row, int col, FormulaValue value);
+int formula_store_result(Cell* cell, FormulaValue value);
 
 // Function implementations
 double func_sum(const double* values, int count);
@@ -520,9 +1014,6 @@ double func_max(const double* values, int count);
 double func_min(const double* values, int count);
 double func_median(double* values, int count);
 double func_mode(const double* values, int count);
-double func_if(double condition, double true_val, double false_val);
-double func_if_enhanced(double condition, double true_val, double false_val, 
-                       const char* true_str, const char* false_str);
 double func_power(double base, double exponent);
 
 // Parse range notation like "A1:A3" or "B2:D5"
@@ -565,41 +1056,6 @@ int parse_range(const char* range_str, CellRange* range) {
     return 1;
 }
 
-// Get values from a range of cells
-int get_range_values(Sheet* sheet, const CellRange* range, double* values, int max_values) {
-    int count = 0;
-    
-    for (int row = range->start_row; row <= range->end_row; row++) {
-        for (int col = range->start_col; col <= range->end_col; col++) {
-            if (count >= max_values) break;
-            
-            Cell* cell = sheet_get_cell(sheet, row, col);
-            if (cell) {
-                switch (cell->type) {
-                    case CELL_NUMBER:
-                        values[count++] = cell->data.number;
-                        break;
-                    case CELL_FORMULA:
-                        if (cell->data.formula.error == ERROR_NONE) {
-                            values[count++] = cell->data.formula.cached_value;
-                        }
-                        break;
-                    case CELL_EMPTY:
-                        values[count++] = 0.0;
-                        break;
-                    default:
-                        // Skip strings and errors
-                        break;
-                }
-            } else {
-                values[count++] = 0.0;
-            }
-        }
-    }
-    
-    return count;
-}
-
 // Function implementations
 double func_sum(const double* values, int count) {
     double sum = 0.0;
@@ -679,76 +1135,10 @@ double func_mode(const double* values, int count) {
     return mode;
 }
 
-double func_if(double condition, double true_val, double false_val) {
-    return (condition != 0.0) ? true_val : false_val;
-}
-
-// Global variables for IF function string results
-char g_if_result_string[256] = {0};
-int g_if_result_is_string = 0;
-Cell* g_current_evaluating_cell = NULL;  // Track current cell during evaluation
-
-double func_if_enhanced(double condition, double true_val, double false_val, 
-                       const char* true_str, const char* false_str) {
-    // Reset global string result flag
-    g_if_result_is_string = 0;
-    g_if_result_string[0] = '\0';
-    
-    // Also reset the current cell's string result
-    if (g_current_evaluating_cell) {
-        if (g_current_evaluating_cell->data.formula.cached_string) {
-            free(g_current_evaluating_cell->data.formula.cached_string);
-            g_current_evaluating_cell->data.formula.cached_string = NULL;
-        }
-        g_current_evaluating_cell->data.formula.is_string_result = 0;
-    }
-    
-    if (condition != 0.0) {
-        // True condition
-        if (true_str) {
-            strcpy_s(g_if_result_string, sizeof(g_if_result_string), true_str);
-            g_if_result_is_string = 1;
-            
-            // Store in current cell if available
-            if (g_current_evaluating_cell) {
-                g_current_evaluating_cell->data.formula.cached_string = _strdup(true_str);
-                g_current_evaluating_cell->data.formula.is_string_result = 1;
-            }
-            
-            return 1.0; // Return non-zero to indicate string result available
-        } else {
-            return true_val;
-        }
-    } else {
-        // False condition
-        if (false_str) {
-            strcpy_s(g_if_result_string, sizeof(g_if_result_string), false_str);
-            g_if_result_is_string = 1;
-            
-            // Store in current cell if available
-            if (g_current_evaluating_cell) {
-                g_current_evaluating_cell->data.formula.cached_string = _strdup(false_str);
-                g_current_evaluating_cell->data.formula.is_string_result = 1;
-            }
-            
-            return 0.0; // Return zero to indicate string result available
-        } else {
-            return false_val;
-        }
-    }
-}
-
 double func_power(double base, double exponent) {
     return pow(base, exponent);
 }
 
-// Skip whitespace in expression
-void skip_whitespace(const char** expr) {
-    while (**expr && isspace(**expr)) {
-        (*expr)++;
-    }
-}
-
 // Clipboard functionality
 static Cell* clipboard_cell = NULL;
 
@@ -795,6 +1185,21 @@ void sheet_set_clipboard_cell(Cell* cell) {
     }
 }
 
+// Give dest a copy of src's formula moved by the given offsets: the text is
+// rendered from 'compiled' and src's parsed tree is copied with the same
+// shift, so the copy is never parsed again. src and dest may be the same cell.
+void cell_take_shifted_formula(Cell* dest, Cell* src, const CompiledFormula* compiled, int row_delta, int col_delta) {
+    FormulaTree* tree = cell_formula_tree(src);
+    FormulaTree* shifted = tree ? formula_tree_shifted(tree, row_delta, col_delta) : NULL;
+    char* expression = formula_render(compiled, row_delta, col_delta);
+    cell_take_formula(dest, expression);
+    if (expression) {
+        dest->data.formula.tree = shifted;
+    } else {
+        formula_tree_free(shifted);
+    }
+}
+
 void sheet_copy_cell(Sheet* sheet, int src_row, int src_col, int dest_row, int dest_col) {
     Cell* src_cell = sheet_get_cell(sheet, src_row, src_col);
     
@@ -811,9 +1216,15 @@ void sheet_copy_cell(Sheet* sheet, int src_row, int src_col, int dest_row, int d
         case CELL_STRING:
             sheet_set_string(sheet, dest_row, dest_col, src_cell->data.string);
             break;
-        case CELL_FORMULA:
-            sheet_set_formula(sheet, dest_row, dest_col, src_cell->data.formula.expression);
+        case CELL_FORMULA: {
+            // Shift relative references by the copy offset
+            CompiledFormula* compiled = formula_compile(src_cell->data.formula.expression);
+            Cell* dest = sheet_get_or_create_cell(sheet, dest_row, dest_col);
+            cell_take_shifted_formula(dest, src_cell, compiled, dest_row - src_row, dest_col - src_col);
+            formula_free(compiled);
+            sheet->needs_recalc = 1;
             break;
+        }
         default:
             sheet_clear_cell(sheet, dest_row, dest_col);
             break;
@@ -869,22 +1280,12 @@ int sheet_is_in_selection(Sheet* sheet, int row, int col) {
     return (row >= min_row && row <= max_row && col >= min_col && col <= max_col);
 }
 
-// NEW: Copy range to clipboard
+// NEW: Copy range to clipboard (records the region; cells are not copied)
 void sheet_copy_range(Sheet* sheet) {
     if (!sheet->selection.is_active) return;
     
     // Free existing clipboard
-    if (sheet->range_clipboard.cells) {
-        for (int i = 0; i < sheet->range_clipboard.rows; i++) {
-            for (int j = 0; j < sheet->range_clipboard.cols; j++) {
-                if (sheet->range_clipboard.cells[i][j]) {
-                    cell_free(sheet->range_clipboard.cells[i][j]);
-                }
-            }
-            free(sheet->range_clipboard.cells[i]);
-        }
-        free(sheet->range_clipboard.cells);
-    }
+    sheet_free_range_clipboard(sheet);
     
     // Calculate range dimensions
     int min_row = sheet->selection.start_row < sheet->selection.end_row ? 
@@ -896,66 +1297,124 @@ void sheet_copy_range(Sheet* sheet) {
     int max_col = sheet->selection.start_col > sheet->selection.end_col ? 
                   sheet->selection.start_col : sheet->selection.end_col;
     
-    int rows = max_row - min_row + 1;
-    int cols = max_col - min_col + 1;
+    RangeClipboard* clipboard = &sheet->range_clipboard;
+    clipboard->src_row = min_row;
+    clipboard->src_col = min_col;
+    clipboard->rows = max_row - min_row + 1;
+    clipboard->cols = max_col - min_col + 1;
+    clipboard->saved = (Cell***)calloc(clipboard->rows, sizeof(Cell**));
+    clipboard->compiled = (CompiledFormula***)calloc(clipboard->rows, sizeof(CompiledFormula**));
+    if (!clipboard->saved || !clipboard->compiled) {
+        sheet_free_range_clipboard(sheet);
+        return;
+    }
     
-    // Allocate clipboard
-    sheet->range_clipboard.rows = rows;
-    sheet->range_clipboard.cols = cols;
-    sheet->range_clipboard.cells = (Cell***)calloc(rows, sizeof(Cell**));
+    clipboard->is_active = 1;
+}
+
+// Marks a preserved position whose cell was empty at copy time
+static Cell clipboard_empty_cell;
+#define CLIPBOARD_EMPTY (&clipboard_empty_cell)
+
+// Keep the copy-time contents of (row, col) if it is part of the copied
+// region and is about to change
+void sheet_clipboard_preserve(Sheet* sheet, int row, int col) {
+    RangeClipboard* clipboard = &sheet->range_clipboard;
+    if (!clipboard->is_active) return;
+    
+    int i = row - clipboard->src_row;
+    int j = col - clipboard->src_col;
+    if (i < 0 || i >= clipboard->rows || j < 0 || j >= clipboard->cols) return;
+    
+    if (!clipboard->saved[i]) {
+        clipboard->saved[i] = (Cell**)calloc(clipboard->cols, sizeof(Cell*));
+        if (!clipboard->saved[i]) return;
+    }
+    if (clipboard->saved[i][j]) return;
     
-    for (int i = 0; i < rows; i++) {
-        sheet->range_clipboard.cells[i] = (Cell**)calloc(cols, sizeof(Cell*));
+    Cell* original = sheet->cells[row][col];
+    Cell* copy = original ? cell_clone(original) : NULL;
+    clipboard->saved[i][j] = copy ? copy : CLIPBOARD_EMPTY;
+    clipboard->saved_count++;
+}
+
+// Preserve every copied cell inside a rectangle. Used before operations that
+// move cells around in the grid rather than writing through the cell setters.
+void sheet_clipboard_preserve_range(Sheet* sheet, int start_row, int start_col, int end_row, int end_col) {
+    RangeClipboard* clipboard = &sheet->range_clipboard;
+    if (!clipboard->is_active) return;
+    
+    int min_row = max(min(start_row, end_row), clipboard->src_row);
+    int max_row = min(max(start_row, end_row), clipboard->src_row + clipboard->rows - 1);
+    int min_col = max(min(start_col, end_col), clipboard->src_col);
+    int max_col = min(max(start_col, end_col), clipboard->src_col + clipboard->cols - 1);
+    
+    for (int row = min_row; row <= max_row; row++) {
+        for (int col = min_col; col <= max_col; col++) {
+            sheet_clipboard_preserve(sheet, row, col);
+        }
     }
+}
+
+// Clipboard contents at offset (i, j) as of copy time (NULL = empty)
+Cell* sheet_clipboard_cell_at(Sheet* sheet, int i, int j) {
+    RangeClipboard* clipboard = &sheet->range_clipboard;
     
-    // Copy cells
-    for (int i = 0; i < rows; i++) {
-        for (int j = 0; j < cols; j++) {
-            Cell* src_cell = sheet_get_cell(sheet, min_row + i, min_col + j);
-            if (src_cell) {
-                Cell* copied_cell = cell_new(min_row + i, min_col + j);
-                switch (src_cell->type) {
-                    case CELL_NUMBER:
-                        cell_set_number(copied_cell, src_cell->data.number);
-                        break;
-                    case CELL_STRING:
-                        cell_set_string(copied_cell, src_cell->data.string);
-                        break;
-                    case CELL_FORMULA:
-                        cell_set_formula(copied_cell, src_cell->data.formula.expression);
-                        copied_cell->data.formula.cached_value = src_cell->data.formula.cached_value;
-                        copied_cell->data.formula.error = src_cell->data.formula.error;
-                        break;
-                    default:
-                        break;
+    if (clipboard->saved[i] && clipboard->saved[i][j]) {
+        Cell* saved = clipboard->saved[i][j];
+        return saved == CLIPBOARD_EMPTY ? NULL : saved;
+    }
+    return sheet->cells[clipboard->src_row + i][clipboard->src_col + j];
+}
+
+// NEW: Release the range clipboard's preserved cells and compiled formulas
+void sheet_free_range_clipboard(Sheet* sheet) {
+    RangeClipboard* clipboard = &sheet->range_clipboard;
+    
+    if (clipboard->saved) {
+        for (int i = 0; i < clipboard->rows; i++) {
+            if (!clipboard->saved[i]) continue;
+            for (int j = 0; j < clipboard->cols; j++) {
+                if (clipboard->saved[i][j] && clipboard->saved[i][j] != CLIPBOARD_EMPTY) {
+                    cell_free(clipboard->saved[i][j]);
                 }
-                // Copy display and formatting properties
-                copied_cell->width = src_cell->width;
-                copied_cell->precision = src_cell->precision;
-                copied_cell->align = src_cell->align;
-                copied_cell->format = src_cell->format;
-                copied_cell->format_style = src_cell->format_style;
-                
-                sheet->range_clipboard.cells[i][j] = copied_cell;
             }
+            free(clipboard->saved[i]);
+        }
+        free(clipboard->saved);
+    }
+    
+    if (clipboard->compiled) {
+        for (int i = 0; i < clipboard->rows; i++) {
+            if (!clipboard->compiled[i]) continue;
+            for (int j = 0; j < clipboard->cols; j++) {
+                formula_free(clipboard->compiled[i][j]);
+            }
+            free(clipboard->compiled[i]);
         }
+        free(clipboard->compiled);
     }
     
-    sheet->range_clipboard.is_active = 1;
+    memset(clipboard, 0, sizeof(*clipboard));
 }
 
 // NEW: Paste range from clipboard
 void sheet_paste_range(Sheet* sheet, int start_row, int start_col) {
-    if (!sheet->range_clipboard.is_active) return;
+    RangeClipboard* clipboard = &sheet->range_clipboard;
+    if (!clipboard->is_active) return;
     
-    for (int i = 0; i < sheet->range_clipboard.rows; i++) {
-        for (int j = 0; j < sheet->range_clipboard.cols; j++) {
+    for (int i = 0; i < clipboard->rows; i++) {
+        for (int j = 0; j < clipboard->cols; j++) {
             int dest_row = start_row + i;
             int dest_col = start_col + j;
             
             if (dest_row >= sheet->rows || dest_col >= sheet->cols) continue;
             
-            Cell* src_cell = sheet->range_clipboard.cells[i][j];
+            // Touching the destination preserves it if it was copied, so
+            // read the source only afterwards
+            sheet_touch_cell(sheet, dest_row, dest_col);
+            Cell* src_cell = sheet_clipboard_cell_at(sheet, i, j);
+            
             if (src_cell) {
                 Cell* dest_cell = sheet_get_or_create_cell(sheet, dest_row, dest_col);
                 if (dest_cell) {
@@ -966,9 +1425,28 @@ void sheet_paste_range(Sheet* sheet, int start_row, int start_col) {
                         case CELL_STRING:
                             cell_set_string(dest_cell, src_cell->data.string);
                             break;
-                        case CELL_FORMULA:
-                            cell_set_formula(dest_cell, src_cell->data.formula.expression);
+                        case CELL_FORMULA: {
+                            // Compile each copied formula once; pastes only rebase its
+                            // text and copy its tree
+                            if (!clipboard->compiled[i]) {
+                                clipboard->compiled[i] = (CompiledFormula**)calloc(clipboard->cols, sizeof(CompiledFormula*));
+                            }
+                            CompiledFormula* compiled = NULL;
+                            if (clipboard->compiled[i]) {
+                                if (!clipboard->compiled[i][j]) {
+                                    clipboard->compiled[i][j] = formula_compile(src_cell->data.formula.expression);
+                                }
+                                compiled = clipboard->compiled[i][j];
+                            }
+                            int row_delta = dest_row - (clipboard->src_row + i);
+                            int col_delta = dest_col - (clipboard->src_col + j);
+                            if (compiled) {
+                                cell_take_shifted_formula(dest_cell, src_cell, compiled, row_delta, col_delta);
+                            } else {
+                                cell_set_formula(dest_cell, src_cell->data.formula.expression);
+                            }
                             break;
+                        }
                         default:
                             cell_clear(dest_cell);
                             break;
@@ -986,733 +1464,4267 @@ void sheet_paste_range(Sheet* sheet, int start_row, int start_col) {
         }
     }
     
+    sheet->needs_recalc = 1;
     sheet_recalculate(sheet);
 }
 
-// NEW: Cell formatting functions
-void cell_set_format(Cell* cell, DataFormat format, FormatStyle style) {
-    if (!cell) return;
+// NEW: Range snapshots
+//
+// A SNAPSHOT_CELLS snapshot takes the existing Cell objects out of the grid
+// instead of copying them, and leaves a formatting-only clone in their place.
+// No strings are duplicated, so it is meant for operations that go on to
+// overwrite the values in the range (such as paste). A SNAPSHOT_FORMAT
+// snapshot records only the formatting fields and suits operations that
+// leave values alone. Either kind is undone or redone with
+// sheet_snapshot_swap, which exchanges the snapshot with the grid contents.
+
+RangeSnapshot* sheet_snapshot_range(Sheet* sheet, SnapshotKind kind, int start_row, int start_col, int end_row, int end_col) {
+    int min_row = max(0, min(start_row, end_row));
+    int max_row = min(sheet->rows - 1, max(start_row, end_row));
+    int min_col = max(0, min(start_col, end_col));
+    int max_col = min(sheet->cols - 1, max(start_col, end_col));
+    if (min_row > max_row || min_col > max_col) return NULL;
+    
+    RangeSnapshot* snapshot = (RangeSnapshot*)calloc(1, sizeof(RangeSnapshot));
+    if (!snapshot) return NULL;
+    
+    if (kind == SNAPSHOT_CELLS) {
+        sheet_clipboard_preserve_range(sheet, min_row, min_col, max_row, max_col);
+    }
+    snapshot->kind = kind;
+    snapshot->start_row = min_row;
+    snapshot->start_col = min_col;
+    snapshot->end_row = max_row;
+    snapshot->end_col = max_col;
+    snapshot->count = (max_row - min_row + 1) * (max_col - min_col + 1);
+    
+    if (kind == SNAPSHOT_CELLS) {
+        snapshot->cells = (Cell**)calloc(snapshot->count, sizeof(Cell*));
+        if (!snapshot->cells) {
+            free(snapshot);
+            return NULL;
+        }
+        
+        int index = 0;
+        for (int row = min_row; row <= max_row; row++) {
+            for (int col = min_col; col <= max_col; col++) {
+                Cell* original = sheet->cells[row][col];
+                if (original) {
+                    Cell* shell = cell_new(row, col);
+                    if (shell) {
+                        shell->width = original->width;
+                        shell->precision = original->precision;
+                        shell->align = original->align;
+                        shell->format = original->format;
+                        shell->format_style = original->format_style;
+                        shell->text_color = original->text_color;
+                        shell->background_color = original->background_color;
+                        shell->row_height = original->row_height;
+                    }
+                    snapshot->cells[index] = original;
+                    sheet->cells[row][col] = shell;
+                }
+                index++;
+            }
+        }
+        sheet->needs_recalc = 1;
+    } else {
+        snapshot->formats = (unsigned char*)malloc(snapshot->count);
+        snapshot->styles = (unsigned char*)malloc(snapshot->count);
+        snapshot->text_colors = (signed char*)malloc(snapshot->count);
+        snapshot->background_colors = (signed char*)malloc(snapshot->count);
+        snapshot->present = (unsigned char*)calloc((snapshot->count + 7) / 8, 1);
+        if (!snapshot->formats || !snapshot->styles || !snapshot->text_colors ||
+            !snapshot->background_colors || !snapshot->present) {
+            sheet_snapshot_free(snapshot);
+            return NULL;
+        }
+        
+        int index = 0;
+        for (int row = min_row; row <= max_row; row++) {
+            for (int col = min_col; col <= max_col; col++) {
+                Cell* cell = sheet->cells[row][col];
+                if (cell) {
+                    snapshot->present[index / 8] |= (unsigned char)(1 << (index % 8));
+                    snapshot->formats[index] = (unsigned char)cell->format;
+                    snapshot->styles[index] = (unsigned char)cell->format_style;
+                    snapshot->text_colors[index] = (signed char)cell->text_color;
+                    snapshot->background_colors[index] = (signed char)cell->background_color;
+                } else {
+                    snapshot->formats[index] = FORMAT_GENERAL;
+                    snapshot->styles[index] = 0;
+                    snapshot->text_colors[index] = -1;
+                    snapshot->background_colors[index] = -1;
+                }
+                index++;
+            }
+        }
+    }
     
-    cell->format = format;
-    cell->format_style = style;
+    return snapshot;
 }
 
-char* format_cell_value(Cell* cell) {
-    static char buffer[256];
-    
-    if (!cell || cell->type == CELL_EMPTY) {
-        return "";
+void sheet_snapshot_swap(Sheet* sheet, RangeSnapshot* snapshot) {
+    if (!snapshot) return;
+    
+    if (snapshot->kind == SNAPSHOT_SPARSE) {
+        for (int i = 0; i < snapshot->count; i++) {
+            sheet_clipboard_preserve(sheet, snapshot->rows[i], snapshot->cols[i]);
+            Cell* current = sheet->cells[snapshot->rows[i]][snapshot->cols[i]];
+            sheet->cells[snapshot->rows[i]][snapshot->cols[i]] = snapshot->cells[i];
+            snapshot->cells[i] = current;
+            sheet_notify_range(sheet, snapshot->rows[i], snapshot->cols[i], snapshot->rows[i], snapshot->cols[i]);
+        }
+        sheet->needs_recalc = 1;
+        return;
     }
     
-    double value = 0.0;
-    char* string_value = NULL;
-    
-    // Get the value to format
-    switch (cell->type) {
-        case CELL_NUMBER:
-            value = cell->data.number;
-            break;
-        case CELL_FORMULA:
-            if (cell->data.formula.error != ERROR_NONE) {
-                switch (cell->data.formula.error) {
-                    case ERROR_DIV_ZERO: return "#DIV/0!";
-                    case ERROR_REF: return "#REF!";
-                    case ERROR_VALUE: return "#VALUE!";
-                    case ERROR_PARSE: return "#PARSE!";
-                    case ERROR_NA: return "#N/A!";
-                    default: return "#ERROR!";
+    sheet_clipboard_preserve_range(sheet, snapshot->start_row, snapshot->start_col, snapshot->end_row, snapshot->end_col);
+    sheet_notify_range(sheet, snapshot->start_row, snapshot->start_col, snapshot->end_row, snapshot->end_col);
+    int index = 0;
+    for (int row = snapshot->start_row; row <= snapshot->end_row; row++) {
+        for (int col = snapshot->start_col; col <= snapshot->end_col; col++) {
+            Cell* current = sheet->cells[row][col];
+            
+            if (snapshot->kind == SNAPSHOT_CELLS) {
+                sheet->cells[row][col] = snapshot->cells[index];
+                snapshot->cells[index] = current;
+            } else {
+                unsigned char bit = (unsigned char)(1 << (index % 8));
+                int had_cell = (snapshot->present[index / 8] & bit) != 0;
+                DataFormat format = (DataFormat)snapshot->formats[index];
+                FormatStyle style = (FormatStyle)snapshot->styles[index];
+                int text_color = snapshot->text_colors[index];
+                int background_color = snapshot->background_colors[index];
+                
+                // Record the current formatting in the snapshot
+                if (current) {
+                    snapshot->present[index / 8] |= bit;
+                    snapshot->formats[index] = (unsigned char)current->format;
+                    snapshot->styles[index] = (unsigned char)current->format_style;
+                    snapshot->text_colors[index] = (signed char)current->text_color;
+                    snapshot->background_colors[index] = (signed char)current->background_color;
+                } else {
+                    snapshot->present[index / 8] &= (unsigned char)~bit;
+                }
+                
+                // Apply the stored formatting; drop cells that only exist because of it
+                if (!had_cell && current && current->type == CELL_EMPTY) {
+                    cell_free(current);
+                    sheet->cells[row][col] = NULL;
+                } else if (had_cell || current) {
+                    Cell* cell = sheet_get_or_create_cell(sheet, row, col);
+                    if (cell) {
+                        cell_set_format(cell, format, style);
+                        cell_set_text_color(cell, text_color);
+                        cell_set_background_color(cell, background_color);
+                    }
                 }
             }
-            if (cell->data.formula.is_string_result && cell->data.formula.cached_string) {
-                return cell->data.formula.cached_string;
-            }
-            value = cell->data.formula.cached_value;
-            break;
-        case CELL_STRING:
-            return cell->data.string;
-        default:
-            return "";
+            index++;
+        }
     }
     
-    // Apply formatting based on format type
-    switch (cell->format) {
-        case FORMAT_PERCENTAGE:
-            return format_number_as_percentage(value, cell->precision);
-            
-        case FORMAT_CURRENCY:
-            return format_number_as_currency(value);
-            
-        case FORMAT_DATE:
-            return format_number_as_date(value, cell->format_style);
-            
-        case FORMAT_TIME:
-            return format_number_as_time(value, cell->format_style);
-              case FORMAT_DATETIME:
-            // Check if it's one of the enhanced datetime styles
-            if (cell->format_style == DATETIME_STYLE_SHORT || 
-                cell->format_style == DATETIME_STYLE_LONG || 
-                cell->format_style == DATETIME_STYLE_ISO) {
-                return format_number_as_enhanced_datetime(value, cell->format_style);
-            } else {
-                return format_number_as_datetime(value, DATE_STYLE_MM_DD_YYYY, TIME_STYLE_12HR);
-            }
-            
-        case FORMAT_NUMBER:
-        case FORMAT_GENERAL:
-        default:
-            // Standard number formatting
-            snprintf(buffer, sizeof(buffer), "%.*f", cell->precision, value);
-            // Remove trailing zeros
-            char* dot = strchr(buffer, '.');
-            if (dot) {
-                char* end = buffer + strlen(buffer) - 1;
-                while (end > dot && *end == '0') *end-- = '\0';
-                if (*end == '.') *end = '\0';
+    if (snapshot->kind == SNAPSHOT_CELLS) {
+        sheet->needs_recalc = 1;
+    }
+}
+
+// Approximate heap footprint of a snapshot, for undo history budgeting
+size_t sheet_snapshot_bytes(const RangeSnapshot* snapshot) {
+    if (!snapshot) return 0;
+    
+    size_t bytes = sizeof(RangeSnapshot);
+    if (snapshot->kind == SNAPSHOT_SPARSE) {
+        bytes += (size_t)snapshot->count * 2 * sizeof(int);
+    }
+    if (snapshot->kind != SNAPSHOT_FORMAT) {
+        bytes += (size_t)snapshot->count * sizeof(Cell*);
+        for (int i = 0; i < snapshot->count; i++) {
+            Cell* cell = snapshot->cells[i];
+            if (!cell) continue;
+            bytes += sizeof(Cell);
+            if (cell->type == CELL_STRING && cell->data.string) {
+                bytes += strlen(cell->data.string) + 1;
+            } else if (cell->type == CELL_FORMULA && cell->data.formula.expression) {
+                bytes += strlen(cell->data.formula.expression) + 1;
             }
-            return buffer;
+        }
+    } else {
+        bytes += (size_t)snapshot->count * 4 + (snapshot->count + 7) / 8;
     }
+    return bytes;
 }
 
-char* format_number_as_percentage(double value, int precision) {
-    static char buffer[64];
-    snprintf(buffer, sizeof(buffer), "%.*f%%", precision, value * 100.0);
-    return buffer;
+void sheet_snapshot_free(RangeSnapshot* snapshot) {
+    if (!snapshot) return;
+    
+    if (snapshot->cells) {
+        for (int i = 0; i < snapshot->count; i++) {
+            if (snapshot->cells[i]) {
+                cell_free(snapshot->cells[i]);
+            }
+        }
+        free(snapshot->cells);
+    }
+    free(snapshot->rows);
+    free(snapshot->cols);
+    free(snapshot->formats);
+    free(snapshot->styles);
+    free(snapshot->text_colors);
+    free(snapshot->background_colors);
+    free(snapshot->present);
+    free(snapshot);
 }
 
-char* format_number_as_currency(double value) {
-    static char buffer[64];
-    if (value < 0) {
-        snprintf(buffer, sizeof(buffer), "-$%.2f", -value);
-    } else {
-        snprintf(buffer, sizeof(buffer), "$%.2f", value);
+// NEW: Batch edits
+//
+// sheet_begin_batch opens a transaction: recalculation is deferred, and the
+// first write to each cell (see sheet_touch_cell) moves the original Cell into
+// a journal and puts a copy in the grid for the edit to work on. Commit runs
+// one recalculation and hands the journal back as a SNAPSHOT_SPARSE snapshot
+// that can undo the whole batch; rollback puts the originals back instead.
+// Batches nest: only the outermost commit or rollback takes effect. If the
+// journal runs out of memory, cells written after that are changed in place,
+// so the batch is marked failed and commit hands back no snapshot.
+
+void sheet_begin_batch(Sheet* sheet) {
+    if (sheet->batch) {
+        sheet->batch->depth++;
+        return;
     }
-    return buffer;
+    
+    SheetBatch* batch = (SheetBatch*)calloc(1, sizeof(SheetBatch));
+    if (!batch) return;
+    batch->touched = (unsigned char*)calloc(((size_t)sheet->rows * sheet->cols + 7) / 8, 1);
+    if (!batch->touched) {
+        free(batch);
+        return;
+    }
+    batch->depth = 1;
+    sheet->batch = batch;
 }
 
-char* format_number_as_date(double value, FormatStyle style) {
-    static char buffer[64];
+void sheet_touch_cell(Sheet* sheet, int row, int col) {
+    sheet_clipboard_preserve(sheet, row, col);
+    sheet_notify_range(sheet, row, col, row, col);
+    
+    SheetBatch* batch = sheet->batch;
+    if (!batch) return;
+    
+    size_t bit = (size_t)row * sheet->cols + col;
+    if (batch->touched[bit / 8] & (1 << (bit % 8))) return;
+    
+    if (batch->count == batch->capacity) {
+        int new_capacity = batch->capacity ? batch->capacity * 2 : 64;
+        int* rows = (int*)realloc(batch->rows, new_capacity * sizeof(int));
+        if (rows) batch->rows = rows;
+        int* cols = (int*)realloc(batch->cols, new_capacity * sizeof(int));
+        if (cols) batch->cols = cols;
+        Cell** originals = (Cell**)realloc(batch->originals, new_capacity * sizeof(Cell*));
+        if (originals) batch->originals = originals;
+        if (!rows || !cols || !originals) {
+            batch->failed = 1;
+            return;
+        }
+        batch->capacity = new_capacity;
+    }
     
-    // Convert Excel serial date to time_t (days since 1900-01-01)
-    // Excel incorrectly treats 1900 as a leap year, so we need adjustment
-    time_t base_time = (time_t)-2209161600LL;  // 1900-01-01 00:00:00 UTC (adjusted)
-    time_t date_time = base_time + (time_t)(value * 86400); // 86400 seconds per day
+    batch->touched[bit / 8] |= (unsigned char)(1 << (bit % 8));
+    Cell* original = sheet->cells[row][col];
+    batch->rows[batch->count] = row;
+    batch->cols[batch->count] = col;
+    batch->originals[batch->count] = original;
+    batch->count++;
     
-    struct tm date_struct;
-    if (gmtime_s(&date_struct, &date_time) != 0) {
-        strcpy_s(buffer, sizeof(buffer), "#DATE!");
-        return buffer;
+    if (original) {
+        sheet->cells[row][col] = cell_clone(original);
+    }
+}
+
+void sheet_batch_free(SheetBatch* batch) {
+    free(batch->touched);
+    free(batch->rows);
+    free(batch->cols);
+    free(batch->originals);
+    free(batch);
+}
+
+// Close the batch. Sets *failed (when given) if the journal missed cells; no
+// snapshot is returned then, as undoing only part of the batch would leave the
+// sheet in a state it was never in.
+RangeSnapshot* sheet_commit_batch(Sheet* sheet, int* failed) {
+    SheetBatch* batch = sheet->batch;
+    if (failed) *failed = 0;
+    if (!batch) return NULL;
+    if (--batch->depth > 0) return NULL;
+    
+    sheet->batch = NULL;
+    if (failed) *failed = batch->failed;
+    RangeSnapshot* snapshot = NULL;
+    if (batch->count > 0 && !batch->failed) {
+        snapshot = (RangeSnapshot*)calloc(1, sizeof(RangeSnapshot));
     }
     
-    switch (style) {
-        case DATE_STYLE_MM_DD_YYYY:
-            strftime(buffer, sizeof(buffer), "%m/%d/%Y", &date_struct);
-            break;
-        case DATE_STYLE_DD_MM_YYYY:
-            strftime(buffer, sizeof(buffer), "%d/%m/%Y", &date_struct);
-            break;
-        case DATE_STYLE_YYYY_MM_DD:
-            strftime(buffer, sizeof(buffer), "%Y-%m-%d", &date_struct);
-            break;
-        case DATE_STYLE_MON_DD_YYYY:
-            strftime(buffer, sizeof(buffer), "%b %d, %Y", &date_struct);
-            break;
-        case DATE_STYLE_DD_MON_YYYY:
-            strftime(buffer, sizeof(buffer), "%d %b %Y", &date_struct);
-            break;
-        case DATE_STYLE_YYYY_MON_DD:
-            strftime(buffer, sizeof(buffer), "%Y %b %d", &date_struct);
-            break;
-        case DATE_STYLE_SHORT_DATE:
-            strftime(buffer, sizeof(buffer), "%m/%d/%y", &date_struct);
-            break;
-        default:
-            strftime(buffer, sizeof(buffer), "%Y-%m-%d", &date_struct);
-            break;
+    if (snapshot) {
+        snapshot->kind = SNAPSHOT_SPARSE;
+        snapshot->count = batch->count;
+        snapshot->rows = batch->rows;
+        snapshot->cols = batch->cols;
+        snapshot->cells = batch->originals;
+        batch->rows = NULL;
+        batch->cols = NULL;
+        batch->originals = NULL;
+    } else {
+        for (int i = 0; i < batch->count; i++) {
+            cell_free(batch->originals[i]);
+        }
     }
+    sheet_batch_free(batch);
     
-    return buffer;
+    sheet_recalculate(sheet);
+    return snapshot;
 }
 
-char* format_number_as_time(double value, FormatStyle style) {
-    static char buffer[64];
+void sheet_rollback_batch(Sheet* sheet) {
+    SheetBatch* batch = sheet->batch;
+    if (!batch) return;
+    if (--batch->depth > 0) return;
+    
+    sheet->batch = NULL;
+    for (int i = 0; i < batch->count; i++) {
+        sheet_clipboard_preserve(sheet, batch->rows[i], batch->cols[i]);
+        Cell** slot = &sheet->cells[batch->rows[i]][batch->cols[i]];
+        cell_free(*slot);
+        *slot = batch->originals[i];
+        sheet_notify_range(sheet, batch->rows[i], batch->cols[i], batch->rows[i], batch->cols[i]);
+    }
+    sheet_batch_free(batch);
     
-    // Extract time portion (fractional part of the day)
-    double time_fraction = value - floor(value);
-    if (time_fraction < 0) time_fraction += 1.0;
+    sheet->needs_recalc = 1;
+    sheet_recalculate(sheet);
+}
+
+// NEW: Fill operations
+//
+// Fills write straight into the grid: a formula source is compiled and
+// parsed once per line, each target gets its text rebased and a shifted copy
+// of the source tree, and no recalculation happens until the whole fill is
+// written.
+
+// Copy the display and formatting properties of src onto dest
+void cell_copy_format(Cell* dest, const Cell* src) {
+    dest->width = src->width;
+    dest->precision = src->precision;
+    dest->align = src->align;
+    dest->format = src->format;
+    dest->format_style = src->format_style;
+    dest->text_color = src->text_color;
+    dest->background_color = src->background_color;
+}
+
+// Repeat the cell at (src_row, src_col) into the next 'count' cells along
+// (row_step, col_step). Returns the number of cells written.
+int sheet_fill_line(Sheet* sheet, int src_row, int src_col, int row_step, int col_step, int count) {
+    Cell* src = sheet->cells[src_row][src_col];
+    
+    if (!src || src->type == CELL_EMPTY) {
+        for (int i = 1; i <= count; i++) {
+            sheet_clear_cell(sheet, src_row + i * row_step, src_col + i * col_step);
+        }
+        return count;
+    }
     
-    int total_seconds = (int)(time_fraction * 86400);
-    int hours = total_seconds / 3600;
-    int minutes = (total_seconds % 3600) / 60;
-    int seconds = total_seconds % 60;
+    CompiledFormula* compiled = NULL;
+    if (src->type == CELL_FORMULA) {
+        compiled = formula_compile(src->data.formula.expression);
+    }
     
-    switch (style) {
-        case TIME_STYLE_12HR:
-            {
-                int display_hours = hours;
-                const char* am_pm = "AM";
-                if (hours == 0) {
-                    display_hours = 12;
-                } else if (hours == 12) {
-                    am_pm = "PM";
-                } else if (hours > 12) {
-                    display_hours = hours - 12;
-                    am_pm = "PM";
+    for (int i = 1; i <= count; i++) {
+        int row = src_row + i * row_step;
+        int col = src_col + i * col_step;
+        Cell* dest = sheet_get_or_create_cell(sheet, row, col);
+        if (!dest) continue;
+        
+        switch (src->type) {
+            case CELL_NUMBER:
+                cell_set_number(dest, src->data.number);
+                break;
+            case CELL_STRING:
+                cell_set_string(dest, src->data.string);
+                break;
+            case CELL_FORMULA:
+                if (compiled) {
+                    cell_take_shifted_formula(dest, src, compiled, i * row_step, i * col_step);
+                } else {
+                    cell_set_formula(dest, src->data.formula.expression);
                 }
-                snprintf(buffer, sizeof(buffer), "%d:%02d %s", display_hours, minutes, am_pm);
+                break;
+            default:
+                break;
+        }
+        cell_copy_format(dest, src);
+    }
+    
+    formula_free(compiled);
+    sheet->needs_recalc = 1;
+    return count;
+}
+
+// Copy the top row of the range down through the rest of it
+int sheet_fill_down(Sheet* sheet, int start_row, int start_col, int end_row, int end_col) {
+    int min_row = max(0, min(start_row, end_row));
+    int max_row = min(sheet->rows - 1, max(start_row, end_row));
+    int min_col = max(0, min(start_col, end_col));
+    int max_col = min(sheet->cols - 1, max(start_col, end_col));
+    if (max_row <= min_row || min_col > max_col) return 0;
+    
+    int written = 0;
+    for (int col = min_col; col <= max_col; col++) {
+        written += sheet_fill_line(sheet, min_row, col, 1, 0, max_row - min_row);
+    }
+    sheet_recalculate(sheet);
+    return written;
+}
+
+// Copy the left column of the range across the rest of it
+int sheet_fill_right(Sheet* sheet, int start_row, int start_col, int end_row, int end_col) {
+    int min_row = max(0, min(start_row, end_row));
+    int max_row = min(sheet->rows - 1, max(start_row, end_row));
+    int min_col = max(0, min(start_col, end_col));
+    int max_col = min(sheet->cols - 1, max(start_col, end_col));
+    if (min_row > max_row || max_col <= min_col) return 0;
+    
+    int written = 0;
+    for (int row = min_row; row <= max_row; row++) {
+        written += sheet_fill_line(sheet, row, min_col, 0, 1, max_col - min_col);
+    }
+    sheet_recalculate(sheet);
+    return written;
+}
+
+// Shift an Excel serial date by whole months, clamping the day to the
+// length of the target month and keeping any time-of-day fraction
+double date_add_months(double serial, int months) {
+    double whole = floor(serial);
+    double fraction = serial - whole;
+    
+    // Civil date from days since 1970-01-01 (serial 25569)
+    long long z = (long long)whole - 25569 + 719468;
+    long long era = (z >= 0 ? z : z - 146096) / 146097;
+    long long doe = z - era * 146097;
+    long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long long mp = (5 * doy + 2) / 153;
+    int day = (int)(doy - (153 * mp + 2) / 5 + 1);
+    int month = (int)(mp < 10 ? mp + 3 : mp - 9);
+    long long year = yoe + era * 400 + (month <= 2);
+    
+    long long total = year * 12 + (month - 1) + months;
+    year = total >= 0 ? total / 12 : (total - 11) / 12;
+    month = (int)(total - year * 12) + 1;
+    
+    static const int days_in_month[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    int month_days = days_in_month[month - 1];
+    if (month == 2 && ((year % 4 == 0 && year % 100 != 0) || year % 400 == 0)) {
+        month_days = 29;
+    }
+    if (day > month_days) day = month_days;
+    
+    // Days since 1970-01-01 from the civil date
+    year -= month <= 2;
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = year - era * 400;
+    doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return (double)(era * 146097 + doe - 719468 + 25569) + fraction;
+}
+
+// Fill each line of the range with a series starting from its first cell.
+// Lines run down the columns, or across when only one row is selected. When
+// no step is given it is taken from the first two cells of a line if both
+// are numbers. Returns the number of cells written, or -1 if no line starts
+// with a number.
+int sheet_fill_series(Sheet* sheet, int start_row, int start_col, int end_row, int end_col,
+                      SeriesType type, double step, int has_step, DateUnit unit) {
+    int min_row = max(0, min(start_row, end_row));
+    int max_row = min(sheet->rows - 1, max(start_row, end_row));
+    int min_col = max(0, min(start_col, end_col));
+    int max_col = min(sheet->cols - 1, max(start_col, end_col));
+    if (min_row > max_row || min_col > max_col) return 0;
+    
+    int down = max_row > min_row;
+    int lines = down ? max_col - min_col + 1 : 1;
+    int length = down ? max_row - min_row + 1 : max_col - min_col + 1;
+    int row_step = down ? 1 : 0;
+    int col_step = down ? 0 : 1;
+    int written = 0;
+    int started = 0;
+    
+    for (int line = 0; line < lines; line++) {
+        int row0 = min_row;
+        int col0 = down ? min_col + line : min_col;
+        Cell* first = sheet->cells[row0][col0];
+        if (!first || first->type != CELL_NUMBER) continue;
+        started = 1;
+        
+        double start = first->data.number;
+        double line_step = step;
+        if (!has_step) {
+            Cell* second = length > 1 ? sheet->cells[row0 + row_step][col0 + col_step] : NULL;
+            int has_second = second && second->type == CELL_NUMBER;
+            switch (type) {
+                case SERIES_GROWTH:
+                    line_step = (has_second && start != 0.0) ? second->data.number / start : 2.0;
+                    break;
+                case SERIES_DATE:
+                    line_step = (has_second && unit == DATE_UNIT_DAY) ? second->data.number - start : 1.0;
+                    break;
+                default:
+                    line_step = has_second ? second->data.number - start : 1.0;
+                    break;
             }
-            break;
-        case TIME_STYLE_12HR_SECONDS:
-            {
-                int display_hours = hours;
-                const char* am_pm = "AM";
-                if (hours == 0) {
-                    display_hours = 12;
-                } else if (hours == 12) {
-                    am_pm = "PM";
-                } else if (hours > 12) {
-                    display_hours = hours - 12;
-                    am_pm = "PM";
-                }
-                snprintf(buffer, sizeof(buffer), "%d:%02d:%02d %s", display_hours, minutes, seconds, am_pm);
+        }
+        
+        double value = start;
+        for (int i = 1; i < length; i++) {
+            switch (type) {
+                case SERIES_GROWTH:
+                    value *= line_step;
+                    break;
+                case SERIES_DATE:
+                    if (unit == DATE_UNIT_MONTH) {
+                        value = date_add_months(start, (int)(line_step * i));
+                    } else if (unit == DATE_UNIT_YEAR) {
+                        value = date_add_months(start, (int)(line_step * i) * 12);
+                    } else {
+                        value = start + line_step * i * (unit == DATE_UNIT_WEEK ? 7 : 1);
+                    }
+                    break;
+                default:
+                    value = start + line_step * i;
+                    break;
             }
-            break;
-        case TIME_STYLE_SECONDS:
-            snprintf(buffer, sizeof(buffer), "%02d:%02d:%02d", hours, minutes, seconds);
-            break;
-        case TIME_STYLE_24HR:
-        default:
-            snprintf(buffer, sizeof(buffer), "%02d:%02d", hours, minutes);
-            break;
+            
+            Cell* dest = sheet_get_or_create_cell(sheet, row0 + i * row_step, col0 + i * col_step);
+            if (!dest) continue;
+            cell_set_number(dest, value);
+            cell_copy_format(dest, first);
+            written++;
+        }
     }
     
-    return buffer;
+    sheet->needs_recalc = 1;
+    sheet_recalculate(sheet);
+    return started ? written : -1;
 }
 
-char* format_number_as_datetime(double value, FormatStyle date_style, FormatStyle time_style) {
-    static char buffer[128];
-    char* date_part = format_number_as_date(value, date_style);
-    char* time_part = format_number_as_time(value, time_style);
-    snprintf(buffer, sizeof(buffer), "%s %s", date_part, time_part);
-    return buffer;
+// NEW: Row and column insert/delete
+//
+// The grid is an array of row pointers, so inserting or deleting rows moves
+// only the row pointers of the shifted block; columns move one pointer slice
+// per row. Cells themselves are never copied. After the move every formula
+// has its references rewritten (see formula_shift_references), and the old
+// text of each rewritten formula is kept in the change so it can be reverted.
+
+StructuralChange* structural_change_new(int on_rows, int at, int count, int deleting) {
+    StructuralChange* change = (StructuralChange*)calloc(1, sizeof(StructuralChange));
+    if (!change) return NULL;
+    change->on_rows = on_rows;
+    change->at = at;
+    change->count = count;
+    change->deleting = deleting;
+    return change;
 }
 
-// NEW: Enhanced datetime formatting for special styles
-char* format_number_as_enhanced_datetime(double value, FormatStyle style) {
-    static char buffer[128];
-    
-    // Convert Excel serial date to time_t
-    time_t base_time = (time_t)-2209161600LL;  // 1900-01-01 00:00:00 UTC (adjusted)
-    time_t date_time = base_time + (time_t)(value * 86400);
-    
-    struct tm date_struct;
-    if (gmtime_s(&date_struct, &date_time) != 0) {
-        strcpy_s(buffer, sizeof(buffer), "#DATE!");
-        return buffer;
+// True if the last 'count' rows (or columns) hold no cells
+int sheet_tail_is_empty(Sheet* sheet, int on_rows, int count) {
+    if (on_rows) {
+        for (int row = sheet->rows - count; row < sheet->rows; row++) {
+            for (int col = 0; col < sheet->cols; col++) {
+                if (sheet->cells[row][col]) return 0;
+            }
+        }
+    } else {
+        for (int row = 0; row < sheet->rows; row++) {
+            for (int col = sheet->cols - count; col < sheet->cols; col++) {
+                if (sheet->cells[row][col]) return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Shift row pointers to open (or close) 'count' rows at 'at'.
+// Insert: the empty tail rows are recycled as the new rows, or replaced by
+// 'block' when given (with heights from 'sizes').
+// Delete: the removed rows go to 'block' (and heights to 'sizes') and fresh
+// empty rows fill the tail; with no block the removed rows must be empty and
+// are recycled as the tail. Returns 0 if memory runs out.
+int sheet_move_rows(Sheet* sheet, int at, int count, int deleting, Cell*** block, int* sizes) {
+    Cell*** spare = (Cell***)malloc(count * sizeof(Cell**));
+    if (!spare) return 0;
+    sheet->structure_version++;
+    
+    if (!deleting) {
+        memcpy(spare, &sheet->cells[sheet->rows - count], count * sizeof(Cell**));
+        memmove(&sheet->cells[at + count], &sheet->cells[at], (sheet->rows - count - at) * sizeof(Cell**));
+        memmove(&sheet->row_heights[at + count], &sheet->row_heights[at], (sheet->rows - count - at) * sizeof(int));
+        for (int i = 0; i < count; i++) {
+            if (block) {
+                sheet->cells[at + i] = block[i];
+                free(spare[i]);
+            } else {
+                sheet->cells[at + i] = spare[i];
+            }
+            sheet->row_heights[at + i] = sizes ? sizes[i] : 1;
+        }
+    } else {
+        for (int i = 0; i < count; i++) {
+            if (block) {
+                spare[i] = (Cell**)calloc(sheet->cols, sizeof(Cell*));
+                if (!spare[i]) {
+                    while (i > 0) free(spare[--i]);
+                    free(spare);
+                    return 0;
+                }
+                block[i] = sheet->cells[at + i];
+            } else {
+                spare[i] = sheet->cells[at + i];
+            }
+            if (sizes) sizes[i] = sheet->row_heights[at + i];
+        }
+        memmove(&sheet->cells[at], &sheet->cells[at + count], (sheet->rows - count - at) * sizeof(Cell**));
+        memmove(&sheet->row_heights[at], &sheet->row_heights[at + count], (sheet->rows - count - at) * sizeof(int));
+        for (int i = 0; i < count; i++) {
+            sheet->cells[sheet->rows - count + i] = spare[i];
+            sheet->row_heights[sheet->rows - count + i] = 1;
+        }
     }
     
-    // Extract time portion for time components
-    double time_fraction = value - floor(value);
-    if (time_fraction < 0) time_fraction += 1.0;
-    int total_seconds = (int)(time_fraction * 86400);
-    int hours = total_seconds / 3600;
-    int minutes = (total_seconds % 3600) / 60;
-    int seconds = total_seconds % 60;
+    free(spare);
+    return 1;
+}
+
+// Column counterpart of sheet_move_rows; 'block' holds rows x count cell
+// pointers, row-major
+void sheet_move_columns(Sheet* sheet, int at, int count, int deleting, Cell** block, int* sizes) {
+    int tail = sheet->cols - count - at;
     
-    switch (style) {
-        case DATETIME_STYLE_SHORT:
-            {
-                int display_hours = hours;
-                const char* am_pm = "AM";
-                if (hours == 0) {
-                    display_hours = 12;
-                } else if (hours == 12) {
-                    am_pm = "PM";
-                } else if (hours > 12) {
-                    display_hours = hours - 12;
-                    am_pm = "PM";
-                }
-                snprintf(buffer, sizeof(buffer), "%d/%d/%02d %d:%02d %s", 
-                        date_struct.tm_mon + 1, date_struct.tm_mday, date_struct.tm_year % 100,
-                        display_hours, minutes, am_pm);
+    for (int row = 0; row < sheet->rows; row++) {
+        Cell** line = sheet->cells[row];
+        Cell** saved = block ? block + (size_t)row * count : NULL;
+        if (!deleting) {
+            memmove(&line[at + count], &line[at], tail * sizeof(Cell*));
+            for (int i = 0; i < count; i++) {
+                line[at + i] = saved ? saved[i] : NULL;
             }
-            break;
-        case DATETIME_STYLE_LONG:
-            {
-                int display_hours = hours;
-                const char* am_pm = "AM";
-                if (hours == 0) {
-                    display_hours = 12;
-                } else if (hours == 12) {
-                    am_pm = "PM";
-                } else if (hours > 12) {
-                    display_hours = hours - 12;
-                    am_pm = "PM";
+        } else {
+            if (saved) memcpy(saved, &line[at], count * sizeof(Cell*));
+            memmove(&line[at], &line[at + count], tail * sizeof(Cell*));
+            memset(&line[sheet->cols - count], 0, count * sizeof(Cell*));
+        }
+    }
+    
+    if (!deleting) {
+        memmove(&sheet->col_widths[at + count], &sheet->col_widths[at], tail * sizeof(int));
+        for (int i = 0; i < count; i++) {
+            sheet->col_widths[at + i] = sizes ? sizes[i] : 10;
+        }
+    } else {
+        if (sizes) memcpy(sizes, &sheet->col_widths[at], count * sizeof(int));
+        memmove(&sheet->col_widths[at], &sheet->col_widths[at + count], tail * sizeof(int));
+        for (int i = 0; i < count; i++) {
+            sheet->col_widths[sheet->cols - count + i] = 10;
+        }
+    }
+}
+
+// Remember a formula's text before it is rewritten (takes ownership)
+int formula_journal_add(FormulaJournal* journal, int row, int col, char* old_text) {
+    if (journal->count == journal->capacity) {
+        int new_capacity = journal->capacity ? journal->capacity * 2 : 16;
+        int* rows = (int*)realloc(journal->rows, new_capacity * sizeof(int));
+        if (rows) journal->rows = rows;
+        int* cols = (int*)realloc(journal->cols, new_capacity * sizeof(int));
+        if (cols) journal->cols = cols;
+        char** texts = (char**)realloc(journal->texts, new_capacity * sizeof(char*));
+        if (texts) journal->texts = texts;
+        if (!rows || !cols || !texts) return 0;
+        journal->capacity = new_capacity;
+    }
+    journal->rows[journal->count] = row;
+    journal->cols[journal->count] = col;
+    journal->texts[journal->count] = old_text;
+    journal->count++;
+    return 1;
+}
+
+// Replace a formula cell's text, journalling the old text. Returns 0 (and
+// frees new_text) if the journal is out of memory.
+int formula_journal_replace(FormulaJournal* journal, Cell* cell, int row, int col, char* new_text) {
+    if (!formula_journal_add(journal, row, col, cell->data.formula.expression)) {
+        free(new_text);
+        return 0;
+    }
+    cell->data.formula.expression = NULL;
+    cell_take_formula(cell, new_text);
+    return 1;
+}
+
+// Put the journalled texts back (the journal is emptied)
+void formula_journal_restore(Sheet* sheet, FormulaJournal* journal) {
+    for (int i = 0; i < journal->count; i++) {
+        Cell* cell = sheet->cells[journal->rows[i]][journal->cols[i]];
+        if (cell) {
+            cell_take_formula(cell, journal->texts[i]);
+        } else {
+            free(journal->texts[i]);
+        }
+    }
+    journal->count = 0;
+}
+
+size_t formula_journal_bytes(const FormulaJournal* journal) {
+    size_t bytes = (size_t)journal->capacity * (2 * sizeof(int) + sizeof(char*));
+    for (int i = 0; i < journal->count; i++) {
+        bytes += strlen(journal->texts[i]) + 1;
+    }
+    return bytes;
+}
+
+void formula_journal_free(FormulaJournal* journal) {
+    for (int i = 0; i < journal->count; i++) {
+        free(journal->texts[i]);
+    }
+    free(journal->rows);
+    free(journal->cols);
+    free(journal->texts);
+    memset(journal, 0, sizeof(*journal));
+}
+
+// Renumber every cell after a move and, when 'change' is given, rewrite
+// formula references for it
+void sheet_rewrite_after_move(Sheet* sheet, StructuralChange* change) {
+    for (int row = 0; row < sheet->rows; row++) {
+        for (int col = 0; col < sheet->cols; col++) {
+            Cell* cell = sheet->cells[row][col];
+            if (!cell) continue;
+            cell->row = row;
+            cell->col = col;
+            
+            if (!change || cell->type != CELL_FORMULA || !cell->data.formula.expression) continue;
+            
+            CompiledFormula* formula = formula_compile(cell->data.formula.expression);
+            if (!formula) continue;
+            if (formula->ref_count > 0 &&
+                formula_shift_references(formula, change->on_rows, change->at, change->count, change->deleting) > 0) {
+                char* text = formula_render(formula, 0, 0);
+                if (text) {
+                    formula_journal_replace(&change->formulas, cell, row, col, text);
                 }
-                strftime(buffer, 80, "%b %d, %Y ", &date_struct);
-                char time_buf[48];
-                snprintf(time_buf, sizeof(time_buf), "%d:%02d:%02d %s", 
-                        display_hours, minutes, seconds, am_pm);
-                strcat_s(buffer, sizeof(buffer), time_buf);
             }
-            break;
-        case DATETIME_STYLE_ISO:
-            snprintf(buffer, sizeof(buffer), "%04d-%02d-%02dT%02d:%02d:%02d",
-                    date_struct.tm_year + 1900, date_struct.tm_mon + 1, date_struct.tm_mday,
-                    hours, minutes, seconds);
-            break;
-        default:
-            // Fall back to regular datetime formatting
-            return format_number_as_datetime(value, DATE_STYLE_MM_DD_YYYY, TIME_STYLE_12HR);
+            formula_free(formula);
+        }
     }
-    
-    return buffer;
 }
 
-// NEW: VLOOKUP function
-double func_vlookup(Sheet* sheet, double lookup_value, const char* lookup_str,
-                   const char* table_range, int col_index, int exact_match, ErrorType* error) {
-    *error = ERROR_NONE;
+// Carry out an insert or delete. Returns 0 without changing anything if an
+// insert would push cells off the edge of the sheet, a batch is open, or the
+// position is out of range.
+int sheet_apply_structural(Sheet* sheet, StructuralChange* change) {
+    int limit = change->on_rows ? sheet->rows : sheet->cols;
+    if (change->applied || sheet->batch) return 0;
+    if (change->at < 0 || change->count <= 0 || change->at + change->count > limit) return 0;
+    if (!change->deleting && !sheet_tail_is_empty(sheet, change->on_rows, change->count)) return 0;
+    
+    change->span = change->on_rows ? sheet->cols : sheet->rows;
+    if (change->deleting && !change->removed_sizes) {
+        change->removed_sizes = (int*)malloc(change->count * sizeof(int));
+        if (change->on_rows) {
+            change->removed_rows = (Cell***)malloc(change->count * sizeof(Cell**));
+        } else {
+            change->removed_cells = (Cell**)malloc((size_t)change->span * change->count * sizeof(Cell*));
+        }
+        if (!change->removed_sizes || (!change->removed_rows && !change->removed_cells)) return 0;
+    }
     
-    // Parse the table range
-    CellRange range;
-    if (!parse_range(table_range, &range)) {
-        *error = ERROR_REF;
-        return 0.0;
+    // The copied range is read from the grid at paste time, so keep its
+    // contents before they move
+    RangeClipboard* clipboard = &sheet->range_clipboard;
+    if (clipboard->is_active) {
+        sheet_clipboard_preserve_range(sheet, clipboard->src_row, clipboard->src_col,
+                                       clipboard->src_row + clipboard->rows - 1,
+                                       clipboard->src_col + clipboard->cols - 1);
     }
     
-    // Validate column index
-    if (col_index < 1 || col_index > (range.end_col - range.start_col + 1)) {
-        *error = ERROR_REF;
-        return 0.0;
+    if (change->on_rows) {
+        if (!sheet_move_rows(sheet, change->at, change->count, change->deleting,
+                             change->deleting ? change->removed_rows : NULL, change->removed_sizes)) {
+            return 0;
+        }
+    } else {
+        sheet_move_columns(sheet, change->at, change->count, change->deleting,
+                           change->deleting ? change->removed_cells : NULL, change->removed_sizes);
     }
     
-    // Search through the first column of the range
-    for (int row = range.start_row; row <= range.end_row; row++) {
-        Cell* lookup_cell = sheet_get_cell(sheet, row, range.start_col);
-        if (!lookup_cell) continue;
-        
-        int match_found = 0;
-        
-        // Compare based on data type
-        if (lookup_str) {
-            // String lookup
-            if (lookup_cell->type == CELL_STRING) {
-                match_found = (strcmp(lookup_cell->data.string, lookup_str) == 0);
-            } else if (lookup_cell->type == CELL_FORMULA && 
-                      lookup_cell->data.formula.is_string_result && 
-                      lookup_cell->data.formula.cached_string) {
-                match_found = (strcmp(lookup_cell->data.formula.cached_string, lookup_str) == 0);
+    sheet_rewrite_after_move(sheet, change);
+    change->applied = 1;
+    sheet_filter_clear(sheet);  // Its rows no longer line up
+    sheet_notify_all(sheet);
+    
+    sheet->needs_recalc = 1;
+    sheet_recalculate(sheet);
+    return 1;
+}
+
+// Undo an applied change: restore the rewritten formulas, then move the
+// lines back (returning deleted cells to the grid)
+void sheet_revert_structural(Sheet* sheet, StructuralChange* change) {
+    if (!change->applied) return;
+    
+    RangeClipboard* clipboard = &sheet->range_clipboard;
+    if (clipboard->is_active) {
+        sheet_clipboard_preserve_range(sheet, clipboard->src_row, clipboard->src_col,
+                                       clipboard->src_row + clipboard->rows - 1,
+                                       clipboard->src_col + clipboard->cols - 1);
+    }
+    
+    formula_journal_restore(sheet, &change->formulas);
+    
+    // The inverse of an insert is a delete and vice versa
+    if (change->on_rows) {
+        sheet_move_rows(sheet, change->at, change->count, !change->deleting,
+                        change->deleting ? change->removed_rows : NULL, change->removed_sizes);
+    } else {
+        sheet_move_columns(sheet, change->at, change->count, !change->deleting,
+                           change->deleting ? change->removed_cells : NULL, change->removed_sizes);
+    }
+    
+    sheet_rewrite_after_move(sheet, NULL);
+    change->applied = 0;
+    sheet_filter_clear(sheet);
+    sheet_notify_all(sheet);
+    
+    sheet->needs_recalc = 1;
+    sheet_recalculate(sheet);
+}
+
+// Cell removed by a delete, at index i of line 'line' (NULL = empty)
+Cell* structural_change_removed_at(const StructuralChange* change, int line, int i) {
+    if (change->on_rows) return change->removed_rows[line][i];
+    return change->removed_cells[(size_t)i * change->count + line];
+}
+
+// Approximate heap footprint of a change, for undo history budgeting
+size_t structural_change_bytes(const StructuralChange* change) {
+    size_t bytes = sizeof(StructuralChange) + formula_journal_bytes(&change->formulas);
+    
+    if (change->applied && change->deleting) {
+        bytes += (size_t)change->count * (sizeof(int) + (size_t)change->span * sizeof(Cell*));
+        for (int line = 0; line < change->count; line++) {
+            for (int i = 0; i < change->span; i++) {
+                Cell* cell = structural_change_removed_at(change, line, i);
+                if (!cell) continue;
+                bytes += sizeof(Cell);
+                if (cell->type == CELL_STRING && cell->data.string) {
+                    bytes += strlen(cell->data.string) + 1;
+                } else if (cell->type == CELL_FORMULA && cell->data.formula.expression) {
+                    bytes += strlen(cell->data.formula.expression) + 1;
+                }
             }
-        } else {
-            // Numeric lookup
-            double cell_value = 0.0;
-            if (lookup_cell->type == CELL_NUMBER) {
-                cell_value = lookup_cell->data.number;
-            } else if (lookup_cell->type == CELL_FORMULA && 
-                      lookup_cell->data.formula.error == ERROR_NONE) {
-                cell_value = lookup_cell->data.formula.cached_value;
-            } else {
-                continue; // Skip non-numeric cells
+        }
+    }
+    return bytes;
+}
+
+void structural_change_free(StructuralChange* change) {
+    if (!change) return;
+    
+    // While applied, deleted cells and old formula texts belong to the change
+    if (change->applied && change->deleting) {
+        for (int line = 0; line < change->count; line++) {
+            for (int i = 0; i < change->span; i++) {
+                cell_free(structural_change_removed_at(change, line, i));
             }
+            if (change->on_rows) free(change->removed_rows[line]);
+        }
+    }
+    formula_journal_free(&change->formulas);
+    
+    free(change->removed_rows);
+    free(change->removed_cells);
+    free(change->removed_sizes);
+    free(change);
+}
+
+// NEW: Sorting
+//
+// Sorting happens in three passes. First the key columns are read into flat
+// arrays (a class, a number and a string pointer per row), so comparisons
+// never touch the grid. Then an array of row offsets is put in order by a
+// stable parallel merge sort. Finally the rows are moved once, following the
+// sorted order: whole row pointers when entire rows move, otherwise one
+// pointer per cell in the range. Relative row references in moved formulas
+// are rebased by the distance their row moved, as with copy and paste.
+
+// Sort classes: numbers come before text, then errors, then empty cells
+#define SORT_NUMBER 0
+#define SORT_STRING 1
+#define SORT_ERROR  2
+#define SORT_EMPTY  3
+
+#define SORT_EXTRACT_CHUNK 4096     // Rows per key extraction task
+
+typedef struct {
+    unsigned char* classes;
+    double* numbers;
+    const char** strings;
+} SortColumn;
+
+typedef struct {
+    Sheet* sheet;
+    int start_row;
+    int rows;
+    const SortKey* keys;
+    int key_count;
+    SortColumn* columns;            // One per key
+} SortContext;
+
+void sort_extract_chunk(void* context, int index) {
+    SortContext* sort = (SortContext*)context;
+    int first = index * SORT_EXTRACT_CHUNK;
+    int last = first + SORT_EXTRACT_CHUNK < sort->rows ? first + SORT_EXTRACT_CHUNK : sort->rows;
+    
+    for (int k = 0; k < sort->key_count; k++) {
+        SortColumn* column = &sort->columns[k];
+        int col = sort->keys[k].col;
+        for (int i = first; i < last; i++) {
+            Cell* cell = sort->sheet->cells[sort->start_row + i][col];
+            unsigned char kind = SORT_EMPTY;
+            column->numbers[i] = 0.0;
+            column->strings[i] = NULL;
             
-            if (exact_match) {
-                match_found = (fabs(cell_value - lookup_value) < 1e-10);
-            } else {
-                // Approximate match - find largest value <= lookup_value
-                match_found = (cell_value <= lookup_value);
-                // For approximate match, we should continue to find the best match
-                // This is a simplified implementation
-                if (match_found) {
-                    // Check if there's a better match later
-                    for (int next_row = row + 1; next_row <= range.end_row; next_row++) {
-                        Cell* next_cell = sheet_get_cell(sheet, next_row, range.start_col);
-                        if (next_cell) {
-                            double next_value = 0.0;
-                            if (next_cell->type == CELL_NUMBER) {
-                                next_value = next_cell->data.number;
-                            } else if (next_cell->type == CELL_FORMULA && 
-                                      next_cell->data.formula.error == ERROR_NONE) {
-                                next_value = next_cell->data.formula.cached_value;
-                            } else {
-                                continue;
-                            }
-                            
-                            if (next_value <= lookup_value && next_value > cell_value) {
-                                // Found a better match
-                                match_found = 0;
-                                break;
-                            }
+            if (cell) {
+                switch (cell->type) {
+                    case CELL_NUMBER:
+                        kind = SORT_NUMBER;
+                        column->numbers[i] = cell->data.number;
+                        break;
+                    case CELL_STRING:
+                        kind = SORT_STRING;
+                        column->strings[i] = cell->data.string ? cell->data.string : "";
+                        break;
+                    case CELL_FORMULA:
+                        if (cell->data.formula.error != ERROR_NONE) {
+                            kind = SORT_ERROR;
+                        } else if (cell->data.formula.is_string_result) {
+                            kind = SORT_STRING;
+                            column->strings[i] = cell->data.formula.cached_string ? cell->data.formula.cached_string : "";
+                        } else {
+                            kind = SORT_NUMBER;
+                            column->numbers[i] = cell->data.formula.cached_value;
                         }
-                    }
+                        break;
+                    default:
+                        break;
                 }
             }
+            column->classes[i] = kind;
+        }
+    }
+}
+
+int sort_compare_rows(void* context, int a, int b) {
+    SortContext* sort = (SortContext*)context;
+    
+    for (int k = 0; k < sort->key_count; k++) {
+        SortColumn* column = &sort->columns[k];
+        int descending = sort->keys[k].descending;
+        int class_a = column->classes[a];
+        int class_b = column->classes[b];
+        
+        if (class_a != class_b) {
+            // Descending puts text before numbers; errors and blanks stay last
+            if (descending && class_a <= SORT_STRING && class_b <= SORT_STRING) {
+                return class_a > class_b ? -1 : 1;
+            }
+            return class_a < class_b ? -1 : 1;
         }
         
-        if (match_found) {
-            // Found a match, return the value from the specified column
-            int result_col = range.start_col + col_index - 1;
-            Cell* result_cell = sheet_get_cell(sheet, row, result_col);
-            
-            if (!result_cell) {
-                return 0.0; // Empty cell
+        int result = 0;
+        if (class_a == SORT_NUMBER) {
+            double x = column->numbers[a];
+            double y = column->numbers[b];
+            result = x < y ? -1 : (x > y ? 1 : 0);
+        } else if (class_a == SORT_STRING) {
+            result = _stricmp(column->strings[a], column->strings[b]);
+        }
+        if (result != 0) {
+            return descending ? -result : result;
+        }
+    }
+    return 0;
+}
+
+// Put the rows of the permutation's range in the given order:
+// row start_row + i receives the row that was at start_row + order[i]
+int sheet_move_rows_by_order(Sheet* sheet, RowPermutation* permutation, const int* order) {
+    int rows = permutation->end_row - permutation->start_row + 1;
+    int first_col = permutation->whole_rows ? 0 : permutation->start_col;
+    int last_col = permutation->whole_rows ? sheet->cols - 1 : permutation->end_col;
+    
+    RangeClipboard* clipboard = &sheet->range_clipboard;
+    if (clipboard->is_active) {
+        sheet_clipboard_preserve_range(sheet, permutation->start_row, first_col, permutation->end_row, last_col);
+    }
+    
+    if (permutation->whole_rows) {
+        Cell*** moved = (Cell***)malloc(rows * sizeof(Cell**));
+        if (!moved) return 0;
+        for (int i = 0; i < rows; i++) {
+            moved[i] = sheet->cells[permutation->start_row + order[i]];
+        }
+        memcpy(&sheet->cells[permutation->start_row], moved, rows * sizeof(Cell**));
+        free(moved);
+        sheet->structure_version++;
+    } else {
+        Cell** moved = (Cell**)malloc(rows * sizeof(Cell*));
+        if (!moved) return 0;
+        for (int col = first_col; col <= last_col; col++) {
+            for (int i = 0; i < rows; i++) {
+                moved[i] = sheet->cells[permutation->start_row + order[i]][col];
             }
+            for (int i = 0; i < rows; i++) {
+                sheet->cells[permutation->start_row + i][col] = moved[i];
+            }
+        }
+        free(moved);
+    }
+    
+    for (int i = 0; i < rows; i++) {
+        if (order[i] == i) continue;
+        for (int col = first_col; col <= last_col; col++) {
+            Cell* cell = sheet->cells[permutation->start_row + i][col];
+            if (cell) cell->row = permutation->start_row + i;
+        }
+    }
+    return 1;
+}
+
+// Move the rows into sorted order and rebase the formulas that moved
+int sheet_apply_permutation(Sheet* sheet, RowPermutation* permutation) {
+    if (permutation->applied || sheet->batch) return 0;
+    if (!sheet_move_rows_by_order(sheet, permutation, permutation->order)) return 0;
+    
+    int rows = permutation->end_row - permutation->start_row + 1;
+    int first_col = permutation->whole_rows ? 0 : permutation->start_col;
+    int last_col = permutation->whole_rows ? sheet->cols - 1 : permutation->end_col;
+    for (int i = 0; i < rows; i++) {
+        int delta = i - permutation->order[i];
+        if (delta == 0) continue;
+        
+        int row = permutation->start_row + i;
+        for (int col = first_col; col <= last_col; col++) {
+            Cell* cell = sheet->cells[row][col];
+            if (!cell || cell->type != CELL_FORMULA || !cell->data.formula.expression) continue;
             
-            switch (result_cell->type) {
-                case CELL_NUMBER:
-                    return result_cell->data.number;
-                case CELL_FORMULA:
-                    if (result_cell->data.formula.error == ERROR_NONE) {
-                        return result_cell->data.formula.cached_value;
-                    }
-                    break;
-                case CELL_EMPTY:
-                    return 0.0;
-                default:
-                    break;
+            CompiledFormula* formula = formula_compile(cell->data.formula.expression);
+            if (!formula) continue;
+            if (formula->ref_count > 0) {
+                char* text = formula_render(formula, delta, 0);
+                if (text && strcmp(text, cell->data.formula.expression) != 0) {
+                    formula_journal_replace(&permutation->formulas, cell, row, col, text);
+                } else {
+                    free(text);
+                }
             }
+            formula_free(formula);
         }
     }
     
-    // No match found
-    *error = ERROR_NA;
-    return 0.0;
+    permutation->applied = 1;
+    sheet_filter_clear(sheet);  // Its rows no longer line up
+    sheet_notify_range(sheet, permutation->start_row, 0, permutation->end_row, sheet->cols - 1);
+    sheet->needs_recalc = 1;
+    sheet_recalculate(sheet);
+    return 1;
 }
 
-// Simple formula evaluator (basic arithmetic and cell references)
-double evaluate_formula(Sheet* sheet, const char* formula, ErrorType* error) {
-    *error = ERROR_NONE;
+// Put the rows back in their original order and restore rebased formulas
+void sheet_revert_permutation(Sheet* sheet, RowPermutation* permutation) {
+    if (!permutation->applied) return;
+    
+    int rows = permutation->end_row - permutation->start_row + 1;
+    int* inverse = (int*)malloc(rows * sizeof(int));
+    if (!inverse) return;
+    for (int i = 0; i < rows; i++) {
+        inverse[permutation->order[i]] = i;
+    }
     
-    // Skip leading '='
-    if (*formula == '=') formula++;
+    formula_journal_restore(sheet, &permutation->formulas);
+    sheet_move_rows_by_order(sheet, permutation, inverse);
+    free(inverse);
     
-    // Try comparison expressions first (for IF function support)
-    return evaluate_comparison(sheet, formula, error);
+    permutation->applied = 0;
+    sheet_filter_clear(sheet);
+    sheet_notify_range(sheet, permutation->start_row, 0, permutation->end_row, sheet->cols - 1);
+    sheet->needs_recalc = 1;
+    sheet_recalculate(sheet);
 }
 
-// Helper function to get string value from a cell reference
-char* get_cell_string_value(Sheet* sheet, const char* ref) {
-    int row, col;
-    if (!parse_cell_reference(ref, &row, &col)) {
+// Sort rows start_row..end_row by the given keys. Only the columns
+// start_col..end_col move, unless whole_rows is set. Returns the applied
+// permutation (for undo), or NULL if the sort could not run.
+RowPermutation* sheet_sort_range(Sheet* sheet, int start_row, int start_col, int end_row, int end_col,
+                                 int whole_rows, const SortKey* keys, int key_count) {
+    if (sheet->batch || key_count <= 0 || end_row < start_row) return NULL;
+    
+    int rows = end_row - start_row + 1;
+    RowPermutation* permutation = (RowPermutation*)calloc(1, sizeof(RowPermutation));
+    SortColumn* columns = (SortColumn*)calloc(key_count, sizeof(SortColumn));
+    if (!permutation || !columns) {
+        free(permutation);
+        free(columns);
         return NULL;
     }
+    permutation->start_row = start_row;
+    permutation->start_col = start_col;
+    permutation->end_row = end_row;
+    permutation->end_col = end_col;
+    permutation->whole_rows = whole_rows;
+    permutation->order = (int*)malloc(rows * sizeof(int));
+    
+    int ok = permutation->order != NULL;
+    for (int k = 0; k < key_count && ok; k++) {
+        columns[k].classes = (unsigned char*)malloc(rows);
+        columns[k].numbers = (double*)malloc(rows * sizeof(double));
+        columns[k].strings = (const char**)malloc(rows * sizeof(const char*));
+        ok = columns[k].classes && columns[k].numbers && columns[k].strings;
+    }
     
-    Cell* cell = sheet_get_cell(sheet, row, col);
-    if (!cell) return NULL;
+    if (ok) {
+        SortContext sort;
+        sort.sheet = sheet;
+        sort.start_row = start_row;
+        sort.rows = rows;
+        sort.keys = keys;
+        sort.key_count = key_count;
+        sort.columns = columns;
+        parallel_run(sort_extract_chunk, &sort, (rows + SORT_EXTRACT_CHUNK - 1) / SORT_EXTRACT_CHUNK);
+        
+        for (int i = 0; i < rows; i++) {
+            permutation->order[i] = i;
+        }
+        ok = parallel_sort_indices(permutation->order, rows, sort_compare_rows, &sort);
+    }
     
-    switch (cell->type) {
-        case CELL_STRING:
-            return cell->data.string;
-        case CELL_FORMULA:
-            if (cell->data.formula.is_string_result && cell->data.formula.cached_string) {
-                return cell->data.formula.cached_string;
+    for (int k = 0; k < key_count; k++) {
+        free(columns[k].classes);
+        free(columns[k].numbers);
+        free((void*)columns[k].strings);
+    }
+    free(columns);
+    
+    if (!ok || !sheet_apply_permutation(sheet, permutation)) {
+        row_permutation_free(permutation);
+        return NULL;
+    }
+    return permutation;
+}
+
+// Approximate heap footprint of a permutation, for undo history budgeting
+size_t row_permutation_bytes(const RowPermutation* permutation) {
+    return sizeof(RowPermutation) +
+           (size_t)(permutation->end_row - permutation->start_row + 1) * sizeof(int) +
+           formula_journal_bytes(&permutation->formulas);
+}
+
+void row_permutation_free(RowPermutation* permutation) {
+    if (!permutation) return;
+    formula_journal_free(&permutation->formulas);
+    free(permutation->order);
+    free(permutation);
+}
+
+// Bounds of the cells in use (0 if the sheet is empty)
+int sheet_used_range(Sheet* sheet, int* start_row, int* start_col, int* end_row, int* end_col) {
+    int min_row = -1, max_row = -1;
+    int min_col = sheet->cols, max_col = -1;
+    
+    for (int row = 0; row < sheet->rows; row++) {
+        Cell** line = sheet->cells[row];
+        for (int col = 0; col < sheet->cols; col++) {
+            if (!line[col]) continue;
+            if (min_row < 0) min_row = row;
+            max_row = row;
+            if (col < min_col) min_col = col;
+            if (col > max_col) max_col = col;
+        }
+    }
+    
+    if (max_row < 0) return 0;
+    *start_row = min_row;
+    *start_col = min_col;
+    *end_row = max_row;
+    *end_col = max_col;
+    return 1;
+}
+
+// NEW: Filtering
+//
+// A filter hides the rows of a range that fail its predicates. Nothing is
+// copied: the filter keeps an ascending list of the sheet rows still shown,
+// and rendering and cursor movement walk that list (see sheet_view_row).
+// Numeric predicates run over a column slice, as simple loops over the
+// whole array that update a match mask without branching.
+
+
+// Numeric value of a cell: a number, or a formula with a numeric result.
+// Returns 0 (and sets *value to 0) for anything else.
+int cell_get_number(const Cell* cell, double* value) {
+    if (cell) {
+        if (cell->type == CELL_NUMBER) {
+            *value = cell->data.number;
+            return 1;
+        }
+        if (cell->type == CELL_FORMULA && cell->data.formula.error == ERROR_NONE &&
+            !cell->data.formula.is_string_result) {
+            *value = cell->data.formula.cached_value;
+            return 1;
+        }
+    }
+    *value = 0.0;
+    return 0;
+}
+
+// k-th smallest of values[0..count) (0-based); reorders the array
+double select_kth(double* values, int count, int k) {
+    int lo = 0, hi = count - 1;
+    while (lo < hi) {
+        double pivot = values[lo + (hi - lo) / 2];
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (values[i] < pivot) i++;
+            while (values[j] > pivot) j--;
+            if (i <= j) {
+                double swap = values[i];
+                values[i] = values[j];
+                values[j] = swap;
+                i++;
+                j--;
             }
-            break;
-        default:
-            break;
+        }
+        if (k <= j) hi = j;
+        else if (k >= i) lo = i;
+        else break;
+    }
+    return values[k];
+}
+
+// Case-insensitive substring search
+int text_contains(const char* text, const char* needle) {
+    size_t needle_len = strlen(needle);
+    if (needle_len == 0) return 1;
+    for (; *text; text++) {
+        if (_strnicmp(text, needle, needle_len) == 0) return 1;
+    }
+    return 0;
+}
+
+// Text shown for a cell when matching text predicates
+const char* filter_cell_text(Cell* cell) {
+    if (!cell) return "";
+    if (cell->type == CELL_STRING) return cell->data.string ? cell->data.string : "";
+    if (cell->type == CELL_FORMULA && cell->data.formula.is_string_result && cell->data.formula.cached_string) {
+        return cell->data.formula.cached_string;
+    }
+    return cell_get_display_value(cell);
+}
+
+// Narrow mask[0..count) to the rows that pass one predicate
+int filter_apply_predicate(Sheet* sheet, const SheetFilter* filter, const FilterPredicate* predicate, unsigned char* mask) {
+    int count = filter->end_row - filter->start_row + 1;
+    
+    if (predicate->is_text) {
+        for (int i = 0; i < count; i++) {
+            if (!mask[i]) continue;
+            const char* text = filter_cell_text(sheet->cells[filter->start_row + i][predicate->col]);
+            int match = predicate->op == FILTER_CONTAINS ? text_contains(text, predicate->text)
+                                                         : _stricmp(text, predicate->text) == 0;
+            if (predicate->op == FILTER_NE) match = !match;
+            mask[i] = (unsigned char)match;
+        }
+        return 1;
+    }
+    
+    ColumnSlice slice;
+    if (!sheet_read_slice(sheet, predicate->col, filter->start_row, count, &slice)) return 0;
+    double* values = slice.values;
+    unsigned char* valid = slice.valid;
+    
+    double low = predicate->low;
+    double high = predicate->high;
+    if (predicate->op == FILTER_TOP || predicate->op == FILTER_BOTTOM) {
+        // Turn top/bottom N into a threshold over the rows still matching
+        double* candidates = (double*)malloc(count * sizeof(double));
+        int candidate_count = 0;
+        if (candidates) {
+            for (int i = 0; i < count; i++) {
+                if (mask[i] & valid[i]) candidates[candidate_count++] = values[i];
+            }
+        }
+        int n = (int)predicate->low;
+        if (n > candidate_count) n = candidate_count;
+        if (n > 0) {
+            low = select_kth(candidates, candidate_count,
+                             predicate->op == FILTER_TOP ? candidate_count - n : n - 1);
+        } else {
+            memset(valid, 0, count);    // Nothing can match
+        }
+        free(candidates);
+    }
+    
+    switch (predicate->op) {
+        case FILTER_EQ:
+            for (int i = 0; i < count; i++) mask[i] &= valid[i] & (values[i] == low);
+            break;
+        case FILTER_NE:
+            for (int i = 0; i < count; i++) mask[i] &= valid[i] & (values[i] != low);
+            break;
+        case FILTER_LT:
+            for (int i = 0; i < count; i++) mask[i] &= valid[i] & (values[i] < low);
+            break;
+        case FILTER_LE:
+            for (int i = 0; i < count; i++) mask[i] &= valid[i] & (values[i] <= low);
+            break;
+        case FILTER_GT:
+            for (int i = 0; i < count; i++) mask[i] &= valid[i] & (values[i] > low);
+            break;
+        case FILTER_GE:
+        case FILTER_TOP:
+            for (int i = 0; i < count; i++) mask[i] &= valid[i] & (values[i] >= low);
+            break;
+        case FILTER_BOTTOM:
+            for (int i = 0; i < count; i++) mask[i] &= valid[i] & (values[i] <= low);
+            break;
+        case FILTER_BETWEEN:
+            for (int i = 0; i < count; i++) mask[i] &= valid[i] & (values[i] >= low) & (values[i] <= high);
+            break;
+        default:
+            break;
+    }
+    
+    column_slice_free(&slice);
+    return 1;
+}
+
+// Run every predicate and rebuild the list of shown rows
+int sheet_filter_evaluate(Sheet* sheet) {
+    SheetFilter* filter = sheet->filter;
+    if (!filter) return 0;
+    
+    int count = filter->end_row - filter->start_row + 1;
+    unsigned char* mask = (unsigned char*)malloc(count);
+    int* rows = (int*)malloc(sheet->rows * sizeof(int));
+    if (!mask || !rows) {
+        free(mask);
+        free(rows);
+        return 0;
+    }
+    memset(mask, 1, count);
+    
+    for (int p = 0; p < filter->predicate_count; p++) {
+        if (!filter_apply_predicate(sheet, filter, &filter->predicates[p], mask)) {
+            free(mask);
+            free(rows);
+            return 0;
+        }
+    }
+    
+    // Rows outside the filtered range are always shown
+    int shown = 0;
+    for (int row = 0; row < filter->start_row; row++) {
+        rows[shown++] = row;
+    }
+    filter->matched = 0;
+    for (int i = 0; i < count; i++) {
+        rows[shown] = filter->start_row + i;
+        shown += mask[i];
+        filter->matched += mask[i];
+    }
+    for (int row = filter->end_row + 1; row < sheet->rows; row++) {
+        rows[shown++] = row;
+    }
+    
+    free(filter->rows);
+    filter->rows = rows;
+    filter->count = shown;
+    free(mask);
+    return 1;
+}
+
+// Add a predicate (ANDed with any already set), creating the filter over
+// start_row..end_row if there is none. Returns 0 on failure.
+int sheet_filter_add(Sheet* sheet, const FilterPredicate* predicate, int start_row, int end_row) {
+    if (!sheet->filter) {
+        sheet->filter = (SheetFilter*)calloc(1, sizeof(SheetFilter));
+        if (!sheet->filter) return 0;
+        sheet->filter->start_row = start_row;
+        sheet->filter->end_row = end_row;
+    }
+    
+    SheetFilter* filter = sheet->filter;
+    if (filter->predicate_count == FILTER_MAX_PREDICATES) return 0;
+    
+    FilterPredicate* added = &filter->predicates[filter->predicate_count];
+    *added = *predicate;
+    added->text = predicate->text ? _strdup(predicate->text) : NULL;
+    filter->predicate_count++;
+    
+    if (!sheet_filter_evaluate(sheet)) {
+        free(added->text);
+        filter->predicate_count--;
+        return 0;
+    }
+    return 1;
+}
+
+void sheet_filter_clear(Sheet* sheet) {
+    SheetFilter* filter = sheet->filter;
+    if (!filter) return;
+    for (int p = 0; p < filter->predicate_count; p++) {
+        free(filter->predicates[p].text);
+    }
+    free(filter->rows);
+    free(filter);
+    sheet->filter = NULL;
+}
+
+// Number of rows in the current view (all rows when there is no filter)
+int sheet_view_count(Sheet* sheet) {
+    return sheet->filter ? sheet->filter->count : sheet->rows;
+}
+
+// Sheet row shown at position index of the view
+int sheet_view_row(Sheet* sheet, int index) {
+    if (!sheet->filter) return index;
+    if (sheet->filter->count == 0) return 0;
+    if (index < 0) index = 0;
+    if (index >= sheet->filter->count) index = sheet->filter->count - 1;
+    return sheet->filter->rows[index];
+}
+
+// Position of a row in the view; a hidden row maps to the next shown row
+int sheet_view_index(Sheet* sheet, int row) {
+    if (!sheet->filter) return row;
+    
+    int lo = 0, hi = sheet->filter->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (sheet->filter->rows[mid] < row) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < sheet->filter->count ? lo : sheet->filter->count - 1;
+}
+
+// NEW: Range watchers
+
+// Register a callback for changes inside the given range. Returns the
+// watcher id, or -1 if it could not be stored.
+int sheet_watch_range(Sheet* sheet, int start_row, int start_col, int end_row, int end_col,
+                      SheetWatchCallback callback, void* context) {
+    if (!callback) return -1;
+    
+    int id = 0;
+    while (id < sheet->watcher_capacity && sheet->watchers[id].callback) id++;
+    if (id == sheet->watcher_capacity) {
+        int new_capacity = sheet->watcher_capacity ? sheet->watcher_capacity * 2 : 4;
+        SheetWatcher* watchers = (SheetWatcher*)realloc(sheet->watchers, new_capacity * sizeof(SheetWatcher));
+        if (!watchers) return -1;
+        memset(watchers + sheet->watcher_capacity, 0, (new_capacity - sheet->watcher_capacity) * sizeof(SheetWatcher));
+        sheet->watchers = watchers;
+        sheet->watcher_capacity = new_capacity;
+    }
+    
+    SheetWatcher* watcher = &sheet->watchers[id];
+    watcher->start_row = start_row < end_row ? start_row : end_row;
+    watcher->end_row = start_row < end_row ? end_row : start_row;
+    watcher->start_col = start_col < end_col ? start_col : end_col;
+    watcher->end_col = start_col < end_col ? end_col : start_col;
+    watcher->callback = callback;
+    watcher->context = context;
+    sheet->watcher_count++;
+    return id;
+}
+
+void sheet_unwatch(Sheet* sheet, int id) {
+    if (id < 0 || id >= sheet->watcher_capacity || !sheet->watchers[id].callback) return;
+    sheet->watchers[id].callback = NULL;
+    sheet->watchers[id].context = NULL;
+    sheet->watcher_count--;
+}
+
+// Tell every watcher whose range overlaps the given block about the overlap.
+// Every change passes through here, so this also bumps the column versions.
+void sheet_notify_range(Sheet* sheet, int start_row, int start_col, int end_row, int end_col) {
+    if (sheet->col_versions) {
+        int c0 = start_col > 0 ? start_col : 0;
+        int c1 = end_col < sheet->cols - 1 ? end_col : sheet->cols - 1;
+        for (int c = c0; c <= c1; c++) sheet->col_versions[c]++;
+    }
+    if (sheet->watcher_count == 0) return;
+    
+    for (int i = 0; i < sheet->watcher_capacity; i++) {
+        SheetWatcher* watcher = &sheet->watchers[i];
+        if (!watcher->callback) continue;
+        
+        int r0 = start_row > watcher->start_row ? start_row : watcher->start_row;
+        int r1 = end_row < watcher->end_row ? end_row : watcher->end_row;
+        int c0 = start_col > watcher->start_col ? start_col : watcher->start_col;
+        int c1 = end_col < watcher->end_col ? end_col : watcher->end_col;
+        if (r0 > r1 || c0 > c1) continue;
+        
+        watcher->callback(watcher->context, r0, c0, r1, c1);
+    }
+}
+
+// Cells may have moved anywhere (row/column insert or delete)
+void sheet_notify_all(Sheet* sheet) {
+    sheet_notify_range(sheet, 0, 0, sheet->rows - 1, sheet->cols - 1);
+}
+
+// NEW: Column slices
+//
+// Readers that only want numbers (charts, filters, aggregates) take a slice
+// of each column instead of calling sheet_get_cell and switching on the cell
+// type row by row. sheet_read_slices fills several adjacent columns in one
+// pass: the rows are split into chunks read in parallel, and each row's
+// cells are visited once for all of the columns.
+
+#define SLICE_READ_CHUNK 8192       // Rows per slice read task
+
+typedef struct {
+    Sheet* sheet;
+    ColumnSlice* slices;
+    int col_count;
+    int count;
+} SliceRead;
+
+void slice_read_chunk(void* context, int index) {
+    SliceRead* read = (SliceRead*)context;
+    int first = index * SLICE_READ_CHUNK;
+    int last = first + SLICE_READ_CHUNK < read->count ? first + SLICE_READ_CHUNK : read->count;
+    int start_row = read->slices[0].start_row;
+    
+    for (int i = first; i < last; i++) {
+        Cell** row = read->sheet->cells[start_row + i];
+        for (int c = 0; c < read->col_count; c++) {
+            ColumnSlice* slice = &read->slices[c];
+            slice->valid[i] = (unsigned char)cell_get_number(row[slice->col], &slice->values[i]);
+        }
+    }
+}
+
+// Read columns first_col..first_col+col_count-1 over 'count' rows into
+// slices[0..col_count). Returns 0 (with nothing allocated) if memory ran out;
+// otherwise free each slice with column_slice_free.
+int sheet_read_slices(Sheet* sheet, int first_col, int col_count, int start_row, int count, ColumnSlice* slices) {
+    if (count < 0) count = 0;
+    int ok = 1;
+    for (int c = 0; c < col_count; c++) {
+        slices[c].col = first_col + c;
+        slices[c].start_row = start_row;
+        slices[c].count = count;
+        slices[c].values = (double*)malloc((count > 0 ? count : 1) * sizeof(double));
+        slices[c].valid = (unsigned char*)malloc(count > 0 ? count : 1);
+        if (!slices[c].values || !slices[c].valid) ok = 0;
+    }
+    if (!ok) {
+        for (int c = 0; c < col_count; c++) column_slice_free(&slices[c]);
+        return 0;
+    }
+    if (count == 0 || col_count == 0) return 1;
+    
+    SliceRead read;
+    read.sheet = sheet;
+    read.slices = slices;
+    read.col_count = col_count;
+    read.count = count;
+    parallel_run(slice_read_chunk, &read, (count + SLICE_READ_CHUNK - 1) / SLICE_READ_CHUNK);
+    return 1;
+}
+
+int sheet_read_slice(Sheet* sheet, int col, int start_row, int count, ColumnSlice* slice) {
+    return sheet_read_slices(sheet, col, 1, start_row, count, slice);
+}
+
+void column_slice_free(ColumnSlice* slice) {
+    free(slice->values);
+    free(slice->valid);
+    slice->values = NULL;
+    slice->valid = NULL;
+    slice->count = 0;
+}
+
+// NEW: Pivot aggregation
+//
+// Rows are grouped by hashing: the key cells of a row hash to 64 bits, which
+// find the row's group in an open-addressing table. Groups keep no copy of
+// their key; a hash match is confirmed against the key cells of the group's
+// first row. The rows are split into blocks that are aggregated in parallel,
+// each into a table of its own, and the block tables are merged in block
+// order afterwards, so a group's first row is the lowest row holding its key.
+
+#define PIVOT_BLOCK_ROWS 65536      // Rows aggregated by one task
+#define PIVOT_HASH_SEED 0x9e3779b97f4a7c15ULL
+
+typedef struct {
+    unsigned long long hash;
+    int group;                      // -1 for a free slot
+} PivotSlot;
+
+// Groups of one block (or of the whole table, once merged)
+typedef struct {
+    PivotSlot* slots;
+    int slot_capacity;              // Power of two
+    int count;
+    int capacity;
+    int* rows;                      // First row of each group
+    int* sizes;
+    unsigned long long* hashes;
+    PivotAggregate* aggregates;     // capacity x value_count
+    int failed;                     // Out of memory
+} PivotGroups;
+
+typedef struct {
+    Sheet* sheet;
+    const PivotTable* pivot;
+    PivotGroups* blocks;
+} PivotRun;
+
+// Kind of a key cell: 0 blank, 1 number (in *number), 2 text (in *text) or
+// 3 error (its code in *number). Text keys match case-insensitively.
+int pivot_key_kind(const Cell* cell, double* number, const char** text) {
+    *number = 0.0;
+    *text = "";
+    if (!cell) return 0;
+    switch (cell->type) {
+        case CELL_NUMBER:
+            *number = cell->data.number;
+            return 1;
+        case CELL_STRING:
+            if (!cell->data.string || !cell->data.string[0]) return 0;
+            *text = cell->data.string;
+            return 2;
+        case CELL_FORMULA:
+            if (cell->data.formula.error != ERROR_NONE) {
+                *number = (double)cell->data.formula.error;
+                return 3;
+            }
+            if (cell->data.formula.is_string_result) {
+                if (!cell->data.formula.cached_string || !cell->data.formula.cached_string[0]) return 0;
+                *text = cell->data.formula.cached_string;
+                return 2;
+            }
+            *number = cell->data.formula.cached_value;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+unsigned long long pivot_mix(unsigned long long hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Hash of a key (as returned by pivot_key_kind); text hashes case-insensitively
+unsigned long long pivot_key_hash(int kind, double number, const char* text) {
+    unsigned long long hash = (unsigned long long)kind;
+    if (kind == 2) {
+        // FNV-1a over the lower-cased text
+        hash = 0xcbf29ce484222325ULL;
+        for (const unsigned char* c = (const unsigned char*)text; *c; c++) {
+            hash ^= (unsigned long long)tolower(*c);
+            hash *= 0x100000001b3ULL;
+        }
+    } else if (kind != 0) {
+        if (number == 0.0) number = 0.0;    // -0 and 0 are one key
+        unsigned long long bits;
+        memcpy(&bits, &number, sizeof(bits));
+        hash = bits + (unsigned long long)kind;
+    }
+    return pivot_mix(hash);
+}
+
+unsigned long long pivot_row_hash(Sheet* sheet, const PivotTable* pivot, int row) {
+    unsigned long long hash = PIVOT_HASH_SEED;
+    for (int k = 0; k < pivot->key_count; k++) {
+        double number;
+        const char* text;
+        int kind = pivot_key_kind(sheet->cells[row][pivot->key_cols[k]], &number, &text);
+        hash = pivot_mix(hash ^ pivot_key_hash(kind, number, text)) + (unsigned long long)k;
+    }
+    return hash;
+}
+
+// Order of two keys: numbers, then text, then errors, then blanks. 0 means
+// the keys are equal.
+int pivot_key_compare(int kind_a, double number_a, const char* text_a, int kind_b, double number_b, const char* text_b) {
+    static const int kind_rank[4] = { 3, 0, 1, 2 };
+    if (kind_a != kind_b) return kind_rank[kind_a] - kind_rank[kind_b];
+    if (kind_a == 2) return _stricmp(text_a, text_b);
+    if (number_a < number_b) return -1;
+    if (number_a > number_b) return 1;
+    if (number_a == number_b) return 0;
+    if (number_a == number_a) return -1;  // NaN sorts after numbers
+    if (number_b == number_b) return 1;
+    return 0;
+}
+
+// Order of two rows by their key cells. 0 means the rows belong to the same group.
+int pivot_compare_rows(Sheet* sheet, const PivotTable* pivot, int row_a, int row_b) {
+    for (int k = 0; k < pivot->key_count; k++) {
+        int col = pivot->key_cols[k];
+        double number_a, number_b;
+        const char* text_a;
+        const char* text_b;
+        int kind_a = pivot_key_kind(sheet->cells[row_a][col], &number_a, &text_a);
+        int kind_b = pivot_key_kind(sheet->cells[row_b][col], &number_b, &text_b);
+        int order = pivot_key_compare(kind_a, number_a, text_a, kind_b, number_b, text_b);
+        if (order != 0) return order;
+    }
+    return 0;
+}
+
+int pivot_groups_init(PivotGroups* groups) {
+    memset(groups, 0, sizeof(*groups));
+    groups->slot_capacity = 64;
+    groups->slots = (PivotSlot*)malloc(groups->slot_capacity * sizeof(PivotSlot));
+    if (!groups->slots) {
+        groups->failed = 1;
+        return 0;
+    }
+    for (int i = 0; i < groups->slot_capacity; i++) groups->slots[i].group = -1;
+    return 1;
+}
+
+void pivot_groups_free(PivotGroups* groups) {
+    free(groups->slots);
+    free(groups->rows);
+    free(groups->sizes);
+    free(groups->hashes);
+    free(groups->aggregates);
+    memset(groups, 0, sizeof(*groups));
+}
+
+// Double the slot table once it is half full
+int pivot_groups_rehash(PivotGroups* groups) {
+    int capacity = groups->slot_capacity * 2;
+    PivotSlot* slots = (PivotSlot*)malloc(capacity * sizeof(PivotSlot));
+    if (!slots) return 0;
+    for (int i = 0; i < capacity; i++) slots[i].group = -1;
+    for (int i = 0; i < groups->slot_capacity; i++) {
+        if (groups->slots[i].group < 0) continue;
+        int slot = (int)(groups->slots[i].hash & (unsigned long long)(capacity - 1));
+        while (slots[slot].group >= 0) slot = (slot + 1) & (capacity - 1);
+        slots[slot] = groups->slots[i];
+    }
+    free(groups->slots);
+    groups->slots = slots;
+    groups->slot_capacity = capacity;
+    return 1;
+}
+
+// Group of 'row' (whose key hashes to 'hash'), added with empty aggregates
+// if the key is new. Returns -1 if memory ran out.
+int pivot_groups_find(Sheet* sheet, const PivotTable* pivot, PivotGroups* groups, unsigned long long hash, int row) {
+    int mask = groups->slot_capacity - 1;
+    int slot = (int)(hash & (unsigned long long)mask);
+    while (groups->slots[slot].group >= 0) {
+        int group = groups->slots[slot].group;
+        if (groups->slots[slot].hash == hash &&
+            pivot_compare_rows(sheet, pivot, groups->rows[group], row) == 0) {
+            return group;
+        }
+        slot = (slot + 1) & mask;
+    }
+    
+    if (groups->count == groups->capacity) {
+        int capacity = groups->capacity ? groups->capacity * 2 : 64;
+        int* rows = (int*)realloc(groups->rows, capacity * sizeof(int));
+        if (rows) groups->rows = rows;
+        int* sizes = (int*)realloc(groups->sizes, capacity * sizeof(int));
+        if (sizes) groups->sizes = sizes;
+        unsigned long long* hashes = (unsigned long long*)realloc(groups->hashes, capacity * sizeof(unsigned long long));
+        if (hashes) groups->hashes = hashes;
+        PivotAggregate* aggregates = (PivotAggregate*)realloc(groups->aggregates,
+            (size_t)capacity * (pivot->value_count > 0 ? pivot->value_count : 1) * sizeof(PivotAggregate));
+        if (aggregates) groups->aggregates = aggregates;
+        if (!rows || !sizes || !hashes || !aggregates) {
+            groups->failed = 1;
+            return -1;
+        }
+        groups->capacity = capacity;
+    }
+    
+    int group = groups->count++;
+    groups->rows[group] = row;
+    groups->sizes[group] = 0;
+    groups->hashes[group] = hash;
+    PivotAggregate* aggregates = &groups->aggregates[(size_t)group * pivot->value_count];
+    for (int v = 0; v < pivot->value_count; v++) {
+        aggregates[v].sum = 0.0;
+        aggregates[v].min = 0.0;
+        aggregates[v].max = 0.0;
+        aggregates[v].count = 0;
+    }
+    groups->slots[slot].hash = hash;
+    groups->slots[slot].group = group;
+    
+    if (groups->count * 2 > groups->slot_capacity && !pivot_groups_rehash(groups)) {
+        groups->failed = 1;
+        return -1;
+    }
+    return group;
+}
+
+void pivot_aggregate_merge(PivotAggregate* into, const PivotAggregate* from) {
+    if (from->count == 0) return;
+    if (into->count == 0) {
+        into->min = from->min;
+        into->max = from->max;
+    } else {
+        if (from->min < into->min) into->min = from->min;
+        if (from->max > into->max) into->max = from->max;
+    }
+    into->sum += from->sum;
+    into->count += from->count;
+}
+
+void pivot_block_task(void* context, int index) {
+    PivotRun* run = (PivotRun*)context;
+    const PivotTable* pivot = run->pivot;
+    PivotGroups* groups = &run->blocks[index];
+    int first = pivot->start_row + index * PIVOT_BLOCK_ROWS;
+    int last = first + PIVOT_BLOCK_ROWS - 1 < pivot->end_row ? first + PIVOT_BLOCK_ROWS - 1 : pivot->end_row;
+    
+    if (!pivot_groups_init(groups)) return;
+    for (int row = first; row <= last; row++) {
+        int group = pivot_groups_find(run->sheet, pivot, groups, pivot_row_hash(run->sheet, pivot, row), row);
+        if (group < 0) return;
+        groups->sizes[group]++;
+        
+        Cell** line = run->sheet->cells[row];
+        PivotAggregate* aggregates = &groups->aggregates[(size_t)group * pivot->value_count];
+        for (int v = 0; v < pivot->value_count; v++) {
+            double value;
+            if (!cell_get_number(line[pivot->value_cols[v]], &value)) continue;
+            PivotAggregate* aggregate = &aggregates[v];
+            if (aggregate->count == 0) {
+                aggregate->min = value;
+                aggregate->max = value;
+            } else {
+                if (value < aggregate->min) aggregate->min = value;
+                if (value > aggregate->max) aggregate->max = value;
+            }
+            aggregate->sum += value;
+            aggregate->count++;
+        }
+    }
+}
+
+int pivot_group_compare(void* context, int a, int b) {
+    PivotRun* run = (PivotRun*)context;
+    const PivotGroups* groups = run->blocks;
+    return pivot_compare_rows(run->sheet, run->pivot, groups->rows[a], groups->rows[b]);
+}
+
+// Group rows start_row..end_row by the key columns and aggregate the value
+// columns of each group. Fills the result fields of 'pivot' (free them with
+// pivot_free); returns 0 if memory ran out.
+int sheet_pivot(Sheet* sheet, PivotTable* pivot) {
+    pivot->group_count = 0;
+    pivot->group_rows = NULL;
+    pivot->group_sizes = NULL;
+    pivot->aggregates = NULL;
+    if (pivot->key_count <= 0 || pivot->end_row < pivot->start_row) return 1;
+    
+    int block_count = (pivot->end_row - pivot->start_row) / PIVOT_BLOCK_ROWS + 1;
+    PivotGroups* blocks = (PivotGroups*)calloc(block_count, sizeof(PivotGroups));
+    if (!blocks) return 0;
+    
+    PivotRun run;
+    run.sheet = sheet;
+    run.pivot = pivot;
+    run.blocks = blocks;
+    parallel_run(pivot_block_task, &run, block_count);
+    
+    // Merge the block tables in order into the first
+    PivotGroups* merged = &blocks[0];
+    int ok = !merged->failed;
+    for (int b = 1; b < block_count && ok; b++) {
+        PivotGroups* block = &blocks[b];
+        if (block->failed) {
+            ok = 0;
+            break;
+        }
+        for (int g = 0; g < block->count; g++) {
+            int group = pivot_groups_find(sheet, pivot, merged, block->hashes[g], block->rows[g]);
+            if (group < 0) {
+                ok = 0;
+                break;
+            }
+            merged->sizes[group] += block->sizes[g];
+            for (int v = 0; v < pivot->value_count; v++) {
+                pivot_aggregate_merge(&merged->aggregates[(size_t)group * pivot->value_count + v],
+                                      &block->aggregates[(size_t)g * pivot->value_count + v]);
+            }
+        }
+        pivot_groups_free(block);
+    }
+    
+    int* order = NULL;
+    if (ok) {
+        order = (int*)malloc((merged->count > 0 ? merged->count : 1) * sizeof(int));
+        pivot->group_rows = (int*)malloc((merged->count > 0 ? merged->count : 1) * sizeof(int));
+        pivot->group_sizes = (int*)malloc((merged->count > 0 ? merged->count : 1) * sizeof(int));
+        pivot->aggregates = (PivotAggregate*)malloc(
+            (size_t)(merged->count > 0 ? merged->count : 1) * (pivot->value_count > 0 ? pivot->value_count : 1) * sizeof(PivotAggregate));
+        ok = order && pivot->group_rows && pivot->group_sizes && pivot->aggregates;
+    }
+    if (ok) {
+        for (int g = 0; g < merged->count; g++) order[g] = g;
+        ok = parallel_sort_indices(order, merged->count, pivot_group_compare, &run);
+    }
+    if (ok) {
+        for (int i = 0; i < merged->count; i++) {
+            int g = order[i];
+            pivot->group_rows[i] = merged->rows[g];
+            pivot->group_sizes[i] = merged->sizes[g];
+            memcpy(&pivot->aggregates[(size_t)i * pivot->value_count],
+                   &merged->aggregates[(size_t)g * pivot->value_count],
+                   pivot->value_count * sizeof(PivotAggregate));
+        }
+        pivot->group_count = merged->count;
+    } else {
+        pivot_free(pivot);
+    }
+    
+    free(order);
+    for (int b = 0; b < block_count; b++) pivot_groups_free(&blocks[b]);
+    free(blocks);
+    return ok;
+}
+
+void pivot_free(PivotTable* pivot) {
+    free(pivot->group_rows);
+    free(pivot->group_sizes);
+    free(pivot->aggregates);
+    pivot->group_rows = NULL;
+    pivot->group_sizes = NULL;
+    pivot->aggregates = NULL;
+    pivot->group_count = 0;
+}
+
+// NEW: Conditional aggregates
+//
+// SUMIF, COUNTIF, AVERAGEIF and the *IFS forms test criteria against their
+// ranges cell by cell. A criteria range within one column is served from a
+// criteria index instead: the kind and number of every row, plus the rows
+// grouped by distinct key (case-insensitively, as :pivot groups them).
+// Equality criteria read their rows straight from the index, numeric
+// comparisons binary-search the column's numbers in sorted order, and any
+// other criterion is tested once per distinct key rather than once per row.
+// Indexes are cached on the sheet and shared by every formula with the same
+// criteria range. Any change to a column bumps its version (see
+// sheet_notify_range), which retires the indexes built over it.
+
+#define CRITERIA_INDEX_MIN_ROWS 64  // Shorter ranges are simply scanned
+
+enum {
+    CRITERIA_TEST_KEY,      // (In)equality: compare each row's key with one key
+    CRITERIA_TEST_NUMBER,   // Numeric comparison: a run of the sorted numbers
+    CRITERIA_TEST_KEYS      // Anything else: a pass/fail flag per distinct key
+};
+
+struct CriteriaIndex {
+    int col, start_row, end_row;
+    unsigned int version;       // sheet->col_versions[col] when built
+    unsigned int last_used;
+    int count;                  // Rows
+    unsigned char* kinds;       // Per row, as pivot_key_kind
+    double* numbers;            // Per row (meaningful where the kind is a number)
+    int* row_keys;              // Distinct key of each row
+    PivotGroups keys;           // First sheet row and row count of each key
+    int* key_start;             // Rows of key k: rows[key_start[k]..key_start[k + 1])
+    int* rows;                  // Row offsets grouped by key, ascending within a key
+    int* sorted;                // Offsets of the numeric rows by value (built on first use)
+    int sorted_count;
+};
+
+// One criterion prepared against the index of its range
+typedef struct {
+    const Criterion* criterion;
+    CriteriaIndex* index;
+    int mode;
+    int key;                    // CRITERIA_TEST_KEY: the operand's key, -1 if no row has it
+    int first, last;            // CRITERIA_TEST_NUMBER: matching run of index->sorted
+    unsigned char* key_match;   // CRITERIA_TEST_KEYS: 1 for each key that passes
+    int estimate;               // Rows that can pass
+} CriteriaTest;
+
+// Parse criteria text: an optional operator (=, <>, <, <=, >, >=) followed
+// by a number, text (* and ? are wildcards for = and <>) or nothing, which
+// stands for a blank cell
+void criteria_parse(const char* text, Criterion* criterion) {
+    memset(criterion, 0, sizeof(*criterion));
+    criterion->op = CRITERIA_EQ;
+    if (strncmp(text, "<=", 2) == 0) {
+        criterion->op = CRITERIA_LE;
+        text += 2;
+    } else if (strncmp(text, ">=", 2) == 0) {
+        criterion->op = CRITERIA_GE;
+        text += 2;
+    } else if (strncmp(text, "<>", 2) == 0) {
+        criterion->op = CRITERIA_NE;
+        text += 2;
+    } else if (*text == '<') {
+        criterion->op = CRITERIA_LT;
+        text++;
+    } else if (*text == '>') {
+        criterion->op = CRITERIA_GT;
+        text++;
+    } else if (*text == '=') {
+        text++;
+    }
+    
+    strncpy_s(criterion->text, sizeof(criterion->text), text, _TRUNCATE);
+    size_t len = strlen(criterion->text);
+    if (len == 0) {
+        criterion->kind = 0;
+    } else if (parse_number_fast(criterion->text, len, &criterion->number)) {
+        criterion->kind = 1;
+    } else {
+        criterion->kind = 2;
+        criterion->wildcard = (criterion->op == CRITERIA_EQ || criterion->op == CRITERIA_NE) &&
+                              strpbrk(criterion->text, "*?") != NULL;
+    }
+}
+
+// Case-insensitive match with * (any run of characters) and ? (any one character)
+int text_wildcard_match(const char* text, const char* pattern) {
+    const char* star = NULL;
+    const char* resume = NULL;
+    while (*text) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = text;
+        } else if (*pattern == '?' ||
+                   (*pattern && tolower((unsigned char)*pattern) == tolower((unsigned char)*text))) {
+            pattern++;
+            text++;
+        } else if (star) {
+            pattern = star + 1;
+            text = ++resume;
+        } else {
+            return 0;
+        }
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
+
+int criteria_number_match(CriteriaOp op, double value, double operand) {
+    switch (op) {
+        case CRITERIA_EQ: return value == operand;
+        case CRITERIA_NE: return value != operand;
+        case CRITERIA_LT: return value < operand;
+        case CRITERIA_LE: return value <= operand;
+        case CRITERIA_GT: return value > operand;
+        default: return value >= operand;
+    }
+}
+
+// Test a key (as returned by pivot_key_kind). Comparisons only match keys of
+// the operand's kind; <> matches everything that = does not.
+int criteria_match_key(const Criterion* criterion, int kind, double number, const char* text) {
+    if (criterion->op == CRITERIA_EQ || criterion->op == CRITERIA_NE) {
+        int equal;
+        if (criterion->kind == 0) {
+            equal = kind == 0;
+        } else if (criterion->kind == 1) {
+            equal = kind == 1 && number == criterion->number;
+        } else {
+            equal = kind == 2 && (criterion->wildcard ? text_wildcard_match(text, criterion->text)
+                                                      : _stricmp(text, criterion->text) == 0);
+        }
+        return criterion->op == CRITERIA_EQ ? equal : !equal;
+    }
+    
+    if (criterion->kind != kind) return 0;
+    if (kind == 1) return criteria_number_match(criterion->op, number, criterion->number);
+    if (kind != 2) return 0;
+    return criteria_number_match(criterion->op, (double)_stricmp(text, criterion->text), 0.0);
+}
+
+int criteria_match_cell(const Criterion* criterion, const Cell* cell) {
+    double number;
+    const char* text;
+    int kind = pivot_key_kind(cell, &number, &text);
+    return criteria_match_key(criterion, kind, number, text);
+}
+
+CriteriaIndex* criteria_index_build(Sheet* sheet, int col, int start_row, int end_row) {
+    CriteriaIndex* index = (CriteriaIndex*)calloc(1, sizeof(CriteriaIndex));
+    if (!index) return NULL;
+    int count = end_row - start_row + 1;
+    index->col = col;
+    index->start_row = start_row;
+    index->end_row = end_row;
+    index->count = count;
+    index->kinds = (unsigned char*)malloc(count);
+    index->numbers = (double*)malloc(count * sizeof(double));
+    index->row_keys = (int*)malloc(count * sizeof(int));
+    index->rows = (int*)malloc(count * sizeof(int));
+    if (!index->kinds || !index->numbers || !index->row_keys || !index->rows ||
+        !pivot_groups_init(&index->keys)) {
+        criteria_index_free(index);
+        return NULL;
+    }
+    
+    // Group the rows by key, exactly as a one-key pivot would
+    PivotTable spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.key_count = 1;
+    spec.key_cols[0] = col;
+    for (int i = 0; i < count; i++) {
+        int row = start_row + i;
+        double number;
+        const char* text;
+        int kind = pivot_key_kind(sheet->cells[row][col], &number, &text);
+        index->kinds[i] = (unsigned char)kind;
+        index->numbers[i] = number;
+        int key = pivot_groups_find(sheet, &spec, &index->keys, pivot_row_hash(sheet, &spec, row), row);
+        if (key < 0) {
+            criteria_index_free(index);
+            return NULL;
+        }
+        index->keys.sizes[key]++;
+        index->row_keys[i] = key;
+    }
+    
+    // Bucket the row offsets by key; walking the rows in order keeps each
+    // key's rows ascending
+    int key_count = index->keys.count;
+    index->key_start = (int*)malloc((key_count + 1) * sizeof(int));
+    int* next = (int*)malloc((key_count > 0 ? key_count : 1) * sizeof(int));
+    if (!index->key_start || !next) {
+        free(next);
+        criteria_index_free(index);
+        return NULL;
+    }
+    index->key_start[0] = 0;
+    for (int k = 0; k < key_count; k++) {
+        index->key_start[k + 1] = index->key_start[k] + index->keys.sizes[k];
+        next[k] = index->key_start[k];
+    }
+    for (int i = 0; i < count; i++) {
+        index->rows[next[index->row_keys[i]]++] = i;
+    }
+    free(next);
+    return index;
+}
+
+void criteria_index_free(CriteriaIndex* index) {
+    if (!index) return;
+    free(index->kinds);
+    free(index->numbers);
+    free(index->row_keys);
+    pivot_groups_free(&index->keys);
+    free(index->key_start);
+    free(index->rows);
+    free(index->sorted);
+    free(index);
+}
+
+void sheet_criteria_cache_clear(Sheet* sheet) {
+    for (int i = 0; i < CRITERIA_CACHE_SIZE; i++) {
+        criteria_index_free(sheet->criteria_cache[i]);
+        sheet->criteria_cache[i] = NULL;
+    }
+}
+
+// Index of rows start_row..end_row of a column, from the cache when the
+// column has not changed since it was built. Returns NULL if memory ran out.
+// Up to CRITERIA_CACHE_SIZE indexes fetched in a row stay valid together.
+CriteriaIndex* sheet_criteria_index(Sheet* sheet, int col, int start_row, int end_row) {
+    unsigned int version = sheet->col_versions ? sheet->col_versions[col] : 0;
+    int slot = -1;
+    for (int i = 0; i < CRITERIA_CACHE_SIZE; i++) {
+        CriteriaIndex* index = sheet->criteria_cache[i];
+        if (index && index->col == col && index->start_row == start_row && index->end_row == end_row) {
+            if (index->version == version) {
+                index->last_used = ++sheet->criteria_clock;
+                return index;
+            }
+            slot = i;   // Stale: rebuild in its place
+            break;
+        }
+    }
+    if (slot < 0) {
+        // A free slot, or else the least recently used
+        slot = 0;
+        for (int i = 0; i < CRITERIA_CACHE_SIZE; i++) {
+            if (!sheet->criteria_cache[i]) {
+                slot = i;
+                break;
+            }
+            if (sheet->criteria_cache[i]->last_used < sheet->criteria_cache[slot]->last_used) slot = i;
+        }
+    }
+    
+    criteria_index_free(sheet->criteria_cache[slot]);
+    sheet->criteria_cache[slot] = NULL;
+    CriteriaIndex* index = criteria_index_build(sheet, col, start_row, end_row);
+    if (!index) return NULL;
+    index->version = version;
+    index->last_used = ++sheet->criteria_clock;
+    sheet->criteria_cache[slot] = index;
+    return index;
+}
+
+// Key of the index equal to the given key, or -1
+int criteria_index_find(Sheet* sheet, const CriteriaIndex* index, int kind, double number, const char* text) {
+    unsigned long long hash = pivot_mix(PIVOT_HASH_SEED ^ pivot_key_hash(kind, number, text));
+    const PivotGroups* keys = &index->keys;
+    int mask = keys->slot_capacity - 1;
+    for (int slot = (int)(hash & (unsigned long long)mask); keys->slots[slot].group >= 0; slot = (slot + 1) & mask) {
+        int key = keys->slots[slot].group;
+        if (keys->slots[slot].hash != hash) continue;
+        double key_number;
+        const char* key_text;
+        int key_kind = pivot_key_kind(sheet->cells[keys->rows[key]][index->col], &key_number, &key_text);
+        if (pivot_key_compare(kind, number, text, key_kind, key_number, key_text) == 0) return key;
+    }
+    return -1;
+}
+
+int criteria_sorted_compare(void* context, int a, int b) {
+    const CriteriaIndex* index = (const CriteriaIndex*)context;
+    double value_a = index->numbers[a];
+    double value_b = index->numbers[b];
+    return value_a < value_b ? -1 : value_a > value_b;
+}
+
+int criteria_index_sort(CriteriaIndex* index) {
+    if (index->sorted) return 1;
+    index->sorted = (int*)malloc((index->count > 0 ? index->count : 1) * sizeof(int));
+    if (!index->sorted) return 0;
+    int n = 0;
+    for (int i = 0; i < index->count; i++) {
+        if (index->kinds[i] == 1 && index->numbers[i] == index->numbers[i]) index->sorted[n++] = i;
+    }
+    index->sorted_count = n;
+    if (!parallel_sort_indices(index->sorted, n, criteria_sorted_compare, index)) {
+        free(index->sorted);
+        index->sorted = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+// First position of index->sorted whose number is >= value (or > value when 'after')
+int criteria_sorted_bound(const CriteriaIndex* index, double value, int after) {
+    int lo = 0, hi = index->sorted_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        double number = index->numbers[index->sorted[mid]];
+        if (number < value || (after && number == value)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int criteria_test_prepare(Sheet* sheet, CriteriaTest* test) {
+    const Criterion* criterion = test->criterion;
+    CriteriaIndex* index = test->index;
+    
+    if ((criterion->op == CRITERIA_EQ || criterion->op == CRITERIA_NE) && !criterion->wildcard) {
+        test->mode = CRITERIA_TEST_KEY;
+        test->key = criteria_index_find(sheet, index, criterion->kind, criterion->number, criterion->text);
+        int size = test->key >= 0 ? index->keys.sizes[test->key] : 0;
+        test->estimate = criterion->op == CRITERIA_EQ ? size : index->count - size;
+        return 1;
+    }
+    
+    if (criterion->kind == 1) {
+        if (!criteria_index_sort(index)) return 0;
+        test->mode = CRITERIA_TEST_NUMBER;
+        int below = criteria_sorted_bound(index, criterion->number, 0);
+        int through = criteria_sorted_bound(index, criterion->number, 1);
+        switch (criterion->op) {
+            case CRITERIA_LT: test->first = 0; test->last = below; break;
+            case CRITERIA_LE: test->first = 0; test->last = through; break;
+            case CRITERIA_GT: test->first = through; test->last = index->sorted_count; break;
+            default: test->first = below; test->last = index->sorted_count; break;
+        }
+        test->estimate = test->last - test->first;
+        return 1;
+    }
+    
+    test->mode = CRITERIA_TEST_KEYS;
+    test->key_match = (unsigned char*)malloc(index->keys.count > 0 ? index->keys.count : 1);
+    if (!test->key_match) return 0;
+    test->estimate = 0;
+    for (int k = 0; k < index->keys.count; k++) {
+        test->key_match[k] = (unsigned char)criteria_match_cell(criterion, sheet->cells[index->keys.rows[k]][index->col]);
+        if (test->key_match[k]) test->estimate += index->keys.sizes[k];
+    }
+    return 1;
+}
+
+int criteria_test_row(const CriteriaTest* test, int offset) {
+    const CriteriaIndex* index = test->index;
+    switch (test->mode) {
+        case CRITERIA_TEST_KEY: {
+            int equal = index->row_keys[offset] == test->key;
+            return test->criterion->op == CRITERIA_EQ ? equal : !equal;
+        }
+        case CRITERIA_TEST_NUMBER:
+            return index->kinds[offset] == 1 &&
+                   criteria_number_match(test->criterion->op, index->numbers[offset], test->criterion->number);
+        default:
+            return test->key_match[index->row_keys[offset]];
+    }
+}
+
+int criteria_offset_compare(const void* a, const void* b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+// Offsets of the rows (ascending) that pass every test, using the most
+// selective test to pick candidates. Returns the count, or -1 if memory ran out.
+int criteria_collect_rows(CriteriaTest* tests, int count, int rows, int** out) {
+    int driver = 0;
+    for (int t = 1; t < count; t++) {
+        if (tests[t].estimate < tests[driver].estimate) driver = t;
+    }
+    *out = (int*)malloc((tests[driver].estimate > 0 ? tests[driver].estimate : 1) * sizeof(int));
+    if (!*out) return -1;
+    if (tests[driver].estimate == 0) return 0;
+    
+    // Candidates: a key's row list, a short run of sorted numbers put back
+    // in row order, or otherwise every row
+    const CriteriaIndex* index = tests[driver].index;
+    const int* candidates = NULL;
+    int candidate_count = rows;
+    int* run = NULL;
+    if (tests[driver].mode == CRITERIA_TEST_KEY && tests[driver].criterion->op == CRITERIA_EQ) {
+        candidates = &index->rows[index->key_start[tests[driver].key]];
+        candidate_count = tests[driver].estimate;
+    } else if (tests[driver].mode == CRITERIA_TEST_NUMBER && tests[driver].estimate * 8 < rows) {
+        run = (int*)malloc(tests[driver].estimate * sizeof(int));
+        if (run) {
+            memcpy(run, &index->sorted[tests[driver].first], tests[driver].estimate * sizeof(int));
+            qsort(run, tests[driver].estimate, sizeof(int), criteria_offset_compare);
+            candidates = run;
+            candidate_count = tests[driver].estimate;
+        }
+    }
+    
+    int matched = 0;
+    for (int i = 0; i < candidate_count; i++) {
+        int offset = candidates ? candidates[i] : i;
+        int pass = 1;
+        for (int t = 0; t < count && pass; t++) {
+            if (t == driver && candidates) continue;
+            pass = criteria_test_row(&tests[t], offset);
+        }
+        if (pass) (*out)[matched++] = offset;
+    }
+    free(run);
+    return matched;
+}
+
+// SUM (PIVOT_SUM), COUNT (PIVOT_COUNT) or AVERAGE (PIVOT_AVG) over the cells
+// of value_range whose counterparts pass every criterion. All ranges have
+// the shape of the first criteria range, anchored at their top-left cells.
+// COUNT counts matching cells; SUM and AVERAGE use the numbers among them.
+double sheet_conditional_aggregate(Sheet* sheet, PivotFunc func, const CellRange* value_range,
+                                   const CellRange* criteria_ranges, const Criterion* criteria, int count, ErrorType* error) {
+    int rows = criteria_ranges[0].end_row - criteria_ranges[0].start_row + 1;
+    int cols = criteria_ranges[0].end_col - criteria_ranges[0].start_col + 1;
+    
+    // Cells past the edge of the sheet are left out
+    for (int i = -1; i < count; i++) {
+        const CellRange* range = i < 0 ? value_range : &criteria_ranges[i];
+        if (range->start_row < 0 || range->start_col < 0 ||
+            range->start_row >= sheet->rows || range->start_col >= sheet->cols) {
+            *error = ERROR_REF;
+            return 0.0;
+        }
+        if (range->start_row + rows > sheet->rows) rows = sheet->rows - range->start_row;
+        if (range->start_col + cols > sheet->cols) cols = sheet->cols - range->start_col;
+    }
+    
+    double sum = 0.0;
+    int matched = 0;
+    int numbers = 0;
+    int indexed = 0;
+    
+    if (cols == 1 && rows >= CRITERIA_INDEX_MIN_ROWS && count <= CRITERIA_CACHE_SIZE) {
+        CriteriaTest tests[CRITERIA_CACHE_SIZE];
+        memset(tests, 0, sizeof(tests));
+        indexed = 1;
+        for (int i = 0; i < count && indexed; i++) {
+            tests[i].criterion = &criteria[i];
+            tests[i].index = sheet_criteria_index(sheet, criteria_ranges[i].start_col, criteria_ranges[i].start_row,
+                                                  criteria_ranges[i].start_row + rows - 1);
+            indexed = tests[i].index && criteria_test_prepare(sheet, &tests[i]);
+        }
+        
+        int* offsets = NULL;
+        int found = -1;
+        if (indexed && count == 1 && func == PIVOT_COUNT) {
+            found = tests[0].estimate;  // Exact for a single test
+        } else if (indexed) {
+            found = criteria_collect_rows(tests, count, rows, &offsets);
+        }
+        if (found >= 0) {
+            matched = found;
+            if (func != PIVOT_COUNT) {
+                for (int i = 0; i < found; i++) {
+                    double value;
+                    if (cell_get_number(sheet->cells[value_range->start_row + offsets[i]][value_range->start_col], &value)) {
+                        sum += value;
+                        numbers++;
+                    }
+                }
+            }
+        } else {
+            indexed = 0;
+        }
+        free(offsets);
+        for (int i = 0; i < count; i++) free(tests[i].key_match);
+    }
+    
+    if (!indexed) {
+        // Plain scan: short or rectangular ranges, or no memory for an index
+        for (int r = 0; r < rows; r++) {
+            for (int c = 0; c < cols; c++) {
+                int pass = 1;
+                for (int i = 0; i < count && pass; i++) {
+                    pass = criteria_match_cell(&criteria[i],
+                        sheet->cells[criteria_ranges[i].start_row + r][criteria_ranges[i].start_col + c]);
+                }
+                if (!pass) continue;
+                matched++;
+                double value;
+                if (func != PIVOT_COUNT &&
+                    cell_get_number(sheet->cells[value_range->start_row + r][value_range->start_col + c], &value)) {
+                    sum += value;
+                    numbers++;
+                }
+            }
+        }
+    }
+    
+    if (func == PIVOT_COUNT) return (double)matched;
+    if (func == PIVOT_AVG) {
+        if (numbers == 0) {
+            *error = ERROR_DIV_ZERO;
+            return 0.0;
+        }
+        return sum / numbers;
+    }
+    return sum;
+}
+
+// A criterion argument: criteria text (a literal, or any text value), a cell
+// (whose text is read as criteria text; a number or an empty cell means
+// "equal to"), or a number
+int formula_node_criterion(Sheet* sheet, const FormulaTree* tree, int index, Criterion* criterion, ErrorType* error) {
+    const FormulaNode* node = &tree->nodes[index];
+    if (node->type == FNODE_REF) {
+        double number;
+        const char* text;
+        int kind = pivot_key_kind(sheet_get_cell(sheet, node->row, node->col), &number, &text);
+        if (kind == 3) {
+            *error = (ErrorType)(int)number;
+            return 0;
+        }
+        if (kind == 2) {
+            criteria_parse(text, criterion);
+            return 1;
+        }
+        memset(criterion, 0, sizeof(*criterion));
+        criterion->op = CRITERIA_EQ;
+        criterion->kind = 1;
+        criterion->number = number;
+        return 1;
+    }
+
+    FormulaValue value = formula_eval(sheet, tree, index);
+    if (value.type == FVALUE_ERROR) {
+        *error = value.error;
+        return 0;
+    }
+    if (value.type == FVALUE_STRING) {
+        criteria_parse(value.string, criterion);
+        return 1;
+    }
+    memset(criterion, 0, sizeof(*criterion));
+    criterion->op = CRITERIA_EQ;
+    criterion->kind = 1;
+    criterion->number = value.number;
+    return 1;
+}
+
+// SUMIF/COUNTIF/AVERAGEIF (range, criteria[, value range]) and
+// SUMIFS/AVERAGEIFS (value range, range, criteria, ...) and COUNTIFS
+// (range, criteria, ...)
+FormulaValue formula_eval_conditional(Sheet* sheet, const FormulaTree* tree, const FormulaNode* node) {
+    PivotFunc func = (node->func == FFUNC_SUMIF || node->func == FFUNC_SUMIFS) ? PIVOT_SUM :
+                     (node->func == FFUNC_COUNTIF || node->func == FFUNC_COUNTIFS) ? PIVOT_COUNT : PIVOT_AVG;
+    int multiple = node->func == FFUNC_SUMIFS || node->func == FFUNC_COUNTIFS || node->func == FFUNC_AVERAGEIFS;
+    int leading_value = multiple && func != PIVOT_COUNT;
+    const int* args = tree->args + node->first_arg;
+    ErrorType error = ERROR_NONE;
+
+    CellRange value_range;
+    CellRange ranges[CRITERIA_MAX];
+    Criterion criteria[CRITERIA_MAX];
+    int pairs = multiple ? (node->arg_count - leading_value) / 2 : 1;
+    if (multiple && (node->arg_count - leading_value) % 2) return formula_error_value(ERROR_PARSE);
+    if (pairs > CRITERIA_MAX) return formula_error_value(ERROR_PARSE);
+
+    int first = leading_value ? 1 : 0;
+    for (int i = 0; i < pairs; i++) {
+        if (!formula_node_range(&tree->nodes[args[first + 2 * i]], &ranges[i], &error) ||
+            !formula_node_criterion(sheet, tree, args[first + 2 * i + 1], &criteria[i], &error)) {
+            return formula_error_value(error);
+        }
+    }
+
+    if (leading_value) {
+        if (!formula_node_range(&tree->nodes[args[0]], &value_range, &error)) return formula_error_value(error);
+    } else if (!multiple && node->arg_count > 2) {
+        if (!formula_node_range(&tree->nodes[args[2]], &value_range, &error)) return formula_error_value(error);
+    } else {
+        value_range = ranges[0];
+    }
+
+    // The *IFS forms need every range to have the same shape
+    if (multiple) {
+        int rows = ranges[0].end_row - ranges[0].start_row;
+        int cols = ranges[0].end_col - ranges[0].start_col;
+        for (int i = -1; i < pairs; i++) {
+            const CellRange* range = i < 0 ? &value_range : &ranges[i];
+            if (range->end_row - range->start_row != rows || range->end_col - range->start_col != cols) {
+                return formula_error_value(ERROR_VALUE);
+            }
+        }
+    }
+
+    double result = sheet_conditional_aggregate(sheet, func, &value_range, ranges, criteria, pairs, &error);
+    return error == ERROR_NONE ? formula_number_value(result) : formula_error_value(error);
+}
+
+// NEW: Cell formatting functions
+void cell_set_format(Cell* cell, DataFormat format, FormatStyle style) {
+    if (!cell) return;
+    
+    cell->format = format;
+    cell->format_style = style;
+}
+
+char* format_cell_value(Cell* cell) {
+    static char buffer[256];
+    
+    if (!cell || cell->type == CELL_EMPTY) {
+        return "";
+    }
+    
+    double value = 0.0;
+    char* string_value = NULL;
+    
+    // Get the value to format
+    switch (cell->type) {
+        case CELL_NUMBER:
+            value = cell->data.number;
+            break;
+        case CELL_FORMULA:
+            if (cell->data.formula.error != ERROR_NONE) {
+                switch (cell->data.formula.error) {
+                    case ERROR_DIV_ZERO: return "#DIV/0!";
+                    case ERROR_REF: return "#REF!";
+                    case ERROR_VALUE: return "#VALUE!";
+                    case ERROR_PARSE: return "#PARSE!";
+                    case ERROR_NA: return "#N/A!";
+                    default: return "#ERROR!";
+                }
+            }
+            if (cell->data.formula.is_string_result && cell->data.formula.cached_string) {
+                return cell->data.formula.cached_string;
+            }
+            value = cell->data.formula.cached_value;
+            break;
+        case CELL_STRING:
+            return cell->data.string;
+        default:
+            return "";
+    }
+    
+    // Apply formatting based on format type
+    switch (cell->format) {
+        case FORMAT_PERCENTAGE:
+            return format_number_as_percentage(value, cell->precision);
+            
+        case FORMAT_CURRENCY:
+            return format_number_as_currency(value);
+            
+        case FORMAT_DATE:
+            return format_number_as_date(value, cell->format_style);
+            
+        case FORMAT_TIME:
+            return format_number_as_time(value, cell->format_style);
+              case FORMAT_DATETIME:
+            // Check if it's one of the enhanced datetime styles
+            if (cell->format_style == DATETIME_STYLE_SHORT || 
+                cell->format_style == DATETIME_STYLE_LONG || 
+                cell->format_style == DATETIME_STYLE_ISO) {
+                return format_number_as_enhanced_datetime(value, cell->format_style);
+            } else {
+                return format_number_as_datetime(value, DATE_STYLE_MM_DD_YYYY, TIME_STYLE_12HR);
+            }
+            
+        case FORMAT_NUMBER:
+        case FORMAT_GENERAL:
+        default:
+            // Standard number formatting
+            snprintf(buffer, sizeof(buffer), "%.*f", cell->precision, value);
+            // Remove trailing zeros
+            char* dot = strchr(buffer, '.');
+            if (dot) {
+                char* end = buffer + strlen(buffer) - 1;
+                while (end > dot && *end == '0') *end-- = '\0';
+                if (*end == '.') *end = '\0';
+            }
+            return buffer;
+    }
+}
+
+char* format_number_as_percentage(double value, int precision) {
+    static char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.*f%%", precision, value * 100.0);
+    return buffer;
+}
+
+char* format_number_as_currency(double value) {
+    static char buffer[64];
+    if (value < 0) {
+        snprintf(buffer, sizeof(buffer), "-$%.2f", -value);
+    } else {
+        snprintf(buffer, sizeof(buffer), "$%.2f", value);
+    }
+    return buffer;
+}
+
+char* format_number_as_date(double value, FormatStyle style) {
+    static char buffer[64];
+    
+    // Convert Excel serial date to time_t (days since 1900-01-01)
+    // Excel incorrectly treats 1900 as a leap year, so we need adjustment
+    time_t base_time = (time_t)-2209161600LL;  // 1900-01-01 00:00:00 UTC (adjusted)
+    time_t date_time = base_time + (time_t)(value * 86400); // 86400 seconds per day
+    
+    struct tm date_struct;
+    if (gmtime_s(&date_struct, &date_time) != 0) {
+        strcpy_s(buffer, sizeof(buffer), "#DATE!");
+        return buffer;
+    }
+    
+    switch (style) {
+        case DATE_STYLE_MM_DD_YYYY:
+            strftime(buffer, sizeof(buffer), "%m/%d/%Y", &date_struct);
+            break;
+        case DATE_STYLE_DD_MM_YYYY:
+            strftime(buffer, sizeof(buffer), "%d/%m/%Y", &date_struct);
+            break;
+        case DATE_STYLE_YYYY_MM_DD:
+            strftime(buffer, sizeof(buffer), "%Y-%m-%d", &date_struct);
+            break;
+        case DATE_STYLE_MON_DD_YYYY:
+            strftime(buffer, sizeof(buffer), "%b %d, %Y", &date_struct);
+            break;
+        case DATE_STYLE_DD_MON_YYYY:
+            strftime(buffer, sizeof(buffer), "%d %b %Y", &date_struct);
+            break;
+        case DATE_STYLE_YYYY_MON_DD:
+            strftime(buffer, sizeof(buffer), "%Y %b %d", &date_struct);
+            break;
+        case DATE_STYLE_SHORT_DATE:
+            strftime(buffer, sizeof(buffer), "%m/%d/%y", &date_struct);
+            break;
+        default:
+            strftime(buffer, sizeof(buffer), "%Y-%m-%d", &date_struct);
+            break;
+    }
+    
+    return buffer;
+}
+
+char* format_number_as_time(double value, FormatStyle style) {
+    static char buffer[64];
+    
+    // Extract time portion (fractional part of the day)
+    double time_fraction = value - floor(value);
+    if (time_fraction < 0) time_fraction += 1.0;
+    
+    int total_seconds = (int)(time_fraction * 86400);
+    int hours = total_seconds / 3600;
+    int minutes = (total_seconds % 3600) / 60;
+    int seconds = total_seconds % 60;
+    
+    switch (style) {
+        case TIME_STYLE_12HR:
+            {
+                int display_hours = hours;
+                const char* am_pm = "AM";
+                if (hours == 0) {
+                    display_hours = 12;
+                } else if (hours == 12) {
+                    am_pm = "PM";
+                } else if (hours > 12) {
+                    display_hours = hours - 12;
+                    am_pm = "PM";
+                }
+                snprintf(buffer, sizeof(buffer), "%d:%02d %s", display_hours, minutes, am_pm);
+            }
+            break;
+        case TIME_STYLE_12HR_SECONDS:
+            {
+                int display_hours = hours;
+                const char* am_pm = "AM";
+                if (hours == 0) {
+                    display_hours = 12;
+                } else if (hours == 12) {
+                    am_pm = "PM";
+                } else if (hours > 12) {
+                    display_hours = hours - 12;
+                    am_pm = "PM";
+                }
+                snprintf(buffer, sizeof(buffer), "%d:%02d:%02d %s", display_hours, minutes, seconds, am_pm);
+            }
+            break;
+        case TIME_STYLE_SECONDS:
+            snprintf(buffer, sizeof(buffer), "%02d:%02d:%02d", hours, minutes, seconds);
+            break;
+        case TIME_STYLE_24HR:
+        default:
+            snprintf(buffer, sizeof(buffer), "%02d:%02d", hours, minutes);
+            break;
+    }
+    
+    return buffer;
+}
+
+char* format_number_as_datetime(double value, FormatStyle date_style, FormatStyle time_style) {
+    static char buffer[128];
+    char* date_part = format_number_as_date(value, date_style);
+    char* time_part = format_number_as_time(value, time_style);
+    snprintf(buffer, sizeof(buffer), "%s %s", date_part, time_part);
+    return buffer;
+}
+
+// NEW: Enhanced datetime formatting for special styles
+char* format_number_as_enhanced_datetime(double value, FormatStyle style) {
+    static char buffer[128];
+    
+    // Convert Excel serial date to time_t
+    time_t base_time = (time_t)-2209161600LL;  // 1900-01-01 00:00:00 UTC (adjusted)
+    time_t date_time = base_time + (time_t)(value * 86400);
+    
+    struct tm date_struct;
+    if (gmtime_s(&date_struct, &date_time) != 0) {
+        strcpy_s(buffer, sizeof(buffer), "#DATE!");
+        return buffer;
+    }
+    
+    // Extract time portion for time components
+    double time_fraction = value - floor(value);
+    if (time_fraction < 0) time_fraction += 1.0;
+    int total_seconds = (int)(time_fraction * 86400);
+    int hours = total_seconds / 3600;
+    int minutes = (total_seconds % 3600) / 60;
+    int seconds = total_seconds % 60;
+    
+    switch (style) {
+        case DATETIME_STYLE_SHORT:
+            {
+                int display_hours = hours;
+                const char* am_pm = "AM";
+                if (hours == 0) {
+                    display_hours = 12;
+                } else if (hours == 12) {
+                    am_pm = "PM";
+                } else if (hours > 12) {
+                    display_hours = hours - 12;
+                    am_pm = "PM";
+                }
+                snprintf(buffer, sizeof(buffer), "%d/%d/%02d %d:%02d %s", 
+                        date_struct.tm_mon + 1, date_struct.tm_mday, date_struct.tm_year % 100,
+                        display_hours, minutes, am_pm);
+            }
+            break;
+        case DATETIME_STYLE_LONG:
+            {
+                int display_hours = hours;
+                const char* am_pm = "AM";
+                if (hours == 0) {
+                    display_hours = 12;
+                } else if (hours == 12) {
+                    am_pm = "PM";
+                } else if (hours > 12) {
+                    display_hours = hours - 12;
+                    am_pm = "PM";
+                }
+                strftime(buffer, 80, "%b %d, %Y ", &date_struct);
+                char time_buf[48];
+                snprintf(time_buf, sizeof(time_buf), "%d:%02d:%02d %s", 
+                        display_hours, minutes, seconds, am_pm);
+                strcat_s(buffer, sizeof(buffer), time_buf);
+            }
+            break;
+        case DATETIME_STYLE_ISO:
+            snprintf(buffer, sizeof(buffer), "%04d-%02d-%02dT%02d:%02d:%02d",
+                    date_struct.tm_year + 1900, date_struct.tm_mon + 1, date_struct.tm_mday,
+                    hours, minutes, seconds);
+            break;
+        default:
+            // Fall back to regular datetime formatting
+            return format_number_as_datetime(value, DATE_STYLE_MM_DD_YYYY, TIME_STYLE_12HR);
+    }
+    
+    return buffer;
+}
+
+// NEW: VLOOKUP function. The first column is scanned once: an exact match
+// takes the first equal row, an approximate one the first row holding the
+// largest value not above the lookup value. Text is always matched exactly.
+FormulaValue func_vlookup(Sheet* sheet, FormulaValue lookup, const CellRange* range, int col_index, int exact_match) {
+    if (col_index < 1 || col_index > (range->end_col - range->start_col + 1)) {
+        return formula_error_value(ERROR_REF);
+    }
+
+    int is_string_lookup = lookup.type == FVALUE_STRING;
+    double lookup_value = lookup.type == FVALUE_NUMBER ? lookup.number : 0.0;
+    int match_row = -1;
+    double best = 0.0;
+
+    for (int row = range->start_row; row <= range->end_row; row++) {
+        FormulaValue key = formula_cell_value(sheet_get_cell(sheet, row, range->start_col));
+        if (is_string_lookup) {
+            if (key.type == FVALUE_STRING && strcmp(key.string, lookup.string) == 0) {
+                match_row = row;
+                break;
+            }
+            continue;
+        }
+
+        if (key.type != FVALUE_NUMBER) continue;   // Skip non-numeric cells
+        if (exact_match) {
+            if (fabs(key.number - lookup_value) < 1e-10) {
+                match_row = row;
+                break;
+            }
+        } else if (key.number <= lookup_value && (match_row < 0 || key.number > best)) {
+            match_row = row;
+            best = key.number;
+        }
+    }
+
+    if (match_row < 0) return formula_error_value(ERROR_NA);
+    FormulaValue result = formula_cell_value(sheet_get_cell(sheet, match_row, range->start_col + col_index - 1));
+    if (result.type == FVALUE_BLANK) return formula_number_value(0.0);
+    return result;
+}
+
+FormulaValue formula_number_value(double number) {
+    FormulaValue value = {FVALUE_NUMBER, number, NULL, ERROR_NONE};
+    return value;
+}
+
+FormulaValue formula_error_value(ErrorType error) {
+    FormulaValue value = {FVALUE_ERROR, 0.0, NULL, error};
+    return value;
+}
+
+// The value a cell shows to formulas that read it
+FormulaValue formula_cell_value(const Cell* cell) {
+    FormulaValue value = {FVALUE_BLANK, 0.0, NULL, ERROR_NONE};
+    if (!cell) return value;
+    switch (cell->type) {
+        case CELL_NUMBER:
+            value.type = FVALUE_NUMBER;
+            value.number = cell->data.number;
+            break;
+        case CELL_STRING:
+            value.type = FVALUE_STRING;
+            value.string = cell->data.string ? cell->data.string : "";
+            break;
+        case CELL_FORMULA:
+            if (cell->data.formula.error != ERROR_NONE) {
+                value.type = FVALUE_ERROR;
+                value.error = cell->data.formula.error;
+            } else if (cell->data.formula.is_string_result) {
+                value.type = FVALUE_STRING;
+                value.string = cell->data.formula.cached_string ? cell->data.formula.cached_string : "";
+            } else {
+                value.type = FVALUE_NUMBER;
+                value.number = cell->data.formula.cached_value;
+            }
+            break;
+        default:
+            break;
+    }
+    return value;
+}
+
+// A value used as a number: blanks are 0, text is #VALUE!
+int formula_value_number(FormulaValue value, double* number, ErrorType* error) {
+    switch (value.type) {
+        case FVALUE_NUMBER:
+            *number = value.number;
+            return 1;
+        case FVALUE_BLANK:
+            *number = 0.0;
+            return 1;
+        case FVALUE_STRING:
+            *error = ERROR_VALUE;
+            return 0;
+        default:
+            *error = value.error;
+            return 0;
+    }
+}
+
+// Sum of the numbers in a range, which is what a range means outside a function
+double formula_range_sum(Sheet* sheet, const FormulaNode* node) {
+    double sum = 0.0;
+    for (int row = node->row; row <= node->end_row && row < sheet->rows; row++) {
+        for (int col = node->col; col <= node->end_col && col < sheet->cols; col++) {
+            FormulaValue value = formula_cell_value(sheet->cells[row][col]);
+            if (value.type == FVALUE_NUMBER) sum += value.number;
+        }
+    }
+    return sum;
+}
+
+// Numbers gathered from the arguments of SUM, AVG, MAX, MIN, MEDIAN and MODE.
+// Only MEDIAN and MODE need the values kept.
+typedef struct {
+    double sum;
+    double min, max;
+    int count;
+    double* values;
+    int capacity;
+    int keep;
+} FormulaNumbers;
+
+int formula_numbers_add(FormulaNumbers* numbers, double value) {
+    if (numbers->keep) {
+        if (numbers->count == numbers->capacity) {
+            int new_capacity = numbers->capacity ? numbers->capacity * 2 : 64;
+            double* values = (double*)realloc(numbers->values, new_capacity * sizeof(double));
+            if (!values) return 0;
+            numbers->values = values;
+            numbers->capacity = new_capacity;
+        }
+        numbers->values[numbers->count] = value;
+    }
+    if (numbers->count == 0 || value < numbers->min) numbers->min = value;
+    if (numbers->count == 0 || value > numbers->max) numbers->max = value;
+    numbers->sum += value;
+    numbers->count++;
+    return 1;
+}
+
+// Ranges contribute their numbers, with empty cells as 0 (text and errors
+// are skipped); other arguments must evaluate to a number
+FormulaValue formula_eval_aggregate(Sheet* sheet, const FormulaTree* tree, const FormulaNode* node) {
+    FormulaNumbers numbers = {0};
+    numbers.keep = node->func == FFUNC_MEDIAN || node->func == FFUNC_MODE;
+    ErrorType error = ERROR_NONE;
+
+    for (int i = 0; i < node->arg_count && error == ERROR_NONE; i++) {
+        const FormulaNode* arg = &tree->nodes[tree->args[node->first_arg + i]];
+        if (arg->type == FNODE_RANGE) {
+            for (int row = arg->row; row <= arg->end_row && error == ERROR_NONE; row++) {
+                for (int col = arg->col; col <= arg->end_col; col++) {
+                    const Cell* cell = row < sheet->rows && col < sheet->cols ? sheet->cells[row][col] : NULL;
+                    FormulaValue value = formula_cell_value(cell);
+                    if (value.type != FVALUE_NUMBER && value.type != FVALUE_BLANK) continue;
+                    if (!formula_numbers_add(&numbers, value.number)) {
+                        error = ERROR_VALUE;
+                        break;
+                    }
+                }
+            }
+            continue;
+        }
+
+        double number;
+        if (!formula_value_number(formula_eval(sheet, tree, tree->args[node->first_arg + i]), &number, &error)) break;
+        if (!formula_numbers_add(&numbers, number)) error = ERROR_VALUE;
+    }
+
+    double result = 0.0;
+    if (error == ERROR_NONE && numbers.count > 0) {
+        switch (node->func) {
+            case FFUNC_SUM: result = numbers.sum; break;
+            case FFUNC_AVG: result = numbers.sum / numbers.count; break;
+            case FFUNC_MAX: result = numbers.max; break;
+            case FFUNC_MIN: result = numbers.min; break;
+            case FFUNC_MEDIAN: result = func_median(numbers.values, numbers.count); break;
+            default: result = func_mode(numbers.values, numbers.count); break;
+        }
+    }
+    free(numbers.values);
+    return error == ERROR_NONE ? formula_number_value(result) : formula_error_value(error);
+}
+
+// A range argument (a single cell counts as a 1x1 range)
+int formula_node_range(const FormulaNode* node, CellRange* range, ErrorType* error) {
+    if (node->type == FNODE_RANGE || node->type == FNODE_REF) {
+        range->start_row = node->row;
+        range->start_col = node->col;
+        range->end_row = node->type == FNODE_RANGE ? node->end_row : node->row;
+        range->end_col = node->type == FNODE_RANGE ? node->end_col : node->col;
+        return 1;
+    }
+    *error = node->type == FNODE_REF_ERROR ? ERROR_REF : ERROR_VALUE;
+    return 0;
+}
+
+// Truth of a condition: non-zero numbers are true, blanks false, text #VALUE!
+int formula_value_truth(FormulaValue value, int* truth, ErrorType* error) {
+    double number;
+    if (!formula_value_number(value, &number, error)) return 0;
+    *truth = number != 0.0;
+    return 1;
+}
+
+FormulaValue formula_eval_compare(FormulaNodeType type, FormulaValue left, FormulaValue right) {
+    if (left.type == FVALUE_ERROR) return left;
+    if (right.type == FVALUE_ERROR) return right;
+
+    int cmp;
+    if (left.type == FVALUE_STRING || right.type == FVALUE_STRING) {
+        // Text against text (a blank reads as ""); numbers sort before text
+        if (left.type == FVALUE_NUMBER) cmp = -1;
+        else if (right.type == FVALUE_NUMBER) cmp = 1;
+        else cmp = strcmp(left.type == FVALUE_STRING ? left.string : "", right.type == FVALUE_STRING ? right.string : "");
+    } else {
+        double a = left.number;
+        double b = right.number;
+        switch (type) {
+            case FNODE_EQ: return formula_number_value(fabs(a - b) < 1e-10 ? 1.0 : 0.0);
+            case FNODE_NE: return formula_number_value(a != b ? 1.0 : 0.0);
+            default: cmp = a < b ? -1 : (a > b ? 1 : 0); break;
+        }
+    }
+
+    int result;
+    switch (type) {
+        case FNODE_EQ: result = cmp == 0; break;
+        case FNODE_NE: result = cmp != 0; break;
+        case FNODE_LT: result = cmp < 0; break;
+        case FNODE_LE: result = cmp <= 0; break;
+        case FNODE_GT: result = cmp > 0; break;
+        default: result = cmp >= 0; break;
+    }
+    return formula_number_value(result ? 1.0 : 0.0);
+}
+
+// The lazy functions evaluate an argument only once the result needs it
+FormulaValue formula_eval_lazy(Sheet* sheet, const FormulaTree* tree, const FormulaNode* node) {
+    const int* args = tree->args + node->first_arg;
+    ErrorType error = ERROR_NONE;
+    int truth;
+
+    switch (node->func) {
+        case FFUNC_IF:
+            if (!formula_value_truth(formula_eval(sheet, tree, args[0]), &truth, &error)) return formula_error_value(error);
+            if (truth) return formula_eval(sheet, tree, args[1]);
+            if (node->arg_count > 2) return formula_eval(sheet, tree, args[2]);
+            return formula_number_value(0.0);
+
+        case FFUNC_IFS:
+            if (node->arg_count % 2) return formula_error_value(ERROR_PARSE);
+            for (int i = 0; i < node->arg_count; i += 2) {
+                if (!formula_value_truth(formula_eval(sheet, tree, args[i]), &truth, &error)) return formula_error_value(error);
+                if (truth) return formula_eval(sheet, tree, args[i + 1]);
+            }
+            return formula_error_value(ERROR_NA);
+
+        case FFUNC_AND:
+        case FFUNC_OR: {
+            // Stop at the first argument that decides the result
+            int stop_on = node->func == FFUNC_OR;
+            for (int i = 0; i < node->arg_count; i++) {
+                const FormulaNode* arg = &tree->nodes[args[i]];
+                if (arg->type == FNODE_RANGE) {
+                    for (int row = arg->row; row <= arg->end_row && row < sheet->rows; row++) {
+                        for (int col = arg->col; col <= arg->end_col && col < sheet->cols; col++) {
+                            FormulaValue value = formula_cell_value(sheet->cells[row][col]);
+                            if (value.type == FVALUE_ERROR) return value;
+                            if (value.type != FVALUE_NUMBER) continue;
+                            if ((value.number != 0.0) == stop_on) return formula_number_value(stop_on ? 1.0 : 0.0);
+                        }
+                    }
+                    continue;
+                }
+                if (!formula_value_truth(formula_eval(sheet, tree, args[i]), &truth, &error)) return formula_error_value(error);
+                if (truth == stop_on) return formula_number_value(stop_on ? 1.0 : 0.0);
+            }
+            return formula_number_value(stop_on ? 0.0 : 1.0);
+        }
+
+        case FFUNC_IFERROR: {
+            FormulaValue value = formula_eval(sheet, tree, args[0]);
+            return value.type == FVALUE_ERROR ? formula_eval(sheet, tree, args[1]) : value;
+        }
+
+        default: {     // FFUNC_CHOOSE
+            double number;
+            if (!formula_value_number(formula_eval(sheet, tree, args[0]), &number, &error)) return formula_error_value(error);
+            if (number < 1.0 || number >= (double)node->arg_count) return formula_error_value(ERROR_VALUE);
+            return formula_eval(sheet, tree, args[(int)number]);
+        }
+    }
+}
+
+FormulaValue formula_eval_vlookup(Sheet* sheet, const FormulaTree* tree, const FormulaNode* node) {
+    const int* args = tree->args + node->first_arg;
+    ErrorType error = ERROR_NONE;
+
+    FormulaValue lookup = formula_eval(sheet, tree, args[0]);
+    if (lookup.type == FVALUE_ERROR) return lookup;
+
+    CellRange range;
+    if (!formula_node_range(&tree->nodes[args[1]], &range, &error)) return formula_error_value(error);
+
+    double col_index;
+    if (!formula_value_number(formula_eval(sheet, tree, args[2]), &col_index, &error)) return formula_error_value(error);
+
+    // The optional fourth argument is 0 for an exact match (approximate by default)
+    int exact_match = 0;
+    if (node->arg_count > 3) {
+        double approximate;
+        if (!formula_value_number(formula_eval(sheet, tree, args[3]), &approximate, &error)) return formula_error_value(error);
+        exact_match = approximate == 0.0;
+    }
+
+    return func_vlookup(sheet, lookup, &range, (int)col_index, exact_match);
+}
+
+// Evaluate a node, reusing the value of a shared node already evaluated
+// during this evaluation of the tree
+FormulaValue formula_eval(Sheet* sheet, const FormulaTree* tree, int index) {
+    int slot = tree->nodes[index].shared;
+    if (slot < 0 || !tree->memo) return formula_eval_node(sheet, tree, index);
+
+    FormulaMemo* memo = (FormulaMemo*)tree->memo + slot;
+    if (memo->generation != tree->memo_generation) {
+        memo->value = formula_eval_node(sheet, tree, index);
+        memo->generation = tree->memo_generation;
+    }
+    return memo->value;
+}
+
+// Evaluate the whole tree; a tree that did not parse is #PARSE!
+FormulaValue formula_eval_tree(Sheet* sheet, FormulaTree* tree) {
+    FormulaProgram* program = NULL;
+    if (formula_tier == FORMULA_TIER_THREADED && tree && tree->root >= 0) program = formula_tree_program(sheet, tree);
+    return formula_eval_program(sheet, tree, program);
+}
+
+// Evaluate the whole tree with its program, or in the interpreter when
+// 'program' is NULL
+FormulaValue formula_eval_program(Sheet* sheet, FormulaTree* tree, const FormulaProgram* program) {
+    if (!tree || tree->root < 0) return formula_error_value(ERROR_PARSE);
+
+    if (tree->shared_count > 0) {
+        if (!tree->memo) tree->memo = calloc(tree->shared_count, sizeof(FormulaMemo));
+        if (++tree->memo_generation == 0) {
+            // Wrapped: clear the old generations so none can match again
+            if (tree->memo) memset(tree->memo, 0, tree->shared_count * sizeof(FormulaMemo));
+            tree->memo_generation = 1;
+        }
+    }
+    if (program) {
+        const FormulaOp* root = &program->ops[tree->root];
+        return root->run(root, sheet);
+    }
+    return formula_eval(sheet, tree, tree->root);
+}
+
+FormulaValue formula_eval_node(Sheet* sheet, const FormulaTree* tree, int index) {
+    const FormulaNode* node = &tree->nodes[index];
+    const int* args = tree->args + node->first_arg;
+    FormulaValue value = {FVALUE_NUMBER, 0.0, NULL, ERROR_NONE};
+    ErrorType error = ERROR_NONE;
+    double a, b;
+
+    switch (node->type) {
+        case FNODE_NUMBER:
+            value.number = node->number;
+            return value;
+
+        case FNODE_STRING:
+            value.type = FVALUE_STRING;
+            value.string = node->text;
+            return value;
+
+        case FNODE_REF:
+            return formula_cell_value(sheet_get_cell(sheet, node->row, node->col));
+
+        case FNODE_RANGE:
+            value.number = formula_range_sum(sheet, node);
+            return value;
+
+        case FNODE_REF_ERROR:
+            return formula_error_value(ERROR_REF);
+
+        case FNODE_NEGATE:
+            if (!formula_value_number(formula_eval(sheet, tree, args[0]), &a, &error)) return formula_error_value(error);
+            value.number = -a;
+            return value;
+
+        case FNODE_ADD:
+        case FNODE_SUB:
+        case FNODE_MUL:
+        case FNODE_DIV:
+            if (!formula_value_number(formula_eval(sheet, tree, args[0]), &a, &error) ||
+                !formula_value_number(formula_eval(sheet, tree, args[1]), &b, &error)) {
+                return formula_error_value(error);
+            }
+            switch (node->type) {
+                case FNODE_ADD: value.number = a + b; break;
+                case FNODE_SUB: value.number = a - b; break;
+                case FNODE_MUL: value.number = a * b; break;
+                default:
+                    if (b == 0.0) return formula_error_value(ERROR_DIV_ZERO);
+                    value.number = a / b;
+                    break;
+            }
+            return value;
+
+        case FNODE_EQ:
+        case FNODE_NE:
+        case FNODE_LT:
+        case FNODE_LE:
+        case FNODE_GT:
+        case FNODE_GE:
+            return formula_eval_compare(node->type, formula_eval(sheet, tree, args[0]), formula_eval(sheet, tree, args[1]));
+
+        default:
+            break;
+    }
+
+    // FNODE_CALL
+    switch (node->func) {
+        case FFUNC_POWER:
+            if (!formula_value_number(formula_eval(sheet, tree, args[0]), &a, &error) ||
+                !formula_value_number(formula_eval(sheet, tree, args[1]), &b, &error)) {
+                return formula_error_value(error);
+            }
+            value.number = func_power(a, b);
+            return value;
+        case FFUNC_VLOOKUP:
+            return formula_eval_vlookup(sheet, tree, node);
+        case FFUNC_SUMIF:
+        case FFUNC_COUNTIF:
+        case FFUNC_AVERAGEIF:
+        case FFUNC_SUMIFS:
+        case FFUNC_COUNTIFS:
+        case FFUNC_AVERAGEIFS:
+            return formula_eval_conditional(sheet, tree, node);
+        case FFUNC_IF:
+        case FFUNC_IFS:
+        case FFUNC_AND:
+        case FFUNC_OR:
+        case FFUNC_IFERROR:
+        case FFUNC_CHOOSE:
+            return formula_eval_lazy(sheet, tree, node);
+        default:
+            return formula_eval_aggregate(sheet, tree, node);
+    }
+}
+
+// NEW: Threaded formula tier
+//
+// A tree evaluated FORMULA_HOT_EVALUATIONS times is compiled into a
+// FormulaProgram, and from then on evaluating it is a chain of calls
+// through the ops' function pointers: no switch on node types, no lookups
+// of arguments in the tree. A reference is bound to the grid slot it reads
+// (&sheet->cells[row][col]), so it costs one load instead of a bounds-checked
+// lookup; the slots are bound again when the sheet's structure_version
+// moves on, because inserting, deleting and sorting rows moves the row
+// arrays. The calls with no op of their own run through the interpreter
+// for that node.
+
+// An operand used as a number: a bound cell is read straight from its slot
+int formula_op_number(const FormulaOp* op, Sheet* sheet, double* number, ErrorType* error) {
+    if (op->slot) {
+        const Cell* cell = *op->slot;
+        if (cell && cell->type == CELL_NUMBER) {
+            *number = cell->data.number;
+            return 1;
+        }
+        return formula_value_number(formula_cell_value(cell), number, error);
+    }
+    if (op->compute == formula_op_constant && op->constant.type == FVALUE_NUMBER) {
+        *number = op->constant.number;
+        return 1;
+    }
+    return formula_value_number(op->run(op, sheet), number, error);
+}
+
+FormulaValue formula_op_constant(const FormulaOp* op, Sheet* sheet) {
+    (void)sheet;
+    return op->constant;
+}
+
+FormulaValue formula_op_ref(const FormulaOp* op, Sheet* sheet) {
+    (void)sheet;
+    return formula_cell_value(*op->slot);
+}
+
+FormulaValue formula_op_negate(const FormulaOp* op, Sheet* sheet) {
+    double a;
+    ErrorType error = ERROR_NONE;
+    if (!formula_op_number(op->a, sheet, &a, &error)) return formula_error_value(error);
+    return formula_number_value(-a);
+}
+
+// a op b for + - * /
+FormulaValue formula_arith(FormulaNodeType type, double a, double b) {
+    switch (type) {
+        case FNODE_ADD: return formula_number_value(a + b);
+        case FNODE_SUB: return formula_number_value(a - b);
+        case FNODE_MUL: return formula_number_value(a * b);
+        default:
+            if (b == 0.0) return formula_error_value(ERROR_DIV_ZERO);
+            return formula_number_value(a / b);
+    }
+}
+
+FormulaValue formula_op_arith(const FormulaOp* op, Sheet* sheet) {
+    double a, b;
+    ErrorType error = ERROR_NONE;
+    if (!formula_op_number(op->a, sheet, &a, &error) || !formula_op_number(op->b, sheet, &b, &error)) {
+        return formula_error_value(error);
+    }
+    return formula_arith(op->type, a, b);
+}
+
+FormulaValue formula_op_power(const FormulaOp* op, Sheet* sheet) {
+    double a, b;
+    ErrorType error = ERROR_NONE;
+    if (!formula_op_number(op->a, sheet, &a, &error) || !formula_op_number(op->b, sheet, &b, &error)) {
+        return formula_error_value(error);
+    }
+    return formula_number_value(func_power(a, b));
+}
+
+FormulaValue formula_op_compare(const FormulaOp* op, Sheet* sheet) {
+    FormulaValue left = op->a->run(op->a, sheet);
+    FormulaValue right = op->b->run(op->b, sheet);
+    return formula_eval_compare(op->type, left, right);
+}
+
+FormulaValue formula_op_if(const FormulaOp* op, Sheet* sheet) {
+    int truth;
+    ErrorType error = ERROR_NONE;
+    if (!formula_value_truth(op->a->run(op->a, sheet), &truth, &error)) return formula_error_value(error);
+    if (truth) return op->b->run(op->b, sheet);
+    if (op->c) return op->c->run(op->c, sheet);
+    return formula_number_value(0.0);
+}
+
+FormulaValue formula_op_iferror(const FormulaOp* op, Sheet* sheet) {
+    FormulaValue value = op->a->run(op->a, sheet);
+    return value.type == FVALUE_ERROR ? op->b->run(op->b, sheet) : value;
+}
+
+FormulaValue formula_op_interpret(const FormulaOp* op, Sheet* sheet) {
+    return formula_eval_node(sheet, op->tree, op->index);
+}
+
+// A shared node: computed once per evaluation, in the interpreter's memo
+FormulaValue formula_op_shared(const FormulaOp* op, Sheet* sheet) {
+    const FormulaTree* tree = op->tree;
+    if (!tree->memo) return op->compute(op, sheet);
+
+    FormulaMemo* memo = (FormulaMemo*)tree->memo + tree->nodes[op->index].shared;
+    if (memo->generation != tree->memo_generation) {
+        memo->value = op->compute(op, sheet);
+        memo->generation = tree->memo_generation;
+    }
+    return memo->value;
+}
+
+// NEW: Kernels. Most formulas in a model are one of a few shapes: SUM over
+// a range, two references combined, a reference scaled by a constant, an
+// exact VLOOKUP. A program of one of those shapes has the kernel as its
+// root op, which reads its cells straight from the grid and only falls
+// back to the general ops when an input is not a number.
+
+// A cell read as a number: numbers, numeric formula results and blanks.
+// Returns 0 for text and errors.
+int formula_slot_number(const Cell* cell, double* number) {
+    if (!cell) {
+        *number = 0.0;
+        return 1;
+    }
+    if (cell->type == CELL_NUMBER) {
+        *number = cell->data.number;
+        return 1;
+    }
+    if (cell->type == CELL_FORMULA && cell->data.formula.error == ERROR_NONE && !cell->data.formula.is_string_result) {
+        *number = cell->data.formula.cached_value;
+        return 1;
+    }
+    return 0;
+}
+
+FormulaValue formula_kernel_sum_range(const FormulaOp* op, Sheet* sheet) {
+    int last_row = op->range.end_row < sheet->rows ? op->range.end_row : sheet->rows - 1;
+    int last_col = op->range.end_col < sheet->cols ? op->range.end_col : sheet->cols - 1;
+    double sum = 0.0;
+    for (int row = op->range.start_row; row <= last_row; row++) {
+        Cell** line = sheet->cells[row];
+        for (int col = op->range.start_col; col <= last_col; col++) {
+            double number;
+            if (line[col] && formula_slot_number(line[col], &number)) sum += number;
+        }
+    }
+    return formula_number_value(sum);
+}
+
+FormulaValue formula_kernel_ref_op_ref(const FormulaOp* op, Sheet* sheet) {
+    double a, b;
+    if (formula_slot_number(*op->a->slot, &a) && formula_slot_number(*op->b->slot, &b)) {
+        return formula_arith(op->type, a, b);
+    }
+    return formula_op_arith(op, sheet);
+}
+
+FormulaValue formula_kernel_ref_op_constant(const FormulaOp* op, Sheet* sheet) {
+    double value;
+    if (op->a->slot) {
+        if (formula_slot_number(*op->a->slot, &value)) return formula_arith(op->type, value, op->b->constant.number);
+    } else if (formula_slot_number(*op->b->slot, &value)) {
+        return formula_arith(op->type, op->a->constant.number, value);
+    }
+    return formula_op_arith(op, sheet);
+}
+
+// The first row of 'range' whose first column equals 'lookup' the way an
+// exact VLOOKUP compares (text case-sensitively, numbers within 1e-10),
+// found through the cached column index instead of a scan. Sets *row to -1
+// when nothing matches; returns 0 when the index cannot answer (a lookup of
+// "", a range off the grid, no memory), so the caller scans.
+int sheet_lookup_exact(Sheet* sheet, const CellRange* range, FormulaValue lookup, int* row) {
+    if (!sheet->col_versions || range->end_row >= sheet->rows || range->end_col >= sheet->cols) return 0;
+    if (lookup.type == FVALUE_STRING && !lookup.string[0]) return 0;
+
+    CriteriaIndex* index = sheet_criteria_index(sheet, range->start_col, range->start_row, range->end_row);
+    if (!index) return 0;
+    *row = -1;
+
+    if (lookup.type == FVALUE_STRING) {
+        // The index groups text case-insensitively; take the group's first
+        // row that matches exactly
+        int key = criteria_index_find(sheet, index, 2, 0.0, lookup.string);
+        if (key < 0) return 1;
+        for (int k = index->key_start[key]; k < index->key_start[key + 1]; k++) {
+            FormulaValue value = formula_cell_value(sheet->cells[index->start_row + index->rows[k]][index->col]);
+            if (value.type == FVALUE_STRING && strcmp(value.string, lookup.string) == 0) {
+                *row = index->start_row + index->rows[k];
+                return 1;
+            }
+        }
+        return 1;
+    }
+
+    // Numbers (a blank looks up 0): the numeric rows near the value, by
+    // binary search over the sorted offsets, then the first of those in range
+    double value = lookup.type == FVALUE_NUMBER ? lookup.number : 0.0;
+    if (value != value) return 1;
+    if (!criteria_index_sort(index)) return 0;
+    double low = value - 2e-10;
+    double high = value + 2e-10;
+    int lo = 0;
+    int hi = index->sorted_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (index->numbers[index->sorted[mid]] < low) lo = mid + 1;
+        else hi = mid;
+    }
+    int best = -1;
+    for (int k = lo; k < index->sorted_count && index->numbers[index->sorted[k]] <= high; k++) {
+        int offset = index->sorted[k];
+        if (fabs(index->numbers[offset] - value) < 1e-10 && (best < 0 || offset < best)) best = offset;
+    }
+    if (best >= 0) *row = index->start_row + best;
+    return 1;
+}
+
+FormulaValue formula_kernel_vlookup_exact(const FormulaOp* op, Sheet* sheet) {
+    FormulaValue lookup = formula_cell_value(*op->a->slot);
+    if (lookup.type == FVALUE_ERROR) return lookup;
+
+    int row;
+    if (!sheet_lookup_exact(sheet, &op->range, lookup, &row)) return func_vlookup(sheet, lookup, &op->range, op->column, 1);
+    if (row < 0) return formula_error_value(ERROR_NA);
+    FormulaValue result = formula_cell_value(sheet->cells[row][op->range.start_col + op->column - 1]);
+    if (result.type == FVALUE_BLANK) return formula_number_value(0.0);
+    return result;
+}
+
+// Give the root op a kernel when the whole formula has one of the shapes
+FormulaKernel formula_program_kernel(FormulaProgram* program, const FormulaTree* tree) {
+    const FormulaNode* root = &tree->nodes[tree->root];
+    const int* args = tree->args + root->first_arg;
+    FormulaOp* op = &program->ops[tree->root];
+    ErrorType error = ERROR_NONE;
+    FormulaKernel kernel;
+
+    switch (root->type) {
+        case FNODE_ADD:
+        case FNODE_SUB:
+        case FNODE_MUL:
+        case FNODE_DIV: {
+            FormulaNodeType a = tree->nodes[args[0]].type;
+            FormulaNodeType b = tree->nodes[args[1]].type;
+            if (a == FNODE_REF && b == FNODE_REF) {
+                op->compute = formula_kernel_ref_op_ref;
+                kernel = FORMULA_KERNEL_REF_OP_REF;
+                break;
+            }
+            if ((a == FNODE_REF && b == FNODE_NUMBER) || (a == FNODE_NUMBER && b == FNODE_REF)) {
+                op->compute = formula_kernel_ref_op_constant;
+                kernel = FORMULA_KERNEL_REF_OP_CONSTANT;
+                break;
+            }
+            return FORMULA_KERNEL_NONE;
+        }
+
+        case FNODE_CALL:
+            if (root->func == FFUNC_SUM && root->arg_count == 1 && tree->nodes[args[0]].type == FNODE_RANGE) {
+                formula_node_range(&tree->nodes[args[0]], &op->range, &error);
+                op->compute = formula_kernel_sum_range;
+                kernel = FORMULA_KERNEL_SUM_RANGE;
+                break;
+            }
+            if (root->func == FFUNC_VLOOKUP && root->arg_count == 4 &&
+                tree->nodes[args[0]].type == FNODE_REF &&
+                formula_node_range(&tree->nodes[args[1]], &op->range, &error) &&
+                tree->nodes[args[2]].type == FNODE_NUMBER &&
+                tree->nodes[args[3]].type == FNODE_NUMBER && tree->nodes[args[3]].number == 0.0) {
+                // Only a column inside the range; the general path reports the #REF!
+                double column = tree->nodes[args[2]].number;
+                if (column < 1.0 || (int)column > op->range.end_col - op->range.start_col + 1) return FORMULA_KERNEL_NONE;
+                op->column = (int)column;
+                op->compute = formula_kernel_vlookup_exact;
+                kernel = FORMULA_KERNEL_VLOOKUP_EXACT;
+                break;
+            }
+            return FORMULA_KERNEL_NONE;
+
+        default:
+            return FORMULA_KERNEL_NONE;
+    }
+
+    op->run = root->shared >= 0 ? formula_op_shared : op->compute;
+    return kernel;
+}
+
+// Compile a tree to ops (one block, so formula_tree_free can free it). The
+// slots are left unbound. Returns NULL if out of memory.
+FormulaProgram* formula_compile_program(const FormulaTree* tree) {
+    FormulaProgram* program = (FormulaProgram*)calloc(1, sizeof(FormulaProgram) + tree->count * sizeof(FormulaOp));
+    if (!program) return NULL;
+    program->count = tree->count;
+    program->ops = (FormulaOp*)(program + 1);
+
+    for (int i = 0; i < tree->count; i++) {
+        const FormulaNode* node = &tree->nodes[i];
+        const int* args = tree->args + node->first_arg;
+        FormulaOp* op = &program->ops[i];
+        op->tree = tree;
+        op->index = i;
+        op->type = node->type;
+        op->a = node->arg_count > 0 ? &program->ops[args[0]] : NULL;
+        op->b = node->arg_count > 1 ? &program->ops[args[1]] : NULL;
+        op->c = node->arg_count > 2 ? &program->ops[args[2]] : NULL;
+
+        switch (node->type) {
+            case FNODE_NUMBER:
+                op->constant = formula_number_value(node->number);
+                op->compute = formula_op_constant;
+                break;
+            case FNODE_STRING:
+                op->constant.type = FVALUE_STRING;
+                op->constant.string = node->text;
+                op->compute = formula_op_constant;
+                break;
+            case FNODE_REF: op->compute = formula_op_ref; break;
+            case FNODE_NEGATE: op->compute = formula_op_negate; break;
+            case FNODE_ADD:
+            case FNODE_SUB:
+            case FNODE_MUL:
+            case FNODE_DIV:
+                op->compute = formula_op_arith;
+                break;
+            case FNODE_EQ:
+            case FNODE_NE:
+            case FNODE_LT:
+            case FNODE_LE:
+            case FNODE_GT:
+            case FNODE_GE:
+                op->compute = formula_op_compare;
+                break;
+            case FNODE_CALL:
+                switch (node->func) {
+                    case FFUNC_POWER: op->compute = formula_op_power; break;
+                    case FFUNC_IF: op->compute = formula_op_if; break;
+                    case FFUNC_IFERROR: op->compute = formula_op_iferror; break;
+                    default: op->compute = formula_op_interpret; break;
+                }
+                break;
+            default:        // Ranges and #REF!
+                op->compute = formula_op_interpret;
+                break;
+        }
+        op->run = node->shared >= 0 ? formula_op_shared : op->compute;
+    }
+    program->kernel = formula_program_kernel(program, tree);
+    return program;
+}
+
+// Point each reference op at the slot of the cell it reads in 'sheet'
+void formula_program_bind(FormulaProgram* program, const FormulaTree* tree, Sheet* sheet) {
+    for (int i = 0; i < program->count; i++) {
+        const FormulaNode* node = &tree->nodes[i];
+        if (node->type != FNODE_REF) continue;
+        int inside = node->row >= 0 && node->row < sheet->rows && node->col >= 0 && node->col < sheet->cols;
+        program->ops[i].slot = inside ? &sheet->cells[node->row][node->col] : &formula_no_cell;
+    }
+    program->sheet = sheet;
+    program->structure_version = sheet->structure_version;
+}
+
+// The tree's program bound to 'sheet', compiled once the tree is hot.
+// NULL means the tree is still interpreted.
+FormulaProgram* formula_tree_program(Sheet* sheet, FormulaTree* tree) {
+    FormulaProgram* program = (FormulaProgram*)tree->program;
+    if (!program) {
+        if (++tree->eval_count < FORMULA_HOT_EVALUATIONS) return NULL;
+        program = formula_compile_program(tree);
+        if (!program) return NULL;
+        tree->program = program;
+    }
+    if (program->sheet != sheet || program->structure_version != sheet->structure_version) {
+        formula_program_bind(program, tree, sheet);
+    }
+    return program;
+}
+
+// The cell's parsed expression, parsed now if it has not been yet
+FormulaTree* cell_formula_tree(Cell* cell) {
+    if (!cell || cell->type != CELL_FORMULA) return NULL;
+    if (!cell->data.formula.tree) {
+        cell->data.formula.tree = formula_parse(cell->data.formula.expression);
+    }
+    return cell->data.formula.tree;
+}
+
+// Store an evaluation result in a formula cell. Returns 1 if what the cell
+// shows changed.
+int formula_store_result(Cell* cell, FormulaValue value) {
+    double number = value.type == FVALUE_NUMBER ? value.number : 0.0;
+    ErrorType error = value.type == FVALUE_ERROR ? value.error : ERROR_NONE;
+    int is_string = value.type == FVALUE_STRING;
+
+    int changed = number != cell->data.formula.cached_value || error != cell->data.formula.error ||
+                  is_string != cell->data.formula.is_string_result;
+    if (is_string) {
+        const char* old = cell->data.formula.cached_string;
+        if (!old || strcmp(old, value.string) != 0) {
+            // Copy before freeing: the value may be this cell's own text
+            char* copy = _strdup(value.string);
+            free(cell->data.formula.cached_string);
+            cell->data.formula.cached_string = copy;
+            changed = 1;
+        }
+    } else if (cell->data.formula.cached_string) {
+        free(cell->data.formula.cached_string);
+        cell->data.formula.cached_string = NULL;
+    }
+
+    cell->data.formula.cached_value = number;
+    cell->data.formula.error = error;
+    cell->data.formula.is_string_result = is_string;
+    return changed;
+}
+
+// Evaluate formula text once, outside any cell. Text results come back as 0.
+double evaluate_formula(Sheet* sheet, const char* formula, ErrorType* error) {
+    *error = ERROR_NONE;
+
+    FormulaTree* tree = formula_parse(formula);
+    FormulaValue value = formula_eval_tree(sheet, tree);
+    formula_tree_free(tree);
+
+    if (value.type == FVALUE_ERROR) {
+        *error = value.error;
+        return 0.0;
+    }
+    return value.type == FVALUE_NUMBER ? value.number : 0.0;
+}
+
+// NEW: Dependency-ordered recalculation
+//
+// Each recalc scans the grid for formula cells. When the scan matches the
+// one the current order was built from (same cells, positions and parsed
+// trees), the order is reused as is. Otherwise edges are found from every
+// reference to the formula cells it covers, and the cells are sorted so each
+// one is evaluated after the cells it reads. An edge is conditional when its
+// reference sits in a lazy argument (an IF branch, say): if the unconditional
+// edges alone leave no cycle, the conditional ones are dropped to break it.
+// Cells still in a cycle are evaluated last, in row-major order.
+
+typedef struct {
+    int from;               // Scan index of the cell read
+    int to;                 // Scan index of the cell reading it
+    int conditional;
+} CalcEdge;
+
+typedef struct {
+    Sheet* sheet;
+    const CalcScan* scan;
+    int* col_start;         // Per column: first entry in col_rows/col_index
+    int* col_rows;          // Formula rows of each column, ascending
+    int* col_index;         // Scan index of each
+    int current;            // Scan index of the formula being visited
+    CalcEdge* edges;
+    int edge_count;
+    int edge_capacity;
+    int failed;
+} CalcGraph;
+
+void calc_scan_free(CalcScan* scan) {
+    free(scan->cells);
+    free(scan->positions);
+    free(scan->tree_ids);
+    memset(scan, 0, sizeof(*scan));
+}
+
+int calc_scan_add(CalcScan* scan, Cell* cell, int position, unsigned int tree_id) {
+    if (scan->count == scan->capacity) {
+        int new_capacity = scan->capacity ? scan->capacity * 2 : 256;
+        Cell** cells = (Cell**)realloc(scan->cells, new_capacity * sizeof(Cell*));
+        if (cells) scan->cells = cells;
+        int* positions = (int*)realloc(scan->positions, new_capacity * sizeof(int));
+        if (positions) scan->positions = positions;
+        unsigned int* tree_ids = (unsigned int*)realloc(scan->tree_ids, new_capacity * sizeof(unsigned int));
+        if (tree_ids) scan->tree_ids = tree_ids;
+        if (!cells || !positions || !tree_ids) return 0;
+        scan->capacity = new_capacity;
+    }
+    scan->cells[scan->count] = cell;
+    scan->positions[scan->count] = position;
+    scan->tree_ids[scan->count] = tree_id;
+    scan->count++;
+    return 1;
+}
+
+void calc_graph_add_reference(void* context, int row, int col, int end_row, int end_col, int conditional) {
+    CalcGraph* graph = (CalcGraph*)context;
+    if (end_col >= graph->sheet->cols) end_col = graph->sheet->cols - 1;
+
+    for (int c = col; c <= end_col; c++) {
+        // First formula row of the column at or below 'row'
+        int lo = graph->col_start[c];
+        int hi = graph->col_start[c + 1];
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (graph->col_rows[mid] < row) lo = mid + 1;
+            else hi = mid;
+        }
+
+        for (int k = lo; k < graph->col_start[c + 1] && graph->col_rows[k] <= end_row; k++) {
+            if (graph->edge_count == graph->edge_capacity) {
+                int new_capacity = graph->edge_capacity ? graph->edge_capacity * 2 : 1024;
+                CalcEdge* edges = (CalcEdge*)realloc(graph->edges, new_capacity * sizeof(CalcEdge));
+                if (!edges) {
+                    graph->failed = 1;
+                    return;
+                }
+                graph->edges = edges;
+                graph->edge_capacity = new_capacity;
+            }
+            CalcEdge* edge = &graph->edges[graph->edge_count++];
+            edge->from = graph->col_index[k];
+            edge->to = graph->current;
+            edge->conditional = conditional;
+        }
+    }
+}
+
+// Scan indexes column by column, then down each column
+int calc_column_major_compare(void* context, int a, int b) {
+    const CalcGraph* graph = (const CalcGraph*)context;
+    int cols = graph->sheet->cols;
+    int position_a = graph->scan->positions[a];
+    int position_b = graph->scan->positions[b];
+    if (position_a % cols != position_b % cols) return position_a % cols < position_b % cols ? -1 : 1;
+    return position_a < position_b ? -1 : position_a > position_b;
+}
+
+// Kahn's algorithm over the cells not yet placed, following only the edges
+// allowed (all of them, or the unconditional ones). Appends to order.
+// The cells are placed in waves, each wave holding the cells whose inputs
+// the earlier waves complete. No cell of a wave reads another, so a wave is
+// put in column order, which lines up formulas filled down a column for
+// sheet_recalculate_run.
+int calc_order_pass(const CalcGraph* graph, const int* out_start, const CalcEdge* out_edges, int n, char* placed,
+                    int* indegree, int* order, int placed_count, int unconditional_only) {
+    for (int i = 0; i < n; i++) indegree[i] = 0;
+    for (int i = 0; i < n; i++) {
+        if (placed[i]) continue;
+        for (int e = out_start[i]; e < out_start[i + 1]; e++) {
+            if (unconditional_only && out_edges[e].conditional) continue;
+            if (!placed[out_edges[e].to]) indegree[out_edges[e].to]++;
+        }
+    }
+
+    int head = placed_count;
+    for (int i = 0; i < n; i++) {
+        if (!placed[i] && indegree[i] == 0) {
+            placed[i] = 1;
+            order[placed_count++] = i;
+        }
+    }
+    while (head < placed_count) {
+        int wave_end = placed_count;
+        int sorted = 1;
+        for (int k = head + 1; k < wave_end && sorted; k++) {
+            sorted = calc_column_major_compare((void*)graph, order[k - 1], order[k]) < 0;
+        }
+        // Out of memory leaves the wave as found, which is still a valid order
+        if (!sorted) parallel_sort_indices(&order[head], wave_end - head, calc_column_major_compare, (void*)graph);
+
+        for (; head < wave_end; head++) {
+            int i = order[head];
+            for (int e = out_start[i]; e < out_start[i + 1]; e++) {
+                if (unconditional_only && out_edges[e].conditional) continue;
+                int to = out_edges[e].to;
+                if (!placed[to] && --indegree[to] == 0) {
+                    placed[to] = 1;
+                    order[placed_count++] = to;
+                }
+            }
+        }
+    }
+    return placed_count;
+}
+
+// Build sheet->calc_order from the scan. Returns 0 if out of memory.
+int sheet_build_calc_order(Sheet* sheet, const CalcScan* scan) {
+    int n = scan->count;
+    CalcGraph graph = {0};
+    graph.sheet = sheet;
+    graph.scan = scan;
+    graph.col_start = (int*)calloc(sheet->cols + 1, sizeof(int));
+    graph.col_rows = (int*)malloc((n ? n : 1) * sizeof(int));
+    graph.col_index = (int*)malloc((n ? n : 1) * sizeof(int));
+    int* order = (int*)malloc((n ? n : 1) * sizeof(int));
+    int* indegree = (int*)malloc((n ? n : 1) * sizeof(int));
+    char* placed = (char*)calloc(n ? n : 1, 1);
+    int* out_start = (int*)calloc(n + 1, sizeof(int));
+    CalcEdge* out_edges = NULL;
+    int ok = graph.col_start && graph.col_rows && graph.col_index && order && indegree && placed && out_start;
+
+    if (ok) {
+        // Formula rows per column; the scan is row-major, so each column comes out sorted
+        for (int i = 0; i < n; i++) graph.col_start[scan->positions[i] % sheet->cols + 1]++;
+        for (int c = 0; c < sheet->cols; c++) graph.col_start[c + 1] += graph.col_start[c];
+        for (int i = 0; i < n; i++) {
+            int c = scan->positions[i] % sheet->cols;
+            int k = graph.col_start[c]++;
+            graph.col_rows[k] = scan->positions[i] / sheet->cols;
+            graph.col_index[k] = i;
+        }
+        for (int c = sheet->cols; c > 0; c--) graph.col_start[c] = graph.col_start[c - 1];
+        graph.col_start[0] = 0;
+
+        for (int i = 0; i < n && !graph.failed; i++) {
+            graph.current = i;
+            formula_tree_references(scan->cells[i]->data.formula.tree, calc_graph_add_reference, &graph);
+        }
+        ok = !graph.failed;
+    }
+
+    if (ok) {
+        // Group the edges by the cell read
+        out_edges = (CalcEdge*)malloc((graph.edge_count ? graph.edge_count : 1) * sizeof(CalcEdge));
+        ok = out_edges != NULL;
+    }
+    if (ok) {
+        for (int e = 0; e < graph.edge_count; e++) out_start[graph.edges[e].from + 1]++;
+        for (int i = 0; i < n; i++) out_start[i + 1] += out_start[i];
+        for (int e = 0; e < graph.edge_count; e++) out_edges[out_start[graph.edges[e].from]++] = graph.edges[e];
+        for (int i = n; i > 0; i--) out_start[i] = out_start[i - 1];
+        out_start[0] = 0;
+
+        int count = calc_order_pass(&graph, out_start, out_edges, n, placed, indegree, order, 0, 0);
+        if (count < n) count = calc_order_pass(&graph, out_start, out_edges, n, placed, indegree, order, count, 1);
+        sheet->calc_cycles = n - count;
+        for (int i = 0; i < n; i++) {
+            if (!placed[i]) order[count++] = i;
+        }
+
+        Cell** calc_order = (Cell**)malloc((n ? n : 1) * sizeof(Cell*));
+        ok = calc_order != NULL;
+        if (ok) {
+            for (int k = 0; k < n; k++) calc_order[k] = scan->cells[order[k]];
+            free(sheet->calc_order);
+            free(sheet->calc_index);
+            sheet->calc_order = calc_order;
+            sheet->calc_index = order;
+            sheet->calc_count = n;
+            order = NULL;
+            sheet_find_calc_blocks(sheet, scan);
+        }
     }
-    return NULL;
+
+    free(graph.col_start);
+    free(graph.col_rows);
+    free(graph.col_index);
+    free(graph.edges);
+    free(out_edges);
+    free(out_start);
+    free(placed);
+    free(indegree);
+    free(order);
+    return ok;
 }
 
-// Enhanced comparison evaluation with string support
-double evaluate_comparison(Sheet* sheet, const char* expr, ErrorType* error) {
-    const char* p = expr;
-    const char* start_left = p;
-    
-    // First, try to identify if we have a string comparison
-    // Look for pattern: cell_ref = "string" or "string" = cell_ref
-    
-    // Check if left side is a cell reference
-    char left_ref[32] = {0};
-    int left_ref_len = 0;
-    const char* temp_p = p;
-    
-    // Extract potential cell reference
-    while (*temp_p && (isalpha(*temp_p) || isdigit(*temp_p)) && left_ref_len < 31) {
-        left_ref[left_ref_len++] = *temp_p;
-        temp_p++;
+// Evaluate one formula cell and notify watchers if what it shows changed
+void sheet_recalculate_cell(Sheet* sheet, Cell* cell, int row, int col) {
+    sheet_store_formula_value(sheet, cell, row, col, formula_eval_tree(sheet, cell->data.formula.tree));
+}
+
+void sheet_store_formula_value(Sheet* sheet, Cell* cell, int row, int col, FormulaValue value) {
+    if (value.type == FVALUE_BLANK) value = formula_number_value(0.0);
+    if (formula_store_result(cell, value)) {
+        sheet_notify_range(sheet, row, col, row, col);
     }
-    left_ref[left_ref_len] = '\0';
-    
-    // Check if it's a valid cell reference
-    int is_left_cell_ref = 0;
-    int left_row, left_col;
-    if (left_ref_len > 0 && parse_cell_reference(left_ref, &left_row, &left_col)) {
-        is_left_cell_ref = 1;
+}
+
+// Evaluate calc_order from entry 'first'. When that cell's program has a
+// kernel, the entries after it whose programs have the same kernel (the
+// rest of a formula filled down, as the waves put them) are evaluated in
+// the same loop, calling the kernel directly. Returns the entry after the
+// last one evaluated.
+int sheet_recalculate_run(Sheet* sheet, int first) {
+    const int* positions = sheet->calc_scan.positions;
+    Cell* cell = sheet->calc_order[first];
+    FormulaTree* tree = cell->data.formula.tree;
+    int position = positions[sheet->calc_index[first]];
+
+    FormulaProgram* program = NULL;
+    if (formula_tier == FORMULA_TIER_THREADED && tree && tree->root >= 0) program = formula_tree_program(sheet, tree);
+    if (!program || program->kernel == FORMULA_KERNEL_NONE) {
+        sheet_store_formula_value(sheet, cell, position / sheet->cols, position % sheet->cols,
+                                  formula_eval_program(sheet, tree, program));
+        return first + 1;
     }
-    
-    // Skip whitespace and look for comparison operator
-    skip_whitespace(&temp_p);
-    char comparison_op[3] = {0};
-    int op_len = 0;
-    
-    if (*temp_p == '=' || *temp_p == '<' || *temp_p == '>') {
-        comparison_op[op_len++] = *temp_p++;
-        if (*temp_p == '=' || (*temp_p == '>' && comparison_op[0] == '<')) {
-            comparison_op[op_len++] = *temp_p++;
+
+    FormulaKernel kernel = program->kernel;
+    int k = first;
+    for (;;) {
+        const FormulaOp* root = &program->ops[tree->root];
+        FormulaValue value;
+        switch (kernel) {
+            case FORMULA_KERNEL_SUM_RANGE: value = formula_kernel_sum_range(root, sheet); break;
+            case FORMULA_KERNEL_REF_OP_REF: value = formula_kernel_ref_op_ref(root, sheet); break;
+            case FORMULA_KERNEL_REF_OP_CONSTANT: value = formula_kernel_ref_op_constant(root, sheet); break;
+            default: value = formula_kernel_vlookup_exact(root, sheet); break;
         }
-        comparison_op[op_len] = '\0';
-    }
-    
-    // Check if right side is a string literal
-    skip_whitespace(&temp_p);
-    int is_right_string = (*temp_p == '"');
-    
-    // If we have cell_ref = "string", handle as string comparison
-    if (is_left_cell_ref && strlen(comparison_op) > 0 && is_right_string) {
-        // Get the string value from the cell
-        char* left_str = get_cell_string_value(sheet, left_ref);
-        
-        // Parse the string literal
-        temp_p++; // Skip opening quote
-        char right_str[256] = {0};
-        int right_len = 0;
-        while (*temp_p && *temp_p != '"' && right_len < 255) {
-            right_str[right_len++] = *temp_p++;
-        }
-        if (*temp_p == '"') temp_p++; // Skip closing quote
-        
-        // Perform string comparison
-        int cmp_result = 0;
-        if (left_str) {
-            cmp_result = strcmp(left_str, right_str);
-        } else {
-            // If cell is empty or not string, compare with empty string
-            cmp_result = strcmp("", right_str);
+        if (formula_store_result(cell, value)) {
+            sheet_notify_range(sheet, position / sheet->cols, position % sheet->cols, position / sheet->cols, position % sheet->cols);
         }
-        
-        // Apply comparison operator
-        if (strcmp(comparison_op, "=") == 0) {
-            return (cmp_result == 0) ? 1.0 : 0.0;
-        } else if (strcmp(comparison_op, "<>") == 0) {
-            return (cmp_result != 0) ? 1.0 : 0.0;
-        } else if (strcmp(comparison_op, "<") == 0) {
-            return (cmp_result < 0) ? 1.0 : 0.0;
-        } else if (strcmp(comparison_op, "<=") == 0) {
-            return (cmp_result <= 0) ? 1.0 : 0.0;
-        } else if (strcmp(comparison_op, ">") == 0) {
-            return (cmp_result > 0) ? 1.0 : 0.0;
-        } else if (strcmp(comparison_op, ">=") == 0) {
-            return (cmp_result >= 0) ? 1.0 : 0.0;
+
+        // Only programs already compiled join the run, so a cold tree is
+        // counted once, by the call that evaluates it
+        if (++k == sheet->calc_count) break;
+        cell = sheet->calc_order[k];
+        tree = cell->data.formula.tree;
+        program = tree ? (FormulaProgram*)tree->program : NULL;
+        if (!program || program->kernel != kernel) break;
+        if (program->sheet != sheet || program->structure_version != sheet->structure_version) {
+            formula_program_bind(program, tree, sheet);
         }
-        
-        *error = ERROR_PARSE;
-        return 0.0;
+        position = positions[sheet->calc_index[k]];
     }
-    
-    // Fall back to numeric comparison
-    double left = parse_arithmetic_expression(sheet, &p, error);
-    if (*error != ERROR_NONE) return left;
-    
-    skip_whitespace(&p);
-    
-    // Check for comparison operators
-    if (*p == '>') {
-        p++;
-        if (*p == '=') {
-            p++; // >=
-            double right = parse_arithmetic_expression(sheet, &p, error);
-            return (left >= right) ? 1.0 : 0.0;
-        } else {
-            // >
-            double right = parse_arithmetic_expression(sheet, &p, error);
-            return (left > right) ? 1.0 : 0.0;
+    return k;
+}
+
+// NEW: Column-at-a-time evaluation
+//
+// A formula filled down a column (=B2*C2+D2, =B3*C3+D3, ...) is one
+// expression applied to every row. When the calc order holds such cells
+// one after another, down one column, with no cell reading another of the
+// block, the block is evaluated a chunk of rows at a time: each node of the
+// expression fills an array with its value for every row of the chunk,
+// so the arithmetic runs as plain loops over contiguous doubles that the
+// compiler can vectorize. Rows whose inputs are not numbers, or that
+// divide by zero, are evaluated one by one instead. Only arithmetic on
+// numbers and references is done this way.
+
+// Whether the tree is arithmetic the block evaluator handles
+int formula_tree_columnar(const FormulaTree* tree) {
+    if (!tree || tree->root < 0) return 0;
+    for (int i = 0; i < tree->count; i++) {
+        const FormulaNode* node = &tree->nodes[i];
+        switch (node->type) {
+            case FNODE_NUMBER:
+            case FNODE_REF:
+            case FNODE_NEGATE:
+            case FNODE_ADD:
+            case FNODE_SUB:
+            case FNODE_MUL:
+            case FNODE_DIV:
+                break;
+            default:
+                return 0;
         }
-    } else if (*p == '<') {
-        p++;
-        if (*p == '=') {
-            p++; // <=
-            double right = parse_arithmetic_expression(sheet, &p, error);
-            return (left <= right) ? 1.0 : 0.0;
-        } else if (*p == '>') {
-            p++; // <>
-            double right = parse_arithmetic_expression(sheet, &p, error);
-            return (left != right) ? 1.0 : 0.0;
-        } else {
-            // <
-            double right = parse_arithmetic_expression(sheet, &p, error);
-            return (left < right) ? 1.0 : 0.0;
-        }
-    } else if (*p == '=') {
-        p++; // =
-        double right = parse_arithmetic_expression(sheet, &p, error);
-        return (fabs(left - right) < 1e-10) ? 1.0 : 0.0; // Use tolerance for floating point comparison
-    }
-    
-    // No comparison operator found, return the arithmetic expression result
-    return left;
-}
-
-// Parse term (handles * and /)
-double parse_term(Sheet* sheet, const char** expr, ErrorType* error) {
-    double result = parse_factor(sheet, expr, error);
-    if (*error != ERROR_NONE) return 0.0;
-    
-    while (1) {
-        skip_whitespace(expr);
-        if (**expr == '*') {
-            (*expr)++;
-            double right = parse_factor(sheet, expr, error);
-            if (*error != ERROR_NONE) return 0.0;
-            result *= right;
-        } else if (**expr == '/') {
-            (*expr)++;
-            double right = parse_factor(sheet, expr, error);
-            if (*error != ERROR_NONE) return 0.0;
-            if (right == 0.0) {
-                *error = ERROR_DIV_ZERO;
-                return 0.0;
-            }
-            result /= right;
-        } else {
-            break;
+        // Operands come first, so one pass in node order computes them all
+        for (int a = 0; a < node->arg_count; a++) {
+            if (tree->args[node->first_arg + a] >= i) return 0;
         }
     }
-    
-    return result;
+    return 1;
 }
 
-// Parse a factor (number, cell reference, or function call)
-double parse_factor(Sheet* sheet, const char** expr, ErrorType* error) {
-    skip_whitespace(expr);
-    
-    if (**expr == '(') {
-        (*expr)++; // Skip '('
-        double result = parse_arithmetic_expression(sheet, expr, error);
-        if (*error != ERROR_NONE) return 0.0;
-        
-        skip_whitespace(expr);
-        if (**expr != ')') {
-            *error = ERROR_PARSE;
-            return 0.0;
+// Whether 'tree' is 'first' filled down 'offset' rows: the same expression,
+// each reference moved down 'offset' rows or left in place, as 'second'
+// (the tree one row below 'first') has them
+int formula_tree_filled_down(const FormulaTree* first, const FormulaTree* second, const FormulaTree* tree, int offset) {
+    if (!tree || tree->count != first->count || tree->arg_count != first->arg_count || tree->root != first->root) return 0;
+    if (memcmp(tree->args, first->args, first->arg_count * sizeof(int)) != 0) return 0;
+
+    for (int i = 0; i < first->count; i++) {
+        const FormulaNode* a = &first->nodes[i];
+        const FormulaNode* b = &tree->nodes[i];
+        if (a->type != b->type || a->first_arg != b->first_arg || a->arg_count != b->arg_count) return 0;
+        if (a->type == FNODE_NUMBER && memcmp(&a->number, &b->number, sizeof(double)) != 0) return 0;
+        if (a->type == FNODE_REF) {
+            int moves = second->nodes[i].row == a->row + 1;
+            if (b->col != a->col || b->row != a->row + (moves ? offset : 0)) return 0;
         }
-        (*expr)++; // Skip ')'
-        
-        return result;
     }
-    
-    // Check if this could be a function call (letters followed by '(')
-    const char* start = *expr;
-    const char* lookahead = *expr;
-    
-    // Look ahead to see if this is a function call
-    while (*lookahead && isalpha(*lookahead)) lookahead++;
-    skip_whitespace(&lookahead);
-    
-    if (*lookahead == '(') {
-        // This is a function call
-        return parse_function(sheet, expr, error);
+    return 1;
+}
+
+// Mark the blocks of the calc order just built from 'scan'
+void sheet_find_calc_blocks(Sheet* sheet, const CalcScan* scan) {
+    free(sheet->calc_blocks);
+    sheet->calc_blocks = (int*)calloc(sheet->calc_count ? sheet->calc_count : 1, sizeof(int));
+    if (!sheet->calc_blocks) return;
+
+    for (int k = 0; k < sheet->calc_count;) {
+        const FormulaTree* first = sheet->calc_order[k]->data.formula.tree;
+        if (!formula_tree_columnar(first) || k + 1 == sheet->calc_count) {
+            k++;
+            continue;
+        }
+
+        int position = scan->positions[sheet->calc_index[k]];
+        const FormulaTree* second = sheet->calc_order[k + 1]->data.formula.tree;
+        int rows = 1;
+        while (k + rows < sheet->calc_count &&
+               scan->positions[sheet->calc_index[k + rows]] == position + rows * sheet->cols &&
+               formula_tree_filled_down(first, second, sheet->calc_order[k + rows]->data.formula.tree, rows)) {
+            rows++;
+        }
+
+        // No reference may read a cell of the block itself
+        int row = position / sheet->cols;
+        int col = position % sheet->cols;
+        int reads_itself = 0;
+        for (int i = 0; i < first->count && rows > 1 && !reads_itself; i++) {
+            const FormulaNode* node = &first->nodes[i];
+            if (node->type != FNODE_REF || node->col != col) continue;
+            int last = second->nodes[i].row == node->row + 1 ? node->row + rows - 1 : node->row;
+            reads_itself = node->row <= row + rows - 1 && last >= row;
+        }
+
+        if (rows >= FORMULA_BLOCK_MIN_ROWS && !reads_itself) sheet->calc_blocks[k] = rows;
+        k += rows;
     }
-    
-    // Try to parse as cell reference or range
-    char ref_buf[32];
-    int i = 0;
-    
-    // Extract potential cell reference (letters followed by numbers, possibly with colon)
-    while (**expr && (isalpha(**expr) || isdigit(**expr) || **expr == ':') && i < 31) {
-        ref_buf[i++] = **expr;
-        (*expr)++;
+}
+
+// Evaluate the block of 'rows' cells starting at calc_order entry 'first'.
+// Returns the entry after the block.
+int sheet_recalculate_block(Sheet* sheet, int first, int rows) {
+    const FormulaTree* tree = sheet->calc_order[first]->data.formula.tree;
+    const FormulaTree* second = sheet->calc_order[first + 1]->data.formula.tree;
+    double* values = (double*)malloc((size_t)tree->count * FORMULA_BLOCK_CHUNK * sizeof(double));
+    if (!values) {
+        int k = first;
+        while (k < first + rows) k = sheet_recalculate_run(sheet, k);
+        return k;
     }
-    ref_buf[i] = '\0';
-    
-    if (i > 0) {
-        // Check if it's a range (contains ':')
-        if (strchr(ref_buf, ':')) {
-            CellRange range;
-            if (parse_range(ref_buf, &range)) {
-                // For a range without a function, just return the sum
-                double values[1000];
-                int count = get_range_values(sheet, &range, values, 1000);
-                return func_sum(values, count);
-            } else {
-                *error = ERROR_PARSE;
-                return 0.0;
-            }
-        } else {
-            // Single cell reference
-            int row, col;
-            if (parse_cell_reference(ref_buf, &row, &col)) {
-                Cell* cell = sheet_get_cell(sheet, row, col);
-                if (!cell) {
-                    return 0.0; // Empty cell
-                }
-                
-                switch (cell->type) {
-                    case CELL_EMPTY:
-                        return 0.0;
-                    case CELL_NUMBER:
-                        return cell->data.number;
-                    case CELL_FORMULA:
-                        if (cell->data.formula.error != ERROR_NONE) {
-                            *error = cell->data.formula.error;
-                            return 0.0;
+
+    const int* positions = sheet->calc_scan.positions;
+    unsigned char slow[FORMULA_BLOCK_CHUNK];
+    for (int start = 0; start < rows; start += FORMULA_BLOCK_CHUNK) {
+        int n = rows - start < FORMULA_BLOCK_CHUNK ? rows - start : FORMULA_BLOCK_CHUNK;
+        memset(slow, 0, n);
+
+        for (int i = 0; i < tree->count; i++) {
+            const FormulaNode* node = &tree->nodes[i];
+            double* out = values + (size_t)i * FORMULA_BLOCK_CHUNK;
+            const double* a = node->arg_count > 0 ? values + (size_t)tree->args[node->first_arg] * FORMULA_BLOCK_CHUNK : NULL;
+            const double* b = node->arg_count > 1 ? values + (size_t)tree->args[node->first_arg + 1] * FORMULA_BLOCK_CHUNK : NULL;
+
+            switch (node->type) {
+                case FNODE_NUMBER:
+                    for (int r = 0; r < n; r++) out[r] = node->number;
+                    break;
+                case FNODE_REF: {
+                    // Gather the column: the same cell for every row, or the
+                    // row's own when the reference moves with the formula
+                    int moves = second->nodes[i].row == node->row + 1;
+                    int col = node->col;
+                    for (int r = 0; r < n; r++) {
+                        int row = node->row + (moves ? start + r : 0);
+                        const Cell* cell = row < sheet->rows && col < sheet->cols ? sheet->cells[row][col] : NULL;
+                        if (!formula_slot_number(cell, &out[r])) {
+                            out[r] = 0.0;
+                            slow[r] = 1;
                         }
-                        return cell->data.formula.cached_value;
-                    default:
-                        *error = ERROR_VALUE;
-                        return 0.0;
+                    }
+                    break;
                 }
+                case FNODE_NEGATE:
+                    for (int r = 0; r < n; r++) out[r] = -a[r];
+                    break;
+                case FNODE_ADD:
+                    for (int r = 0; r < n; r++) out[r] = a[r] + b[r];
+                    break;
+                case FNODE_SUB:
+                    for (int r = 0; r < n; r++) out[r] = a[r] - b[r];
+                    break;
+                case FNODE_MUL:
+                    for (int r = 0; r < n; r++) out[r] = a[r] * b[r];
+                    break;
+                default:        // FNODE_DIV
+                    for (int r = 0; r < n; r++) out[r] = a[r] / b[r];
+                    for (int r = 0; r < n; r++) slow[r] |= b[r] == 0.0;
+                    break;
             }
         }
-    }
-    
-    // Reset and try to parse as number
-    *expr = start;
-    char* endptr;
-    double value = strtod(*expr, &endptr);
-    if (endptr != *expr) {
-        *expr = endptr;
-        return value;
-    }
-    
-    *error = ERROR_PARSE;
-    return 0.0;
-}
 
-// Enhanced arithmetic expression parser (with updated signature)
-double parse_arithmetic_expression(Sheet* sheet, const char** expr, ErrorType* error) {
-    double result = parse_term(sheet, expr, error);
-    if (*error != ERROR_NONE) return 0.0;
-    
-    while (1) {
-        skip_whitespace(expr);
-        if (**expr == '+') {
-            (*expr)++;
-            double right = parse_term(sheet, expr, error);
-            if (*error != ERROR_NONE) return 0.0;
-            result += right;
-        } else if (**expr == '-') {
-            (*expr)++;
-            double right = parse_term(sheet, expr, error);
-            if (*error != ERROR_NONE) return 0.0;
-            result -= right;
-        } else {
-            break;
+        // Store the results, taking the rows that need it the long way
+        const double* results = values + (size_t)tree->root * FORMULA_BLOCK_CHUNK;
+        for (int r = 0; r < n; r++) {
+            int k = first + start + r;
+            Cell* cell = sheet->calc_order[k];
+            int position = positions[sheet->calc_index[k]];
+            FormulaValue value = slow[r] ? formula_eval_tree(sheet, cell->data.formula.tree) : formula_number_value(results[r]);
+            sheet_store_formula_value(sheet, cell, position / sheet->cols, position % sheet->cols, value);
         }
     }
-    
-    return result;
+
+    free(values);
+    return first + rows;
 }
 
 // Recalculate all formulas in the sheet
 void sheet_recalculate(Sheet* sheet) {
     if (!sheet->needs_recalc) return;
-    
-    // Simple recalculation - just evaluate all formulas
-    // TODO: Implement proper dependency tracking and topological sort
-    
-    for (int row = 0; row < sheet->rows; row++) {
-        for (int col = 0; col < sheet->cols; col++) {            Cell* cell = sheet_get_cell(sheet, row, col);
+    if (sheet->batch) return;  // Deferred until the batch commits
+
+    CalcScan scan = {0};
+    int scanned = 1;
+    for (int row = 0; row < sheet->rows && scanned; row++) {
+        for (int col = 0; col < sheet->cols; col++) {
+            Cell* cell = sheet->cells[row][col];
             if (cell && cell->type == CELL_FORMULA) {
-                ErrorType error;
-                g_current_evaluating_cell = cell;  // Set global context
-                double value = evaluate_formula(sheet, cell->data.formula.expression, &error);
-                cell->data.formula.cached_value = value;
-                cell->data.formula.error = error;
-                g_current_evaluating_cell = NULL;   // Clear global context
+                FormulaTree* tree = cell_formula_tree(cell);
+                if (!calc_scan_add(&scan, cell, row * sheet->cols + col, tree ? tree->id : 0)) {
+                    scanned = 0;
+                    break;
+                }
             }
         }
     }
-    
+
+    // Reuse the order when the formula cells are exactly as last time
+    CalcScan* last = &sheet->calc_scan;
+    int same = scanned && scan.count == last->count && scan.count == sheet->calc_count &&
+               (scan.count == 0 ||
+                (memcmp(scan.cells, last->cells, scan.count * sizeof(Cell*)) == 0 &&
+                 memcmp(scan.positions, last->positions, scan.count * sizeof(int)) == 0 &&
+                 memcmp(scan.tree_ids, last->tree_ids, scan.count * sizeof(unsigned int)) == 0));
+    if (!same && scanned && sheet_build_calc_order(sheet, &scan)) {
+        calc_scan_free(last);
+        *last = scan;
+        memset(&scan, 0, sizeof(scan));
+        same = 1;
+    }
+
+    if (same) {
+        for (int k = 0; k < sheet->calc_count;) {
+            int block = formula_tier == FORMULA_TIER_THREADED && sheet->calc_blocks ? sheet->calc_blocks[k] : 0;
+            k = block ? sheet_recalculate_block(sheet, k, block) : sheet_recalculate_run(sheet, k);
+        }
+    } else {
+        // Out of memory for the order: fall back to a row-major pass
+        calc_scan_free(last);
+        free(sheet->calc_order);
+        free(sheet->calc_index);
+        free(sheet->calc_blocks);
+        sheet->calc_order = NULL;
+        sheet->calc_index = NULL;
+        sheet->calc_blocks = NULL;
+        sheet->calc_count = 0;
+        for (int row = 0; row < sheet->rows; row++) {
+            for (int col = 0; col < sheet->cols; col++) {
+                Cell* cell = sheet->cells[row][col];
+                if (cell && cell->type == CELL_FORMULA) {
+                    cell_formula_tree(cell);
+                    sheet_recalculate_cell(sheet, cell, row, col);
+                }
+            }
+        }
+    }
+    calc_scan_free(&scan);
+
     sheet->needs_recalc = 0;
 }
 
@@ -1955,6 +5967,250 @@ int sheet_load_csv(Sheet* sheet, const char* filename, int preserve_formulas) {
     return 1;  // Success
 }
 
+// NEW: TSV (clipboard text) operations
+//
+// Ranges are exchanged with other programs as tab-separated rows ending in
+// CRLF, the format spreadsheets put on the clipboard. Fields holding tabs,
+// line breaks or quotes are wrapped in quotes with embedded quotes doubled.
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} TextBuffer;
+
+int text_buffer_append(TextBuffer* buffer, const char* text, size_t len) {
+    if (buffer->length + len + 1 > buffer->capacity) {
+        size_t new_capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (new_capacity < buffer->length + len + 1) {
+            new_capacity *= 2;
+        }
+        char* data = (char*)realloc(buffer->data, new_capacity);
+        if (!data) return 0;
+        buffer->data = data;
+        buffer->capacity = new_capacity;
+    }
+    memcpy(buffer->data + buffer->length, text, len);
+    buffer->length += len;
+    buffer->data[buffer->length] = '\0';
+    return 1;
+}
+
+void text_buffer_append_field(TextBuffer* buffer, const char* text) {
+    size_t len = strlen(text);
+    if (strcspn(text, "\t\r\n\"") == len) {
+        text_buffer_append(buffer, text, len);
+        return;
+    }
+    
+    text_buffer_append(buffer, "\"", 1);
+    const char* run = text;
+    for (const char* p = text; *p; p++) {
+        if (*p == '"') {
+            text_buffer_append(buffer, run, p - run + 1);
+            text_buffer_append(buffer, "\"", 1);
+            run = p + 1;
+        }
+    }
+    text_buffer_append(buffer, run, strlen(run));
+    text_buffer_append(buffer, "\"", 1);
+}
+
+// Format the displayed values of a range as TSV. Returns a newly allocated string.
+char* sheet_range_to_tsv(Sheet* sheet, int start_row, int start_col, int end_row, int end_col) {
+    int min_row = max(0, min(start_row, end_row));
+    int max_row = min(sheet->rows - 1, max(start_row, end_row));
+    int min_col = max(0, min(start_col, end_col));
+    int max_col = min(sheet->cols - 1, max(start_col, end_col));
+    
+    TextBuffer buffer = {0};
+    text_buffer_append(&buffer, "", 0);
+    
+    for (int row = min_row; row <= max_row; row++) {
+        for (int col = min_col; col <= max_col; col++) {
+            if (col > min_col) {
+                text_buffer_append(&buffer, "\t", 1);
+            }
+            Cell* cell = sheet->cells[row][col];
+            if (cell && cell->type != CELL_EMPTY) {
+                text_buffer_append_field(&buffer, cell_get_display_value(cell));
+            }
+        }
+        text_buffer_append(&buffer, "\r\n", 2);
+    }
+    
+    return buffer.data;
+}
+
+// Parse a decimal number spanning exactly len characters. Plain numbers with
+// at most 15 significant digits are converted directly (exact, since both the
+// digits and the power of ten are representable); anything else falls back
+// to strtod. Returns 0 if the text is not a number.
+int parse_number_fast(const char* str, size_t len, double* out) {
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    
+    const char* p = str;
+    const char* end = str + len;
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int scale = 0;
+    int seen_digit = 0;
+    while (p < end && isdigit((unsigned char)*p)) {
+        seen_digit = 1;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa) digits++;
+        } else {
+            scale++;
+        }
+        p++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && isdigit((unsigned char)*p)) {
+            seen_digit = 1;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa) digits++;
+                scale--;
+            }
+            p++;
+        }
+    }
+    if (!seen_digit) return 0;
+    
+    int exponent = 0;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char* exp_start = p++;
+        int exp_negative = 0;
+        if (p < end && (*p == '-' || *p == '+')) {
+            exp_negative = *p == '-';
+            p++;
+        }
+        if (p >= end || !isdigit((unsigned char)*p)) {
+            p = exp_start;
+        } else {
+            while (p < end && isdigit((unsigned char)*p)) {
+                if (exponent < 10000) exponent = exponent * 10 + (*p - '0');
+                p++;
+            }
+            if (exp_negative) exponent = -exponent;
+        }
+    }
+    if (p != end) return 0;
+    
+    int power = scale + exponent;
+    if (digits <= 15 && power >= -22 && power <= 22) {
+        double value = (double)mantissa;
+        value = power < 0 ? value / powers[-power] : value * powers[power];
+        *out = negative ? -value : value;
+        return 1;
+    }
+    
+    // Slow path for long or extreme numbers
+    char buf[128];
+    if (len >= sizeof(buf)) return 0;
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+    *out = strtod(buf, NULL);
+    return 1;
+}
+
+// Store one pasted field: '=' starts a formula, numbers become numbers, an
+// empty field clears the cell, anything else is text
+void sheet_paste_field(Sheet* sheet, int row, int col, const char* field, size_t len) {
+    if (row >= sheet->rows || col >= sheet->cols) return;
+    
+    double number;
+    if (len == 0) {
+        sheet_clear_cell(sheet, row, col);
+    } else if (field[0] == '=') {
+        sheet_set_formula(sheet, row, col, field);
+    } else if (parse_number_fast(field, len, &number)) {
+        sheet_set_number(sheet, row, col, number);
+    } else {
+        sheet_set_string(sheet, row, col, field);
+    }
+}
+
+// Write TSV text into the sheet starting at (start_row, start_col), streaming
+// field by field. Returns the number of fields read and reports the size of
+// the pasted block.
+int sheet_paste_tsv(Sheet* sheet, const char* text, int start_row, int start_col, int* out_rows, int* out_cols) {
+    TextBuffer field = {0};
+    int row = 0, col = 0;
+    int max_cols = 0;
+    int fields = 0;
+    const char* p = text;
+    
+    while (*p) {
+        field.length = 0;
+        text_buffer_append(&field, "", 0);
+        
+        if (*p == '"') {
+            // Quoted field: runs to the closing quote, "" is a literal quote
+            p++;
+            while (*p) {
+                if (*p == '"') {
+                    if (p[1] == '"') {
+                        text_buffer_append(&field, "\"", 1);
+                        p += 2;
+                        continue;
+                    }
+                    p++;
+                    break;
+                }
+                const char* run = p;
+                while (*p && *p != '"') p++;
+                text_buffer_append(&field, run, p - run);
+            }
+            // Ignore anything between the closing quote and the separator
+            while (*p && *p != '\t' && *p != '\r' && *p != '\n') p++;
+        } else {
+            const char* run = p;
+            while (*p && *p != '\t' && *p != '\r' && *p != '\n') p++;
+            text_buffer_append(&field, run, p - run);
+        }
+        
+        sheet_paste_field(sheet, start_row + row, start_col + col, field.data, field.length);
+        fields++;
+        col++;
+        if (col > max_cols) max_cols = col;
+        
+        if (*p == '\t') {
+            p++;
+            // A tab at the very end still ends with an empty field
+            if (!*p || *p == '\r' || *p == '\n') {
+                sheet_paste_field(sheet, start_row + row, start_col + col, "", 0);
+                fields++;
+                col++;
+                if (col > max_cols) max_cols = col;
+            }
+        }
+        if (*p == '\r' || *p == '\n') {
+            if (*p == '\r' && p[1] == '\n') p++;
+            p++;
+            row++;
+            col = 0;
+        }
+    }
+    if (col > 0) row++;
+    
+    free(field.data);
+    if (out_rows) *out_rows = row;
+    if (out_cols) *out_cols = max_cols;
+    return fields;
+}
+
 // Demo: Create a simple spreadsheet with some data
 void demo_spreadsheet() {
     Sheet* sheet = sheet_new(100, 26);
@@ -1992,250 +6248,6 @@ void demo_spreadsheet() {
       sheet_free(sheet);
 }
 
-// Enhanced parse_function to support VLOOKUP and other functions
-double parse_function(Sheet* sheet, const char** expr, ErrorType* error) {
-    skip_whitespace(expr);
-    
-    // Extract function name
-    const char* start = *expr;
-    char func_name[32];
-    int i = 0;
-    
-    while (**expr && isalpha(**expr) && i < 31) {
-        func_name[i++] = toupper(**expr);
-        (*expr)++;
-    }
-    func_name[i] = '\0';
-    
-    skip_whitespace(expr);
-    if (**expr != '(') {
-        *error = ERROR_PARSE;
-        return 0.0;
-    }
-    (*expr)++; // Skip '('
-    
-    // NEW: Handle VLOOKUP function
-    if (strcmp(func_name, "VLOOKUP") == 0) {
-        // VLOOKUP(lookup_value, table_array, col_index_num, [range_lookup])
-        skip_whitespace(expr);
-        
-        // Parse lookup value (can be number or string)
-        double lookup_value = 0.0;
-        char lookup_str[256] = {0};
-        int is_string_lookup = 0;
-        
-        if (**expr == '"') {
-            // Parse string literal
-            (*expr)++; // Skip opening quote
-            int j = 0;
-            while (**expr && **expr != '"' && j < 255) {
-                lookup_str[j++] = **expr;
-                (*expr)++;
-            }
-            if (**expr == '"') {
-                (*expr)++; // Skip closing quote
-                is_string_lookup = 1;
-            } else {
-                *error = ERROR_PARSE;
-                return 0.0;
-            }
-        } else {
-            // Parse as numeric expression
-            lookup_value = parse_arithmetic_expression(sheet, expr, error);
-            if (*error != ERROR_NONE) return 0.0;
-        }
-        
-        // Expect comma
-        skip_whitespace(expr);
-        if (**expr != ',') {
-            *error = ERROR_PARSE;
-            return 0.0;
-        }
-        (*expr)++;
-        
-        // Parse table range
-        skip_whitespace(expr);
-        const char* range_start = *expr;
-        char table_range[64];
-        int range_len = 0;
-        
-        while (**expr && **expr != ',' && range_len < 63) {
-            table_range[range_len++] = **expr;
-            (*expr)++;
-        }
-        table_range[range_len] = '\0';
-        
-        // Expect comma
-        skip_whitespace(expr);
-        if (**expr != ',') {
-            *error = ERROR_PARSE;
-            return 0.0;
-        }
-        (*expr)++;
-        
-        // Parse column index
-        skip_whitespace(expr);
-        double col_index_f = parse_arithmetic_expression(sheet, expr, error);
-        if (*error != ERROR_NONE) return 0.0;
-        int col_index = (int)col_index_f;
-        
-        // Parse optional range_lookup parameter (default is approximate match)
-        int exact_match = 0; // Default to approximate match
-        skip_whitespace(expr);
-        if (**expr == ',') {
-            (*expr)++;
-            skip_whitespace(expr);
-            double exact_f = parse_arithmetic_expression(sheet, expr, error);
-            if (*error != ERROR_NONE) return 0.0;
-            exact_match = (exact_f == 0.0) ? 0 : 1; // 0 = approximate, anything else = exact
-        }
-        
-        // Expect closing parenthesis
-        skip_whitespace(expr);
-        if (**expr != ')') {
-            *error = ERROR_PARSE;
-            return 0.0;
-        }
-        (*expr)++;
-        
-        // Call VLOOKUP function
-        return func_vlookup(sheet, lookup_value, is_string_lookup ? lookup_str : NULL,
-                           table_range, col_index, exact_match, error);
-    }
-    
-    // Handle other existing functions (simplified for basic functionality)
-    double values[1000];  // Max 1000 values in a range
-    int value_count = 0;
-    
-    if (strcmp(func_name, "SUM") == 0 || strcmp(func_name, "AVG") == 0 || 
-        strcmp(func_name, "MAX") == 0 || strcmp(func_name, "MIN") == 0 ||
-        strcmp(func_name, "MEDIAN") == 0 || strcmp(func_name, "MODE") == 0) {
-        
-        // Parse range or single values
-        skip_whitespace(expr);
-        const char* arg_start = *expr;
-        
-        // Find the end of the argument (look for closing parenthesis)
-        int paren_count = 1;
-        const char* arg_end = *expr;
-        while (*arg_end && paren_count > 0) {
-            if (*arg_end == '(') paren_count++;
-            else if (*arg_end == ')') paren_count--;
-            if (paren_count > 0) arg_end++;
-        }
-        
-        // Extract the argument
-        int arg_len = (int)(arg_end - arg_start);
-        char arg[256];
-        if (arg_len >= sizeof(arg)) {
-            *error = ERROR_PARSE;
-            return 0.0;
-        }
-        
-        strncpy_s(arg, sizeof(arg), arg_start, arg_len);
-        arg[arg_len] = '\0';
-        
-        // Check if it's a range (contains ':')
-        if (strchr(arg, ':')) {
-            CellRange range;
-            if (parse_range(arg, &range)) {
-                value_count = get_range_values(sheet, &range, values, 1000);
-            } else {
-                *error = ERROR_PARSE;
-                return 0.0;
-            }
-        } else {
-            // Single cell reference or value
-            int row, col;
-            if (parse_cell_reference(arg, &row, &col)) {
-                Cell* cell = sheet_get_cell(sheet, row, col);
-                if (cell) {
-                    switch (cell->type) {
-                        case CELL_NUMBER:
-                            values[0] = cell->data.number;
-                            value_count = 1;
-                            break;
-                        case CELL_FORMULA:
-                            if (cell->data.formula.error == ERROR_NONE) {
-                                values[0] = cell->data.formula.cached_value;
-                                value_count = 1;
-                            }
-                            break;
-                        case CELL_EMPTY:
-                            values[0] = 0.0;
-                            value_count = 1;
-                            break;
-                        default:
-                            *error = ERROR_VALUE;
-                            return 0.0;
-                    }
-                } else {
-                    values[0] = 0.0;
-                    value_count = 1;
-                }
-            } else {
-                // Try to parse as number
-                char* endptr;
-                double val = strtod(arg, &endptr);
-                if (*endptr == '\0') {
-                    values[0] = val;
-                    value_count = 1;
-                } else {
-                    *error = ERROR_PARSE;
-                    return 0.0;
-                }
-            }
-        }
-        
-        *expr = arg_end + 1; // Skip closing ')'
-        
-        // Call appropriate function
-        if (strcmp(func_name, "SUM") == 0) {
-            return func_sum(values, value_count);
-        } else if (strcmp(func_name, "AVG") == 0) {
-            return func_avg(values, value_count);
-        } else if (strcmp(func_name, "MAX") == 0) {
-            return func_max(values, value_count);
-        } else if (strcmp(func_name, "MIN") == 0) {
-            return func_min(values, value_count);
-        } else if (strcmp(func_name, "MEDIAN") == 0) {
-            return func_median(values, value_count);
-        } else if (strcmp(func_name, "MODE") == 0) {
-            return func_mode(values, value_count);
-        }
-        
-    } else if (strcmp(func_name, "POWER") == 0) {
-        // POWER function: POWER(base, exponent)
-        skip_whitespace(expr);
-        
-        // Parse first argument (base)
-        double base = parse_arithmetic_expression(sheet, expr, error);
-        if (*error != ERROR_NONE) return 0.0;
-        
-        skip_whitespace(expr);
-        if (**expr != ',') {
-            *error = ERROR_PARSE;
-            return 0.0;
-        }
-        (*expr)++; // Skip comma
-        
-        // Parse second argument (exponent)  
-        double exponent = parse_arithmetic_expression(sheet, expr, error);
-        if (*error != ERROR_NONE) return 0.0;
-        
-        skip_whitespace(expr);
-        if (**expr != ')') {
-            *error = ERROR_PARSE;
-            return 0.0;
-        }
-        (*expr)++; // Skip closing parenthesis
-        
-        return func_power(base, exponent);
-    }
-      *error = ERROR_PARSE;
-    return 0.0;
-}
-
 // NEW: Cell color formatting functions
 void cell_set_text_color(Cell* cell, int color) {
     if (cell) {